@@ -0,0 +1,346 @@
+// Decode path microbenchmarks per DecodeProfile, on a
+// recorded stream, so choosing a profile is backed by
+// numbers for the streams you actually get:
+//   annexb  AVCC -> Annex B in place (naluAVCCToAnnexB)
+//   decode  send_packet + receive_frame (h264AUDecode), with
+//           the profile's threading; latency is AU sent ->
+//           its frame out
+//   bgr     YUV420P -> BGR24 of each frame (pixFmtYUVToBGR)
+//   full    all of the above per AU, latency is AU sent ->
+//           its frame converted
+// Same decoder setup as a session (applyDecodeProfile(),
+// FramePool buffers), no queues or stage threads, one
+// stream at a time: squig_bench --profile for many.
+//
+// Output is laid out like Google Benchmark's: time and CPU
+// per iteration, an iteration is an AU (a frame for bgr).
+// CPU is the whole process', i.e. with the decoder's
+// threads, so frame threading shows up as CPU > time.
+//
+// The recording is decoded `rounds` times per row, from
+// its first IDR each time. A .flv, e.g.
+//   ffmpeg -i assets/test0_1080_30_squig_base.mp4 -c copy test0.flv
+//
+// Usage: decode_bench <file.flv> [--rounds N]
+//                     [--profile low-latency|balanced|throughput]
+#include <time.h>
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "squig/decodedframe.h"
+#include "squig/flvreader.h"
+#include "squig/framepool.h"
+#include "squig/latencyhistogram.h"
+#include "squig/nalparser.h"
+#include "squig/streamdecoder.h"
+#include "squig/yuvconvert.h"
+
+namespace {
+uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+uint64_t processCpuNs() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct AU {
+    std::vector<uint8_t> data;  // AVCC, or Annex B SPS/PPS if config
+    int64_t dts;
+    int32_t cts;
+    // a sequence header after the first, sent in-band as
+    // StreamDecoder::applyConfig() does
+    bool config;
+};
+
+struct Recording {
+    std::vector<uint8_t> avccHdr;
+    h264::AVCConfig avc{};
+    bool parsed = false;
+    std::vector<AU> aus;
+    size_t configs{};
+    int64_t spanMs{};  // pts offset between rounds
+};
+
+bool load(const std::string& path, Recording& r) {
+    FlvReader reader(path);
+    FlvTag tag;
+    librtmp::RTMPMediaMessage m{};
+    while (reader.next(tag)) {
+        if (!flvVideoToMessage(tag, m)) {
+            continue;
+        }
+        auto& payload = m.video.video_data_send;
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(payload.data());
+        if (m.video.d.avc_packet_type == 0) {
+            if (r.avccHdr.empty()) {
+                r.avccHdr.assign(p, p + payload.size());
+                r.parsed = h264::parseAVCConfig(p, payload.size(), r.avc);
+                continue;
+            }
+            AU au{{}, int64_t(m.timestamp), 0, true};
+            if (h264::avcConfigToAnnexB(p, payload.size(), au.data)) {
+                r.aus.push_back(std::move(au));
+                r.configs++;
+            }
+            continue;
+        }
+        if (r.avccHdr.empty()) {
+            continue;  // nothing decodes before the header
+        }
+        r.aus.push_back({std::vector<uint8_t>(p, p + payload.size()),
+                         int64_t(m.timestamp), m.video.d.composition_time, false});
+    }
+    if (r.aus.empty()) {
+        return false;
+    }
+    // a second past the end, room for any cts
+    r.spanMs = r.aus.back().dts - r.aus.front().dts + 1000;
+    return true;
+}
+
+// One pass over the recording, `rounds` times.
+struct Pass {
+    uint64_t wallNs{}, cpuNs{};
+    uint64_t aus{}, frames{};
+    uint64_t annexbNs{};
+    uint64_t decodeNs{};  // in send_packet/receive_frame
+    uint64_t bgrNs{};
+    LatencyHistogram latencyUs;
+    int threads{};
+    const char* threadType = "none";  // of the pool, "none": no pool
+};
+
+// When each pts was sent, for AU sent -> frame out. Slots
+// like StreamDecoder's arrivals: the bookkeeping doesn't
+// allocate in the timed pass.
+struct Sent {
+    int64_t pts = AV_NOPTS_VALUE;
+    uint64_t ns{};
+};
+// reorder delay plus frame threads' frames, as the session's
+constexpr size_t kSentSlots = 64;
+
+bool runPass(const Recording& rec, DecodeProfile profile, int rounds, bool toBGR,
+             Pass& out) {
+    const AVCodec* pDec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    AVCodecContext* pCtx = avcodec_alloc_context3(pDec);
+    pCtx->extradata =
+        (uint8_t*)av_mallocz(rec.avccHdr.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+    pCtx->extradata_size = rec.avccHdr.size();
+    memcpy(pCtx->extradata, rec.avccHdr.data(), rec.avccHdr.size());
+    pCtx->width = rec.avc.width;
+    pCtx->height = rec.avc.height;
+    pCtx->pix_fmt = AV_PIX_FMT_YUV420P;
+    FramePool pool(32);
+    pCtx->opaque = &pool;
+    pCtx->get_buffer2 = FramePool::getBuffer2;
+    applyDecodeProfile(pCtx, profile, rec.parsed ? &rec.avc : nullptr);
+    if (avcodec_open2(pCtx, pDec, nullptr) < 0) {
+        avcodec_free_context(&pCtx);
+        return false;
+    }
+    out.threads = pCtx->thread_count;
+    out.threadType = pCtx->active_thread_type == FF_THREAD_FRAME   ? "frame"
+                     : pCtx->active_thread_type == FF_THREAD_SLICE ? "slice"
+                                                                   : "none";
+
+    auto pPools = std::make_shared<ConversionPools>();
+    AVPacket* pPkt = av_packet_alloc();
+    std::array<Sent, kSentSlots> sent{};
+    size_t sentIdx = 0;
+    uint64_t seq = 0;
+
+    auto receive = [&]() {
+        while (true) {
+            // recycled shells, as the session's decode stage
+            AVFrame* pFrame = pPools->shells.getFrame();
+            if (!pFrame) {
+                return;
+            }
+            uint64_t t0 = nowNs();
+            int ret = avcodec_receive_frame(pCtx, pFrame);
+            out.decodeNs += nowNs() - t0;
+            if (ret < 0) {
+                pPools->shells.putFrame(pFrame);
+                return;
+            }
+            out.frames++;
+            FrameHandle f = DecodedFrame::create(pFrame, ++seq, 0, pPools);
+            if (toBGR) {
+                t0 = nowNs();
+                f->bgr();
+                out.bgrNs += nowNs() - t0;
+            }
+            for (Sent& s : sent) {
+                if (s.pts == f->pts() && s.pts != AV_NOPTS_VALUE) {
+                    out.latencyUs.record((nowNs() - s.ns) / 1000);
+                    s = Sent{};
+                    break;
+                }
+            }
+        }
+    };
+
+    uint64_t wall0 = nowNs(), cpu0 = processCpuNs();
+    for (int round = 0; round < rounds; round++) {
+        int64_t offset = round * rec.spanMs;
+        for (const AU& au : rec.aus) {
+            // refcounted, as the session's pooled buffers: the
+            // decoder refs it instead of copying
+            if (av_new_packet(pPkt, int(au.data.size())) < 0) {
+                break;
+            }
+            memcpy(pPkt->data, au.data.data(), au.data.size());
+            if (!au.config) {
+                uint64_t t0 = nowNs();
+                h264::avccToAnnexB(pPkt->data, au.data.size());
+                out.annexbNs += nowNs() - t0;
+                pPkt->dts = au.dts + offset;
+                pPkt->pts = pPkt->dts + au.cts;
+                sent[sentIdx++ % kSentSlots] = {pPkt->pts, nowNs()};
+                out.aus++;
+            }
+            uint64_t t0 = nowNs();
+            int ret = avcodec_send_packet(pCtx, pPkt);
+            out.decodeNs += nowNs() - t0;
+            av_packet_unref(pPkt);
+            if (ret == 0) {
+                receive();
+            }
+        }
+        // the frames still held back, then a clean start
+        // for the next round
+        avcodec_send_packet(pCtx, nullptr);
+        receive();
+        avcodec_flush_buffers(pCtx);
+        sent.fill(Sent{});
+    }
+    out.wallNs = nowNs() - wall0;
+    out.cpuNs = processCpuNs() - cpu0;
+
+    av_packet_free(&pPkt);
+    avcodec_free_context(&pCtx);
+    return true;
+}
+
+std::string fmtNs(double ns) {
+    char buf[32];
+    if (ns < 1e3) {
+        snprintf(buf, sizeof(buf), "%.0f ns", ns);
+    } else if (ns < 1e6) {
+        snprintf(buf, sizeof(buf), "%.2f us", ns / 1e3);
+    } else {
+        snprintf(buf, sizeof(buf), "%.2f ms", ns / 1e6);
+    }
+    return buf;
+}
+
+// "-" for a CPU column that isn't measured separately
+void printRow(const std::string& name, double ns, double cpuNs, uint64_t n,
+              const std::string& counters) {
+    printf("%-26s %12s %12s %10llu %s\n", name.c_str(), fmtNs(ns).c_str(),
+           cpuNs < 0 ? "-" : fmtNs(cpuNs).c_str(), (unsigned long long)n,
+           counters.c_str());
+}
+
+std::string counters(const Pass& p, const char* to) {
+    double fps = p.wallNs ? p.frames * 1e9 / p.wallNs : 0;
+    char buf[160];
+    snprintf(buf, sizeof(buf), "fps=%.0f AU->%s p50=%s p99=%s max=%s", fps, to,
+             fmtNs(p.latencyUs.quantile(0.5) * 1e3).c_str(),
+             fmtNs(p.latencyUs.quantile(0.99) * 1e3).c_str(),
+             fmtNs(p.latencyUs.max() * 1e3).c_str());
+    return buf;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr,
+                "usage: %s <file.flv> [--rounds N] "
+                "[--profile low-latency|balanced|throughput]\n",
+                argv[0]);
+        return 2;
+    }
+    int rounds = 3;
+    std::vector<DecodeProfile> profiles = {DecodeProfile::kLowLatency,
+                                           DecodeProfile::kBalanced,
+                                           DecodeProfile::kThroughput};
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        DecodeProfile p;
+        if (arg == "--rounds" && i + 1 < argc) {
+            rounds = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--profile" && i + 1 < argc &&
+                   parseDecodeProfile(argv[i + 1], p)) {
+            profiles = {p};
+            i++;
+        } else {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return 2;
+        }
+    }
+
+    Recording rec;
+    try {
+        if (!load(argv[1], rec)) {
+            fprintf(stderr, "%s: no H.264 video\n", argv[1]);
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    printf("%s: %dx%d, profile_idc %d level %d, %zu AUs (%zu mid-stream headers)"
+           " x %d rounds, %u cpus, %s\n",
+           argv[1], rec.avc.width, rec.avc.height, rec.avc.profile, rec.avc.level,
+           rec.aus.size() - rec.configs, rec.configs, rounds,
+           std::thread::hardware_concurrency(), yuv::simdName(yuv::detectSimd()));
+    printf("%-26s %12s %12s %10s %s\n", "Benchmark", "Time", "CPU", "Iterations",
+           "UserCounters...");
+
+    for (DecodeProfile profile : profiles) {
+        std::string suffix = std::string("/") + decodeProfileName(profile);
+        Pass dec, full;
+        if (!runPass(rec, profile, rounds, false, dec) ||
+            !runPass(rec, profile, rounds, true, full)) {
+            fprintf(stderr, "can't open the decoder\n");
+            return 1;
+        }
+        if (dec.aus == 0) {
+            continue;
+        }
+        printRow("annexb" + suffix, double(dec.annexbNs) / dec.aus, -1, dec.aus, "");
+        char threads[48];
+        snprintf(threads, sizeof(threads), " threads=%d(%s)", dec.threads,
+                 dec.threadType);
+        printRow("decode" + suffix, double(dec.wallNs) / dec.aus,
+                 double(dec.cpuNs) / dec.aus, dec.aus,
+                 counters(dec, "frame") + threads);
+        if (full.frames) {
+            printRow("bgr" + suffix, double(full.bgrNs) / full.frames, -1,
+                     full.frames, "");
+        }
+        printRow("full" + suffix, double(full.wallNs) / full.aus,
+                 double(full.cpuNs) / full.aus, full.aus, counters(full, "bgr"));
+    }
+    return 0;
+}
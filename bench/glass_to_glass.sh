@@ -0,0 +1,50 @@
+#!/bin/bash
+# Glass-to-glass latency on localhost, no camera needed.
+#
+# Starts squig, pushes stamped synthetic streams to it with
+# stamp_publisher (publisher options are passed through),
+# stops squig and prints its capture -> stage latencies.
+# With MAX_P99_MS set, fails if the capture -> sink p99 over
+# all sessions is above it, for CI.
+#
+# Usage: bench/glass_to_glass.sh [stamp_publisher options]
+#   e.g. bench/glass_to_glass.sh --size 1920x1080 --fps 30 --streams 4 --seconds 20
+# SQUIG=<path> and PUBLISHER=<path> override the binaries,
+# SINK the squig sink (default null, display needs a screen).
+set -e
+
+SQUIG=${SQUIG:-./build/squig}
+PUBLISHER=${PUBLISHER:-./build/stamp_publisher}
+PORT=${PORT:-1935}
+SINK=${SINK:-null}
+LOG=$(mktemp)
+
+cleanup() {
+    kill $(jobs -p) 2>/dev/null || true
+    wait 2>/dev/null || true
+}
+trap cleanup EXIT
+
+"$SQUIG" "$PORT" --sink "$SINK" >"$LOG" 2>&1 &
+SQUIG_PID=$!
+sleep 1
+
+"$PUBLISHER" --url "rtmp://127.0.0.1:$PORT/live/stamp" "$@"
+
+# closing the sessions prints their stats
+sleep 1
+kill -INT $SQUIG_PID
+wait $SQUIG_PID || true
+
+grep -E "capture ->|glass-to-glass" "$LOG" || {
+    echo "no stamped frames reached squig, see $LOG"
+    exit 1
+}
+if [ -n "$MAX_P99_MS" ]; then
+    p99=$(grep "glass-to-glass" "$LOG" | grep -o 'p99 [0-9]*' | head -1 | tr -dc 0-9)
+    if [ "$((p99 / 1000))" -gt "$MAX_P99_MS" ]; then
+        echo "FAIL: capture -> $SINK p99 $((p99 / 1000))ms > ${MAX_P99_MS}ms"
+        exit 1
+    fi
+    echo "ok: capture -> $SINK p99 $((p99 / 1000))ms <= ${MAX_P99_MS}ms"
+fi
@@ -0,0 +1,166 @@
+// Late joiner catch-up through the GOP cache, on a recorded
+// stream: a StreamDecoder with --gop-cache ingests the
+// recording (null sink, replay pacing), and every N AUs a
+// consumer attaches the way an in-process one would,
+// StreamDecoder::gopSnapshot() then decodeLatest(). Each
+// catch-up frame is checked against the snapshot: the
+// stream's size, and the newest pts of the AUs it decodes.
+//
+// Prints the snapshot copy and the catch-up decode per
+// attach, with the GOP length they had to cover. Exit
+// status is non-zero if an attach fails or a frame is off.
+//
+//   ffmpeg -i assets/test0_1080_30_squig_base.mp4 -c copy test0.flv
+//
+// Usage: gopcache_bench <file.flv> [--every N] [--gop-cache MB]
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "squig/flvreader.h"
+#include "squig/gopcache.h"
+#include "squig/latencyhistogram.h"
+#include "squig/nalparser.h"
+#include "squig/perfstatistics.hpp"
+#include "squig/streamdecoder.h"
+#include "squig/utils.hpp"
+
+namespace {
+bool parseSize(const char* s, unsigned long max, size_t& out) {
+    char* end = nullptr;
+    errno = 0;
+    unsigned long v = std::strtoul(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v == 0 || v > max) {
+        return false;
+    }
+    out = v;
+    return true;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file.flv> [--every N] [--gop-cache MB]\n",
+                argv[0]);
+        return 2;
+    }
+    size_t every = 30;
+    size_t cacheMB = 8;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--every" && i + 1 < argc && parseSize(argv[i + 1], 100000, every)) {
+            i++;
+        } else if (arg == "--gop-cache" && i + 1 < argc &&
+                   parseSize(argv[i + 1], 65536, cacheMB)) {
+            i++;
+        } else {
+            fprintf(stderr, "bad option %s\n", arg.c_str());
+            return 2;
+        }
+    }
+
+    // the whole recording up front, ingest isn't what's timed
+    librtmp::RTMPMediaMessage hdr{};
+    std::vector<librtmp::RTMPMediaMessage> aus;
+    h264::AVCConfig avc{};
+    try {
+        FlvReader reader(argv[1]);
+        FlvTag tag;
+        librtmp::RTMPMediaMessage m{};
+        while (reader.next(tag)) {
+            if (!flvVideoToMessage(tag, m)) {
+                continue;
+            }
+            if (m.video.d.avc_packet_type == 0) {
+                if (hdr.video.video_data_send.empty()) {
+                    hdr = m;
+                }
+                continue;  // mid-stream headers: same stream here
+            }
+            if (!hdr.video.video_data_send.empty()) {
+                aus.push_back(m);
+            }
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    auto& hdrPayload = hdr.video.video_data_send;
+    if (aus.empty() ||
+        !h264::parseAVCConfig(reinterpret_cast<const uint8_t*>(hdrPayload.data()),
+                              hdrPayload.size(), avc)) {
+        fprintf(stderr, "%s: no H.264 video\n", argv[1]);
+        return 1;
+    }
+
+    librtmp::ClientParameters params{};
+    params.width = avc.width;
+    params.height = avc.height;
+    PerfStatistics stats(utils::nowUs());
+    StreamConfig config;
+    config.sink = SinkType::kNull;
+    config.blockingIngest = true;
+    config.gopCacheBytes = cacheMB << 20;
+
+    LatencyHistogram snapshotUs, catchUpUs;
+    size_t gopAUs = 0, maxGopAUs = 0;  // summed over attaches
+    size_t attaches = 0, failed = 0;
+    GopSnapshot snap;  // reused, like a consumer would
+    {
+        StreamDecoder decoder(hdr, params, stats, 0, config);
+        for (size_t i = 0; i < aus.size(); i++) {
+            decoder.process(aus[i]);
+            if ((i + 1) % every != 0) {
+                continue;
+            }
+            uint64_t t0 = utils::nowUs();
+            if (!decoder.gopSnapshot(snap)) {
+                continue;  // before the first IDR, or it overflowed
+            }
+            uint64_t t1 = utils::nowUs();
+            FrameHandle f = decodeLatest(snap);
+            uint64_t t2 = utils::nowUs();
+            attaches++;
+            snapshotUs.record(t1 - t0);
+            catchUpUs.record(t2 - t1);
+            gopAUs += snap.aus.size();
+            maxGopAUs = std::max(maxGopAUs, snap.aus.size());
+
+            // of what decodeLatest() decodes: the reference
+            // AUs and the last one
+            int64_t newest = INT64_MIN;
+            for (size_t k = 0; k < snap.aus.size(); k++) {
+                const CachedAU& au = snap.aus[k];
+                if (au.reference || k + 1 == snap.aus.size()) {
+                    newest = std::max(newest, au.dts + au.cts);
+                }
+            }
+            if (!f || f->width() != avc.width || f->height() != avc.height ||
+                f->pts() != newest) {
+                failed++;
+                fprintf(stderr, "attach at AU %zu: %s\n", i,
+                        f ? "frame isn't the newest of the GOP" : "nothing decoded");
+            }
+        }
+        decoder.stop();
+        decoder.printStageStats(0);
+    }
+
+    printf("%s: %dx%d, %zu AUs, attach every %zu, %zuMB cache\n", argv[1],
+           avc.width, avc.height, aus.size(), every, cacheMB);
+    printf("  %zu attaches, %zu failed\n", attaches, failed);
+    if (attaches > 0) {
+        printf("  GOP AUs:       mean %.1f, max %zu\n",
+               double(gopAUs) / attaches, maxGopAUs);
+        printf("  snapshot, us:  %s\n", snapshotUs.summary().c_str());
+        printf("  catch-up, us:  %s\n", catchUpUs.summary().c_str());
+    }
+    bool ok = attaches > 0 && failed == 0;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
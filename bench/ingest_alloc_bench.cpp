@@ -0,0 +1,247 @@
+// Allocation count for the ingest path: feeds the AUs of an
+// H.264 file through StreamDecoder::process() the way the
+// RTMP reader does, and counts heap allocations per AU once
+// the pools have warmed up.
+//
+//   - ingest (the thread calling process()) must not allocate
+//     at all in steady state: the payload is copied into a
+//     pooled buffer and queued by move.
+//   - decode (the decode stage's thread, "sq-dec-<id>") is
+//     reported per AU, not checked: the frame shells and
+//     handles are recycled (FrameShells), what's left is
+//     libavcodec's own bookkeeping and the buffer refs.
+//   - other threads (converter, sink) are reported as well.
+//
+// Runs with the null sink, no conversion or display.
+// The input has to carry AVCC (length prefixed) H.264 like
+// RTMP does, i.e. mp4/mov/flv/mkv, not a raw .h264 file.
+//
+// Usage: ingest_alloc_bench <file> [warmup AUs]
+// Exit status is non-zero if the ingest thread allocates.
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <dlfcn.h>
+#include <sys/prctl.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "squig/perfstatistics.hpp"
+#include "squig/streamdecoder.h"
+#include "squig/utils.hpp"
+
+// Interposed allocator entry points. Counting is global
+// for the total, thread local for the ingest thread, and
+// global again for the decode thread, recognised by its
+// name, so the three can be told apart.
+namespace {
+std::atomic<bool> gCounting{false};
+std::atomic<uint64_t> gAllocs{0};
+std::atomic<uint64_t> gDecodeAllocs{0};
+thread_local uint64_t tAllocs = 0;
+// -1 until looked up, which is only done while counting:
+// by then the pipeline's threads have named themselves.
+thread_local int tIsDecode = -1;
+
+bool isDecodeThread() {
+    if (tIsDecode < 0) {
+        // prctl, unlike most ways to get at the name, doesn't
+        // allocate
+        char name[16]{};
+        prctl(PR_GET_NAME, name);
+        tIsDecode = strncmp(name, "sq-dec-", 7) == 0;
+    }
+    return tIsDecode;
+}
+
+void count() {
+    if (gCounting.load(std::memory_order_relaxed)) {
+        gAllocs.fetch_add(1, std::memory_order_relaxed);
+        tAllocs++;
+        if (isDecodeThread()) {
+            gDecodeAllocs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+template <typename Fn>
+Fn next(const char* name) {
+    return reinterpret_cast<Fn>(dlsym(RTLD_NEXT, name));
+}
+}  // namespace
+
+extern "C" {
+void* malloc(size_t size) {
+    static auto real = next<void* (*)(size_t)>("malloc");
+    count();
+    return real(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    // dlsym itself may calloc before real is resolved,
+    // serve that from a static scratch buffer.
+    static char scratch[4096];
+    static bool resolving = false;
+    static void* (*real)(size_t, size_t) = nullptr;
+    if (!real) {
+        if (resolving) {
+            return scratch;
+        }
+        resolving = true;
+        real = next<void* (*)(size_t, size_t)>("calloc");
+        resolving = false;
+    }
+    count();
+    return real(n, size);
+}
+
+void* realloc(void* p, size_t size) {
+    static auto real = next<void* (*)(void*, size_t)>("realloc");
+    count();
+    return real(p, size);
+}
+
+int posix_memalign(void** p, size_t align, size_t size) {
+    static auto real = next<int (*)(void**, size_t, size_t)>("posix_memalign");
+    count();
+    return real(p, align, size);
+}
+}
+
+namespace {
+constexpr size_t kDefaultWarmup = 120;
+
+// One demuxed AU, as easyRTMP would have delivered it.
+librtmp::RTMPMediaMessage toMessage(const AVPacket* pkt,
+                                    AVRational tb,
+                                    int avcPacketType) {
+    librtmp::RTMPMediaMessage m{};
+    m.message_type = librtmp::RTMPMessageType::VIDEO;
+    // RTMP timestamps are in ms
+    AVRational ms{1, 1000};
+    int64_t dts = pkt->dts == AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    m.timestamp = av_rescale_q(dts, tb, ms);
+    m.video.d.frame_type = (pkt->flags & AV_PKT_FLAG_KEY) ? 1 : 2;
+    m.video.d.avc_packet_type = avcPacketType;
+    m.video.d.composition_time =
+        pkt->pts == AV_NOPTS_VALUE ? 0 : av_rescale_q(pkt->pts - dts, tb, ms);
+    m.video.video_data_send.assign(pkt->data, pkt->data + pkt->size);
+    return m;
+}
+
+// Wait (bounded, a broken AU may never produce a frame)
+// until the decode stage has output frame seq.
+void waitDecoded(const StreamDecoder& decoder, uint64_t seq) {
+    uint64_t deadline = utils::nowUs() + 1000 * 1000;
+    while (decoder.frames().latestSeq() < seq && utils::nowUs() < deadline) {
+        std::this_thread::yield();
+    }
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [warmup AUs]\n", argv[0]);
+        return 2;
+    }
+    size_t warmup = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : kDefaultWarmup;
+
+    AVFormatContext* pFmt = nullptr;
+    if (avformat_open_input(&pFmt, argv[1], nullptr, nullptr) < 0 ||
+        avformat_find_stream_info(pFmt, nullptr) < 0) {
+        fprintf(stderr, "can't open %s\n", argv[1]);
+        return 2;
+    }
+    int vIdx = av_find_best_stream(pFmt, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (vIdx < 0) {
+        fprintf(stderr, "no video stream\n");
+        return 2;
+    }
+    AVStream* st = pFmt->streams[vIdx];
+    AVCodecParameters* par = st->codecpar;
+    // AVCDecoderConfigurationRecord starts with version 1
+    if (par->codec_id != AV_CODEC_ID_H264 || par->extradata_size < 7 ||
+        par->extradata[0] != 1) {
+        fprintf(stderr, "need AVCC H.264 (mp4/flv/mkv)\n");
+        return 2;
+    }
+
+    // Demux everything up front, so the timed loop only
+    // contains what the RTMP reader would do per message.
+    std::vector<librtmp::RTMPMediaMessage> aus;
+    AVPacket* pkt = av_packet_alloc();
+    while (av_read_frame(pFmt, pkt) >= 0) {
+        if (pkt->stream_index == vIdx) {
+            aus.push_back(toMessage(pkt, st->time_base, 1));
+        }
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    if (aus.size() <= warmup) {
+        fprintf(stderr, "only %zu AUs, need more than the %zu warmup\n",
+                aus.size(), warmup);
+        return 2;
+    }
+
+    librtmp::RTMPMediaMessage hdr{};
+    hdr.message_type = librtmp::RTMPMessageType::VIDEO;
+    hdr.video.d.frame_type = 1;
+    hdr.video.d.avc_packet_type = 0;
+    hdr.video.video_data_send.assign(par->extradata,
+                                     par->extradata + par->extradata_size);
+    librtmp::ClientParameters params{};
+    params.width = par->width;
+    params.height = par->height;
+
+    PerfStatistics stats(utils::nowUs());
+    StreamConfig config;
+    config.sink = SinkType::kNull;
+    uint64_t ingestAllocs = 0, totalAllocs = 0;
+    size_t measured = aus.size() - warmup;
+    {
+        StreamDecoder decoder(hdr, params, stats, 0, config);
+        for (size_t i = 0; i < aus.size(); i++) {
+            if (i == warmup) {
+                // let the decode stage catch up so its warmup
+                // allocations don't land in the measurement
+                waitDecoded(decoder, warmup - 8);
+                tAllocs = 0;
+                gCounting = true;
+            }
+            decoder.process(aus[i]);
+            // pace like a live source would, so the
+            // queue doesn't overflow and drop to IDR
+            if (i >= 16) {
+                waitDecoded(decoder, i - 16);
+            }
+        }
+        ingestAllocs = tAllocs;
+        // decode keeps counting while it drains
+        decoder.stop();
+        gCounting = false;
+        totalAllocs = gAllocs;
+        decoder.printStageStats(0);
+    }
+    avformat_close_input(&pFmt);
+
+    uint64_t decodeAllocs = gDecodeAllocs;
+    uint64_t otherAllocs = totalAllocs - ingestAllocs - decodeAllocs;
+    printf("%zu AUs measured after %zu warmup\n", measured, warmup);
+    printf("  ingest: %llu allocs (%.2f/AU)\n",
+           (unsigned long long)ingestAllocs, (double)ingestAllocs / measured);
+    printf("  decode: %llu allocs (%.2f/AU)\n",
+           (unsigned long long)decodeAllocs, (double)decodeAllocs / measured);
+    printf("  other:  %llu allocs (%.2f/AU)\n",
+           (unsigned long long)otherAllocs, (double)otherAllocs / measured);
+
+    bool ok = ingestAllocs == 0;
+    printf("%s\n", ok ? "PASS" : "FAIL: ingest thread allocated");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+// Compose cost of the Mosaic (see mosaic.h) as streams are
+// added: 1, 4, 16 and 64 synthetic streams on one canvas,
+// every stream with a new frame each refresh (the worst
+// case), then with only a quarter of them moving. Reports
+// ms per refresh; it should stay about flat with the stream
+// count, the canvas area bounds the work.
+//
+// No window, Mosaic::compose() is timed on this thread.
+// Preparing the frames is not timed.
+//
+// Usage: mosaic_bench [width height rounds canvas_w canvas_h]
+//   defaults: 1920x1080 streams, 100 rounds, 1920x1080 canvas
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "squig/decodedframe.h"
+#include "squig/framepool.h"
+#include "squig/mosaic.h"
+#include "squig/utils.hpp"
+
+namespace {
+// Camera-ish content, so the sampling doesn't see
+// constant rows.
+void fillTemplate(std::vector<uint8_t>& y, std::vector<uint8_t>& c, int w, int h) {
+    std::mt19937 rng(7);
+    y.resize((size_t)w * h);
+    for (int r = 0; r < h; r++) {
+        for (int x = 0; x < w; x++) {
+            y[(size_t)r * w + x] = uint8_t((x + r) * 255 / (w + h) ^ (rng() & 7));
+        }
+    }
+    c.resize((size_t)((w + 1) / 2) * ((h + 1) / 2));
+    for (size_t i = 0; i < c.size(); i++) {
+        c[i] = uint8_t(96 + i % 64);
+    }
+}
+
+FrameHandle makeFrame(FramePool& pool,
+                      const std::shared_ptr<ConversionPools>& pPools,
+                      int w,
+                      int h,
+                      const std::vector<uint8_t>& y,
+                      const std::vector<uint8_t>& c,
+                      uint64_t seq) {
+    AVFrame* f = av_frame_alloc();
+    f->format = AV_PIX_FMT_YUV420P;
+    f->width = w;
+    f->height = h;
+    f->pts = int64_t(seq) * 33;
+    pool.get(f);
+    for (int r = 0; r < h; r++) {
+        memcpy(f->data[0] + (size_t)r * f->linesize[0], y.data() + (size_t)r * w, w);
+    }
+    int cw = (w + 1) / 2;
+    for (int p = 1; p < 3; p++) {
+        for (int r = 0; r < (h + 1) / 2; r++) {
+            memcpy(f->data[p] + (size_t)r * f->linesize[p], c.data() + (size_t)r * cw,
+                   cw);
+        }
+    }
+    return std::make_shared<const DecodedFrame>(f, seq, utils::nowUs(), pPools);
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    int w = argc > 1 ? atoi(argv[1]) : 1920;
+    int h = argc > 2 ? atoi(argv[2]) : 1080;
+    int rounds = argc > 3 ? atoi(argv[3]) : 100;
+    MosaicConfig mc;
+    mc.width = argc > 4 ? atoi(argv[4]) : 1920;
+    mc.height = argc > 5 ? atoi(argv[5]) : 1080;
+    mc.fps = 0;  // no render thread, compose() here
+    mc.show = false;
+    if (w <= 0 || h <= 0 || rounds <= 0 || mc.width < 64 || mc.height < 64) {
+        fprintf(stderr, "usage: %s [width height rounds canvas_w canvas_h]\n",
+                argv[0]);
+        return 2;
+    }
+
+    std::vector<uint8_t> y, c;
+    fillTemplate(y, c, w, h);
+    auto pPools = std::make_shared<ConversionPools>();
+    // every stream shows the same picture, only the frame
+    // (and so its seq) is new each round
+    FramePool pool(2);
+    uint64_t seq = 0;
+
+    printf("streams of %dx%d on a %dx%d canvas, %s\n", w, h, mc.width, mc.height,
+           yuv::simdName(yuv::detectSimd()));
+    for (int streams : {1, 4, 16, 64}) {
+        for (int moving : {streams, (streams + 3) / 4}) {
+            Mosaic mosaic(mc);
+            for (int s = 0; s < streams; s++) {
+                mosaic.attach(s);
+                mosaic.offer(s, makeFrame(pool, pPools, w, h, y, c, ++seq));
+            }
+            mosaic.compose();  // layout, first full draw
+
+            uint64_t totalUs = 0;
+            for (int r = 0; r < rounds; r++) {
+                for (int s = 0; s < moving; s++) {
+                    mosaic.offer(s, makeFrame(pool, pPools, w, h, y, c, ++seq));
+                }
+                uint64_t t0 = utils::nowUs();
+                mosaic.compose();
+                totalUs += utils::nowUs() - t0;
+            }
+            printf("  %2d streams, %2d moving  %7.3f ms/refresh\n", streams, moving,
+                   totalUs / 1000.0 / rounds);
+            if (moving == streams && streams < 4) {
+                break;  // a quarter of one is the same case
+            }
+        }
+    }
+    return 0;
+}
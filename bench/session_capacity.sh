@@ -0,0 +1,67 @@
+#!/bin/bash
+# How many 1080p30 publishers can one core of squig sustain?
+#
+# Pins squig to a single core, then adds ffmpeg publishers
+# (pinned to the remaining cores) one at a time. Each publisher
+# sends a 1080p30 H.264 file at real-time rate with -c copy, so
+# publisher CPU is negligible and the encode is identical across runs.
+# If squig falls behind, TCP backpressure slows the publishers
+# below 1.0x real time.
+#
+# Usage: bench/session_capacity.sh <1080p30 h264 file> [max_sessions] [secs]
+#   e.g. bench/session_capacity.sh assets/test0_1080_30_squig_base.mp4 32 20
+# SQUIG=<path> overrides the server binary, SQUIG_CORE the pinned core.
+set -e
+
+INPUT=${1:?usage: $0 <1080p30 h264 file> [max_sessions] [secs]}
+MAX_SESSIONS=${2:-32}
+SECS=${3:-20}
+SQUIG=${SQUIG:-./build/squig}
+SQUIG_CORE=${SQUIG_CORE:-0}
+PORT=${PORT:-1935}
+PUB_CORES="$((SQUIG_CORE + 1))-$(($(nproc) - 1))"
+CLK_TCK=$(getconf CLK_TCK)
+LOGDIR=$(mktemp -d)
+
+cpu_ticks() {
+    # utime + stime of the whole process (all threads)
+    awk '{print $14 + $15}' "/proc/$1/stat"
+}
+
+cleanup() {
+    kill $(jobs -p) 2>/dev/null || true
+    wait 2>/dev/null || true
+}
+trap cleanup EXIT
+
+taskset -c "$SQUIG_CORE" "$SQUIG" "$PORT" >"$LOGDIR/squig.log" 2>&1 &
+SQUIG_PID=$!
+sleep 1
+
+printf "%-9s %-10s %-14s %-10s\n" sessions "cpu(%)" "cpu/session(%)" "min speed"
+for ((n = 1; n <= MAX_SESSIONS; n++)); do
+    taskset -c "$PUB_CORES" ffmpeg -hide_banner -nostats -loglevel error \
+        -progress "$LOGDIR/pub$n.progress" -re -stream_loop -1 -i "$INPUT" \
+        -c:v copy -an -f flv "rtmp://localhost:$PORT/live/stream$n" \
+        >/dev/null 2>&1 &
+    # let the new session reach steady state (first IDR etc.)
+    sleep 2
+
+    t0=$(cpu_ticks $SQUIG_PID)
+    sleep "$SECS"
+    t1=$(cpu_ticks $SQUIG_PID)
+
+    cpu=$(echo "($t1 - $t0) * 100 / ($CLK_TCK * $SECS)" | bc -l)
+    # slowest publisher, from the last progress report of each
+    minSpeed=$(for f in "$LOGDIR"/pub*.progress; do
+        grep '^speed=' "$f" | tail -1 | tr -d 'speed=x '
+    done | sort -g | head -1)
+    printf "%-9d %-10.1f %-14.1f %-10s\n" "$n" "$cpu" \
+        "$(echo "$cpu / $n" | bc -l)" "$minSpeed"
+
+    if [ "$(echo "$minSpeed < 0.98" | bc -l)" = 1 ]; then
+        echo "sustained: $((n - 1)) sessions on one core"
+        exit 0
+    fi
+done
+echo "sustained: >= $MAX_SESSIONS sessions on one core"
@@ -0,0 +1,187 @@
+// Throughput/latency benchmark for the shared-memory frame
+// export (shmexport.h, shmreader.h). A writer thread does
+// what the decode thread does with --shm: takes buffers from
+// a FramePool backed by the export, fills them (standing in
+// for the decoder), publishes them and keeps the last few
+// alive like the FrameRing. N reader threads follow it with
+// their own mapping of the object, exactly as an analyzer
+// process would, and verify every frame they get.
+//
+// Reports writer fps, per reader frames seen / skipped,
+// publish -> reader wake latency, and how many frames were
+// overwritten before a reader was done with them (valid()
+// false, expected for slow readers). A frame that valid()
+// accepts but whose pixels don't match is a bug: exit
+// status is non-zero then.
+//
+// Usage: shm_bench [width height seconds readers fps]
+//   fps 0 (default) publishes as fast as possible
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "squig/framepool.h"
+#include "squig/latencyhistogram.h"
+#include "squig/shmexport.h"
+#include "squig/shmreader.h"
+#include "squig/utils.hpp"
+
+namespace {
+// frames the writer holds, like StreamDecoder's FrameRing
+constexpr size_t kHeld = 8;
+constexpr size_t kSlots = kHeld + 8;
+
+struct ReaderStats {
+    uint64_t frames{};
+    uint64_t skipped{};  // published but never seen (latest-frame semantics)
+    uint64_t overwritten{};
+    uint64_t corrupt{};
+    LatencyHistogram wakeUs;
+};
+
+// Every byte of frame seq is (seq + plane) & 0xff, so a
+// reader can tell which frame it is looking at.
+void fill(AVFrame* f, uint64_t seq) {
+    for (int p = 0; p < 3; p++) {
+        int ph = p ? (f->height + 1) / 2 : f->height;
+        memset(f->data[p], int((seq + p) & 0xff), size_t(f->linesize[p]) * ph);
+    }
+}
+
+bool check(const ShmFrameView& v) {
+    for (int p = 0; p < 3; p++) {
+        int pw = p ? (v.width + 1) / 2 : v.width;
+        int ph = p ? (v.height + 1) / 2 : v.height;
+        auto want = uint8_t((v.seq + p) & 0xff);
+        // first and last pixel of every plane: cheap, and
+        // catches a slot reused mid-frame
+        const uint8_t* last = v.planes[p] + size_t(ph - 1) * v.linesize[p] + pw - 1;
+        if (v.planes[p][0] != want || *last != want) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void readLoop(const std::string& name, std::atomic<bool>& stop, ReaderStats& s) {
+    ShmFrameReader r;
+    ShmFrameView v;
+    uint64_t lastSeq = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+        if (!r.isOpen() && !r.open(name)) {
+            usleep(1000);
+            continue;
+        }
+        if (!r.next(v, 100)) {
+            continue;
+        }
+        s.wakeUs.record(utils::nowUs() - v.publishUs);
+        if (lastSeq && v.seq > lastSeq + 1) {
+            s.skipped += v.seq - lastSeq - 1;
+        }
+        lastSeq = v.seq;
+        bool ok = check(v);
+        if (!r.valid(v)) {
+            s.overwritten++;
+        } else if (!ok) {
+            s.corrupt++;
+        } else {
+            s.frames++;
+        }
+    }
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    int width = argc > 1 ? atoi(argv[1]) : 1920;
+    int height = argc > 2 ? atoi(argv[2]) : 1080;
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    int nReaders = argc > 4 ? atoi(argv[4]) : 2;
+    int fps = argc > 5 ? atoi(argv[5]) : 0;
+    if (width <= 0 || height <= 0 || seconds <= 0 || nReaders < 0 || fps < 0) {
+        fprintf(stderr, "usage: %s [width height seconds readers fps]\n", argv[0]);
+        return 2;
+    }
+
+    std::string name = "/squig-bench-" + std::to_string(getpid());
+    ShmFrameExport exp(name, kSlots);
+    FramePool pool(kSlots);
+    pool.setExport(&exp);
+
+    std::atomic<bool> stop{false};
+    std::vector<ReaderStats> stats(nReaders);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < nReaders; i++) {
+        readers.emplace_back(readLoop, std::cref(name), std::ref(stop),
+                             std::ref(stats[i]));
+    }
+
+    std::deque<AVFrame*> held;
+    uint64_t seq = 0;
+    uint64_t start = utils::nowUs();
+    uint64_t end = start + uint64_t(seconds) * 1000000;
+    uint64_t periodUs = fps ? 1000000 / fps : 0;
+    for (uint64_t now = start; now < end; now = utils::nowUs()) {
+        AVFrame* f = av_frame_alloc();
+        f->format = AV_PIX_FMT_YUV420P;
+        f->width = width;
+        f->height = height;
+        if (pool.get(f) < 0) {
+            fprintf(stderr, "FramePool::get failed\n");
+            return 1;
+        }
+        seq++;
+        fill(f, seq);
+        f->pts = int64_t((now - start) / 1000);
+        exp.publish(f, seq);
+        held.push_back(f);
+        if (held.size() > kHeld) {
+            av_frame_free(&held.front());
+            held.pop_front();
+        }
+        if (periodUs) {
+            uint64_t next = start + seq * periodUs;
+            uint64_t t = utils::nowUs();
+            if (next > t) {
+                usleep(next - t);
+            }
+        }
+    }
+    double elapsed = (utils::nowUs() - start) / 1e6;
+    stop = true;
+    for (auto& t : readers) {
+        t.join();
+    }
+    for (AVFrame* f : held) {
+        av_frame_free(&f);
+    }
+
+    printf("shm %s: %dx%d, %zu slots, %.1f MB/frame\n", name.c_str(), width,
+           height, kSlots, width * height * 1.5 / (1 << 20));
+    printf("writer: %lu frames in %.2fs, %.0f fps, %lu exported, %lu not\n",
+           (unsigned long)seq, elapsed, seq / elapsed,
+           (unsigned long)exp.exported(), (unsigned long)exp.notExported());
+    uint64_t corrupt = 0;
+    for (int i = 0; i < nReaders; i++) {
+        const ReaderStats& s = stats[i];
+        printf("reader %d: %lu ok, %lu skipped, %lu overwritten, %lu corrupt\n"
+               "  wake: %s\n",
+               i, (unsigned long)s.frames, (unsigned long)s.skipped,
+               (unsigned long)s.overwritten, (unsigned long)s.corrupt,
+               s.wakeUs.summary().c_str());
+        corrupt += s.corrupt;
+    }
+    return corrupt ? 1 : 0;
+}
@@ -0,0 +1,206 @@
+// End-to-end throughput/latency benchmark on a recorded
+// session: replays a .pcap (full RTMP path) or .flv
+// (decoder only) in-process, see replay.h, and reports
+// decode fps, E2E latency and CPU per stream. The per-stage
+// breakdown is printed by each session as it closes.
+//
+// Deterministic input, no camera or ffmpeg client needed,
+// so it can run on every change (make bench).
+//
+// Usage: squig_bench <file.pcap|file.flv> [--copies N]
+//                    [--wire] [--sink display|null|yuv|bgr|mosaic]
+//                    [--decode all|keyframes|<N>fps] [--motion T]
+//                    [--profile low-latency|balanced|throughput]
+//                    [--batch N] [--workers N]
+//   --copies N  replay every recorded stream N times at once
+//   --wire      pace as captured instead of as fast as possible
+//   --sink S    where frames go (default null: ingest + decode only),
+//               mosaic: all streams on one 1920x1080@30 window
+//   --decode P  decode policy, or a comma separated list of them
+//               (all,keyframes,5fps) to replay once per policy and
+//               compare CPU per stream
+//   --profile P decoder threading (see decode_bench for one stream
+//               in isolation)
+//   --motion T  motion gate threshold, e.g. 0.005 with --sink bgr
+//               to see the conversion saved on static scenes
+//   --workers N run all streams' stages on N shared workers
+//               (0: one per core) instead of 3 threads per stream
+//   --batch N   batch the streams' frames for a (no-op) inference
+//               worker, N per batch, 640x640 NCHW float, 10ms deadline
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "squig/executor.h"
+#include "squig/mosaic.h"
+#include "squig/replay.h"
+#include "squig/tensorbatcher.h"
+
+namespace {
+bool parsePolicies(const std::string& list, std::vector<DecodePolicy>& out) {
+    out.clear();
+    size_t start = 0;
+    while (true) {
+        size_t end = list.find(',', start);
+        DecodePolicy policy;
+        if (!parseDecodePolicy(list.substr(start, end - start), policy)) {
+            return false;
+        }
+        out.push_back(policy);
+        if (end == std::string::npos) {
+            return true;
+        }
+        start = end + 1;
+    }
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr,
+                "usage: %s <file.pcap|file.flv> [--copies N] [--wire] "
+                "[--sink display|null|yuv|bgr|mosaic] [--decode all|keyframes|<N>fps[,...]] "
+                "[--motion T] [--profile low-latency|balanced|throughput] "
+                "[--batch N] [--workers N]\n",
+                argv[0]);
+        return 2;
+    }
+    std::string path = argv[1];
+    StreamConfig config;
+    config.sink = SinkType::kNull;
+    ReplayOptions opts;
+    opts.pacing = ReplayPacing::kFast;
+    std::vector<DecodePolicy> policies{config.decode};
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--copies" && i + 1 < argc) {
+            opts.copies = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--wire") {
+            opts.pacing = ReplayPacing::kWire;
+        } else if (arg == "--sink" && i + 1 < argc &&
+                   parseSinkType(argv[i + 1], config.sink)) {
+            i++;
+        } else if (arg == "--decode" && i + 1 < argc &&
+                   parsePolicies(argv[i + 1], policies)) {
+            i++;
+        } else if (arg == "--profile" && i + 1 < argc &&
+                   parseDecodeProfile(argv[i + 1], config.profile)) {
+            i++;
+        } else if (arg == "--motion" && i + 1 < argc) {
+            config.motionThreshold = std::strtof(argv[++i], nullptr);
+        } else if (arg == "--workers" && i + 1 < argc) {
+            ExecutorConfig ec;
+            ec.threads = std::strtoul(argv[++i], nullptr, 10);
+            config.executor = std::make_shared<Executor>(ec);
+        } else if (arg == "--batch" && i + 1 < argc) {
+            size_t n = std::max(1, std::atoi(argv[++i]));
+            config.batcher = std::make_shared<TensorBatcher>(
+                TensorSpec{}, n, std::chrono::milliseconds(10));
+        } else {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return 2;
+        }
+    }
+
+    if (config.sink == SinkType::kMosaic) {
+        config.mosaic = std::make_shared<Mosaic>(MosaicConfig{});
+    }
+
+    // stands in for an inference worker, takes batches and
+    // drops them
+    std::thread worker;
+    if (config.batcher) {
+        worker = std::thread([b = config.batcher] {
+            TensorBatcher::Batch batch;
+            while (b->next(batch, std::chrono::milliseconds(100)) ||
+                   !b->closed()) {
+            }
+        });
+    }
+
+    // one replay per policy, same input and options, so the
+    // CPU lines compare policies and nothing else
+    std::vector<ReplayResult> results;
+    for (const DecodePolicy& policy : policies) {
+        config.decode = policy;
+        ReplayResult r;
+        try {
+            r = replayFile(path, config, opts);
+        } catch (const std::exception& e) {
+            fprintf(stderr, "%s\n", e.what());
+            if (worker.joinable()) {
+                config.batcher->close();
+                worker.join();
+            }
+            return 2;
+        }
+        if (r.frames == 0) {
+            fprintf(stderr, "decode %s: nothing decoded\n",
+                    decodePolicyName(policy).c_str());
+            return 1;
+        }
+        // Fast replay never drops for a full queue, and without
+        // a policy or budget nothing is skipped on purpose: every
+        // AU fed has to come out as a frame, or the numbers
+        // below are about something else.
+        bool expectAll = opts.pacing == ReplayPacing::kFast &&
+                         policy.mode == DecodeMode::kAll &&
+                         config.latencyBudgetMs == 0;
+        if (expectAll && r.frames != r.aus) {
+            fprintf(stderr, "decoded %llu frames of %llu AUs fed\n",
+                    (unsigned long long)r.frames, (unsigned long long)r.aus);
+            return 1;
+        }
+
+        const LatencyHistogram& e2e = r.e2e;
+        printf("\n%s, %zu stream(s), %s, %s sink, decode %s\n", path.c_str(),
+               r.streams, opts.pacing == ReplayPacing::kFast ? "fast" : "wire paced",
+               sinkName(config.sink), decodePolicyName(policy).c_str());
+        printf("  frames      %llu of %llu AUs in %.2fs\n",
+               (unsigned long long)r.frames, (unsigned long long)r.aus, r.wallSec);
+        printf("  decode fps  %.1f total, %.1f per stream\n", r.frames / r.wallSec,
+               r.frames / r.wallSec / r.streams);
+        printf("  cpu         %.2fs, %.1f%% of a core per stream\n", r.cpuSec,
+               100.0 * r.cpuSec / r.wallSec / r.streams);
+        printf("  e2e (us)    p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+               (unsigned long long)e2e.quantile(0.5),
+               (unsigned long long)e2e.quantile(0.9),
+               (unsigned long long)e2e.quantile(0.99),
+               (unsigned long long)e2e.quantile(0.999),
+               (unsigned long long)e2e.max());
+        results.push_back(std::move(r));
+    }
+    if (worker.joinable()) {
+        config.batcher->close();
+        worker.join();
+    }
+
+    if (results.size() > 1) {
+        // Fast replay finishes sooner when less is decoded,
+        // CPU seconds per stream compare, % of a core doesn't
+        printf("\ncpu per policy (getrusage, user + sys)\n");
+        for (size_t i = 0; i < results.size(); i++) {
+            const ReplayResult& r = results[i];
+            printf("  %-12s %.3fs per stream, %.2fms per AU fed, %llu frames\n",
+                   decodePolicyName(policies[i]).c_str(), r.cpuSec / r.streams,
+                   1000.0 * r.cpuSec / std::max<uint64_t>(r.aus, 1),
+                   (unsigned long long)r.frames);
+        }
+    }
+    if (config.batcher) {
+        printf("  batches     %s\n", config.batcher->summary().c_str());
+    }
+    if (config.executor) {
+        printf("  executor\n%s", config.executor->summary().c_str());
+    }
+    if (config.mosaic) {
+        printf("  mosaic      %s\n", config.mosaic->summary().c_str());
+    }
+    return 0;
+}
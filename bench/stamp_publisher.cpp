@@ -0,0 +1,351 @@
+// Synthetic RTMP publisher for glass-to-glass latency:
+// generates frames, stamps each with its capture time (an
+// SEI NAL in front of the encoded picture, see
+// h264::writeStampSEI()), encodes with libavcodec
+// (libx264 by default) and pushes them to Squig as FLV over
+// RTMP, paced in real time. Squig reads the stamps back and
+// reports capture -> ingest/decoded/converted/sink latency
+// per session, and capture -> sink over all sessions.
+//
+// Capture times are CLOCK_MONOTONIC, publisher and server
+// must run on the same host. No camera, phone or ffmpeg CLI
+// needed; see glass_to_glass.sh for a CI run.
+//
+// Usage: stamp_publisher [--url rtmp://127.0.0.1:1935/live/stamp]
+//                        [--size 1280x720] [--fps 30] [--gop 60]
+//                        [--bframes 0] [--bitrate KBPS] [--streams N]
+//                        [--seconds S] [--encoder libx264] [--preset P]
+//   --streams N  N concurrent publishers, stream keys <url>-<i>
+//   --bframes B  B-frames between references; 0 also tunes
+//                libx264 for zero latency (no lookahead)
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+}
+
+#include "squig/latencyhistogram.h"
+#include "squig/nalparser.h"
+#include "squig/utils.hpp"
+
+namespace {
+struct Options {
+    std::string url = "rtmp://127.0.0.1:1935/live/stamp";
+    int width = 1280;
+    int height = 720;
+    int fps = 30;
+    int gop = 60;
+    int bframes = 0;
+    int bitrateKbps = 2000;
+    int streams = 1;
+    int seconds = 30;
+    std::string encoder = "libx264";
+    std::string preset = "ultrafast";
+};
+
+struct StreamResult {
+    bool ok = false;
+    uint64_t frames{};
+    uint64_t late{};  // frames generated behind schedule
+    LatencyHistogram encodeUs;  // capture -> packet out of the encoder
+};
+
+std::atomic<bool> gStop{false};
+
+void onSignal(int) { gStop = true; }
+
+std::string errStr(int err) {
+    char buf[128];
+    av_strerror(err, buf, sizeof(buf));
+    return buf;
+}
+
+// Bands scrolling down plus a box moving across, enough
+// change per frame for the encoder to do real work.
+void drawFrame(AVFrame* f, uint64_t n) {
+    for (int y = 0; y < f->height; y++) {
+        memset(f->data[0] + (size_t)y * f->linesize[0], uint8_t(y * 2 + n * 3),
+               f->width);
+    }
+    int box = f->height / 8;
+    int bx = int(n * 8 % uint64_t(std::max(1, f->width - box)));
+    int by = f->height / 2 - box / 2;
+    for (int y = by; y < by + box; y++) {
+        memset(f->data[0] + (size_t)y * f->linesize[0] + bx, 235, box);
+    }
+    for (int p = 1; p < 3; p++) {
+        for (int y = 0; y < (f->height + 1) / 2; y++) {
+            memset(f->data[p] + (size_t)y * f->linesize[p], p == 1 ? 96 : 160,
+                   (f->width + 1) / 2);
+        }
+    }
+}
+
+class Publisher {
+   private:
+    const Options& m_opts;
+    const std::string m_url;
+    StreamResult& m_result;
+
+    AVCodecContext* m_pEnc = nullptr;
+    AVFormatContext* m_pOut = nullptr;
+    AVFrame* m_pFrame = nullptr;
+    AVPacket* m_pPkt = nullptr;
+    AVPacket* m_pStamped = nullptr;
+    // capture time by frame pts (= frame index), B-frames
+    // come out of the encoder reordered
+    static constexpr size_t kCaptureSlots = 64;
+    uint64_t m_captureUs[kCaptureSlots]{};
+
+    bool open() {
+        const AVCodec* pCodec = avcodec_find_encoder_by_name(m_opts.encoder.c_str());
+        if (!pCodec) {
+            fprintf(stderr, "no encoder %s, using the default H.264 one\n",
+                    m_opts.encoder.c_str());
+            pCodec = avcodec_find_encoder(AV_CODEC_ID_H264);
+        }
+        if (!pCodec) {
+            fprintf(stderr, "no H.264 encoder\n");
+            return false;
+        }
+        m_pEnc = avcodec_alloc_context3(pCodec);
+        m_pEnc->width = m_opts.width;
+        m_pEnc->height = m_opts.height;
+        m_pEnc->pix_fmt = AV_PIX_FMT_YUV420P;
+        m_pEnc->time_base = AVRational{1, m_opts.fps};
+        m_pEnc->framerate = AVRational{m_opts.fps, 1};
+        m_pEnc->gop_size = m_opts.gop;
+        m_pEnc->max_b_frames = m_opts.bframes;
+        m_pEnc->bit_rate = int64_t(m_opts.bitrateKbps) * 1000;
+        // one core per publisher, many streams would
+        // oversubscribe otherwise
+        m_pEnc->thread_count = 1;
+        // encoders ignore options they don't know
+        av_opt_set(m_pEnc->priv_data, "preset", m_opts.preset.c_str(), 0);
+        if (m_opts.bframes == 0) {
+            av_opt_set(m_pEnc->priv_data, "tune", "zerolatency", 0);
+        }
+
+        int ret = avformat_alloc_output_context2(&m_pOut, nullptr, "flv",
+                                                 m_url.c_str());
+        if (ret < 0) {
+            fprintf(stderr, "%s: %s\n", m_url.c_str(), errStr(ret).c_str());
+            return false;
+        }
+        if (m_pOut->oformat->flags & AVFMT_GLOBALHEADER) {
+            // SPS/PPS in the FLV sequence header, not in-band
+            m_pEnc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+        if ((ret = avcodec_open2(m_pEnc, pCodec, nullptr)) < 0) {
+            fprintf(stderr, "encoder: %s\n", errStr(ret).c_str());
+            return false;
+        }
+        AVStream* pStream = avformat_new_stream(m_pOut, nullptr);
+        avcodec_parameters_from_context(pStream->codecpar, m_pEnc);
+        pStream->time_base = m_pEnc->time_base;
+        if ((ret = avio_open(&m_pOut->pb, m_url.c_str(), AVIO_FLAG_WRITE)) < 0) {
+            fprintf(stderr, "%s: %s\n", m_url.c_str(), errStr(ret).c_str());
+            return false;
+        }
+        // every packet on the wire right away
+        m_pOut->flush_packets = 1;
+        if ((ret = avformat_write_header(m_pOut, nullptr)) < 0) {
+            fprintf(stderr, "%s: %s\n", m_url.c_str(), errStr(ret).c_str());
+            return false;
+        }
+
+        m_pFrame = av_frame_alloc();
+        m_pFrame->format = AV_PIX_FMT_YUV420P;
+        m_pFrame->width = m_opts.width;
+        m_pFrame->height = m_opts.height;
+        av_frame_get_buffer(m_pFrame, 0);
+        m_pPkt = av_packet_alloc();
+        m_pStamped = av_packet_alloc();
+        return true;
+    }
+
+    // Writes every packet the encoder has ready, each with
+    // its frame's stamp SEI in front. false on a write error
+    // (e.g. Squig went away).
+    bool drain() {
+        while (avcodec_receive_packet(m_pEnc, m_pPkt) == 0) {
+            uint64_t captureUs = m_captureUs[uint64_t(m_pPkt->pts) % kCaptureSlots];
+            m_result.encodeUs.record(utils::nowUs() - captureUs);
+
+            // libx264 packets are Annex B, the FLV muxer turns
+            // them (and so the SEI) into length prefixed NALs
+            uint8_t sei[h264::kStampSEIMaxSize];
+            size_t seiSize = h264::writeStampSEI(captureUs, sei);
+            av_new_packet(m_pStamped, int(seiSize) + m_pPkt->size);
+            memcpy(m_pStamped->data, sei, seiSize);
+            memcpy(m_pStamped->data + seiSize, m_pPkt->data, m_pPkt->size);
+            av_packet_copy_props(m_pStamped, m_pPkt);
+            m_pStamped->stream_index = 0;
+            av_packet_rescale_ts(m_pStamped, m_pEnc->time_base,
+                                 m_pOut->streams[0]->time_base);
+            av_packet_unref(m_pPkt);
+
+            int ret = av_interleaved_write_frame(m_pOut, m_pStamped);
+            if (ret < 0) {
+                fprintf(stderr, "%s: %s\n", m_url.c_str(), errStr(ret).c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+   public:
+    Publisher(const Options& opts, std::string url, StreamResult& result)
+        : m_opts(opts), m_url(std::move(url)), m_result(result) {}
+
+    ~Publisher() {
+        if (m_pOut) {
+            if (m_pOut->pb) {
+                av_write_trailer(m_pOut);
+                avio_closep(&m_pOut->pb);
+            }
+            avformat_free_context(m_pOut);
+        }
+        avcodec_free_context(&m_pEnc);
+        av_frame_free(&m_pFrame);
+        av_packet_free(&m_pPkt);
+        av_packet_free(&m_pStamped);
+    }
+
+    void run() {
+        if (!open()) {
+            return;
+        }
+        m_result.ok = true;
+        const uint64_t periodUs = 1000000 / m_opts.fps;
+        const uint64_t totalFrames = uint64_t(m_opts.seconds) * m_opts.fps;
+        uint64_t startUs = utils::nowUs();
+        for (uint64_t n = 0; n < totalFrames && !gStop; n++) {
+            uint64_t dueUs = startUs + n * periodUs;
+            uint64_t now = utils::nowUs();
+            if (now < dueUs) {
+                std::this_thread::sleep_for(std::chrono::microseconds(dueUs - now));
+            } else if (now > dueUs + periodUs) {
+                m_result.late++;
+            }
+
+            av_frame_make_writable(m_pFrame);
+            drawFrame(m_pFrame, n);
+            m_pFrame->pts = int64_t(n);
+            // "captured" now, encode and network are part of
+            // the measured latency as with a real camera
+            m_captureUs[n % kCaptureSlots] = utils::nowUs();
+            if (avcodec_send_frame(m_pEnc, m_pFrame) < 0 || !drain()) {
+                m_result.ok = false;
+                return;
+            }
+            m_result.frames++;
+        }
+        // B-frames still in the encoder
+        avcodec_send_frame(m_pEnc, nullptr);
+        drain();
+    }
+};
+
+bool parseSize(const char* s, int& w, int& h) {
+    int end = 0;
+    return sscanf(s, "%dx%d%n", &w, &h, &end) == 2 && s[end] == '\0' && w > 0 &&
+           h > 0 && w % 2 == 0 && h % 2 == 0;
+}
+
+// utils::parseUInt() within [min, max]
+bool parseInt(const char* s, int min, int max, int& out) {
+    unsigned long v;
+    if (!utils::parseUInt(s, max, v) || v < (unsigned long)min) {
+        return false;
+    }
+    out = int(v);
+    return true;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options opts;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--url" && hasValue) {
+            opts.url = argv[++i];
+        } else if (arg == "--size" && hasValue) {
+            if (!parseSize(argv[++i], opts.width, opts.height)) {
+                fprintf(stderr, "bad size %s, want e.g. 1280x720\n", argv[i]);
+                return 2;
+            }
+        } else if (arg == "--fps" && hasValue &&
+                   parseInt(argv[i + 1], 1, 1000, opts.fps)) {
+            i++;
+        } else if (arg == "--gop" && hasValue &&
+                   parseInt(argv[i + 1], 1, 100000, opts.gop)) {
+            i++;
+        } else if (arg == "--bframes" && hasValue &&
+                   parseInt(argv[i + 1], 0, 16, opts.bframes)) {
+            i++;
+        } else if (arg == "--bitrate" && hasValue &&
+                   parseInt(argv[i + 1], 1, 1000000, opts.bitrateKbps)) {
+            i++;
+        } else if (arg == "--streams" && hasValue &&
+                   parseInt(argv[i + 1], 1, 1000, opts.streams)) {
+            i++;
+        } else if (arg == "--seconds" && hasValue &&
+                   parseInt(argv[i + 1], 1, 86400, opts.seconds)) {
+            i++;
+        } else if (arg == "--encoder" && hasValue) {
+            opts.encoder = argv[++i];
+        } else if (arg == "--preset" && hasValue) {
+            opts.preset = argv[++i];
+        } else {
+            fprintf(stderr,
+                    "usage: %s [--url U] [--size WxH] [--fps N] [--gop N] "
+                    "[--bframes N] [--bitrate KBPS] [--streams N] [--seconds S] "
+                    "[--encoder NAME] [--preset P]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    // a server going away is reported by the write, not a signal
+    std::signal(SIGPIPE, SIG_IGN);
+    avformat_network_init();
+
+    printf("%d stream(s) of %dx%d@%d, gop %d, %d B-frames, %dkbps, %ds -> %s\n",
+           opts.streams, opts.width, opts.height, opts.fps, opts.gop, opts.bframes,
+           opts.bitrateKbps, opts.seconds, opts.url.c_str());
+    std::vector<StreamResult> results(opts.streams);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < opts.streams; i++) {
+        std::string url =
+            opts.streams == 1 ? opts.url : opts.url + "-" + std::to_string(i);
+        threads.emplace_back([&opts, url, &r = results[i]] {
+            Publisher(opts, url, r).run();
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    int failed = 0;
+    for (int i = 0; i < opts.streams; i++) {
+        const StreamResult& r = results[i];
+        failed += !r.ok;
+        printf("  stream %d: %s, %llu frames, %llu late, encode %s\n", i,
+               r.ok ? "ok" : "FAILED", (unsigned long long)r.frames,
+               (unsigned long long)r.late, r.encodeUs.summary().c_str());
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,149 @@
+// Batch-fill cost of TensorBatcher (see tensorbatcher.h):
+// N synthetic streams offer a fresh frame each round, the
+// batch is taken and filled, and the fill time is reported
+// per batch and per image, for every layout/type combination
+// at the given model input size.
+//
+// Frames are new every round (the pyramid levels and BGR
+// conversions are cached per frame, reusing one would only
+// time the resize). Preparing them is not timed.
+//
+// Usage: tensorbatch_bench [streams width height rounds model_w model_h]
+//   defaults: 8 streams of 1920x1080, 100 rounds, 640x640
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "squig/decodedframe.h"
+#include "squig/framepool.h"
+#include "squig/parallelfor.h"
+#include "squig/tensorbatcher.h"
+#include "squig/utils.hpp"
+
+namespace {
+// Camera-ish content, so resize/convert don't see
+// constant rows.
+void fillTemplate(std::vector<uint8_t>& y, std::vector<uint8_t>& c, int w, int h) {
+    std::mt19937 rng(7);
+    y.resize((size_t)w * h);
+    for (int r = 0; r < h; r++) {
+        for (int x = 0; x < w; x++) {
+            y[(size_t)r * w + x] = uint8_t((x + r) * 255 / (w + h) ^ (rng() & 7));
+        }
+    }
+    c.resize((size_t)((w + 1) / 2) * ((h + 1) / 2));
+    for (size_t i = 0; i < c.size(); i++) {
+        c[i] = uint8_t(96 + i % 64);
+    }
+}
+
+FrameHandle makeFrame(FramePool& pool,
+                      const std::shared_ptr<ConversionPools>& pPools,
+                      int w,
+                      int h,
+                      const std::vector<uint8_t>& y,
+                      const std::vector<uint8_t>& c,
+                      uint64_t seq) {
+    AVFrame* f = av_frame_alloc();
+    f->format = AV_PIX_FMT_YUV420P;
+    f->width = w;
+    f->height = h;
+    f->pts = int64_t(seq) * 33;
+    pool.get(f);
+    for (int r = 0; r < h; r++) {
+        memcpy(f->data[0] + (size_t)r * f->linesize[0], y.data() + (size_t)r * w, w);
+    }
+    int cw = (w + 1) / 2;
+    for (int p = 1; p < 3; p++) {
+        for (int r = 0; r < (h + 1) / 2; r++) {
+            memcpy(f->data[p] + (size_t)r * f->linesize[p], c.data() + (size_t)r * cw,
+                   cw);
+        }
+    }
+    return std::make_shared<const DecodedFrame>(f, seq, utils::nowUs(), pPools);
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    int streams = argc > 1 ? atoi(argv[1]) : 8;
+    int w = argc > 2 ? atoi(argv[2]) : 1920;
+    int h = argc > 3 ? atoi(argv[3]) : 1080;
+    int rounds = argc > 4 ? atoi(argv[4]) : 100;
+    int mw = argc > 5 ? atoi(argv[5]) : 640;
+    int mh = argc > 6 ? atoi(argv[6]) : 640;
+    if (streams <= 0 || w <= 0 || h <= 0 || rounds <= 0 || mw <= 0 || mh <= 0) {
+        fprintf(stderr, "usage: %s [streams width height rounds model_w model_h]\n",
+                argv[0]);
+        return 2;
+    }
+
+    std::vector<uint8_t> y, c;
+    fillTemplate(y, c, w, h);
+    FramePool pool(streams + 2);
+    // one per stream, as StreamDecoders have
+    std::vector<std::shared_ptr<ConversionPools>> convPools;
+    for (int s = 0; s < streams; s++) {
+        convPools.push_back(std::make_shared<ConversionPools>());
+    }
+
+    printf("%d streams of %dx%d -> %dx%d, batch %d, %zu threads\n", streams, w, h,
+           mw, mh, streams, ParallelFor::shared().threads());
+    struct Case {
+        const char* name;
+        TensorLayout layout;
+        TensorType type;
+    };
+    const Case cases[] = {
+        {"NCHW f32", TensorLayout::kNCHW, TensorType::kF32},
+        {"NHWC f32", TensorLayout::kNHWC, TensorType::kF32},
+        {"NCHW u8", TensorLayout::kNCHW, TensorType::kU8},
+        {"NHWC u8", TensorLayout::kNHWC, TensorType::kU8},
+    };
+    uint64_t seq = 0;
+    for (const Case& cs : cases) {
+        TensorSpec spec;
+        spec.width = mw;
+        spec.height = mh;
+        spec.layout = cs.layout;
+        spec.type = cs.type;
+        // ImageNet's, a typical non-trivial normalization
+        const float mean[3] = {0.485f, 0.456f, 0.406f};
+        const float std[3] = {0.229f, 0.224f, 0.225f};
+        std::copy(mean, mean + 3, spec.mean);
+        std::copy(std, std + 3, spec.std);
+        TensorBatcher batcher(spec, streams, std::chrono::milliseconds(1000));
+
+        uint64_t totalUs = 0;
+        std::vector<FrameHandle> frames(streams);
+        for (int r = 0; r < rounds; r++) {
+            seq++;
+            for (int s = 0; s < streams; s++) {
+                frames[s] = makeFrame(pool, convPools[s], w, h, y, c, seq);
+            }
+            for (int s = 0; s < streams; s++) {
+                batcher.offer(s, frames[s]);
+            }
+            frames.assign(streams, nullptr);  // the batcher holds them now
+            TensorBatcher::Batch b;
+            uint64_t t0 = utils::nowUs();
+            if (!batcher.next(b, std::chrono::milliseconds(1000)) ||
+                b.size() != size_t(streams)) {
+                fprintf(stderr, "incomplete batch\n");
+                return 1;
+            }
+            totalUs += utils::nowUs() - t0;
+        }
+        double perBatch = totalUs / 1000.0 / rounds;
+        printf("  %-9s %7.3f ms/batch  %7.3f ms/image  %6.1f MB/batch\n", cs.name,
+               perBatch, perBatch / streams,
+               streams * spec.bytesPerImage() / 1048576.0);
+    }
+    return 0;
+}
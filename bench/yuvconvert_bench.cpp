@@ -0,0 +1,222 @@
+// Microbenchmark + exactness check for the yuv:: YUV420P -> BGR24
+// kernels against the sws_scale path they replace.
+//
+// For every matrix/range combination:
+//   - all SIMD levels must be bit-identical to the scalar kernel
+//   - the max abs difference to an accurate-rounding sws_scale
+//     (same matrix and range) must stay within kMaxSwsDiff
+// then times each level single threaded and row-split across
+// ParallelFor::shared(), next to the old SWS_BICUBIC context.
+// Last, the fused pyramid pass (full-res BGR plus BGR at 1/2
+// and 1/4, see pyramid.h) against converting and then
+// cv::resize'ing to each level.
+//
+// Usage: yuvconvert_bench [width height iterations]
+// Exit status is non-zero if an exactness check fails.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+#include <opencv2/imgproc.hpp>
+
+#include "squig/parallelfor.h"
+#include "squig/pyramid.h"
+#include "squig/yuvconvert.h"
+
+namespace {
+// sws interpolates chroma, we replicate it (both are valid
+// 4:2:0 upsamplings); on smooth chroma that is worth <= 1,
+// plus rounding.
+constexpr int kMaxSwsDiff = 3;
+
+// Camera-like content: gradients plus luma noise, so the
+// SIMD paths don't hit trivial cases. Chroma is kept smooth
+// so the upsampling choice doesn't dominate the sws diff.
+AVFrame* makeFrame(int w, int h, AVColorSpace cs, AVColorRange range) {
+    AVFrame* f = av_frame_alloc();
+    f->format = AV_PIX_FMT_YUV420P;
+    f->width = w;
+    f->height = h;
+    f->colorspace = cs;
+    f->color_range = range;
+    av_frame_get_buffer(f, 64);
+    std::mt19937 rng(42);
+    for (int p = 0; p < 3; p++) {
+        int pw = p ? (w + 1) / 2 : w;
+        int ph = p ? (h + 1) / 2 : h;
+        for (int y = 0; y < ph; y++) {
+            uint8_t* row = f->data[p] + (size_t)y * f->linesize[p];
+            for (int x = 0; x < pw; x++) {
+                int v = x * 255 / pw + (p ? y / 4 : y);
+                row[x] = (uint8_t)(p ? v : v ^ (rng() & 7));
+            }
+        }
+    }
+    return f;
+}
+
+SwsContext* makeSws(const AVFrame* f, int flags) {
+    SwsContext* ctx = sws_getContext(f->width,
+                                     f->height,
+                                     AV_PIX_FMT_YUV420P,
+                                     f->width,
+                                     f->height,
+                                     AV_PIX_FMT_BGR24,
+                                     flags,
+                                     NULL,
+                                     NULL,
+                                     NULL);
+    yuv::ColorParams cp = yuv::colorParamsOf(f);
+    int cs = cp.matrix == yuv::Matrix::kBT709 ? SWS_CS_ITU709 : SWS_CS_ITU601;
+    sws_setColorspaceDetails(ctx,
+                             sws_getCoefficients(cs),
+                             cp.fullRange,
+                             sws_getCoefficients(SWS_CS_DEFAULT),
+                             1,  // BGR is always full range
+                             0,
+                             1 << 16,
+                             1 << 16);
+    return ctx;
+}
+
+void swsConvert(SwsContext* ctx, const AVFrame* f, uint8_t* dst, int stride) {
+    uint8_t* dstData[4] = {dst};
+    int dstStride[4] = {stride};
+    sws_scale(ctx,
+              (const uint8_t* const*)f->data,
+              f->linesize,
+              0,
+              f->height,
+              dstData,
+              dstStride);
+}
+
+template <typename F>
+double msPerFrame(int iterations, F&& fn) {
+    fn();  // warm caches / page in dst
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        fn();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(t1 - t0).count() /
+           iterations;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    int w = argc > 2 ? std::atoi(argv[1]) : 1920;
+    int h = argc > 2 ? std::atoi(argv[2]) : 1080;
+    int iterations = argc > 3 ? std::atoi(argv[3]) : 200;
+    int stride = w * 3;
+    std::vector<uint8_t> ref(stride * h + 64), out(stride * h + 64);
+
+    const yuv::SimdLevel best = yuv::detectSimd();
+    std::vector<yuv::SimdLevel> levels{yuv::SimdLevel::kScalar};
+    if (best >= yuv::SimdLevel::kSSE41) levels.push_back(yuv::SimdLevel::kSSE41);
+    if (best >= yuv::SimdLevel::kAVX2) levels.push_back(yuv::SimdLevel::kAVX2);
+
+    bool ok = true;
+    struct Case {
+        const char* name;
+        AVColorSpace cs;
+        AVColorRange range;
+    };
+    const Case cases[] = {
+        {"bt601 limited", AVCOL_SPC_SMPTE170M, AVCOL_RANGE_MPEG},
+        {"bt601 full", AVCOL_SPC_SMPTE170M, AVCOL_RANGE_JPEG},
+        {"bt709 limited", AVCOL_SPC_BT709, AVCOL_RANGE_MPEG},
+        {"bt709 full", AVCOL_SPC_BT709, AVCOL_RANGE_JPEG},
+    };
+
+    printf("exactness (%dx%d)\n", w, h);
+    for (const Case& c : cases) {
+        AVFrame* f = makeFrame(w, h, c.cs, c.range);
+        yuv::convertFrame(f, ref.data(), stride, nullptr, yuv::Order::kBGR,
+                          yuv::SimdLevel::kScalar);
+        for (yuv::SimdLevel l : levels) {
+            yuv::convertFrame(f, out.data(), stride, nullptr, yuv::Order::kBGR,
+                              l);
+            if (out != ref) {
+                printf("  %-14s %-7s differs from scalar\n", c.name,
+                       yuv::simdName(l));
+                ok = false;
+            }
+        }
+
+        SwsContext* sws =
+            makeSws(f, SWS_POINT | SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT);
+        swsConvert(sws, f, out.data(), stride);
+        int maxDiff = 0;
+        size_t exact = 0;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < 3 * w; x++) {
+                int d = std::abs(ref[y * stride + x] - out[y * stride + x]);
+                maxDiff = std::max(maxDiff, d);
+                exact += d == 0;
+            }
+        }
+        printf("  %-14s vs sws_scale: max diff %d, %.2f%% exact\n", c.name,
+               maxDiff, 100.0 * exact / (3.0 * w * h));
+        ok &= maxDiff <= kMaxSwsDiff;
+        sws_freeContext(sws);
+        av_frame_free(&f);
+    }
+
+    printf("\nthroughput (%dx%d, %d iterations, %zu threads)\n", w, h,
+           iterations, ParallelFor::shared().threads());
+    AVFrame* f = makeFrame(w, h, AVCOL_SPC_BT709, AVCOL_RANGE_MPEG);
+    SwsContext* bicubic = makeSws(f, SWS_BICUBIC);
+    double ms = msPerFrame(iterations, [&] {
+        swsConvert(bicubic, f, out.data(), stride);
+    });
+    printf("  %-22s %7.3f ms/frame\n", "sws_scale bicubic", ms);
+    sws_freeContext(bicubic);
+
+    for (yuv::SimdLevel l : levels) {
+        ms = msPerFrame(iterations, [&] {
+            yuv::convertFrame(f, out.data(), stride, nullptr, yuv::Order::kBGR,
+                              l);
+        });
+        printf("  %-22s %7.3f ms/frame  %7.1f Mpix/s\n", yuv::simdName(l), ms,
+               w * h / ms / 1e3);
+        ms = msPerFrame(iterations, [&] {
+            yuv::convertFrame(f, out.data(), stride, &ParallelFor::shared(),
+                              yuv::Order::kBGR, l);
+        });
+        printf("  %-15s threaded %7.3f ms/frame  %7.1f Mpix/s\n",
+               yuv::simdName(l), ms, w * h / ms / 1e3);
+    }
+
+    // single threaded, the point is memory traffic
+    cv::Mat full(h, w, CV_8UC3, out.data(), stride);
+    cv::Mat half(h / 2, w / 2, CV_8UC3), quarter(h / 4, w / 4, CV_8UC3);
+    ms = msPerFrame(iterations, [&] {
+        yuv::convertFrame(f, out.data(), stride);
+        cv::resize(full, half, half.size(), 0, 0, cv::INTER_AREA);
+        cv::resize(full, quarter, quarter.size(), 0, 0, cv::INTER_AREA);
+    });
+    printf("  %-22s %7.3f ms/frame\n", "bgr + 2x cv::resize", ms);
+    pyramid::Targets t;
+    size_t i2 = PyramidLevel{PyramidFormat::kBGR24, 2}.index();
+    size_t i4 = PyramidLevel{PyramidFormat::kBGR24, 4}.index();
+    t.data[i2] = half.data;
+    t.stride[i2] = int(half.step);
+    t.data[i4] = quarter.data;
+    t.stride[i4] = int(quarter.step);
+    t.bgr = out.data();
+    t.bgrStride = stride;
+    ms = msPerFrame(iterations, [&] { pyramid::build(f, t); });
+    printf("  %-22s %7.3f ms/frame\n", "bgr + pyramid, fused", ms);
+    av_frame_free(&f);
+
+    printf("\n%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
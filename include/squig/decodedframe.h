@@ -0,0 +1,159 @@
+#ifndef DECODEDFRAME_H
+#define DECODEDFRAME_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include <opencv2/core.hpp>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "squig/framepool.h"
+#include "squig/streamconfig.h"
+
+// Formats a DecodedFrame can be converted to on demand.
+enum class ConvertedFormat { kBGR24, kRGB24, kNV12, kCount };
+
+// Output buffers for on-demand conversions, shared by all
+// frames of a stream. Frames keep them alive, since a frame
+// may outlive the StreamDecoder that produced it.
+struct ConversionPools {
+    // every AVFrame of the stream's frames, decoded and
+    // converted, and the frames themselves (create())
+    FrameShells shells;
+    FramePool packed{4};  // BGR24 and RGB24 (same layout)
+    FramePool nv12{2};
+    struct LevelPool {
+        FramePool pool{2};
+    };
+    LevelPool pyramid[kPyramidLevels];
+    // Pyramid levels somebody subscribed to (bit per
+    // PyramidLevel::index()); the first scaled() call on a
+    // frame builds all of them in one pass.
+    std::atomic<uint32_t> pyramidSubs{0};
+
+    void subscribe(const PyramidLevel& l) {
+        pyramidSubs.fetch_or(1u << l.index(), std::memory_order_relaxed);
+    }
+};
+
+// One decoded picture, shared read-only between all
+// consumers. Owns a reference to the decoder's output
+// buffer (from a FramePool), so handing it out never copies
+// pixel data.
+//
+// Consumers that only need luma (motion detection, grayscale
+// CV) read the planes through zero-copy views. Packed formats
+// are converted the first time any consumer asks for them and
+// cached on the frame, so a stream nobody wants BGR from never
+// pays for the conversion, and N consumers pay for it once.
+class DecodedFrame {
+   private:
+    AVFrame* m_pFrame;
+    uint64_t m_seq;
+    uint64_t m_arrivalUs;
+    float m_motion;
+    uint64_t m_captureUs;
+    std::shared_ptr<ConversionPools> m_pPools;
+
+    struct Converted {
+        std::once_flag once;
+        std::atomic<AVFrame*> pFrame{nullptr};
+    };
+    mutable Converted m_converted[static_cast<int>(ConvertedFormat::kCount)];
+
+    const AVFrame* converted(ConvertedFormat fmt) const;
+    AVFrame* convert(ConvertedFormat fmt) const;
+
+    // Built levels, guarded by m_pyramidLock (a build holds
+    // it, concurrent callers wait for it like for bgr()).
+    mutable std::mutex m_pyramidLock;
+    mutable AVFrame* m_pPyramid[kPyramidLevels]{};
+    // Builds the levels in mask that aren't built yet, with
+    // m_pyramidLock held. pBGROut: also convert full-res BGR
+    // into it in the same pass.
+    void buildLevels(uint32_t mask, AVFrame* pBGROut) const;
+
+   public:
+    // Takes ownership of pFrame, which goes back to pPools'
+    // shells with the frame.
+    DecodedFrame(AVFrame* pFrame,
+                 uint64_t seq,
+                 uint64_t arrivalUs,
+                 std::shared_ptr<ConversionPools> pPools,
+                 float motion = -1,
+                 uint64_t captureUs = 0)
+        : m_pFrame(pFrame),
+          m_seq(seq),
+          m_arrivalUs(arrivalUs),
+          m_motion(motion),
+          m_captureUs(captureUs),
+          m_pPools(std::move(pPools)) {}
+    DecodedFrame(const DecodedFrame&) = delete;
+    DecodedFrame& operator=(const DecodedFrame&) = delete;
+    ~DecodedFrame();
+
+    // A handle to a new frame held in a recycled block of
+    // pPools' shells (the decode path, no malloc per frame).
+    static std::shared_ptr<const DecodedFrame> create(
+        AVFrame* pFrame,
+        uint64_t seq,
+        uint64_t arrivalUs,
+        const std::shared_ptr<ConversionPools>& pPools,
+        float motion = -1,
+        uint64_t captureUs = 0);
+
+    const AVFrame* avFrame() const { return m_pFrame; }
+    uint64_t seq() const { return m_seq; }
+    int64_t pts() const { return m_pFrame->pts; }
+    // when its AU was read off the socket
+    uint64_t arrivalUs() const { return m_arrivalUs; }
+    // when the publisher captured it, from a stamp SEI (see
+    // h264::writeStampSEI()), 0 if the stream has none
+    uint64_t captureUs() const { return m_captureUs; }
+    // Change since the previous frame, see motion.h. -1 if
+    // the stream isn't scored (StreamConfig::motionThreshold).
+    float motion() const { return m_motion; }
+    int width() const { return m_pFrame->width; }
+    int height() const { return m_pFrame->height; }
+
+    // Zero-copy views over the decoded planes. The data is
+    // shared with every other consumer: treat it as read-only.
+    cv::Mat yPlane() const;
+    cv::Mat uPlane() const;
+    cv::Mat vPlane() const;
+
+    // Converted on first use, then cached. Thread-safe, a
+    // concurrent caller waits for the one conversion. Empty
+    // if no buffer could be allocated for it.
+    cv::Mat bgr() const;
+    cv::Mat rgb() const;
+    // Y rows followed by interleaved UV rows, one stride
+    // (the layout cv::cvtColor expects for NV12).
+    cv::Mat nv12() const;
+
+    bool isConverted(ConvertedFormat fmt) const;
+
+    // Reduced resolution level (div 2 or 4, see pyramid.h),
+    // built on first use together with every level the
+    // stream's consumers subscribed to (ConversionPools::
+    // subscribe), then cached. Empty for other divs or
+    // frames too small to reduce.
+    cv::Mat scaled(PyramidFormat fmt, int div) const;
+    // The subscribed levels, plus full-res BGR if withBGR,
+    // in one pass. For the convert stage, to build them
+    // ahead of the consumers. False if the BGR was asked for
+    // but couldn't be allocated.
+    bool buildPyramid(bool withBGR) const;
+    bool isScaled(PyramidFormat fmt, int div) const;
+};
+
+// Refcounted, read-only handle to a decoded frame.
+// The pixel buffer stays valid while any handle is alive.
+using FrameHandle = std::shared_ptr<const DecodedFrame>;
+#endif
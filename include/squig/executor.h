@@ -0,0 +1,153 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "squig/spscqueue.hpp"
+
+// Which queue a Strand goes to. Workers take every
+// kLatency task (theirs, then stolen) before any
+// kBackground one.
+enum class TaskPriority {
+    kLatency,     // e.g. stages of a displayed stream
+    kBackground,  // analysis, headless/dump sessions
+};
+inline constexpr size_t kTaskPriorities = 2;
+
+struct ExecutorConfig {
+    // 0: one per entry of cpus, or per core if cpus is empty
+    size_t threads = 0;
+    // Worker i is pinned to cpus[i % cpus.size()], empty:
+    // not pinned. See parseCpuSpec().
+    std::vector<int> cpus;
+};
+
+// "0-3,8,10-11" or "node1" (that NUMA node's cpus, from
+// sysfs) into cpus. false if it doesn't parse or names no cpu.
+bool parseCpuSpec(const std::string& spec, std::vector<int>& cpus);
+
+class Executor;
+
+// A serial task on an Executor: body is never run by two
+// workers at once, and every notify() is followed by at
+// least one run of it that starts after the notify(). A
+// pipeline stage's body drains its input queue, so items
+// are handled in order, whichever worker runs them.
+//
+// body returns true if it stopped with work left (e.g. to
+// let other streams in after a few items), the strand is
+// then queued again right away.
+//
+// notify() is lock free unless a worker has to be woken,
+// and never allocates.
+class Strand {
+   private:
+    friend class Executor;
+
+    Executor& m_exec;
+    const TaskPriority m_priority;
+    const size_t m_home;  // worker notify() queues to from other threads
+    std::function<bool()> m_body;
+    // notify()s not yet covered by a run, > 0 while queued
+    // or running
+    std::atomic<uint32_t> m_pending{0};
+    std::mutex m_idleLock;
+    std::condition_variable m_idle;
+
+    void run();
+
+   public:
+    Strand(Executor& exec, TaskPriority priority, std::function<bool()> body);
+    Strand(const Strand&) = delete;
+    Strand& operator=(const Strand&) = delete;
+    ~Strand() { waitIdle(); }
+
+    // Any thread.
+    void notify();
+    // Blocks until no run is queued or in progress. Nothing
+    // may notify() meanwhile.
+    void waitIdle();
+    TaskPriority priority() const { return m_priority; }
+};
+
+// Snapshot of one worker, see Executor::stats().
+struct WorkerStats {
+    int cpu = -1;  // pinned to, -1 if not
+    uint64_t runs{};
+    uint64_t steals{};  // runs taken from another worker's queue
+    uint64_t busyUs{};  // in strand bodies
+    uint64_t upUs{};    // since the worker started
+    size_t depth[kTaskPriorities]{};  // queued now
+    size_t maxDepth{};                // deepest own queue seen, both priorities
+};
+
+// Worker threads shared by every session's pipeline stages
+// (and any analysis strands), instead of three threads per
+// stream: 50 cameras on 16 cores run on 16 threads.
+//
+// Each worker has a queue per priority. A strand notified
+// from a worker goes to that worker's queue (decode ->
+// convert -> sink of one stream stay on a warm core), from
+// any other thread to the strand's home worker. Idle
+// workers steal from the back of the others' queues and
+// sleep once there is nothing to steal.
+//
+// Strands must be idle (waitIdle()) before the Executor
+// goes away.
+class Executor {
+   private:
+    struct alignas(kCacheLine) Worker {
+        std::mutex lock;
+        // ring of queued strands per priority, grows if a
+        // worker ever holds more than there were so far
+        std::vector<Strand*> ring[kTaskPriorities];
+        size_t head[kTaskPriorities]{};
+        size_t count[kTaskPriorities]{};
+        size_t maxDepth{};
+        int cpu = -1;
+        // written by the worker, read by stats()
+        std::atomic<uint64_t> runs{}, steals{}, busyUs{};
+        uint64_t startUs{};
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<size_t> m_nextHome{};
+    // queued over all workers, and workers asleep or about
+    // to be; either side checks the other's (seq_cst) so no
+    // wakeup is lost.
+    std::atomic<size_t> m_queued{};
+    std::atomic<size_t> m_sleepers{};
+    std::mutex m_sleepLock;
+    std::condition_variable m_wake;
+    bool m_stopping = false;
+
+    void schedule(Strand* s);
+    Strand* take(size_t self, bool& stolen);
+    void workerLoop(size_t self);
+    size_t nextHome() { return m_nextHome.fetch_add(1) % m_workers.size(); }
+    friend class Strand;
+
+   public:
+    explicit Executor(const ExecutorConfig& config);
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+    ~Executor();
+
+    size_t threads() const { return m_workers.size(); }
+    std::vector<WorkerStats> stats() const;
+    // One line per worker: cpu, utilization, runs, steals,
+    // queue depths.
+    std::string summary() const;
+};
+#endif
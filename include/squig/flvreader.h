@@ -0,0 +1,46 @@
+#ifndef FLVREADER_H
+#define FLVREADER_H
+
+#include <stdint.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "squig/rtmp_server.h"
+
+// FLV tags carry the same payloads as RTMP audio/video
+// messages, so a recorded .flv can stand in for a live
+// publisher (see replay.h).
+struct FlvTag {
+    static constexpr uint8_t kAudio = 8;
+    static constexpr uint8_t kVideo = 9;
+    static constexpr uint8_t kScript = 18;
+
+    uint8_t type{};
+    uint32_t timestampMs{};
+    std::vector<uint8_t> data;
+};
+
+// Sequential reader over the tags of an FLV file.
+class FlvReader {
+   private:
+    std::ifstream m_in;
+
+   public:
+    // Throws std::runtime_error if path isn't an FLV file.
+    explicit FlvReader(const std::string& path);
+    // false at the end of the file (or a truncated tag).
+    bool next(FlvTag& tag);
+};
+
+// The RTMP message easyRTMP would have produced for an
+// H.264 video tag: frame type, AVC packet type and
+// composition time from the tag header, the AVCC payload
+// (or AVCDecoderConfigurationRecord) in video_data_send.
+// false for anything that isn't AVC video.
+bool flvVideoToMessage(const FlvTag& tag, librtmp::RTMPMediaMessage& m);
+
+// width/height from an onMetaData script tag, if present.
+bool flvMetaDimensions(const FlvTag& tag, int& width, int& height);
+#endif
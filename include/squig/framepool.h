@@ -0,0 +1,129 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "squig/shmexport.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+}
+
+// A FramePool hands out frame buffers of one
+// format/size from an AVBufferPool, so steady state
+// decoding does no heap allocation. A buffer returns to
+// the pool when the last AVFrame referencing it is unref'd,
+// regardless of which thread (consumer) does that.
+// A size change reallocates (and drops the old pool) only
+// if the new size needs bigger buffers than the pool has;
+// otherwise the buffers are reused with the new layout.
+class FramePool {
+   private:
+    std::mutex m_lock;  // get_buffer2 may run on decoder threads
+    AVBufferPool* m_pPool = nullptr;
+    AVPixelFormat m_fmt = AV_PIX_FMT_NONE;
+    int m_width{}, m_height{};
+    int m_linesize[4]{};
+    size_t m_planeOffset[4]{};
+    size_t m_bufSize{};  // of the pool's buffers, >= the layout's
+    size_t m_prealloc;
+    std::atomic<uint64_t> m_reallocs{};
+    std::atomic<uint64_t> m_reuses{};  // size changes served by the old pool
+    // buffers come from shared memory instead of the heap
+    ShmFrameExport* m_pExport = nullptr;
+
+    void reset(AVPixelFormat fmt, int width, int height);
+
+   public:
+    // SIMD friendly row alignment
+    static constexpr int kAlign = 64;
+
+    explicit FramePool(size_t prealloc) : m_prealloc(prealloc) {}
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+    ~FramePool();
+
+    // Points frame->buf[0]/data/linesize at a pooled buffer.
+    // frame->format/width/height must be set. Returns < 0 on error.
+    int get(AVFrame* frame);
+
+    // AVCodecContext::get_buffer2 hook, ctx->opaque must be the pool.
+    // Frames the pool can't serve fall back to the default allocator.
+    static int getBuffer2(AVCodecContext* ctx, AVFrame* frame, int flags);
+
+    uint64_t reallocs() const { return m_reallocs.load(); }
+    uint64_t reuses() const { return m_reuses.load(); }
+
+    // Carve buffers out of pExport's shared object from the
+    // next (re)allocation on. Set before the first get(); the
+    // export must outlive the pool.
+    void setExport(ShmFrameExport* pExport) { m_pExport = pExport; }
+};
+
+// Recycles the small allocations around each pooled
+// picture: AVFrame structs, and the blocks a DecodedFrame
+// and its shared_ptr control block live in (see
+// Allocator). Without it every decoded frame costs a few
+// mallocs on the decode thread. Shells go back from
+// whichever thread drops the last reference.
+class FrameShells {
+   public:
+    // DecodedFrame plus control block, with room to spare
+    static constexpr size_t kBlockSize = 512;
+
+   private:
+    // returned beyond that many idle ones are freed, more
+    // would only be a burst's leftovers
+    static constexpr size_t kMaxIdle = 64;
+
+    std::mutex m_lock;
+    std::vector<AVFrame*> m_frames;
+    std::vector<void*> m_blocks;
+
+   public:
+    FrameShells();
+    FrameShells(const FrameShells&) = delete;
+    FrameShells& operator=(const FrameShells&) = delete;
+    ~FrameShells();
+
+    // Blank, as from av_frame_alloc(). nullptr if out of memory.
+    AVFrame* getFrame();
+    // Unrefs f and keeps it for getFrame(), null is ignored.
+    void putFrame(AVFrame* f);
+    void* getBlock();
+    void putBlock(void* p);
+
+    // For std::allocate_shared, which asks for one block
+    // holding object and control block. Keeps the shells
+    // alive, the block goes back after the object is gone.
+    template <typename T>
+    struct Allocator {
+        using value_type = T;
+        std::shared_ptr<FrameShells> pShells;
+
+        explicit Allocator(std::shared_ptr<FrameShells> p) : pShells(std::move(p)) {}
+        template <typename U>
+        Allocator(const Allocator<U>& o) : pShells(o.pShells) {}
+
+        T* allocate(size_t) {
+            static_assert(sizeof(T) <= kBlockSize &&
+                          alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+            return static_cast<T*>(pShells->getBlock());
+        }
+        void deallocate(T* p, size_t) { pShells->putBlock(p); }
+
+        template <typename U>
+        bool operator==(const Allocator<U>& o) const {
+            return pShells == o.pShells;
+        }
+    };
+};
+#endif
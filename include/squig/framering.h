@@ -0,0 +1,54 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "squig/decodedframe.h"
+
+// Fixed-capacity ring of the most recent decoded frames
+// of one stream. The decoder publishes into it and never
+// waits on consumers; each consumer keeps its own cursor
+// and gets "latest frame" semantics, i.e. a slow consumer
+// skips frames instead of holding the decoder back.
+class FrameRing {
+   private:
+    mutable std::mutex m_lock;
+    mutable std::condition_variable m_cv;
+    std::vector<FrameHandle> m_slots;
+    // seq of the newest frame, 0 = nothing published yet
+    std::atomic<uint64_t> m_latestSeq{0};
+    bool m_closed = false;
+
+   public:
+    explicit FrameRing(size_t capacity) : m_slots(capacity) {}
+
+    // Decoder side. frames must be published in seq order.
+    void publish(FrameHandle f);
+    // Wakes all waitNext() callers, e.g. on session end.
+    void close();
+
+    // Newest frame, or nullptr if none yet.
+    FrameHandle latest() const;
+    // Newest frame if it is newer than cursor (and advances cursor),
+    // otherwise nullptr. Intermediate frames are skipped.
+    // With minMotion, frames that scored below it (see
+    // DecodedFrame::motion()) are skipped as well; unscored
+    // streams pass everything.
+    FrameHandle next(uint64_t& cursor, float minMotion = 0) const;
+    // As next(), but waits up to timeout for a new frame.
+    FrameHandle waitNext(uint64_t& cursor,
+                         std::chrono::milliseconds timeout,
+                         float minMotion = 0) const;
+    // A specific recent frame, nullptr if already overwritten.
+    FrameHandle at(uint64_t seq) const;
+
+    uint64_t latestSeq() const { return m_latestSeq.load(); }
+    size_t capacity() const { return m_slots.size(); }
+};
+#endif
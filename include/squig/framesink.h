@@ -0,0 +1,98 @@
+#ifndef FRAMESINK_H
+#define FRAMESINK_H
+
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+
+#include "squig/decodedframe.h"
+#include "squig/streamconfig.h"
+
+// The end of a StreamDecoder's pipeline: every decoded
+// frame the sink stage gets to (it may skip frames when
+// behind, see StreamDecoder) is handed to consume().
+// consume() and finish() run on the sink stage thread
+// only, so sinks need no locking of their own.
+class FrameSink {
+   public:
+    virtual ~FrameSink() = default;
+    // True if consume() will ask for f->bgr(); the pipeline
+    // then converts ahead, on its own stage.
+    virtual bool wantsBGR() const { return false; }
+    // True if consume() must always run on the same thread
+    // (highgui windows): the sink stage stays a thread of its
+    // own even when the other stages run on the executor.
+    virtual bool wantsOwnThread() const { return false; }
+    virtual void consume(const FrameHandle& f) = 0;
+    // The stream ended, the last call on the sink thread.
+    virtual void finish() {}
+};
+
+// One highgui window per session. The only sink that
+// touches highgui, and pays imshow + a 1ms waitKey.
+class DisplaySink : public FrameSink {
+   private:
+    std::string m_windowName;
+    bool m_windowShown = false;
+
+   public:
+    explicit DisplaySink(int sessionId);
+    bool wantsBGR() const override { return true; }
+    bool wantsOwnThread() const override { return true; }
+    void consume(const FrameHandle& f) override;
+    void finish() override;
+};
+
+class Mosaic;
+
+// Hands every frame to the shared Mosaic (see mosaic.h),
+// which draws and shows it on its own thread. The stream
+// has a tile from construction to finish(). No BGR wanted,
+// tiles are scaled straight from YUV.
+class MosaicSink : public FrameSink {
+   private:
+    std::shared_ptr<Mosaic> m_pMosaic;
+    int m_sessionId;
+    bool m_attached = true;
+
+   public:
+    MosaicSink(std::shared_ptr<Mosaic> pMosaic, int sessionId);
+    ~MosaicSink() override { finish(); }
+    void consume(const FrameHandle& f) override;
+    void finish() override;
+};
+
+// Drops every frame.
+class NullSink : public FrameSink {
+   public:
+    void consume(const FrameHandle&) override {}
+};
+
+// Appends frames to a headerless raw file, i.e. what
+// `ffplay -f rawvideo -pixel_format yuv420p|bgr24
+// -video_size WxH` plays. The file is opened on the first
+// frame, named after the resolution, so a stream that
+// changes resolution gets a file per resolution.
+class RawFileSink : public FrameSink {
+   private:
+    std::string m_dir;
+    int m_sessionId;
+    bool m_bgr;
+    FILE* m_pFile = nullptr;
+    int m_width{}, m_height{};
+    uint64_t m_frames{};
+
+    void open(int width, int height);
+    void close();
+
+   public:
+    RawFileSink(std::string dir, int sessionId, bool bgr);
+    ~RawFileSink() override { close(); }
+    bool wantsBGR() const override { return m_bgr; }
+    void consume(const FrameHandle& f) override;
+    void finish() override { close(); }
+};
+
+std::unique_ptr<FrameSink> makeFrameSink(const StreamConfig& config, int sessionId);
+#endif
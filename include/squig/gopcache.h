@@ -0,0 +1,99 @@
+#ifndef GOPCACHE_H
+#define GOPCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "squig/decodedframe.h"
+
+// One cached access unit, its payload lives in the arena.
+struct CachedAU {
+    size_t offset;  // into the arena / GopSnapshot::data
+    size_t size;
+    int64_t dts;
+    int32_t cts;
+    bool idr;
+    bool reference;
+};
+
+// Everything a late joiner needs to start decoding now:
+// the AVCC header and the AUs (still AVCC, as received)
+// from the last IDR up to the newest one.
+struct GopSnapshot {
+    std::vector<uint8_t> avccHdr;
+    std::vector<CachedAU> aus;
+    std::vector<uint8_t> data;
+
+    const uint8_t* auData(size_t i) const { return data.data() + aus[i].offset; }
+};
+
+// The encoded AUs of a stream since its most recent IDR,
+// copied back to back into one arena, so a consumer that
+// attaches mid-stream (viewer, recorder, analyzer) can
+// start from the last IDR instead of waiting up to a GOP
+// for the next one.
+//
+// Written by the ingest thread, one memcpy per AU. The
+// arena is reserved once and reused from GOP to GOP; a GOP
+// that doesn't fit in maxBytes is given up on until the
+// next IDR, memory stays bounded.
+class GopCache {
+   private:
+    mutable std::mutex m_lock;  // ingest vs snapshot(), never contended otherwise
+    const size_t m_maxBytes;
+    std::vector<uint8_t> m_avccHdr;
+    std::vector<uint8_t> m_arena;
+    std::vector<CachedAU> m_aus;
+    bool m_valid = false;  // holds a GOP from its IDR on
+
+    // stats, written under m_lock, read relaxed
+    std::atomic<uint64_t> m_gops{};
+    std::atomic<uint64_t> m_overflows{};
+    mutable std::atomic<uint64_t> m_snapshots{};
+
+   public:
+    // index entries reserved up front, ~30s of 30fps
+    static constexpr size_t kReservedAUs = 1024;
+
+    GopCache(const std::vector<uint8_t>& avccHdr, size_t maxBytes)
+        : m_maxBytes(maxBytes), m_avccHdr(avccHdr) {}
+    GopCache(const GopCache&) = delete;
+    GopCache& operator=(const GopCache&) = delete;
+
+    // An IDR starts a new GOP, anything before the first one
+    // is ignored.
+    void append(const uint8_t* data, size_t size, int64_t dts, int32_t cts,
+                bool idr, bool reference);
+
+    // A new sequence header mid-stream: the cached GOP was
+    // coded against the old one, it is dropped, the next IDR
+    // starts over with this header.
+    void setHeader(const uint8_t* data, size_t size);
+
+    // Copies the current GOP into out (reusing its capacity).
+    // False if there's none, i.e. no IDR yet or it overflowed.
+    bool snapshot(GopSnapshot& out) const;
+
+    // For stats; bytes/AUs of the current GOP.
+    size_t bytes() const;
+    size_t auCount() const;
+    size_t capacityBytes() const { return m_maxBytes; }
+    uint64_t gops() const { return m_gops.load(std::memory_order_relaxed); }
+    uint64_t overflows() const {
+        return m_overflows.load(std::memory_order_relaxed);
+    }
+    uint64_t snapshots() const {
+        return m_snapshots.load(std::memory_order_relaxed);
+    }
+};
+
+// Catch-up decode of a snapshot on a private decoder: only
+// the reference AUs (and the last one) are decoded, the
+// newest frame is returned, nullptr if nothing decodes.
+// Runs on the caller's thread.
+FrameHandle decodeLatest(const GopSnapshot& gop);
+#endif
@@ -0,0 +1,125 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <string>
+
+// Fixed size, log-bucketed (HDR-style) histogram of
+// latencies in us. Values below 64 get their own bucket,
+// above that every power of two is split into 32 linear
+// sub-buckets, so any reported quantile is within ~3% of
+// the true value. record() is O(1), quantiles are a walk
+// over the buckets; memory never grows.
+//
+// One writer, any number of readers: counts are relaxed
+// atomics, so a reader (stats printer, metrics endpoint)
+// may look at a histogram that is still being recorded
+// into and sees a slightly stale but sane picture.
+class LatencyHistogram {
+   public:
+    static constexpr int kSubBucketBits = 5;
+    static constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+    // ~71 minutes, anything above lands in the last bucket
+    // (max() is still exact).
+    static constexpr int kMaxValueBits = 32;
+    static constexpr size_t kBuckets =
+        (kMaxValueBits - kSubBucketBits) * kSubBuckets + kSubBuckets;
+
+   private:
+    std::array<std::atomic<uint32_t>, kBuckets> m_counts{};
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<uint64_t> m_sum{0};
+    std::atomic<uint64_t> m_min{UINT64_MAX};
+    std::atomic<uint64_t> m_max{0};
+
+    // writer side only, no RMW needed with a single writer
+    template <typename T>
+    static void bump(std::atomic<T>& a, T by) {
+        a.store(a.load(std::memory_order_relaxed) + by,
+                std::memory_order_relaxed);
+    }
+
+   public:
+    LatencyHistogram() = default;
+    LatencyHistogram(const LatencyHistogram& o) { merge(o); }
+    LatencyHistogram& operator=(const LatencyHistogram& o);
+
+    static size_t bucketOf(uint64_t v) {
+        if (v < 2 * kSubBuckets) {
+            return v;
+        }
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - kSubBucketBits;
+        size_t idx = shift * kSubBuckets + (v >> shift);
+        return idx < kBuckets ? idx : kBuckets - 1;
+    }
+    // Highest value that maps to bucket idx.
+    static uint64_t upperOf(size_t idx);
+
+    void record(uint64_t v) {
+        size_t b = bucketOf(v);
+        bump(m_counts[b], 1u);
+        bump(m_count, uint64_t{1});
+        bump(m_sum, v);
+        if (v < m_min.load(std::memory_order_relaxed)) {
+            m_min.store(v, std::memory_order_relaxed);
+        }
+        if (v > m_max.load(std::memory_order_relaxed)) {
+            m_max.store(v, std::memory_order_relaxed);
+        }
+    }
+
+    // Adds o's samples to this one. Unlike record() this
+    // uses RMWs, so several threads may merge into one
+    // aggregate (each session into the server total).
+    void merge(const LatencyHistogram& o);
+    void reset();
+
+    // q in [0, 1]; 0 if empty. Reports the bucket's upper
+    // edge, clamped to max(), so it never under-reports.
+    uint64_t quantile(double q) const;
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+    uint64_t min() const {
+        return count() ? m_min.load(std::memory_order_relaxed) : 0;
+    }
+    uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+    uint64_t mean() const {
+        uint64_t n = count();
+        return n ? m_sum.load(std::memory_order_relaxed) / n : 0;
+    }
+    // "p50 ..us, p90 ..us, p99 ..us, p99.9 ..us, max ..us (n)"
+    std::string summary() const;
+};
+
+// A LatencyHistogram over all time, plus a ring of short
+// slices so the last N seconds can be looked at on their
+// own (a 24/7 stream's all-time p99 hides the last spike).
+// Slices are recycled as time moves on, memory is fixed.
+// Same one writer / many readers rule.
+class WindowedHistogram {
+   public:
+    static constexpr uint64_t kSliceUs = 5'000'000;
+    static constexpr size_t kSlices = 12;  // 60s of history
+
+   private:
+    struct Slice {
+        std::atomic<uint64_t> epoch{UINT64_MAX};  // nowUs / kSliceUs
+        LatencyHistogram hist;
+    };
+    LatencyHistogram m_total;
+    std::array<Slice, kSlices> m_slices;
+
+   public:
+    void record(uint64_t v, uint64_t nowUs);
+
+    const LatencyHistogram& total() const { return m_total; }
+    // The samples of the last spanUs (rounded up to whole
+    // slices, at most kSlices * kSliceUs), as a copy.
+    LatencyHistogram window(uint64_t spanUs, uint64_t nowUs) const;
+};
+#endif
@@ -0,0 +1,122 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "squig/latencyhistogram.h"
+
+// Live stats in Prometheus text format (exposition format
+// 0.0.4), for long running ingest nodes.
+//
+// Whatever has stats (a session, a decoder, the server)
+// registers a collector with the MetricsRegistry for as long
+// as it lives. A scrape runs every collector on the metrics
+// server's thread; collectors only read counters their
+// stages keep anyway, single writer relaxed atomics and
+// LatencyHistograms, so a scrape never takes a lock the
+// frame path takes. The registry lock is only shared with
+// sessions starting and ending.
+
+// Builds one scrape. Samples are grouped by metric name
+// whatever order collectors add them in, as the format
+// requires. labels is the inside of the braces, e.g.
+// session="3",stage="decode", or empty.
+class MetricsWriter {
+   private:
+    struct Family {
+        std::string name;
+        const char* help;
+        const char* type;
+        std::string samples;
+    };
+    std::vector<Family> m_families;  // in first seen order
+    std::unordered_map<std::string, size_t> m_index;
+
+    Family& family(const char* name, const char* help, const char* type);
+    static void sample(std::string& out,
+                       const std::string& name,
+                       const std::string& labels,
+                       double v);
+
+   public:
+    void counter(const char* name, const char* help, const std::string& labels,
+                 double v);
+    void gauge(const char* name, const char* help, const std::string& labels,
+               double v);
+    // Prometheus summary: p50/p90/p99/p99.9, _sum and _count
+    void summary(const char* name, const char* help, const std::string& labels,
+                 const LatencyHistogram& h);
+    std::string text() const;
+};
+
+class MetricsRegistry {
+   public:
+    using Collector = std::function<void(MetricsWriter&)>;
+
+    // Unregisters on destruction, blocking until a scrape
+    // running the collector is done with it. Declare it
+    // after everything the collector reads.
+    class Registration {
+       private:
+        MetricsRegistry* m_pRegistry = nullptr;
+        uint64_t m_id{};
+        friend class MetricsRegistry;
+
+       public:
+        Registration() = default;
+        Registration(Registration&& o) noexcept { *this = std::move(o); }
+        Registration& operator=(Registration&& o) noexcept;
+        ~Registration() { reset(); }
+        void reset();
+    };
+
+   private:
+    std::mutex m_lock;
+    std::unordered_map<uint64_t, Collector> m_collectors;
+    uint64_t m_nextId{};
+
+   public:
+    Registration add(Collector c);
+    // Runs every collector, returns the exposition text.
+    std::string scrape();
+};
+
+// Serves GET /metrics from a registry on its own thread,
+// one connection at a time (Prometheus scrapes every few
+// seconds, there's nothing to overlap).
+class MetricsServer {
+   private:
+    std::shared_ptr<MetricsRegistry> m_pRegistry;
+    std::string m_where;
+    bool m_unix = false;
+    int m_listenFd = -1;
+    int m_stopFd = -1;  // eventfd
+    std::thread m_thread;
+
+    void serveLoop();
+    void serve(int fd);
+
+   public:
+    // listen: a TCP port ("9464", all interfaces), or a
+    // Unix socket path (anything with a '/'), replaced if
+    // it exists. Throws if it can't listen.
+    MetricsServer(std::shared_ptr<MetricsRegistry> pRegistry,
+                  const std::string& listen);
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+    ~MetricsServer();
+
+    // "http://0.0.0.0:9464/metrics" or "unix:/run/squig.sock"
+    const std::string& where() const { return m_where; }
+};
+#endif
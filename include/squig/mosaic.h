@@ -0,0 +1,136 @@
+#ifndef MOSAIC_H
+#define MOSAIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "squig/decodedframe.h"
+#include "squig/latencyhistogram.h"
+#include "squig/yuvconvert.h"
+
+struct MosaicConfig {
+    int width = 1920;  // canvas, rounded down to even
+    int height = 1080;
+    // Refreshes per second. 0: no render thread, the caller
+    // runs compose() itself (benchmarks).
+    int fps = 30;
+    // false: compose only, no highgui window
+    bool show = true;
+    std::string title = "Squig";
+};
+
+// "1920x1080" or "1920x1080@25" into c (size and fps only).
+// false if it doesn't parse.
+bool parseMosaicSpec(const std::string& spec, MosaicConfig& c);
+
+// A video wall of every session on one window, instead of a
+// highgui window per session driven from each sink stage.
+//
+// Sessions offer() their newest frame (a handle, no copy);
+// one render thread, at a fixed refresh rate, scales each
+// stream's newest frame straight from its YUV planes into
+// its tile of one preallocated BGR canvas and shows the
+// canvas. Tiles whose stream has no new frame since the last
+// refresh are not touched, so a static or stalled camera
+// costs nothing but a seq compare.
+//
+// Scaling samples only the source pixels a tile needs (a 2x2
+// box per output pixel when reducing by 2 or more, nearest
+// otherwise), gathered into one row pair at a time and
+// converted with the yuv:: kernels. Work per refresh is
+// bounded by the canvas area, not by the number or the
+// resolution of the streams, and nothing is allocated once
+// the layout is set.
+//
+// The grid is the smallest square-ish one that fits the
+// attached streams, in attach order; frames are letterboxed
+// into their tile.
+class Mosaic {
+   private:
+    struct Stream {
+        int id;
+        FrameHandle latest;  // newest offered, null until the first
+        uint64_t drawnSeq{};  // seq of the frame in its tile
+    };
+    // A tile to redraw, copied out under the lock.
+    struct Draw {
+        int id;
+        FrameHandle frame;
+        cv::Rect tile;
+    };
+    // Source -> tile sampling of one stream, rebuilt when
+    // either size changes. Render thread only.
+    struct TileMap {
+        int srcW{}, srcH{};
+        cv::Rect tile;  // the whole tile
+        cv::Rect image;  // letterboxed frame inside it
+        bool box = false;
+        std::vector<int> yCols, cCols;  // source x per output x
+        std::vector<int> yRows, cRows;  // source y per output y
+    };
+
+    const MosaicConfig m_config;
+    const yuv::SimdLevel m_simd;
+
+    std::mutex m_lock;
+    std::condition_variable m_wake;  // stop only
+    std::vector<Stream> m_streams;   // in attach order
+    bool m_layoutChanged = false;
+    bool m_stopping = false;
+    uint64_t m_offered{};
+
+    // render thread only
+    cv::Mat m_canvas;
+    std::vector<cv::Rect> m_tiles;  // [stream index]
+    std::vector<Draw> m_draws;
+    std::unordered_map<int, TileMap> m_maps;
+    std::vector<uint8_t> m_rowY, m_rowU, m_rowV;
+    bool m_windowShown = false;
+
+    // stats, under m_lock
+    uint64_t m_refreshes{};
+    uint64_t m_late{};  // refreshes that started a period or more late
+    uint64_t m_tilesDrawn{};
+    uint64_t m_tilesSkipped{};  // no new frame since the last refresh
+    LatencyHistogram m_composeUs;  // per refresh, drawing only
+    LatencyHistogram m_presentUs;  // imshow + waitKey
+
+    std::thread m_thread;
+
+    void layout(size_t n);
+    const TileMap& tileMap(int id, const cv::Rect& tile, const AVFrame* f);
+    void drawTile(const Draw& d);
+    void renderLoop();
+
+   public:
+    explicit Mosaic(const MosaicConfig& config);
+    Mosaic(const Mosaic&) = delete;
+    Mosaic& operator=(const Mosaic&) = delete;
+    ~Mosaic();
+
+    // Any thread. A stream gets a tile from attach() to
+    // detach(); offer() replaces its newest frame, frames of
+    // streams not attached are ignored.
+    void attach(int streamId);
+    void offer(int streamId, const FrameHandle& f);
+    void detach(int streamId);
+
+    // One refresh's drawing, without showing it. The render
+    // thread's, or the caller's with fps 0.
+    void compose();
+    const cv::Mat& canvas() const { return m_canvas; }
+
+    // "900 refreshes (2 late), 3400 tiles drawn, 500 skipped,
+    // compose p50 ..."
+    std::string summary();
+};
+#endif
@@ -0,0 +1,71 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdint.h>
+
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "squig/yuvconvert.h"
+
+// Cheap per-frame motion score, so consumers can skip
+// static frames before paying for BGR conversion or
+// analysis.
+//
+// The Y plane is reduced to one mean per 8x8 block (psadbw
+// against zero sums 8 pixels at a time, so this is one pass
+// over the luma at memory speed), and compared with the
+// previous frame's block means. The score is the fraction
+// of blocks whose mean moved by more than kNoise: 0 for a
+// static scene, ~1 for a scene cut. Block means average out
+// sensor noise and coding flicker, a threshold of around
+// 0.005 (half a percent of the picture) works for most
+// cameras.
+namespace motion {
+
+// Block mean change (of 255) below which a block counts as static.
+inline constexpr uint8_t kNoise = 6;
+inline constexpr int kBlock = 8;
+
+// Block means of the top-left (w / 8) x (h / 8) blocks,
+// dst is (w / 8) bytes per row.
+void downsample(const uint8_t* y,
+                int stride,
+                int width,
+                int height,
+                uint8_t* dst,
+                yuv::SimdLevel level = yuv::detectSimd());
+// Number of positions where a and b differ by more than noise.
+size_t countChanged(const uint8_t* a,
+                    const uint8_t* b,
+                    size_t n,
+                    uint8_t noise,
+                    yuv::SimdLevel level = yuv::detectSimd());
+
+// Scores the frames of one stream, decode thread only.
+// Keeps the block means of the last frame that passed the
+// gate as the reference, no allocation once the resolution
+// is known. Comparing with the previous frame instead would
+// let slow motion (a few noise levels per frame) slip
+// through forever, against a held reference it adds up
+// until it's detected.
+class MotionDetector {
+   private:
+    std::vector<uint8_t> m_ref, m_cur;
+    int m_width{}, m_height{};
+    bool m_hasRef = false;
+    yuv::SimdLevel m_level = yuv::detectSimd();
+
+   public:
+    // In [0, 1]. The first frame (and the first after a
+    // resolution change) scores 1, there's nothing to compare.
+    // The frame becomes the reference if it scores at least
+    // threshold, 0 compares every frame with the previous one.
+    float score(const AVFrame* f, float threshold = 0);
+};
+
+}  // namespace motion
+#endif
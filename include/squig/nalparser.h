@@ -0,0 +1,95 @@
+#ifndef NALPARSER_H
+#define NALPARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Just enough H.264 bitstream parsing to make dropping
+// decisions without decoding: walks the NAL units of one
+// AVCC (length prefixed) access unit, as carried in an
+// RTMP video message, and reads the NAL header of each and
+// the slice type of the first slice. Touches a few bytes
+// per NAL, never the slice data.
+namespace h264 {
+
+enum NalType : uint8_t {
+    kNalSlice = 1,  // non-IDR slice
+    kNalIDR = 5,
+    kNalSEI = 6,
+    kNalSPS = 7,
+    kNalPPS = 8,
+    kNalAUD = 9,
+};
+
+// slice_type % 5
+enum SliceType : int8_t {
+    kSliceUnknown = -1,
+    kSliceP = 0,
+    kSliceB = 1,
+    kSliceI = 2,
+    kSliceSP = 3,
+    kSliceSI = 4,
+};
+
+struct AUInfo {
+    bool idr = false;
+    // any VCL NAL with nal_ref_idc != 0, i.e. other
+    // pictures may predict from this one. false means
+    // disposable (NOTES.md: the 0x01 slices).
+    bool reference = false;
+    bool hasParamSets = false;  // in-band SPS/PPS
+    SliceType sliceType = kSliceUnknown;  // of the first slice
+    // Capture time from a Squig stamp SEI (see
+    // writeStampSEI()), 0 if the AU has none.
+    uint64_t captureUs{};
+};
+
+// false if the AU isn't well formed AVCC (lengths running
+// past the end) or has no slice at all.
+bool parseAVCC(const uint8_t* data, size_t size, AUInfo& info);
+
+// Capture timestamps for glass-to-glass measurements: an
+// SEI user_data_unregistered message (payload type 5) with
+// this UUID, followed by the capture time as 8 bytes big
+// endian, in us of CLOCK_MONOTONIC (utils::nowUs()), so
+// only comparable on the host that wrote it.
+inline constexpr uint8_t kStampUUID[16] = {0x73, 0x71, 0x75, 0x69, 0x67, 0x2d,
+                                           0x73, 0x74, 0x61, 0x6d, 0x70, 0x2d,
+                                           0x76, 0x31, 0x00, 0x01};
+// start code + NAL header + SEI header + escaped payload + trailing bits
+inline constexpr size_t kStampSEIMaxSize = 48;
+
+// Writes the stamp SEI as an Annex B NAL unit (with start
+// code) to dst, which has room for kStampSEIMaxSize bytes.
+// Returns its size. Used by the test publisher, a muxer
+// converting to AVCC keeps it as a NAL of its own.
+size_t writeStampSEI(uint64_t captureUs, uint8_t* dst);
+
+// Rewrites the 4 byte length prefixes of an AVCC AU into
+// Annex B start codes, in place (same size).
+void avccToAnnexB(uint8_t* data, size_t size);
+
+// What an AVCDecoderConfigurationRecord (the payload of an
+// RTMP/FLV sequence header) sets up, from its first SPS.
+struct AVCConfig {
+    uint8_t profile{};
+    uint8_t level{};
+    int width{};  // cropped, i.e. the size of decoded frames
+    int height{};
+    uint8_t spsCount{};
+    uint8_t ppsCount{};
+};
+
+// false if data isn't a well formed record with at least
+// one SPS, or the SPS doesn't parse.
+bool parseAVCConfig(const uint8_t* data, size_t size, AVCConfig& out);
+
+// Appends the record's SPS and PPS NAL units to out as
+// Annex B, to feed new parameter sets in-band to a decoder
+// that is already open. false if the record is malformed.
+bool avcConfigToAnnexB(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+}  // namespace h264
+#endif
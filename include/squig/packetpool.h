@@ -0,0 +1,138 @@
+#ifndef PACKETPOOL_H
+#define PACKETPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// A reusable, padded packet buffer. pBuf is the pool's own
+// reference and lives as long as the pool; consumers borrow
+// it (e.g. as AVPacket::buf for send_packet, which takes its
+// own reference if it needs the data later).
+// The slot is free again once nobody claims it and no
+// extra reference to pBuf is left.
+struct PacketSlot {
+    AVBufferRef* pBuf = nullptr;
+    std::atomic<bool> claimed{false};
+
+    bool isFree() const {
+        // claimed first: whoever clears it has already
+        // taken any reference it wants to keep.
+        return !claimed.load(std::memory_order_acquire) &&
+               av_buffer_get_ref_count(pBuf) == 1;
+    }
+};
+
+// Per-session pool of padded, refcounted packet buffers.
+// An RTMP payload is copied once into a pooled buffer on
+// ingest; from there it is rewritten to AnnexB in place and
+// handed to avcodec_send_packet by reference, so the rest of
+// the path neither copies nor allocates payload memory.
+// Every buffer carries AV_INPUT_BUFFER_PADDING_SIZE zeroed
+// bytes past the payload, as libavcodec requires.
+//
+// Slots are created (and grown) on demand, so a stream
+// allocates during its first few IDRs and never after.
+// copyIn() is called from one thread (the RTMP reader),
+// slots may be released from any thread.
+class PacketPool {
+   private:
+    std::vector<std::unique_ptr<PacketSlot>> m_slots;
+    size_t m_next{};     // where the next free-slot scan starts
+    size_t m_bufSize{};  // every slot is grown to this
+    size_t m_maxSlots;
+    uint64_t m_grows{};
+
+   public:
+    static constexpr size_t kInitialSize = 256 * 1024;  // 1080p IDRs fit
+    // queued AUs plus what libavcodec holds on to
+    static constexpr size_t kMaxSlots = 64;
+
+    explicit PacketPool(size_t maxSlots = kMaxSlots) : m_maxSlots(maxSlots) {
+        m_slots.reserve(maxSlots);
+    }
+    PacketPool(const PacketPool&) = delete;
+    PacketPool& operator=(const PacketPool&) = delete;
+    ~PacketPool();
+
+    // A claimed slot holding a copy of data[0, size) plus
+    // zeroed padding, or nullptr if all maxSlots are busy.
+    PacketSlot* copyIn(const uint8_t* data, size_t size);
+
+    size_t slots() const { return m_slots.size(); }
+    uint64_t grows() const { return m_grows; }
+};
+
+// An encoded access unit on its way to the decoder
+// (or any other consumer of encoded video). Move-only,
+// holds the claim on its pooled slot until reset.
+struct EncodedAU {
+    PacketSlot* pSlot = nullptr;
+    size_t size{};
+    int64_t dts{};
+    int32_t cts{};  // composition time offset, pts = dts + cts
+    bool keyframe = false;
+    bool idr = false;       // decoding may restart here
+    bool reference = true;  // some slice has nal_ref_idc != 0
+    // An IDR, or an I picture carrying its SPS/PPS in-band
+    // (an open-GOP keyframe): decoding may restart here once
+    // the B pictures right after it are left out.
+    bool resync = false;
+    bool bidir = false;  // B slices (first slice's slice_type)
+    // hand the decoded frame downstream, false if it is only
+    // decoded as a reference for later ones (DecodePolicy)
+    bool forward = true;
+    // least the decoder should discard while decoding this AU
+    AVDiscard discard = AVDISCARD_DEFAULT;
+    // not a picture: a new AVCDecoderConfigurationRecord,
+    // applied by the decode stage in stream order
+    bool config = false;
+    uint64_t arrivalUs{};  // when it was read off the socket
+    uint64_t captureUs{};  // from a stamp SEI, 0 if none
+
+    EncodedAU() = default;
+    EncodedAU(const EncodedAU&) = delete;
+    EncodedAU& operator=(const EncodedAU&) = delete;
+    EncodedAU(EncodedAU&& o) noexcept { *this = std::move(o); }
+    EncodedAU& operator=(EncodedAU&& o) noexcept {
+        if (this != &o) {
+            reset();
+            pSlot = std::exchange(o.pSlot, nullptr);
+            size = o.size;
+            dts = o.dts;
+            cts = o.cts;
+            keyframe = o.keyframe;
+            idr = o.idr;
+            reference = o.reference;
+            resync = o.resync;
+            bidir = o.bidir;
+            forward = o.forward;
+            discard = o.discard;
+            config = o.config;
+            arrivalUs = o.arrivalUs;
+            captureUs = o.captureUs;
+        }
+        return *this;
+    }
+    ~EncodedAU() { reset(); }
+
+    // Give the slot back to the pool.
+    void reset() {
+        if (pSlot) {
+            pSlot->claimed.store(false, std::memory_order_release);
+            pSlot = nullptr;
+        }
+    }
+
+    uint8_t* data() const { return pSlot ? pSlot->pBuf->data : nullptr; }
+    AVBufferRef* buffer() const { return pSlot ? pSlot->pBuf : nullptr; }
+};
+#endif
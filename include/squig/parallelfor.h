@@ -0,0 +1,64 @@
+#ifndef PARALLELFOR_H
+#define PARALLELFOR_H
+
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small set of persistent worker threads for splitting
+// one large job (e.g. the rows of a 1080p frame) across
+// cores, without paying thread creation per frame.
+//
+// Only one job runs at a time. If the workers are already
+// busy (another stream is using them) the caller simply
+// runs its job serially, with many streams there is
+// plenty of parallelism across streams anyway. So does a
+// run() from inside a job's body (nested), on any thread.
+class ParallelFor {
+   private:
+    using Body = std::function<void(size_t, size_t)>;
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_runLock;  // held for the duration of a job
+
+    std::mutex m_lock;
+    std::condition_variable m_wake, m_done;
+    uint64_t m_generation{};
+    bool m_stopping = false;
+
+    // current job, valid while m_runLock is held
+    const Body* m_pBody = nullptr;
+    size_t m_n{}, m_grain{};
+    std::atomic<size_t> m_nextChunk{};
+    size_t m_chunks{};
+    size_t m_busyWorkers{};
+    // workers that picked up the current generation, every
+    // worker checks in on every job so none can wake up
+    // late into the next one.
+    size_t m_arrived{};
+
+    void workerLoop();
+    void drainChunks();
+
+   public:
+    // nThreads workers in addition to the calling thread.
+    explicit ParallelFor(size_t nThreads);
+    ParallelFor(const ParallelFor&) = delete;
+    ParallelFor& operator=(const ParallelFor&) = delete;
+    ~ParallelFor();
+
+    // Calls body(begin, end) over [0, n) in chunks of ~grain,
+    // returns once all chunks are done. The caller works too.
+    void run(size_t n, size_t grain, const Body& body);
+
+    size_t threads() const { return m_workers.size() + 1; }
+
+    // Process wide instance, one worker per extra core.
+    static ParallelFor& shared();
+};
+#endif
@@ -0,0 +1,37 @@
+#ifndef PCAPREPLAY_H
+#define PCAPREPLAY_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Publisher -> server byte streams recovered from a packet
+// capture (testing/pcap/*.pcap), for replaying a recorded
+// session into the server without a camera or ffmpeg.
+//
+// Reads classic pcap (not pcapng) with Ethernet, Linux
+// cooked (v1/v2), BSD loopback or raw IP link types, IPv4
+// or IPv6. Every TCP connection to serverPort becomes one
+// stream: its payload is reassembled in sequence order
+// (retransmits and overlaps dropped) and split back into
+// the chunks it arrived in, each with its capture time.
+// A hole in the capture ends that stream early.
+
+// Bytes that arrived together on the wire.
+struct ReplayChunk {
+    uint64_t tUs;  // capture time, relative to the stream's first chunk
+    std::vector<uint8_t> data;
+};
+
+struct PcapStream {
+    std::string client;  // "ip:port" of the publisher
+    std::vector<ReplayChunk> chunks;
+    size_t bytes{};
+    bool truncated = false;  // capture lost a segment
+};
+
+// Throws std::runtime_error if path is not a readable pcap.
+std::vector<PcapStream> readPcapStreams(const std::string& path,
+                                        uint16_t serverPort = 1935);
+#endif
@@ -1,14 +1,15 @@
 #ifndef PERFSTATISTICS_H_
 #define PERFSTATISTICS_H_
-#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
 #include <fstream>
-#include <limits>
-#include <memory>
-#include <numeric>
 #include <string>
 #include <string_view>
 #include <vector>
+
+#include "squig/latencyhistogram.h"
+#include "squig/utils.hpp"
 // Squig server on Zephyrus G14 in all cases.
 enum TestType {
     kFfmpegLocalhost,  // ffmpeg rtmp stream from zephyrus G14, ubuntu 24.04
@@ -28,64 +29,121 @@ inline std::string getTestName(TestType test) {
     }
 }
 
+// Why a video AU never made it to the sink.
+enum class DropReason {
+    kQueueFull,  // ingest: decode queue full, or waiting for a keyframe after
+    kNonRef,     // over the latency budget, non-reference picture discarded
+    kSkipToIDR,  // far over the budget, skipped ahead to the next IDR
+                 // (or open-GOP keyframe)
+    kCount,
+};
+
+inline const char* dropReasonName(DropReason r) {
+    switch (r) {
+        case DropReason::kQueueFull:
+            return "queue full";
+        case DropReason::kNonRef:
+            return "non-ref";
+        case DropReason::kSkipToIDR:
+            return "skip-to-IDR";
+        case DropReason::kCount:
+            break;
+    }
+    return "unknown";
+}
+
+// Points a stamped frame's age (now - publisher capture
+// time, see h264::writeStampSEI()) is taken at.
+enum class GlassStage {
+    kIngest,     // AU read off the socket
+    kDecoded,    // out of the decoder
+    kConverted,  // BGR (and pyramid levels) done
+    kSink,       // consumed by the sink, e.g. imshow returned
+    kCount,
+};
+
+inline const char* glassStageName(GlassStage s) {
+    switch (s) {
+        case GlassStage::kIngest:
+            return "ingest";
+        case GlassStage::kDecoded:
+            return "decoded";
+        case GlassStage::kConverted:
+            return "converted";
+        case GlassStage::kSink:
+            return "sink";
+        case GlassStage::kCount:
+            break;
+    }
+    return "unknown";
+}
+
+// Latency stats of one stream (or one pipeline stage),
+// safe to keep on for the lifetime of a 24/7 stream:
+// samples go into fixed size histograms (all time plus
+// the last 60s), not into ever growing vectors. Only the
+// last kCSVSamples imshow periods are kept verbatim, for
+// the CSV the notebook plots.
+//
+// One thread records (update / updateImshowTime), others
+// may read the quantiles at any time.
 class PerfStatistics {
    private:
-    uint64_t m_iMaxTime{};
-    uint64_t m_iMinTime{};  // ignored, list initialized by constructor
-    std::vector<uint64_t> m_allTimes{};
+    static constexpr size_t kCSVSamples = 4096;
 
+    WindowedHistogram m_e2e;
     uint64_t m_iTprev;
-    std::vector<uint64_t> m_imshowTimesE2E{};  // used to store time interval
-                                               // b/w successive cv::imshow.
+    bool m_imshowStarted = false;
+    // time interval b/w successive cv::imshow.
+    WindowedHistogram m_imshow;
+
+    // most recent imshow periods, ring of kCSVSamples
+    std::vector<uint64_t> m_recentImshow;
+    uint64_t m_imshowSamples{};  // all time, also the ring cursor
+
+    // AUs dropped, by reason. Bumped by the ingest and
+    // decode threads, not the one recording latencies.
+    std::array<std::atomic<uint64_t>, size_t(DropReason::kCount)> m_dropped{};
+    // Capture -> stage, stamped streams only. Each written
+    // by its own stage.
+    std::array<LatencyHistogram, size_t(GlassStage::kCount)> m_glass;
+
    public:
-    PerfStatistics(uint64_t tStartMs)
-        : m_iTprev{tStartMs},
-          m_iMinTime{std::numeric_limits<uint64_t>::max()} {}
+    PerfStatistics(uint64_t tStartUs) : m_iTprev{tStartUs} {}
 
     void updateImshowTime(uint64_t now) {
-        m_imshowTimesE2E.push_back(now - m_iTprev);
+        uint64_t delta = now - m_iTprev;
         m_iTprev = now;
-    }
-    // Class method with definition is implicitly inline.
-    // In general, inline is just a compiler hint.
-    void update(uint64_t duration) {
-        if (duration < m_iMinTime) {
-            m_iMinTime = duration;
+
+        if (m_recentImshow.size() < kCSVSamples) {
+            m_recentImshow.push_back(delta);
+        } else {
+            m_recentImshow[m_imshowSamples % kCSVSamples] = delta;
         }
-        if (duration > m_iMaxTime) {
-            m_iMaxTime = duration;
+        m_imshowSamples++;
+
+        // the first delta is between server init
+        // and client start, not a frame period.
+        if (m_imshowStarted) {
+            m_imshow.record(delta, now);
         }
-        m_allTimes.push_back(duration);
+        m_imshowStarted = true;
     }
+    // Class method with definition is implicitly inline.
+    // In general, inline is just a compiler hint.
+    void update(uint64_t duration) { m_e2e.record(duration, utils::nowUs()); }
+
     // not helpful for streaming
-    uint64_t mean() {
-        uint64_t sum = std::accumulate(m_allTimes.begin(), m_allTimes.end(), 0);
-        return sum / m_allTimes.size();
-    }
+    uint64_t mean() const { return m_e2e.total().mean(); }
     // p99 more relevant
-    uint64_t p99E2E() {
-        std::sort(m_allTimes.begin(), m_allTimes.end());
-        size_t idx = static_cast<size_t>(0.99 * (m_allTimes.size() - 1));
+    uint64_t p99E2E() const { return m_e2e.total().quantile(0.99); }
+    uint64_t p99Imshow() const { return m_imshow.total().quantile(0.99); }
 
-        // for (uint64_t x: m_allTimes) {
-        //     std::cout << x << " ";
-        // }
-        // std::cout << "\n";
+    // Full distributions, for arbitrary quantiles,
+    // windows (last 10s/60s) and merging across sessions.
+    const WindowedHistogram& e2e() const { return m_e2e; }
+    const WindowedHistogram& imshow() const { return m_imshow; }
 
-        return m_allTimes[idx];
-    }
-    // p99 more relevant
-    uint64_t p99Imshow() {
-        // +1 bec the first chrono timestamp is between server init
-        // and client start...
-        std::sort(m_imshowTimesE2E.begin() + 1, m_imshowTimesE2E.end());
-        size_t idx = static_cast<size_t>(0.99 * (m_imshowTimesE2E.size() - 1));
-        //     for (uint64_t x: m_imshowTimesE2E) {
-        //         std::cout << x << " ";
-        //     }
-        //     std::cout << "\n";
-        return m_imshowTimesE2E[idx];
-    }
     void writeToCSV(std::string_view csvNameStr, TestType test) {
         // open csv file
         // case based on the test type
@@ -106,16 +164,46 @@ class PerfStatistics {
             outFile << "TestType, FrameIdx, TimeDelta\n";
         }
         // Format: TestName, FrameIndex, Value
-        for (size_t i = 0; i < m_imshowTimesE2E.size(); ++i) {
-            outFile << testName << "," << i << "," << m_imshowTimesE2E[i]
-                    << "\n";
+        // oldest retained sample first, FrameIdx stays the
+        // all-time index.
+        uint64_t first = m_imshowSamples - m_recentImshow.size();
+        for (uint64_t i = first; i < m_imshowSamples; ++i) {
+            outFile << testName << "," << i << ","
+                    << m_recentImshow[i % kCSVSamples] << "\n";
         }
 
         outFile.close();
     }
 
-    uint64_t min() { return m_iMinTime; }
-    uint64_t max() { return m_iMaxTime; }
+    void addDropped(DropReason r) {
+        m_dropped[size_t(r)].fetch_add(1, std::memory_order_relaxed);
+    }
+    uint64_t dropped(DropReason r) const {
+        return m_dropped[size_t(r)].load(std::memory_order_relaxed);
+    }
+    uint64_t droppedTotal() const {
+        uint64_t n = 0;
+        for (const auto& d : m_dropped) {
+            n += d.load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    // Stage thread of s. Capture times later than now (a
+    // stamp from another host or boot) are ignored.
+    void recordGlass(GlassStage s, uint64_t captureUs, uint64_t now) {
+        if (captureUs && captureUs <= now) {
+            m_glass[size_t(s)].record(now - captureUs);
+        }
+    }
+    const LatencyHistogram& glass(GlassStage s) const {
+        return m_glass[size_t(s)];
+    }
+
+    size_t count() const { return m_e2e.total().count(); }
+    size_t imshowCount() const { return m_imshowSamples; }
+    uint64_t min() const { return m_e2e.total().min(); }
+    uint64_t max() const { return m_e2e.total().max(); }
 };
 
 #endif  // PERFSTATISTICS_H_
@@ -0,0 +1,56 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <stdint.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "squig/streamconfig.h"
+#include "squig/yuvconvert.h"
+
+class ParallelFor;
+
+// Reduced resolution copies of a decoded frame (1/2 and
+// 1/4 per side), built in one pass over the YUV frame
+// instead of one cv::resize per consumer.
+//
+// The frame is walked in strips of 8 rows. Each strip's
+// Y, U and V rows are 2x2 box filtered into a half-res
+// 4:2:0 strip, that one again into a quarter-res strip,
+// and the packed levels are converted from those with the
+// yuv:: kernels while they are still in L1. Gray levels
+// are the reduced Y rows themselves. Full-res BGR, if
+// wanted, is converted from the same strip in the same
+// pass, so full-res pixels are read from memory once
+// whatever the number of levels.
+//
+// Reducing before converting is ~4x less conversion work
+// than reducing converted BGR. Every level is 4:2:0 again,
+// so the half level's chroma is box filtered to a quarter
+// of the source's resolution (the source chroma would fit
+// the half level 1:1, but that needs a 4:4:4 conversion
+// kernel); colour edges are a little softer than a
+// cv::resize of the full-res BGR.
+namespace pyramid {
+
+struct Targets {
+    // [PyramidLevel::index()], nullptr if not wanted.
+    // Level sizes are (width / div) x (height / div).
+    uint8_t* data[kPyramidLevels]{};
+    int stride[kPyramidLevels]{};
+    // full-res BGR, converted in the same pass if set
+    uint8_t* bgr = nullptr;
+    int bgrStride{};
+};
+
+// src must be 4:2:0 (yuv::isSupported), or any planar YUV
+// if only gray levels are wanted.
+void build(const AVFrame* src,
+           const Targets& t,
+           ParallelFor* pWorkers = nullptr,
+           yuv::SimdLevel level = yuv::detectSimd());
+
+}  // namespace pyramid
+#endif
@@ -0,0 +1,153 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "squig/latencyhistogram.h"
+#include "squig/packetpool.h"
+#include "squig/rtmp_server.h"
+#include "squig/spscqueue.hpp"
+#include "squig/streamconfig.h"
+
+// One closed segment, as listed in the index.
+struct SegmentInfo {
+    std::string path;
+    uint64_t startMs{};     // wall clock (unix ms) of its first AU
+    uint64_t durationMs{};  // first to last video dts
+    uint64_t bytes{};
+};
+
+// Passthrough recorder for one session: the encoded H.264
+// AUs (and AAC audio, if the publisher sends any) are
+// remuxed as they are, no decode or re-encode, into
+// segments of about StreamConfig::segmentSec, each starting
+// at a keyframe:
+//   <recordDir>/squig-s<session>-<unix ms>.mp4|.ts
+// plus a rolling index of the retained segments,
+//   <recordDir>/squig-s<session>.index
+// rewritten (atomically) whenever a segment closes.
+//
+// The RTMP read thread only copies each payload into a
+// pooled buffer and queues it, like the decoder's ingest.
+// Muxing and all file I/O run on the recorder's own thread
+// through a large AVIO buffer, so the disk sees ~1MB writes
+// and a disk stall only backs up this queue: once full,
+// AUs are dropped (video resumes at the next keyframe),
+// GetRTMPMessage() and decoding never wait on it.
+class Recorder {
+   private:
+    // ~3s of 30fps video plus AAC at 44.1kHz
+    static constexpr size_t kQueueLen = 256;
+    static constexpr int kIOBufSize = 1 << 20;
+    // stop() waits this long for the queue to be written
+    static constexpr int kFlushMs = 2000;
+
+    enum class ItemKind : uint8_t {
+        kVideoHdr,  // AVCDecoderConfigurationRecord
+        kAudioHdr,  // AudioSpecificConfig
+        kVideo,
+        kAudio,
+    };
+    struct Item {
+        ItemKind kind{};
+        EncodedAU au;  // dts/cts in ms, keyframe for video
+        uint64_t wallMs{};
+        int width{}, height{};  // kVideoHdr only
+    };
+
+    const int m_sessionId;
+    const std::string m_dir;
+    const RecordFormat m_format;
+    const int64_t m_segmentMs;
+    const size_t m_keepSegments;
+
+    // one payload copy on the read thread, like the decoder's
+    // ingest; small audio packets get big slots, but pages
+    // are only committed as written.
+    PacketPool m_pool{kQueueLen};
+    SPSCQueue<Item, kQueueLen> m_queue;
+
+    // read thread side
+    bool m_waitForKeyframe = false;
+    uint64_t m_dropped{};
+
+    // recorder thread side
+    std::vector<uint8_t> m_avccHdr;
+    std::vector<uint8_t> m_aacHdr;
+    int m_width{}, m_height{};
+    AVFormatContext* m_pFmt = nullptr;
+    AVPacket* m_pPkt = nullptr;
+    int m_fd = -1;
+    bool m_headerWritten = false;
+    int m_videoIdx = -1, m_audioIdx = -1;
+    int64_t m_baseDts{};  // first video dts of the segment
+    int64_t m_lastDts{};
+    SegmentInfo m_current;
+    std::deque<SegmentInfo> m_index;
+    // write() call durations (us), disk stalls show up here
+    LatencyHistogram m_writeTime;
+    size_t m_maxDepth{};
+    uint64_t m_segments{};
+    uint64_t m_bytes{};
+    uint64_t m_errors{};
+    uint64_t m_abandoned{};  // queued at stop(), never written
+
+    // set by stop() once kFlushMs are up
+    std::atomic<bool> m_abandon{false};
+    std::mutex m_doneLock;
+    std::condition_variable m_doneWake;
+    bool m_done = false;  // writer finished, under m_doneLock
+    std::thread m_thread;
+
+    void enqueue(ItemKind kind, const std::vector<char>& payload,
+                 const librtmp::RTMPMediaMessage& m, bool keyframe);
+
+    void writeLoop();
+    void handle(Item& item);
+    bool openSegment(const Item& first);
+    void closeSegment();
+    void writePacket(int streamIdx, const EncodedAU& au);
+    void writeIndex();
+    // libavformat 61 (FFmpeg 7) made the AVIO write
+    // callback's buffer const
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+    using WriteBuf = uint8_t*;
+#else
+    using WriteBuf = const uint8_t*;
+#endif
+    static int writeCallback(void* opaque, WriteBuf buf, int size);
+
+   public:
+    Recorder(int sessionId, const StreamConfig& config);
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+    ~Recorder();
+
+    // Read thread. Never block, each copies the payload
+    // and queues it for the recorder thread.
+    void videoHeader(const librtmp::RTMPMediaMessage& m, int width, int height);
+    void video(const librtmp::RTMPMediaMessage& m);
+    // AAC only (sequence header or raw frame), anything
+    // else is ignored.
+    void audio(const librtmp::RTMPMediaMessage& m);
+
+    // Closes the open segment and joins the thread. What's
+    // still queued after kFlushMs (a stalled disk) is dropped,
+    // so this waits about that long at most, plus a write in
+    // progress and the trailer. Idempotent.
+    void stop();
+    void printStats();
+};
+#endif
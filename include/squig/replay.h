@@ -0,0 +1,52 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "squig/latencyhistogram.h"
+#include "squig/streamconfig.h"
+
+// Replays a recorded publisher in-process, for benchmarks
+// and debugging without a camera or an ffmpeg client.
+//
+// .pcap: every captured publisher connection (see
+//   pcapreplay.h) is written into a socketpair that a
+//   SessionServer serves like an accepted client, so the
+//   whole path (easyRTMP parsing, session, decoder) runs.
+// .flv: the tags are turned into the RTMP messages easyRTMP
+//   would produce and fed straight into StreamDecoders,
+//   i.e. without the RTMP protocol layer.
+//
+// Blocks until every stream has been played and drained.
+// kFast replay waits for room in each decoder's queue
+// (StreamConfig::blockingIngest) instead of dropping, so
+// every AU fed is decoded.
+
+enum class ReplayPacing {
+    kWire,  // as captured (pcap time / FLV timestamps)
+    kFast,  // as fast as the server takes it
+};
+
+struct ReplayOptions {
+    ReplayPacing pacing = ReplayPacing::kWire;
+    int copies = 1;                // sessions per recorded stream
+    uint16_t capturePort = 1935;   // server port in the pcap
+};
+
+struct ReplayResult {
+    size_t streams{};
+    uint64_t frames{};  // decoded, all streams
+    uint64_t aus{};     // video AUs fed to the decoders, all streams
+    double wallSec{};
+    double cpuSec{};  // whole process, user + sys
+    LatencyHistogram e2e;
+};
+
+// Throws std::runtime_error if the file can't be read
+// or holds no playable stream.
+ReplayResult replayFile(const std::string& path,
+                        const StreamConfig& config,
+                        const ReplayOptions& opts);
+#endif
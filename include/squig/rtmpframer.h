@@ -0,0 +1,67 @@
+#ifndef RTMPFRAMER_H
+#define RTMPFRAMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+// Just enough RTMP parsing to know where the messages of a
+// publisher's byte stream end, without looking at their
+// payloads: the handshake (C0 C1 C2), then chunk headers
+// (basic header, message header fmt 0-3, extended
+// timestamp) and the payload lengths they announce. Set
+// Chunk Size and Abort are applied, they change the
+// framing. Fed every byte of the stream in order, in
+// pieces of any size, so the server can tell whether
+// easyRTMP would block reading the next media message.
+class RTMPFramer {
+   private:
+    struct ChunkStream {
+        uint32_t length{};     // of the message in progress
+        uint32_t remaining{};  // payload bytes still to come
+        uint8_t type{};
+        bool extTs = false;  // last header had an extended timestamp
+    };
+
+    static constexpr size_t kHandshake = 1 + 1536 + 1536;  // C0 C1 C2
+
+    size_t m_handshakeLeft = kHandshake;
+    uint32_t m_chunkSize = 128;  // until the publisher sets one
+    std::unordered_map<uint32_t, ChunkStream> m_streams;
+    // header bytes of the next chunk, until all are in
+    std::vector<uint8_t> m_hdr;
+    ChunkStream* m_pCur = nullptr;  // chunk whose payload is being skipped
+    uint32_t m_skip{};              // of its payload still to come
+    // payload start of the current control message, if any
+    uint8_t m_ctrl[4]{};
+    uint32_t m_ctrlLen{};
+    uint64_t m_offset{};
+    // stream offsets just past each whole media message
+    std::deque<uint64_t> m_mediaEnds;
+
+    size_t headerLen() const;
+    bool parseHeader();
+    bool messageDone(const ChunkStream& cs);
+
+   public:
+    // Parses the next size bytes of the stream. false if
+    // they can't be RTMP (e.g. a zero chunk size), the
+    // framer is lost from there on.
+    bool feed(const uint8_t* data, size_t size);
+    // Number of audio/video messages that end at or before
+    // stream offset end, and forgets them.
+    size_t takeMedia(uint64_t end);
+    // Some media message is whole, fed but not taken yet.
+    bool hasMedia() const { return !m_mediaEnds.empty(); }
+    // Offset just past the oldest such message.
+    uint64_t nextMediaEnd() const { return m_mediaEnds.front(); }
+    // Part of a chunk or message has been fed, the rest of
+    // it hasn't.
+    bool midMessage() const;
+    // Bytes fed so far.
+    uint64_t offset() const { return m_offset; }
+};
+#endif
@@ -0,0 +1,174 @@
+#ifndef RTMPSESSION_H
+#define RTMPSESSION_H
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "squig/metrics.h"
+#include "squig/perfstatistics.hpp"
+#include "squig/recorder.h"
+#include "squig/rtmp_server.h"
+#include "squig/rtmpframer.h"
+#include "squig/streamconfig.h"
+#include "squig/streamdecoder.h"
+
+// An RTMPSession owns everything that belongs to a single
+// publisher (camera): the accepted socket, the easyRTMP
+// endpoint/session pair, and the StreamDecoder and
+// PerfStatistics for its stream.
+// Sessions are driven by the SessionServer event loop.
+//
+// easyRTMP reads a whole message per GetRTMPMessage() and
+// blocks until it has it, so it never sees the publisher's
+// socket. The loop reads that (non-blocking) and passes
+// the bytes on through a socketpair easyRTMP reads
+// instead, while an RTMPFramer follows the chunk stream:
+// GetRTMPMessage() is only called for media messages that
+// are already whole on easyRTMP's side, all of them, so it
+// neither blocks the loop on a partial message nor leaves
+// messages it buffered waiting for the next readiness
+// event. Its answers (acks) go back the same way.
+// The handshake and connect/publish exchange take round
+// trips, the first GetRTMPMessage() runs on a reader thread
+// of the session's own while the loop relays. So does one
+// for a message that is whole here but bigger than the
+// socketpair holds (a big keyframe), easyRTMP only makes
+// room by reading it. The loop goes on relaying the rest.
+class RTMPSession {
+   private:
+    // who calls GetRTMPMessage() next
+    enum class Reader { kThread, kDone, kFailed, kLoop };
+
+    int m_id;
+    int m_fd;  // the publisher's socket, non-blocking
+    // our end of the socketpair easyRTMP reads, non-blocking
+    int m_relayFd;
+    // easyRTMP's end, owned by m_pClient. Blocking while
+    // the reader thread has it, else a framing mismatch
+    // would wait for bytes that aren't coming.
+    int m_libFd;
+    int m_epollFd;  // the server's, both fds are watched there
+    int m_wakeFd;   // the server's, written when the reader thread is done
+    uint32_t m_peerEvents{}, m_relayEvents{};  // registered
+    int m_fifoIdx{};
+    StreamConfig m_config;
+
+    RTMPFramer m_framer;
+    // read from the publisher, not in the socketpair yet
+    std::vector<uint8_t> m_toLib;
+    uint64_t m_relayed{};  // stream bytes in the socketpair
+    // whole media messages easyRTMP can read without waiting
+    size_t m_ready{};
+    // easyRTMP's answers, not sent to the publisher yet
+    std::vector<uint8_t> m_toPeer;
+    bool m_peerClosed = false;
+    uint64_t m_lastReadUs;
+
+    std::thread m_readerThread;
+    std::mutex m_readerLock;
+    std::condition_variable m_readerWake;
+    bool m_quit = false;  // under m_readerLock
+    std::atomic<Reader> m_reader{Reader::kThread};
+    librtmp::RTMPMediaMessage m_handoff;  // read by the reader thread
+
+    // declaration order matters, the endpoint
+    // and session hold raw pointers into m_pClient.
+    std::unique_ptr<TCPNetwork> m_pClient;
+    librtmp::RTMPEndpoint m_endpoint;
+    librtmp::RTMPServerSession m_session;
+
+    PerfStatistics m_stats;
+    // outlives decoders (declared before them), null unless
+    // recording
+    std::unique_ptr<Recorder> m_pRecorder;
+    // Set by the loop on the first AVCC header. Other threads
+    // (gopSnapshot()) only read it under m_decoderLock.
+    mutable std::mutex m_decoderLock;
+    std::unique_ptr<StreamDecoder> m_pDecoder;
+
+    // RTMP messages and payload bytes read, by type. Written
+    // by the read loop, read by metrics scrapes.
+    std::atomic<uint64_t> m_videoMessages{}, m_audioMessages{};
+    std::atomic<uint64_t> m_videoBytes{}, m_audioBytes{};
+    // last, see MetricsRegistry::Registration
+    MetricsRegistry::Registration m_metrics;
+
+    RTMPSession(int id,
+                int fd,
+                int epollFd,
+                int wakeFd,
+                const StreamConfig& config,
+                std::array<int, 2> relay);
+
+    void readerLoop();
+    void handleMessage(librtmp::RTMPMediaMessage& message);
+    void handleVideo(librtmp::RTMPMediaMessage& m,
+                     librtmp::ClientParameters* sourceParams);
+    // m_toLib into the socketpair, as much as fits
+    void relayToLib();
+    // Reads every whole media message easyRTMP has.
+    void dispatch();
+    // The next one to the reader thread, see above.
+    void handOff();
+    void flushPeer();
+    // Registers what the buffers need now.
+    void watch();
+
+   public:
+    // Payload bytes buffered (before easyRTMP) past which the
+    // publisher's socket isn't read, RTMP messages are < 16MB.
+    static constexpr size_t kMaxBuffered = 32u << 20;
+    // Per easyRTMP read on the reader thread.
+    static constexpr int kReaderTimeoutMs = 2000;
+    // Asked for on both ends of the socketpair (the kernel
+    // caps it at net.core.wmem_max/rmem_max), enough that
+    // most keyframes never need the reader thread.
+    static constexpr int kRelayBuffer = 4 << 20;
+
+    // Watches fd (and the socketpair) in epollFd, the reader
+    // thread being done writes wakeFd.
+    RTMPSession(int id, int fd, int epollFd, int wakeFd, const StreamConfig& config);
+    RTMPSession(const RTMPSession&) = delete;
+    RTMPSession& operator=(const RTMPSession&) = delete;
+    ~RTMPSession();
+
+    // The publisher's socket is readable: reads what's there
+    // and dispatches every whole media message. Throws when
+    // the peer disconnects or the stream is malformed.
+    void onReadable();
+    // The publisher's socket has room again.
+    void onWritable();
+    // easyRTMP wrote (handshake, acks) or can take more.
+    void onRelayEvent(uint32_t events);
+    // After the wake fd fired: dispatches the message the
+    // reader thread read, if it's done. Throws if it failed.
+    void pollReader();
+    // Part of a message has been waiting longer than timeoutUs.
+    bool stalled(uint64_t nowUs, uint64_t timeoutUs) const;
+    void printStats();
+    // live stats for the metrics endpoint, any thread
+    void collectMetrics(MetricsWriter& w) const;
+    // Applies from the stream's next IDR on, and to any
+    // decoder a new AVCC header creates.
+    void setDecodePolicy(const DecodePolicy& policy);
+
+    int id() const { return m_id; }
+    int fd() const { return m_fd; }
+    int relayFd() const { return m_relayFd; }
+    const PerfStatistics& stats() const { return m_stats; }
+    // See StreamDecoder::gopSnapshot(). Any thread.
+    bool gopSnapshot(GopSnapshot& out) const {
+        std::lock_guard<std::mutex> lock(m_decoderLock);
+        return m_pDecoder && m_pDecoder->gopSnapshot(out);
+    }
+    // Only final once printStats() has stopped the decoder.
+    uint64_t framesDecoded() const;
+    // video AUs handed to the decoder, see StreamDecoder::ausIn()
+    uint64_t ausIn() const { return m_pDecoder ? m_pDecoder->ausIn() : 0; }
+};
+#endif
@@ -0,0 +1,116 @@
+#ifndef SESSIONSERVER_H
+#define SESSIONSERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "squig/latencyhistogram.h"
+#include "squig/metrics.h"
+#include "squig/rtmpsession.h"
+#include "squig/streamconfig.h"
+
+// A SessionServer accepts any number of RTMP publishers
+// on one port and drives all of them from a single
+// epoll readiness loop.
+//
+// All sockets are non-blocking. easyRTMP reads a whole
+// message per GetRTMPMessage() call, so a session only
+// calls it for messages it already has whole (see
+// RTMPSession): a publisher that stops half way through a
+// message holds up nobody, and is dropped once that has
+// lasted kRecvTimeoutMs. Reads per event are bounded, so a
+// busy publisher cannot starve the others (level-triggered
+// round robin). A closed session is torn down (decoder
+// drained and joined, recording finished) on a reaper
+// thread, not the loop.
+class SessionServer {
+   private:
+    int m_listenFd = -1;
+    int m_epollFd = -1;
+    int m_stopFd = -1;    // eventfd, written by stop()
+    int m_traceFd = -1;   // eventfd, written by requestTraceDump()
+    int m_policyFd = -1;  // eventfd, written by requestDecodePolicy()
+    int m_readerFd = -1;  // eventfd, written by sessions' reader threads
+    // the requested policy, lock-free so a signal handler can set it
+    std::atomic<DecodeMode> m_reqMode{DecodeMode::kAll};
+    std::atomic<double> m_reqFps{0};
+    int m_nextSessionId{};
+    StreamConfig m_config;  // for every new session
+    std::unordered_map<int, std::unique_ptr<RTMPSession>> m_sessions;
+    // socketpair end to easyRTMP -> session socket
+    std::unordered_map<int, int> m_relays;
+    uint64_t m_lastSweepUs{};
+    // closed sessions, to be stopped and destroyed
+    std::thread m_reaper;
+    std::mutex m_reapLock;
+    std::condition_variable m_reapWake;
+    std::vector<std::unique_ptr<RTMPSession>> m_toReap;
+    bool m_reapStop = false;
+    // Written by the reaper. E2E latency of every session
+    // closed so far
+    LatencyHistogram m_allE2E;
+    // capture -> sink of stamped streams, see GlassStage
+    LatencyHistogram m_allGlass;
+    uint64_t m_allFrames{};
+    uint64_t m_allAUs{};
+    bool m_exitWhenIdle = false;
+    // mirrors of the loop's own state for metrics scrapes
+    std::atomic<size_t> m_activeSessions{};
+    std::atomic<uint64_t> m_acceptedSessions{};
+    MetricsRegistry::Registration m_metrics;  // last, see Registration
+
+    void acceptAll();
+    void closeSession(int fd);
+    void closeAll();
+    void reapLoop();
+    // waits for the sessions closed so far
+    void stopReaper();
+    void dumpTrace();
+    void pollReaders();
+    void closeStalled();
+    void applyDecodePolicy();
+
+   public:
+    static constexpr int kMaxEvents = 64;
+    // a partial message older than this drops the session
+    static constexpr int kRecvTimeoutMs = 2000;
+    static constexpr int kSweepMs = 250;
+
+    explicit SessionServer(uint16_t port, const StreamConfig& config = {});
+    SessionServer(const SessionServer&) = delete;
+    SessionServer& operator=(const SessionServer&) = delete;
+    ~SessionServer();
+
+    // Blocks until stop() is called.
+    void run();
+    // async-signal-safe, may be called from a signal handler.
+    void stop();
+    // Asks the loop to write a Chrome trace (see trace.h) of
+    // the last few seconds. async-signal-safe as well.
+    void requestTraceDump();
+    // Switches every session (and new ones) to policy, each
+    // at its next IDR. async-signal-safe as well.
+    void requestDecodePolicy(const DecodePolicy& policy);
+
+    // Serve an already connected socket, accepted ones or
+    // e.g. one end of a socketpair fed by a replay. From
+    // outside the loop, only before run().
+    void adopt(int fd);
+    // Make run() return once the last session has closed,
+    // for replays. Call before run().
+    void setExitWhenIdle(bool exit) { m_exitWhenIdle = exit; }
+
+    size_t sessionCount() const { return m_sessions.size(); }
+    // Of the sessions closed by the time run() returned.
+    const LatencyHistogram& allSessionsE2E() const { return m_allE2E; }
+    const LatencyHistogram& allSessionsGlass() const { return m_allGlass; }
+    uint64_t allSessionsFrames() const { return m_allFrames; }
+    uint64_t allSessionsAUs() const { return m_allAUs; }
+};
+#endif
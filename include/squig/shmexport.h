@@ -0,0 +1,89 @@
+#ifndef SHMEXPORT_H
+#define SHMEXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/version.h>
+}
+
+#include "squig/shmlayout.h"
+
+// Writer side of the shared-memory frame export, layout in
+// shmlayout.h. Backs a FramePool (see FramePool::setExport):
+// the decoder's frame buffers are carved out of the shared
+// object, so publish() only writes a descriptor and wakes
+// readers, the pixels are never copied.
+//
+// The object is created when the pool learns the frame size
+// and replaced (same name, the old one marked stale) if that
+// changes. A replaced mapping stays alive until the last
+// frame in it is released. If every slot is busy, frames
+// fall back to heap buffers and aren't exported.
+class ShmFrameExport {
+   private:
+    // One shared object, refcounted by the export and every
+    // live buffer in it.
+    struct Region {
+        int fd = -1;
+        uint8_t* pBase = nullptr;
+        size_t mapSize{};
+        shm::Header* pHdr = nullptr;
+        std::mutex lock;
+        std::vector<uint32_t> freeSlots;
+        std::atomic<int> refs{1};
+
+        void release();
+    };
+
+    const std::string m_name;  // shm_open name, "/squig-s<id>"
+    const size_t m_slots;
+    Region* m_pRegion = nullptr;
+    size_t m_bufSize{};
+    std::atomic<uint64_t> m_exported{};
+    std::atomic<uint64_t> m_notExported{};
+
+    static void freeSlot(void* opaque, uint8_t* data);
+    void retire();
+    int slotOf(const uint8_t* data) const;
+
+   public:
+    ShmFrameExport(std::string name, size_t slots);
+    ShmFrameExport(const ShmFrameExport&) = delete;
+    ShmFrameExport& operator=(const ShmFrameExport&) = delete;
+    // Marks the object stale, wakes readers and unlinks
+    // the name.
+    ~ShmFrameExport();
+
+    // FramePool side. configure() (re)creates the object for
+    // buffers of bufSize, false if that fails (frames then
+    // come from the heap).
+    bool configure(size_t bufSize);
+    // av_buffer_pool_init2 allocator, opaque is the export.
+    // Its size was an int before libavutil 57 (FFmpeg 5).
+#if LIBAVUTIL_VERSION_MAJOR < 57
+    using BufSize = int;
+#else
+    using BufSize = size_t;
+#endif
+    static AVBufferRef* allocBuffer(void* opaque, BufSize size);
+    // The decoder is about to write into this buffer.
+    void onAcquire(const AVBufferRef* pBuf);
+
+    // Decode thread: makes a decoded frame visible to
+    // readers. false if its buffer isn't in the shared object.
+    bool publish(const AVFrame* pFrame, uint64_t seq);
+
+    const std::string& name() const { return m_name; }
+    uint64_t exported() const { return m_exported.load(); }
+    uint64_t notExported() const { return m_notExported.load(); }
+};
+#endif
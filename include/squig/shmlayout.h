@@ -0,0 +1,93 @@
+#ifndef SHMLAYOUT_H
+#define SHMLAYOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// Memory layout of a session's shared-memory frame export,
+// /dev/shm/squig-s<session> (shm_open name "/squig-s<id>").
+// Shared by the writer (shmexport.h) and readers
+// (shmreader.h); other languages map the same layout, all
+// fields are little endian, naturally aligned, and the
+// atomics are plain 32/64 bit words.
+//
+//   [Header][slotGen[slotCount]] ... [slot 0][slot 1]...
+//                                    ^ dataOffset, slotSize apart
+//
+// Slots are the decoder's own frame buffers: Squig decodes
+// straight into them, nothing is copied for the export. A
+// slot is recycled by the decoder once Squig itself no
+// longer needs the frame in it (a few frame periods after
+// it was published), readers never hold it back. Each slot
+// therefore has a generation: even while its content is a
+// published frame, odd while the decoder owns it. A reader
+// checks the generation before and after using the pixels,
+// like a seqlock; a change means the frame was overwritten
+// under it and must be discarded.
+namespace shm {
+
+inline constexpr uint32_t kMagic = 0x48535153;  // "SQSH"
+inline constexpr uint32_t kVersion = 1;
+// recent frame descriptors, readers get latest-frame semantics
+inline constexpr size_t kDescs = 16;
+// planar 4:2:0, Y then U then V
+inline constexpr uint32_t kFourccI420 = 0x30323449;  // "I420"
+
+// Written under a seqlock: lock is odd while the writer
+// updates the rest.
+struct FrameDesc {
+    std::atomic<uint32_t> lock;
+    std::atomic<uint32_t> slot;
+    std::atomic<uint32_t> slotGen;  // generation the frame is valid for
+    std::atomic<uint32_t> fourcc;
+    std::atomic<int32_t> width;
+    std::atomic<int32_t> height;
+    std::atomic<uint32_t> fullRange;  // 0: limited (MPEG) range
+    std::atomic<int32_t> linesize[4];
+    std::atomic<uint64_t> planeOffset[4];  // from the slot start
+    std::atomic<uint64_t> seq;             // Squig's frame seq, 1, 2, ...
+    std::atomic<int64_t> pts;              // ms, RTMP timeline
+    std::atomic<uint64_t> publishUs;       // CLOCK_MONOTONIC
+};
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t reserved;
+    uint64_t slotSize;
+    uint64_t dataOffset;  // page aligned
+    // 1 once the writer is done with this mapping (session
+    // ended, or resolution changed and a new object took the
+    // name): readers close and reopen by name.
+    std::atomic<uint32_t> stale;
+    // bumped on every publish; readers FUTEX_WAIT on it
+    // (shared, not FUTEX_PRIVATE), the writer only wakes
+    // when waiters is non-zero.
+    std::atomic<uint32_t> futex;
+    std::atomic<uint32_t> waiters;
+    uint32_t reserved2;
+    // newest published seq, its descriptor is
+    // desc[latestSeq % kDescs]
+    std::atomic<uint64_t> latestSeq;
+    FrameDesc desc[kDescs];
+    // std::atomic<uint32_t> slotGen[slotCount] follows
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == 4 &&
+                  std::atomic<uint32_t>::is_always_lock_free,
+              "shared atomics must be plain words");
+static_assert(sizeof(std::atomic<uint64_t>) == 8 &&
+                  std::atomic<uint64_t>::is_always_lock_free,
+              "shared atomics must be plain words");
+
+inline std::atomic<uint32_t>* slotGens(Header* h) {
+    return reinterpret_cast<std::atomic<uint32_t>*>(h + 1);
+}
+inline const std::atomic<uint32_t>* slotGens(const Header* h) {
+    return reinterpret_cast<const std::atomic<uint32_t>*>(h + 1);
+}
+}  // namespace shm
+#endif
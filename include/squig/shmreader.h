@@ -0,0 +1,79 @@
+#ifndef SHMREADER_H
+#define SHMREADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "squig/shmlayout.h"
+
+// Reference reader for a session's shared-memory frame
+// export (see shmlayout.h). Depends on nothing but libc, so
+// an analyzer links it (libsquig_shm.a) without pulling in
+// libav*/OpenCV.
+//
+//   ShmFrameReader r;
+//   r.open(0);  // session 0, i.e. /squig-s0
+//   ShmFrameView f;
+//   while (r.next(f, 1000)) {
+//       run(f.planes[0], f.linesize[0], ...);  // no copy
+//       if (!r.valid(f)) { /* overwritten meanwhile, drop result */ }
+//   }
+//
+// next() hands out the newest frame (a slow reader skips
+// frames, it never holds the decoder back). The pixels
+// point into Squig's decoder buffers and are only
+// guaranteed intact while valid() says so; check it after
+// using them, or copy out first and check then.
+struct ShmFrameView {
+    uint64_t seq{};
+    int64_t pts{};        // ms
+    uint64_t publishUs{};  // CLOCK_MONOTONIC, when Squig published it
+    uint32_t fourcc{};     // shm::kFourccI420
+    int width{}, height{};
+    bool fullRange = false;
+    const uint8_t* planes[4]{};
+    int linesize[4]{};
+    // for valid()
+    uint32_t slot{};
+    uint32_t slotGen{};
+};
+
+class ShmFrameReader {
+   private:
+    std::string m_name;
+    int m_fd = -1;
+    uint8_t* m_pBase = nullptr;
+    size_t m_mapSize{};
+    shm::Header* m_pHdr = nullptr;
+    uint64_t m_cursor{};  // seq of the last frame returned
+
+    bool map();
+    void unmap();
+    bool readDesc(uint64_t seq, ShmFrameView& v) const;
+
+   public:
+    ShmFrameReader() = default;
+    ShmFrameReader(const ShmFrameReader&) = delete;
+    ShmFrameReader& operator=(const ShmFrameReader&) = delete;
+    ~ShmFrameReader() { close(); }
+
+    // shm_open name ("/squig-s3"), or the session id.
+    // false if Squig isn't exporting it (yet).
+    bool open(const std::string& name);
+    bool open(int sessionId) {
+        return open("/squig-s" + std::to_string(sessionId));
+    }
+    void close();
+    bool isOpen() const { return m_pHdr != nullptr; }
+
+    // Newest frame after the last one returned, waiting up
+    // to timeoutMs (futex, no polling) if there is none.
+    // Follows the export across resolution changes; false
+    // on timeout or once the session has gone away.
+    bool next(ShmFrameView& v, int timeoutMs);
+    // The frame's pixels haven't been reused since next().
+    bool valid(const ShmFrameView& v) const;
+};
+#endif
@@ -0,0 +1,129 @@
+#ifndef SPSCQUEUE_H_
+#define SPSCQUEUE_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+// Destructive interference size, hardcoded since
+// std::hardware_destructive_interference_size
+// warns on gcc (ABI unstable).
+inline constexpr size_t kCacheLine = 64;
+
+// Bounded, lock-free single-producer/single-consumer ring.
+// Links two pipeline stages (i.e. two threads).
+//
+// head/tail live on separate cache lines, and each side keeps
+// a cached copy of the other side's index so the common case
+// (queue neither full nor empty) touches no shared line.
+// Indices increase monotonically, slot = idx & (Capacity - 1).
+// The top bit of the tail index marks the queue closed, so a
+// consumer parked on the tail is woken by close() as well.
+template <typename T, size_t Capacity>
+class SPSCQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of 2");
+
+   private:
+    static constexpr size_t kClosedBit = size_t{1} << 63;
+
+    // consumer owned
+    alignas(kCacheLine) std::atomic<size_t> m_head{0};
+    size_t m_tailCached{0};
+    // producer owned
+    alignas(kCacheLine) std::atomic<size_t> m_tail{0};
+    size_t m_headCached{0};
+
+    alignas(kCacheLine) std::array<T, Capacity> m_slots{};
+
+   public:
+    // Producer side. Returns false if full, v is left untouched.
+    bool tryPush(T&& v) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail & kClosedBit) {
+            return false;
+        }
+        if (tail - m_headCached == Capacity) {
+            m_headCached = m_head.load(std::memory_order_acquire);
+            if (tail - m_headCached == Capacity) {
+                return false;
+            }
+        }
+        m_slots[tail & (Capacity - 1)] = std::move(v);
+        m_tail.store(tail + 1, std::memory_order_release);
+        // futex wake only if the consumer is parked
+        m_tail.notify_one();
+        return true;
+    }
+
+    // Consumer side. Returns false if empty.
+    bool tryPop(T& out) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tailCached) {
+            m_tailCached =
+                m_tail.load(std::memory_order_acquire) & ~kClosedBit;
+            if (head == m_tailCached) {
+                return false;
+            }
+        }
+        out = std::move(m_slots[head & (Capacity - 1)]);
+        m_head.store(head + 1, std::memory_order_release);
+        // only a producer in waitPush() parks on the head
+        m_head.notify_one();
+        return true;
+    }
+
+    // Producer side. Blocks until there's room, instead of
+    // failing when full (replay, where the input can wait).
+    // Returns false if the queue is closed.
+    bool waitPush(T&& v) {
+        while (!tryPush(std::move(v))) {
+            size_t tail = m_tail.load(std::memory_order_relaxed);
+            if (tail & kClosedBit) {
+                return false;
+            }
+            size_t head = m_head.load(std::memory_order_acquire);
+            if (tail - head == Capacity) {
+                m_head.wait(head, std::memory_order_acquire);
+            }
+        }
+        return true;
+    }
+
+    // Consumer side. Blocks until an element is available.
+    // Returns false once the queue is closed and drained.
+    bool waitPop(T& out) {
+        while (!tryPop(out)) {
+            size_t raw = m_tail.load(std::memory_order_acquire);
+            if (raw & kClosedBit) {
+                return tryPop(out);
+            }
+            m_tail.wait(raw, std::memory_order_acquire);
+        }
+        return true;
+    }
+
+    // Producer side (or once the producer has stopped).
+    // Wakes a consumer blocked in waitPop(), further pushes fail.
+    void close() {
+        m_tail.fetch_or(kClosedBit, std::memory_order_release);
+        m_tail.notify_all();
+    }
+
+    // Consumer side: no more elements will come. Some may
+    // still be queued, pop until tryPop() fails.
+    bool closed() const {
+        return m_tail.load(std::memory_order_acquire) & kClosedBit;
+    }
+
+    // Approximate, may be read from any thread.
+    size_t size() const {
+        return (m_tail.load(std::memory_order_relaxed) & ~kClosedBit) -
+               m_head.load(std::memory_order_relaxed);
+    }
+    static constexpr size_t capacity() { return Capacity; }
+};
+
+#endif  // SPSCQUEUE_H_
@@ -0,0 +1,290 @@
+#ifndef STREAMCONFIG_H
+#define STREAMCONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Executor;
+class MetricsRegistry;
+class Mosaic;
+class TensorBatcher;
+
+// Where the decoded frames of a stream end up, see framesink.h.
+enum class SinkType {
+    kDisplay,  // highgui window per session
+    kNull,     // dropped, for ingest + decode throughput
+    kRawYUV,   // appended to a raw yuv420p file
+    kRawBGR,   // appended to a raw bgr24 file
+    kMosaic,   // a tile of one shared window, see mosaic.h
+};
+
+inline const char* sinkName(SinkType t) {
+    switch (t) {
+        case SinkType::kDisplay:
+            return "display";
+        case SinkType::kNull:
+            return "null";
+        case SinkType::kRawYUV:
+            return "yuv";
+        case SinkType::kRawBGR:
+            return "bgr";
+        case SinkType::kMosaic:
+            return "mosaic";
+    }
+    return "unknown";
+}
+
+// Inverse of sinkName(), false for an unknown name.
+inline bool parseSinkType(const std::string& name, SinkType& t) {
+    for (SinkType c : {SinkType::kDisplay, SinkType::kNull, SinkType::kRawYUV,
+                       SinkType::kRawBGR, SinkType::kMosaic}) {
+        if (name == sinkName(c)) {
+            t = c;
+            return true;
+        }
+    }
+    return false;
+}
+
+// How much of a stream is decoded. Most cameras only need
+// a low rate view (thumbnails, liveness, periodic
+// analytics), decoding every frame of them is wasted CPU.
+enum class DecodeMode {
+    kAll,        // every frame
+    kKeyframes,  // IDR frames only, the rest never reaches the decoder
+    kTargetFps,  // at most DecodePolicy::fps frames per second
+};
+
+struct DecodePolicy {
+    DecodeMode mode = DecodeMode::kAll;
+    double fps = 0;  // kTargetFps only
+
+    bool operator==(const DecodePolicy&) const = default;
+};
+
+// "all", "keyframes" or "<fps>fps" (e.g. "2fps", "0.5fps")
+inline std::string decodePolicyName(const DecodePolicy& p) {
+    switch (p.mode) {
+        case DecodeMode::kAll:
+            return "all";
+        case DecodeMode::kKeyframes:
+            return "keyframes";
+        case DecodeMode::kTargetFps: {
+            std::string fps = std::to_string(p.fps);
+            // trailing zeros of to_string's %f
+            fps.erase(fps.find_last_not_of('0') + 1);
+            if (fps.back() == '.') {
+                fps.pop_back();
+            }
+            return fps + "fps";
+        }
+    }
+    return "unknown";
+}
+
+// Inverse of decodePolicyName(), false if name isn't one.
+inline bool parseDecodePolicy(const std::string& name, DecodePolicy& p) {
+    if (name == "all") {
+        p = {DecodeMode::kAll, 0};
+        return true;
+    }
+    if (name == "keyframes") {
+        p = {DecodeMode::kKeyframes, 0};
+        return true;
+    }
+    const std::string suffix = "fps";
+    if (name.size() > suffix.size() &&
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        std::string num = name.substr(0, name.size() - suffix.size());
+        char* end;
+        double fps = std::strtod(num.c_str(), &end);
+        if (*end == '\0' && fps > 0) {
+            p = {DecodeMode::kTargetFps, fps};
+            return true;
+        }
+    }
+    return false;
+}
+
+// How the H.264 decoder is threaded, a latency/throughput
+// trade (see applyDecodeProfile()). Frame threading keeps
+// a frame per extra thread in flight, i.e. that many frames
+// of delay. The explicit pools are per session: with many
+// sessions, leave the cores to the sessions (low-latency).
+enum class DecodeProfile {
+    kLowLatency,  // one thread, a frame out per AU in
+    kBalanced,    // 2 frame threads, one frame of delay
+    kThroughput,  // a frame thread per core, most fps per stream
+};
+
+inline const char* decodeProfileName(DecodeProfile p) {
+    switch (p) {
+        case DecodeProfile::kLowLatency:
+            return "low-latency";
+        case DecodeProfile::kBalanced:
+            return "balanced";
+        case DecodeProfile::kThroughput:
+            return "throughput";
+    }
+    return "unknown";
+}
+
+inline bool parseDecodeProfile(const std::string& name, DecodeProfile& p) {
+    for (DecodeProfile c : {DecodeProfile::kLowLatency, DecodeProfile::kBalanced,
+                            DecodeProfile::kThroughput}) {
+        if (name == decodeProfileName(c)) {
+            p = c;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Container of recorded segments, see recorder.h.
+enum class RecordFormat {
+    kMP4,  // fragmented, playable while being written
+    kTS,   // MPEG-TS
+};
+
+inline const char* recordFormatName(RecordFormat f) {
+    return f == RecordFormat::kTS ? "ts" : "mp4";
+}
+
+inline bool parseRecordFormat(const std::string& name, RecordFormat& f) {
+    for (RecordFormat c : {RecordFormat::kMP4, RecordFormat::kTS}) {
+        if (name == recordFormatName(c)) {
+            f = c;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reduced resolution outputs of a decoded frame, 1/2 or
+// 1/4 per side, see pyramid.h and DecodedFrame::scaled().
+enum class PyramidFormat { kBGR24, kRGB24, kGray };
+
+struct PyramidLevel {
+    PyramidFormat format = PyramidFormat::kBGR24;
+    int div = 2;  // 2 or 4
+
+    // dense, for per-level tables
+    size_t index() const { return size_t(format) * 2 + (div == 4 ? 1 : 0); }
+    bool operator==(const PyramidLevel&) const = default;
+};
+inline constexpr size_t kPyramidLevels = 6;
+
+// "bgr/2", "rgb/4", "gray/2", ...
+inline std::string pyramidLevelName(const PyramidLevel& l) {
+    static constexpr const char* kFormats[] = {"bgr", "rgb", "gray"};
+    return std::string(kFormats[int(l.format)]) + "/" + std::to_string(l.div);
+}
+
+// Comma separated pyramidLevelName()s, false if any isn't one.
+inline bool parsePyramidLevels(const std::string& spec,
+                               std::vector<PyramidLevel>& levels) {
+    std::vector<PyramidLevel> out;
+    size_t begin = 0;
+    while (begin <= spec.size()) {
+        size_t end = spec.find(',', begin);
+        if (end == std::string::npos) {
+            end = spec.size();
+        }
+        std::string name = spec.substr(begin, end - begin);
+        bool found = false;
+        for (PyramidFormat f :
+             {PyramidFormat::kBGR24, PyramidFormat::kRGB24, PyramidFormat::kGray}) {
+            for (int div : {2, 4}) {
+                if (name == pyramidLevelName({f, div})) {
+                    out.push_back({f, div});
+                    found = true;
+                }
+            }
+        }
+        if (!found) {
+            return false;
+        }
+        begin = end + 1;
+    }
+    levels = std::move(out);
+    return true;
+}
+
+// Per-session options, chosen at startup (command line)
+// and handed to every StreamDecoder the session creates.
+struct StreamConfig {
+    SinkType sink = SinkType::kDisplay;
+    // kRaw* sinks write <dumpDir>/squig-s<session>-<w>x<h>.<yuv|bgr>
+    std::string dumpDir = ".";
+    // Max age (read -> decode) of a video AU before frames
+    // are dropped to catch up, see StreamDecoder::decodeLoop.
+    // 0 never drops for latency.
+    uint32_t latencyBudgetMs = 0;
+    // Can be changed while streaming, takes effect at the
+    // stream's next IDR (StreamDecoder::setDecodePolicy).
+    DecodePolicy decode;
+    // Decoder threading, fixed when the decoder is opened.
+    DecodeProfile profile = DecodeProfile::kLowLatency;
+    // Bound on the encoded AUs kept since the last IDR for
+    // late joiners (see gopcache.h). 0 keeps none: every AU
+    // is copied into the cache, only worth it for sessions
+    // something in-process attaches to mid-stream.
+    size_t gopCacheBytes = 0;
+
+    // Passthrough recording, off if recordDir is empty.
+    // Segments of ~segmentSec (cut at keyframes), the
+    // newest keepSegments of them are kept (0: all).
+    std::string recordDir;
+    RecordFormat recordFormat = RecordFormat::kMP4;
+    uint32_t segmentSec = 60;
+    uint32_t keepSegments = 60;
+
+    // Motion gating, off if < 0. Otherwise every frame gets a
+    // motion score (fraction of the picture that changed, see
+    // motion.h), and frames scoring below this skip the BGR
+    // conversion and the sink.
+    float motionThreshold = -1;
+
+    // Reduced resolution levels built for every frame that
+    // reaches the convert stage (fused with its BGR
+    // conversion). Consumers can still ask for any level on
+    // demand, these are just computed ahead.
+    std::vector<PyramidLevel> pyramid;
+
+    // Shared by all sessions: every frame that reaches the
+    // sink stage is also offered to it (see tensorbatcher.h),
+    // keyed by session id. Null: no batching.
+    std::shared_ptr<TensorBatcher> batcher;
+
+    // Shared by all sessions of a kMosaic sink: the one
+    // window every stream gets a tile of. Null with kMosaic:
+    // a window per session, as kDisplay.
+    std::shared_ptr<Mosaic> mosaic;
+
+    // Shared by all sessions: run their decode/convert/sink
+    // stages as strands on these workers instead of three
+    // threads per session (see executor.h). Display and
+    // mosaic sessions get latency priority. Null: a thread
+    // per stage.
+    std::shared_ptr<Executor> executor;
+
+    // Shared by all sessions: each session and its decoder
+    // register their live stats here for the Prometheus
+    // endpoint (see metrics.h). Null: no metrics.
+    std::shared_ptr<MetricsRegistry> metrics;
+
+    // Decode into shared memory (/dev/shm/squig-s<session>)
+    // for out-of-process readers, see shmreader.h.
+    bool shmExport = false;
+
+    // Replay only: the RTMP reader waits for room in the
+    // decode queue instead of dropping AUs, so a fast replay
+    // measures decoding, not drops. Never for live input.
+    bool blockingIngest = false;
+};
+#endif
@@ -1,8 +1,13 @@
 #ifndef STREAMDECODER_H
 #define STREAMDECODER_H
 
+#include <atomic>
 #include <iostream>
+#include <memory>
 #include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 // extern C is needed
 // tells the compiler to
@@ -14,55 +19,309 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/log.h>
-#include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
 }
 
+#include "squig/decodedframe.h"
+#include "squig/executor.h"
+#include "squig/framering.h"
+#include "squig/framesink.h"
+#include "squig/gopcache.h"
+#include "squig/metrics.h"
+#include "squig/motion.h"
+#include "squig/nalparser.h"
+#include "squig/packetpool.h"
 #include "squig/perfstatistics.hpp"
+#include "squig/shmexport.h"
 #include "squig/rtmp_server.h"
+#include "squig/spscqueue.hpp"
+#include "squig/streamconfig.h"
+
+// Per stage bookkeeping. Only the stage's own thread
+// writes to it; read after the stage has been joined,
+// except time and dropped, which metrics scrapes read live.
+struct StageStats {
+    PerfStatistics time{0};  // us spent per item in this stage
+    size_t maxDepth{};       // deepest input queue seen by the stage
+    // items dropped because the next queue was full
+    std::atomic<uint64_t> dropped{};
+    uint64_t cpuUs{};        // thread CPU time of the stage, set on exit
+    bool finished = false;   // input closed and drained (executor mode)
+};
 
 // A StreamDecoder is responsible
 // for transforming encoded YUV NALUs from RTMP messages
-// to decoded BGR Video Frames, usable by openCV.
+// to decoded Video Frames, usable by openCV
+// (YUV plane views, or BGR converted on demand).
 // The StreamDecoder makes a buffer of AVFrames
-// from a single client available for playback or analysis.
+// from a single client available for playback or analysis
+// (see frames()), and hands them to the session's
+// FrameSink (display, null, raw file; see StreamConfig).
+//
+// Work is split into stages, each on its own thread,
+// linked by bounded SPSC queues:
+//   RTMP read (caller of process())
+//     -> decode (AVCC->AnnexB, send_packet/receive_frame)
+//          publishes every frame to the shared FrameRing
+//     -> convert (YUV->BGR and the configured pyramid
+//          levels, ahead of time, only if the sink wants
+//          BGR or levels are configured)
+//     -> sink (e.g. imshow)
+// so a slow stage no longer blocks socket reads, and
+// stages overlap instead of adding up per frame.
+//
+// With StreamConfig::executor set, the stages are Strands
+// on the shared workers instead of threads: queue pushes
+// notify the next stage's strand, which drains a few items
+// per run. Same queues, same per-stream order.
 class StreamDecoder {
 private:
+    static constexpr size_t kAUQueueLen = 32;  // ~1s at 30fps
+    static constexpr size_t kFrameQueueLen = 4;
+    static constexpr size_t kRingLen = 8;
+    // H.264 keeps up to 16 reference frames, plus frames
+    // in flight in the queues.
+    static constexpr size_t kYUVFramesInFlight = kRingLen + 16 + kFrameQueueLen;
+    // Only a few are allocated up front, most streams use far
+    // fewer references; the pool grows to what the stream
+    // needs in its first GOP and stays there.
+    static constexpr size_t kYUVPoolPrealloc = 4;
+    // frames briefly held by the sink/consumers on top
+    static constexpr size_t kShmSlots = kYUVFramesInFlight + 8;
+    // How long the keyframe after a new sequence header (and
+    // the header) may wait for room in m_auQueue, instead of
+    // the whole first GOP of the new stream being dropped.
+    static constexpr uint64_t kConfigWaitUs = 20000;
+
     int m_fifoIdx {};
-    // RTMP message containing AVCDecoderConfigurationRecord
-    // i.e. AVCC header i.e. first RTMP message.
-    const librtmp::RTMPMediaMessage m_avccHdr;
+    int m_sessionId;
+    // AVCDecoderConfigurationRecord i.e. AVCC header,
+    // the payload of the first RTMP video message. Replaced
+    // by the decode stage when a new one is applied.
+    std::vector<uint8_t> m_avccHdr;
+    const StreamConfig m_config;
 
-    // non-const for later multi-resoultion source
-    // support...
+    // as announced at connect; the frame size in use is
+    // m_width/m_height, it may change with a new header
     librtmp::ClientParameters m_sourceParams;
 
     // H.264 decoder context
     const AVCodec* m_dec = nullptr;
     AVCodecContext* m_pDecCtx = nullptr;
+    // reused for every AU, only ever points at pooled buffers
+    AVPacket* m_pPkt = nullptr;
 
-    // pixel format conversion context
-    struct SwsContext* m_pSwsCtx = nullptr;
-
-    // YUV: transport pixel format, compact
-    // BGR: Required by openCV render methods
-    // Frames are allocated once, and buffers
-    // are reused until session ends.
-    AVFrame* m_pFrameYUV, *m_pFrameBGR;
+    // RTMP payloads are copied once into these (reader thread),
+    // and referenced from there on.
+    PacketPool m_packetPool;
+    // AUs since the last IDR, for late joiners. Null if
+    // disabled in the config.
+    std::unique_ptr<GopCache> m_pGopCache;
 
+    // Session stats: e2e (socket read -> sink) latency
+    // and sink (imshow) period. Written by the sink stage only.
     PerfStatistics& m_stats;
+
+    // Decoder output buffers in shared memory, for other
+    // processes. Null unless enabled; outlives m_yuvPool.
+    std::unique_ptr<ShmFrameExport> m_pShmExport;
+    // Decoder output buffers, and the buffers for
+    // on-demand conversions (BGR etc.) of its frames.
+    FramePool m_yuvPool {kYUVPoolPrealloc};
+    std::shared_ptr<ConversionPools> m_pConvPools =
+        std::make_shared<ConversionPools>();
+    // Most recent decoded frames, shared with any consumer.
+    FrameRing m_ring {kRingLen};
+    uint64_t m_frameSeq {};
+
+    // read -> decode
+    SPSCQueue<EncodedAU, kAUQueueLen> m_auQueue;
+    // decode -> convert (YUV frames, shared with the ring)
+    SPSCQueue<FrameHandle, kFrameQueueLen> m_yuvQueue;
+    // convert (or decode) -> sink
+    SPSCQueue<FrameHandle, kFrameQueueLen> m_sinkQueue;
+
+    // where frames end up, used by the sink stage only
+    std::unique_ptr<FrameSink> m_pSink;
+    // sink wants BGR, run the convert stage
+    bool m_convertAhead;
+
+    // ingest side, touched by the process() caller only
+    bool m_waitForKeyframe = false;
+    h264::AUInfo m_auInfo;
+    // a new sequence header that didn't fit in m_auQueue,
+    // it goes before the next AU that does
+    std::vector<uint8_t> m_pendingConfig;
+    uint64_t m_pendingConfigUs{};  // when it was read
+    bool m_configPending = false;
+    uint64_t m_ausIn{};  // video AUs handed to process()
+
+    // Decode policy, also ingest side: AUs the policy has no
+    // use for are dropped before they are even copied.
+    DecodePolicy m_policy;
+    DecodePolicy m_pendingPolicy;
+    bool m_policyPending = false;
+    uint64_t m_policySkipped {};
+    // times a pending policy took over, printed with the
+    // stats rather than from the ingest thread
+    uint64_t m_policySwitches {};
+    // kTargetFps: pts (ms) the next forwarded frame is due at,
+    // and the IDR interval, to tell whether IDRs alone are
+    // frequent enough for the target rate.
+    double m_nextDueMs {};
+    int64_t m_lastIdrPts = -1;
+    int64_t m_gopMs {};
+    bool m_fpsIdrOnly = false;
+
+    // Latency budget state, decode stage only. Over budget
+    // the decoder discards non-reference pictures; far over
+    // it (or still over with nothing left to discard) AUs are
+    // skipped until the next IDR. Back under half the budget,
+    // everything is decoded again.
+    uint64_t m_budgetUs;
+    bool m_discardNonRef = false;
+    bool m_skipToIDR = false;
+    // restarted at an open-GOP keyframe, B's before the next P go
+    bool m_skipLeading = false;
+    AVDiscard m_skipFrame = AVDISCARD_DEFAULT;  // as set on m_pDecCtx
+
+    // Motion gating, decode stage only. Static frames still
+    // go to the ring (scored), not to convert/sink.
+    motion::MotionDetector m_motion;
+    uint64_t m_motionGated {};
+    uint64_t m_motionUs {};
+
+    StageStats m_decodeStage, m_convertStage, m_sinkStage;
+    // send_packet/receive_frame failures (corrupt input),
+    // decode stage only
+    std::atomic<uint64_t> m_decodeErrors{};
+
+    // Mid-stream sequence headers, decode stage only (the
+    // counters are read by metrics). Frame size of the
+    // current header, from its SPS.
+    int m_width{}, m_height{};
+    std::vector<uint8_t> m_annexBConfig;  // SPS/PPS to send in-band
+    std::atomic<uint64_t> m_resizes{};    // new frame size
+    std::atomic<uint64_t> m_reconfigs{};  // new parameter sets, same size
+    std::atomic<uint64_t> m_reconfigsUnchanged{};  // same record resent
+    // header read off the socket -> applied, and -> the
+    // first frame decoded with it
+    LatencyHistogram m_reconfigApplyUs;
+    LatencyHistogram m_reconfigFirstFrameUs;
+    uint64_t m_reconfigArrivalUs{};  // until that first frame, 0 otherwise
+
+    // send_packet -> receive_frame may reorder and delay
+    // frames, remember when each pts arrived and whether it
+    // goes downstream.
+    struct PtsArrival {
+        // an unused slot must not match a frame with pts 0
+        int64_t pts = AV_NOPTS_VALUE;
+        uint64_t arrivalUs;
+        uint64_t captureUs;
+        bool forward;
+    };
+    // covers the reorder delay (<= 16) plus a frame per
+    // frame thread (libavcodec's auto count is <= 16)
+    static constexpr size_t kArrivalSlots = 48;
+    PtsArrival m_arrivals[kArrivalSlots] {};
+    size_t m_arrivalIdx {};
+
+    std::thread m_decodeThread, m_convertThread, m_sinkThread;
+    // executor mode instead of the threads, null otherwise
+    std::unique_ptr<Strand> m_pDecodeStrand, m_pConvertStrand, m_pSinkStrand;
+
+    // Last, so it's unregistered before anything the
+    // collector reads goes away.
+    MetricsRegistry::Registration m_metrics;
+
     // AU = Access Unit (= Video Frame thanks to easyRTMP)
     void initDecoder();
     void registerAVCCExtraData();
     void registerDecoderCtx();
-    void registerPixelFmtConversionCtx();
-    void h264AUDecode(uint8_t* pAUData, size_t payloadSize, uint64_t dTime, uint32_t cTime);
+    void h264AUDecode(EncodedAU& au);
+    // receive_frame until the decoder wants more input,
+    // each frame goes to the ring and downstream
+    void receiveFrames();
+    // a config AU (new sequence header), decode stage
+    void applyConfig(EncodedAU& au);
+    // packet pool copy; waits for a free slot with
+    // StreamConfig::blockingIngest
+    PacketSlot* copyIn(const uint8_t* data, size_t size);
+    // ingest side: until n AUs fit in m_auQueue, at most
+    // timeoutUs; false if they still don't
+    bool waitForRoom(size_t n, uint64_t timeoutUs);
+    // ingest side: queue a config AU, false if it didn't fit
+    bool pushConfig(const uint8_t* data, size_t size, uint64_t arrivalUs);
+    // false if the AU should be dropped to stay in budget
+    bool keepWithinBudget(const EncodedAU& au, uint64_t now);
+    void applySkipFrame(const EncodedAU& au);
     void naluAVCCToAnnexB(uint8_t* pNaluData, size_t payloadSize);
-    void pixFmtYUVToBGR();
+    bool pixFmtYUVToBGR(const FrameHandle& f);
     void updateImshowTime(uint64_t now);
+    const PtsArrival* arrivalOf(int64_t pts) const;
+    // Ingest side: false if the decode policy skips the AU,
+    // otherwise sets its forward/discard.
+    bool admitByPolicy(EncodedAU& au);
+
+    // one item of each stage, and what a stage does once its
+    // input is closed and drained
+    void decodeOne(EncodedAU& au);
+    void decodeFinish();
+    void convertOne(FrameHandle& in);
+    void convertFinish();
+    void sinkOne(FrameHandle& in);
+    void sinkFinish();
+    // stage thread bodies
+    void decodeLoop();
+    void convertLoop();
+    void sinkLoop();
+    // stage strand bodies, true if they yielded with work left
+    bool decodeSome();
+    bool convertSome();
+    bool sinkSome();
+    // live stats for the metrics endpoint, any thread
+    void collectMetrics(MetricsWriter& w) const;
 public:
-    StreamDecoder(const librtmp::RTMPMediaMessage& m, librtmp::ClientParameters& sourceParams, PerfStatistics& stats);
-    void process(librtmp::RTMPMediaMessage& m);
+    StreamDecoder(const librtmp::RTMPMediaMessage& avccHdr, librtmp::ClientParameters& sourceParams, PerfStatistics& stats, int sessionId, const StreamConfig& config);
+    // Copies the AU into a pooled buffer, hands it to the
+    // decode stage and returns immediately.
+    void process(const librtmp::RTMPMediaMessage& m);
+    // A new AVCC header mid-stream (bitrate or resolution
+    // change): applied in place, in stream order, by the
+    // decode stage. The session, its queues and its ring
+    // stay. Same thread as process().
+    void reconfigure(const librtmp::RTMPMediaMessage& avccHdr);
+    // Switch decode policy at the next IDR, without a
+    // reconnect. Same thread as process().
+    void setDecodePolicy(const DecodePolicy& policy);
+    const DecodePolicy& decodePolicy() const { return m_policy; }
+    // Encoded AUs from the last IDR on, to prime a consumer
+    // that attaches mid-stream (see decodeLatest()). Any
+    // thread; false if there's no complete GOP cached.
+    bool gopSnapshot(GopSnapshot& out) const {
+        return m_pGopCache && m_pGopCache->snapshot(out);
+    }
+    // Drains and joins all stages. Idempotent.
+    void stop();
+    void printStageStats(int sessionId);
+    // Have every frame's first scaled() call build this
+    // level too (see DecodedFrame::scaled()). Any thread.
+    void subscribePyramid(const PyramidLevel& l) { m_pConvPools->subscribe(l); }
+    // Decoded YUV frames of this stream, see FrameRing.
+    const FrameRing& frames() const { return m_ring; }
+    uint64_t framesDecoded() const { return m_ring.latestSeq(); }
+    // Same thread as process(), or after stop().
+    uint64_t ausIn() const { return m_ausIn; }
     ~StreamDecoder();
 };
+
+// Threading and delay settings of a DecodeProfile, on an
+// H.264 decoder context before avcodec_open2(). pAvc: the
+// stream's sequence header if known, low delay output is
+// only forced for profiles without B-frames (baseline),
+// otherwise frames could come out of order. Shared with
+// decode_bench so it measures what sessions run.
+void applyDecodeProfile(AVCodecContext* pCtx,
+                        DecodeProfile profile,
+                        const h264::AVCConfig* pAvc);
 #endif
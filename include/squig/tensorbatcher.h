@@ -0,0 +1,162 @@
+#ifndef TENSORBATCHER_H
+#define TENSORBATCHER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "squig/decodedframe.h"
+#include "squig/latencyhistogram.h"
+
+// Shape and element format of one image in a batch.
+enum class TensorLayout { kNCHW, kNHWC };
+enum class TensorType { kU8, kF32 };
+
+struct TensorSpec {
+    int width = 640;
+    int height = 640;
+    TensorLayout layout = TensorLayout::kNCHW;
+    TensorType type = TensorType::kF32;
+    bool rgb = true;  // channel order, most models want RGB
+    // kF32 only: (v / 255 - mean[c]) / std[c], in channel order
+    float mean[3] = {0, 0, 0};
+    float std[3] = {1, 1, 1};
+
+    size_t bytesPerImage() const {
+        return size_t(width) * height * 3 * (type == TensorType::kF32 ? 4 : 1);
+    }
+};
+
+// What is in slot i of a batch.
+struct BatchSlotInfo {
+    int streamId{};
+    int64_t pts{};         // ms
+    uint64_t seq{};        // the stream's frame seq
+    uint64_t arrivalUs{};  // of the frame's AU, for latency accounting
+};
+
+// Collects the newest frame of many streams into batches
+// for one inference worker: sessions offer() frames (each
+// stream keeps at most one pending, a newer frame replaces
+// it), the worker's next() returns as soon as maxBatch
+// streams have one pending, or the deadline after the
+// oldest pending frame has passed, whichever is first.
+//
+// Each batch is written, resized (stretched, no letterbox)
+// and normalized, into one contiguous preallocated buffer,
+// images split across ParallelFor::shared(). Images are
+// resized from the smallest pyramid level (see
+// DecodedFrame::scaled()) that is still at least the
+// target size, so a 1080p stream feeding a 640x640 model
+// never converts its full-res frame.
+//
+// Buffers are leased: the worker holds a Batch while the
+// engine reads it, there are `buffers` of them so the next
+// batch can be filled meanwhile. The batch buffers are
+// allocated once, at construction; filling them can still
+// allocate on the way: the pyramid level or BGR frame an
+// image is resized from comes from its stream's pools
+// (allocated on first use or a size change), and the F32
+// layouts resize through a per-thread scratch image.
+class TensorBatcher {
+   public:
+    class Batch;
+
+   private:
+    struct Buffer {
+        std::unique_ptr<uint8_t, void (*)(void*)> data{nullptr, nullptr};
+        std::vector<BatchSlotInfo> slots;
+        size_t count{};
+        bool leased = false;
+    };
+    struct Pending {
+        int streamId;
+        FrameHandle frame;
+        uint64_t offeredUs;
+    };
+
+    const TensorSpec m_spec;
+    const size_t m_maxBatch;
+    const uint64_t m_deadlineUs;
+    // F32: v * m_mul[c] + m_add[c], in output channel order
+    float m_mul[3], m_add[3];
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::vector<Pending> m_pending;  // in offer order
+    std::vector<Buffer> m_buffers;
+    bool m_closed = false;
+    // the batch being filled, next() only
+    std::vector<Pending> m_taking;
+
+    uint64_t m_offered{};
+    uint64_t m_replaced{};  // pending frames superseded before batching
+    uint64_t m_batches{};
+    uint64_t m_images{};
+    LatencyHistogram m_fillUs;  // per batch
+    LatencyHistogram m_waitUs;  // offer -> batch, per image
+
+    void fillSlot(const Pending& p, uint8_t* dst) const;
+    void release(size_t buf);
+
+   public:
+    // A leased batch buffer, returned on destruction.
+    class Batch {
+       private:
+        TensorBatcher* m_pOwner = nullptr;
+        size_t m_buf{};
+        friend class TensorBatcher;
+
+       public:
+        Batch() = default;
+        Batch(Batch&& o) noexcept { *this = std::move(o); }
+        Batch& operator=(Batch&& o) noexcept;
+        ~Batch() { reset(); }
+        void reset();
+
+        explicit operator bool() const { return m_pOwner != nullptr; }
+        // images in the batch, <= maxBatch
+        size_t size() const;
+        // size() images, spec().bytesPerImage() apart
+        const void* data() const;
+        size_t bytes() const;
+        const BatchSlotInfo& slot(size_t i) const;
+    };
+
+    TensorBatcher(const TensorSpec& spec,
+                  size_t maxBatch,
+                  std::chrono::microseconds deadline,
+                  size_t buffers = 2);
+    TensorBatcher(const TensorBatcher&) = delete;
+    TensorBatcher& operator=(const TensorBatcher&) = delete;
+
+    // Any thread (e.g. a session's sink stage). Never blocks
+    // on the worker, only on the short pending list lock.
+    void offer(int streamId, const FrameHandle& f);
+    // Worker thread: waits up to timeout for a batch to be
+    // due and a buffer to be free, then fills it. false on
+    // timeout, or once closed and drained.
+    bool next(Batch& out, std::chrono::milliseconds timeout);
+    // Wakes next(), pending frames are still handed out.
+    void close();
+    bool closed();
+
+    const TensorSpec& spec() const { return m_spec; }
+    size_t maxBatch() const { return m_maxBatch; }
+    // "12000 images in 3000 batches (4.0/batch), fill p50 ..."
+    std::string summary();
+};
+
+// "WxH:N[@MS]": model input size, images per batch and the
+// deadline in ms (deadlineMs is left alone if not given).
+bool parseBatchSpec(const std::string& spec,
+                    TensorSpec& tensor,
+                    size_t& maxBatch,
+                    int& deadlineMs);
+#endif
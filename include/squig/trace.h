@@ -0,0 +1,81 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "squig/utils.hpp"
+
+// Per-frame, per-stage tracing.
+//
+// Every thread records into its own fixed-size ring of
+// events (no locks, no allocation after the first event),
+// each event is a named span tagged with the id of the
+// frame it worked on: the frame's RTMP presentation
+// timestamp (ms), so one frame can be followed from the
+// socket read through decode, conversion and display.
+// dumpChrome() writes all rings as Chrome trace JSON, which
+// chrome://tracing and ui.perfetto.dev both open.
+//
+// Built with SQUIG_ENABLE_TRACING=OFF (the default),
+// Scope is an empty type and every call compiles away.
+//
+//   trace::Scope span("send_packet", frameId);
+namespace trace {
+
+// Frame id for spans that aren't about one frame.
+inline constexpr int64_t kNoFrame = -1;
+
+#ifdef SQUIG_TRACING
+// Records a finished span on the calling thread.
+void record(const char* name, uint64_t beginUs, uint64_t endUs, int64_t frameId);
+// Label for the calling thread's events (e.g. "sq-dec-2").
+void nameThread(const char* name);
+
+// name must be a string literal (or otherwise outlive the
+// trace), only the pointer is stored.
+class Scope {
+   private:
+    const char* m_name;
+    int64_t m_frameId;
+    uint64_t m_beginUs;
+
+   public:
+    explicit Scope(const char* name, int64_t frameId = kNoFrame)
+        : m_name(name), m_frameId(frameId), m_beginUs(utils::nowUs()) {}
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+    ~Scope() { record(m_name, m_beginUs, utils::nowUs(), m_frameId); }
+
+    // For spans that only learn their frame on the way,
+    // e.g. a socket read.
+    void setFrame(int64_t frameId) { m_frameId = frameId; }
+};
+#else
+inline void record(const char*, uint64_t, uint64_t, int64_t) {}
+inline void nameThread(const char*) {}
+
+class Scope {
+   public:
+    explicit Scope(const char*, int64_t = kNoFrame) {}
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+    void setFrame(int64_t) {}
+};
+#endif
+
+constexpr bool enabled() {
+#ifdef SQUIG_TRACING
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Writes every thread's retained events to path as Chrome
+// trace JSON. May run while the threads keep recording;
+// events overwritten during the dump are left out.
+// Returns false if tracing is compiled out or the file
+// can't be written.
+bool dumpChrome(const char* path);
+}  // namespace trace
+#endif
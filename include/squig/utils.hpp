@@ -2,18 +2,35 @@
 #define UTILS_H_
 
 #include <cctype>   //std::isprint
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
 #include <iomanip>  // std::hex
 #include <iostream>
 #include <vector>
 namespace utils {
 // modern c++ inline usage: bypass the ODR.
-inline uint64_t nowMs() {
+// Monotonic, in microseconds.
+inline uint64_t nowUs() {
     using clock = std::chrono::steady_clock;
     return std::chrono::duration_cast<std::chrono::microseconds>(
                clock::now().time_since_epoch())
         .count();
 }
 
+// The whole of s, a decimal number <= max. strtoul alone
+// takes "12abc" as 12 and "abc" (or "-1") as something.
+inline bool parseUInt(const char* s, unsigned long max, unsigned long& out) {
+    char* end = nullptr;
+    errno = 0;
+    unsigned long v = std::strtoul(s, &end, 10);
+    if (*s == '-' || end == s || *end != '\0' || errno == ERANGE || v > max) {
+        return false;
+    }
+    out = v;
+    return true;
+}
+
 inline void printHexDump(const std::vector<char>& buffer) {
     std::ios::fmtflags original_flags = std::cout.flags();
     char original_fill = std::cout.fill();
@@ -0,0 +1,73 @@
+#ifndef YUVCONVERT_H
+#define YUVCONVERT_H
+
+#include <stdint.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+class ParallelFor;
+
+// Dedicated planar YUV 4:2:0 -> packed 24 bit RGB conversion.
+// Replaces a same-size sws_scale (which runs a full
+// scaler just to convert colours).
+//
+// 8.4 fixed point: the luma/chroma terms are computed at
+// 16x precision with rounding multiplies (pmulhrsw), the
+// scalar path mirrors the SIMD arithmetic exactly, so all
+// levels produce bit-identical output.
+namespace yuv {
+
+enum class Matrix { kBT601, kBT709 };
+
+struct ColorParams {
+    Matrix matrix = Matrix::kBT601;
+    bool fullRange = false;
+};
+
+// From the AVFrame colorspace tags. Untagged streams
+// follow the usual player convention: BT.709 for HD,
+// BT.601 for SD.
+ColorParams colorParamsOf(const AVFrame* f);
+
+enum class SimdLevel { kScalar, kSSE41, kAVX2 };
+// Best level the running CPU supports.
+SimdLevel detectSimd();
+const char* simdName(SimdLevel level);
+
+// Byte order of the packed output.
+enum class Order { kBGR, kRGB };
+
+struct Planes {
+    const uint8_t* data[3];
+    int stride[3];
+    int width;
+    int height;
+};
+
+// Converts rows [rowBegin, rowEnd) of src into dst
+// (dst points at row 0). Building block for frame level
+// conversion and for fused multi-pass kernels.
+void convertRows(const Planes& src,
+                 int rowBegin,
+                 int rowEnd,
+                 uint8_t* dst,
+                 int dstStride,
+                 const ColorParams& cp,
+                 Order order = Order::kBGR,
+                 SimdLevel level = detectSimd());
+
+// Whole frame, split by rows across pWorkers if given.
+// src must be AV_PIX_FMT_YUV420P or AV_PIX_FMT_YUVJ420P.
+void convertFrame(const AVFrame* src,
+                  uint8_t* dst,
+                  int dstStride,
+                  ParallelFor* pWorkers = nullptr,
+                  Order order = Order::kBGR,
+                  SimdLevel level = detectSimd());
+
+bool isSupported(int avPixFmt);
+
+}  // namespace yuv
+#endif
@@ -0,0 +1,296 @@
+#include "squig/decodedframe.h"
+
+#include <cstring>
+
+#include <opencv2/imgproc.hpp>
+
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+#include "squig/parallelfor.h"
+#include "squig/pyramid.h"
+#include "squig/trace.h"
+#include "squig/yuvconvert.h"
+
+namespace {
+cv::Mat planeView(const AVFrame* f, int plane, int rows, int cols) {
+    return cv::Mat(rows, cols, CV_8UC1, f->data[plane], f->linesize[plane]);
+}
+
+// Rare path (non 4:2:0 sources), a one-shot context is fine.
+void swsConvert(const AVFrame* src, AVFrame* dst) {
+    SwsContext* ctx = sws_getContext(src->width,
+                                     src->height,
+                                     (AVPixelFormat)src->format,
+                                     dst->width,
+                                     dst->height,
+                                     (AVPixelFormat)dst->format,
+                                     SWS_POINT,  // no scaling
+                                     NULL,
+                                     NULL,
+                                     NULL);
+    sws_scale(ctx,
+              (const uint8_t* const*)src->data,
+              src->linesize,
+              0,
+              src->height,
+              dst->data,
+              dst->linesize);
+    sws_freeContext(ctx);
+}
+
+void yuv420ToNV12(const AVFrame* src, AVFrame* dst) {
+    for (int y = 0; y < src->height; y++) {
+        memcpy(dst->data[0] + (size_t)y * dst->linesize[0],
+               src->data[0] + (size_t)y * src->linesize[0],
+               src->width);
+    }
+    int cw = (src->width + 1) / 2;
+    for (int y = 0; y < (src->height + 1) / 2; y++) {
+        const uint8_t* u = src->data[1] + (size_t)y * src->linesize[1];
+        const uint8_t* v = src->data[2] + (size_t)y * src->linesize[2];
+        uint8_t* uv = dst->data[1] + (size_t)y * dst->linesize[1];
+        for (int x = 0; x < cw; x++) {
+            uv[2 * x] = u[x];
+            uv[2 * x + 1] = v[x];
+        }
+    }
+}
+}  // namespace
+
+DecodedFrame::~DecodedFrame() {
+    FrameShells& shells = m_pPools->shells;
+    for (auto& c : m_converted) {
+        shells.putFrame(c.pFrame.load());
+    }
+    for (AVFrame* f : m_pPyramid) {
+        shells.putFrame(f);
+    }
+    shells.putFrame(m_pFrame);
+}
+
+std::shared_ptr<const DecodedFrame> DecodedFrame::create(
+    AVFrame* pFrame,
+    uint64_t seq,
+    uint64_t arrivalUs,
+    const std::shared_ptr<ConversionPools>& pPools,
+    float motion,
+    uint64_t captureUs) {
+    // aliasing: the allocator keeps the whole ConversionPools alive
+    FrameShells::Allocator<DecodedFrame> alloc(
+        std::shared_ptr<FrameShells>(pPools, &pPools->shells));
+    return std::allocate_shared<DecodedFrame>(alloc, pFrame, seq, arrivalUs,
+                                              pPools, motion, captureUs);
+}
+
+cv::Mat DecodedFrame::yPlane() const {
+    return planeView(m_pFrame, 0, height(), width());
+}
+
+cv::Mat DecodedFrame::uPlane() const {
+    return planeView(m_pFrame, 1, (height() + 1) / 2, (width() + 1) / 2);
+}
+
+cv::Mat DecodedFrame::vPlane() const {
+    return planeView(m_pFrame, 2, (height() + 1) / 2, (width() + 1) / 2);
+}
+
+AVFrame* DecodedFrame::convert(ConvertedFormat fmt) const {
+    static constexpr const char* kSpanNames[] = {
+        "convert_bgr", "convert_rgb", "convert_nv12"};
+    trace::Scope span(kSpanNames[static_cast<int>(fmt)], pts());
+    AVFrame* out = m_pPools->shells.getFrame();
+    if (!out) {
+        return nullptr;
+    }
+    out->width = width();
+    out->height = height();
+    bool fast = yuv::isSupported(m_pFrame->format);
+
+    if (fmt == ConvertedFormat::kNV12) {
+        out->format = AV_PIX_FMT_NV12;
+        if (m_pPools->nv12.get(out) < 0) {
+            m_pPools->shells.putFrame(out);
+            return nullptr;
+        }
+        if (fast) {
+            yuv420ToNV12(m_pFrame, out);
+        } else {
+            swsConvert(m_pFrame, out);
+        }
+        return out;
+    }
+
+    // BGR and RGB share a pool, only the byte order differs
+    out->format = AV_PIX_FMT_BGR24;
+    if (m_pPools->packed.get(out) < 0) {
+        m_pPools->shells.putFrame(out);
+        return nullptr;
+    }
+    bool rgb = fmt == ConvertedFormat::kRGB24;
+    if (rgb) {
+        out->format = AV_PIX_FMT_RGB24;
+    }
+    if (fast) {
+        yuv::convertFrame(m_pFrame,
+                          out->data[0],
+                          out->linesize[0],
+                          &ParallelFor::shared(),
+                          rgb ? yuv::Order::kRGB : yuv::Order::kBGR);
+    } else {
+        swsConvert(m_pFrame, out);
+    }
+    return out;
+}
+
+const AVFrame* DecodedFrame::converted(ConvertedFormat fmt) const {
+    Converted& c = m_converted[static_cast<int>(fmt)];
+    std::call_once(c.once, [&] { c.pFrame = convert(fmt); });
+    return c.pFrame;
+}
+
+bool DecodedFrame::isConverted(ConvertedFormat fmt) const {
+    return m_converted[static_cast<int>(fmt)].pFrame != nullptr;
+}
+
+cv::Mat DecodedFrame::bgr() const {
+    const AVFrame* f = converted(ConvertedFormat::kBGR24);
+    if (!f) {
+        return cv::Mat();
+    }
+    return cv::Mat(f->height, f->width, CV_8UC3, f->data[0], f->linesize[0]);
+}
+
+cv::Mat DecodedFrame::rgb() const {
+    const AVFrame* f = converted(ConvertedFormat::kRGB24);
+    if (!f) {
+        return cv::Mat();
+    }
+    return cv::Mat(f->height, f->width, CV_8UC3, f->data[0], f->linesize[0]);
+}
+
+cv::Mat DecodedFrame::nv12() const {
+    const AVFrame* f = converted(ConvertedFormat::kNV12);
+    if (!f) {
+        return cv::Mat();
+    }
+    // the pool lays the UV plane out right after Y, same stride
+    return cv::Mat(f->height + (f->height + 1) / 2,
+                   f->width,
+                   CV_8UC1,
+                   f->data[0],
+                   f->linesize[0]);
+}
+
+void DecodedFrame::buildLevels(uint32_t mask, AVFrame* pBGROut) const {
+    static constexpr AVPixelFormat kFormats[] = {
+        AV_PIX_FMT_BGR24, AV_PIX_FMT_RGB24, AV_PIX_FMT_GRAY8};
+    bool fast = yuv::isSupported(m_pFrame->format);
+    pyramid::Targets t;
+    for (size_t i = 0; i < kPyramidLevels; i++) {
+        int div = i % 2 ? 4 : 2;
+        if (!(mask & (1u << i)) || m_pPyramid[i] || width() / div == 0 ||
+            height() / div == 0) {
+            continue;
+        }
+        AVFrame* out = m_pPools->shells.getFrame();
+        if (!out) {
+            continue;
+        }
+        out->format = kFormats[i / 2];
+        out->width = width() / div;
+        out->height = height() / div;
+        if (m_pPools->pyramid[i].pool.get(out) < 0) {
+            m_pPools->shells.putFrame(out);
+            continue;  // stays empty, see scaled()
+        }
+        m_pPyramid[i] = out;
+        if (!fast && out->format != AV_PIX_FMT_GRAY8) {
+            // Rare path (non 4:2:0 sources), from sws' BGR
+            const AVFrame* f = converted(ConvertedFormat::kBGR24);
+            if (!f) {
+                continue;
+            }
+            cv::Mat bgr(f->height, f->width, CV_8UC3, f->data[0], f->linesize[0]);
+            cv::Mat dst(out->height, out->width, CV_8UC3, out->data[0],
+                        out->linesize[0]);
+            cv::resize(bgr, dst, dst.size(), 0, 0, cv::INTER_AREA);
+            if (out->format == AV_PIX_FMT_RGB24) {
+                cv::cvtColor(dst, dst, cv::COLOR_BGR2RGB);
+            }
+            continue;
+        }
+        t.data[i] = out->data[0];
+        t.stride[i] = out->linesize[0];
+    }
+    if (pBGROut) {
+        t.bgr = pBGROut->data[0];
+        t.bgrStride = pBGROut->linesize[0];
+    }
+    trace::Scope span("pyramid", pts());
+    pyramid::build(m_pFrame, t, &ParallelFor::shared());
+}
+
+cv::Mat DecodedFrame::scaled(PyramidFormat fmt, int div) const {
+    if (div != 2 && div != 4) {
+        return cv::Mat();
+    }
+    size_t i = PyramidLevel{fmt, div}.index();
+    std::lock_guard<std::mutex> lk(m_pyramidLock);
+    if (!m_pPyramid[i]) {
+        uint32_t subs = m_pPools->pyramidSubs.load(std::memory_order_relaxed);
+        buildLevels(subs | (1u << i), nullptr);
+    }
+    const AVFrame* f = m_pPyramid[i];
+    if (!f) {
+        return cv::Mat();
+    }
+    return cv::Mat(f->height, f->width, fmt == PyramidFormat::kGray ? CV_8UC1 : CV_8UC3,
+                   f->data[0], f->linesize[0]);
+}
+
+bool DecodedFrame::buildPyramid(bool withBGR) const {
+    uint32_t subs = m_pPools->pyramidSubs.load(std::memory_order_relaxed);
+    if (withBGR && yuv::isSupported(m_pFrame->format)) {
+        // full-res BGR is converted strip by strip inside the
+        // pyramid pass, the levels are reduced from it while
+        // it's still in cache
+        Converted& c = m_converted[int(ConvertedFormat::kBGR24)];
+        bool fused = false;
+        std::call_once(c.once, [&] {
+            AVFrame* out = m_pPools->shells.getFrame();
+            if (!out) {
+                return;
+            }
+            out->format = AV_PIX_FMT_BGR24;
+            out->width = width();
+            out->height = height();
+            if (m_pPools->packed.get(out) < 0) {
+                // no BGR, the levels are still built below
+                m_pPools->shells.putFrame(out);
+                return;
+            }
+            std::lock_guard<std::mutex> lk(m_pyramidLock);
+            buildLevels(subs, out);
+            c.pFrame = out;
+            fused = true;
+        });
+        if (fused) {
+            return true;
+        }
+    } else if (withBGR) {
+        converted(ConvertedFormat::kBGR24);
+    }
+    std::lock_guard<std::mutex> lk(m_pyramidLock);
+    buildLevels(subs, nullptr);
+    return !withBGR || isConverted(ConvertedFormat::kBGR24);
+}
+
+bool DecodedFrame::isScaled(PyramidFormat fmt, int div) const {
+    if (div != 2 && div != 4) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lk(m_pyramidLock);
+    return m_pPyramid[PyramidLevel{fmt, div}.index()] != nullptr;
+}
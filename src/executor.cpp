@@ -0,0 +1,267 @@
+#include "squig/executor.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "squig/trace.h"
+#include "squig/utils.hpp"
+
+namespace {
+// The executor and worker the calling thread is, if any.
+thread_local const Executor* tExecutor = nullptr;
+thread_local size_t tWorker = 0;
+
+constexpr size_t kInitialRing = 64;
+
+bool parseCpuList(const std::string& list, std::vector<int>& cpus) {
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int first, last;
+        char dash;
+        std::stringstream is(item);
+        if (!(is >> first) || first < 0) {
+            return false;
+        }
+        last = first;
+        if (is >> dash && (dash != '-' || !(is >> last) || last < first)) {
+            return false;
+        }
+        for (int c = first; c <= last; c++) {
+            cpus.push_back(c);
+        }
+    }
+    return true;
+}
+}  // namespace
+
+bool parseCpuSpec(const std::string& spec, std::vector<int>& cpus) {
+    std::vector<int> out;
+    if (spec.rfind("node", 0) == 0) {
+        std::ifstream in("/sys/devices/system/node/" + spec + "/cpulist");
+        std::string list;
+        if (!std::getline(in, list) || !parseCpuList(list, out)) {
+            return false;
+        }
+    } else if (!parseCpuList(spec, out)) {
+        return false;
+    }
+    if (out.empty()) {
+        return false;
+    }
+    cpus = std::move(out);
+    return true;
+}
+
+Strand::Strand(Executor& exec, TaskPriority priority, std::function<bool()> body)
+    : m_exec(exec),
+      m_priority(priority),
+      m_home(exec.nextHome()),
+      m_body(std::move(body)) {}
+
+void Strand::notify() {
+    // only the notify that finds the strand idle queues it,
+    // a queued or running one will see the others' work
+    if (m_pending.fetch_add(1, std::memory_order_acq_rel) == 0) {
+        m_exec.schedule(this);
+    }
+}
+
+void Strand::run() {
+    uint32_t seen = m_pending.load(std::memory_order_acquire);
+    if (m_body()) {
+        // yielded, stay pending (>= 1) and go to the back
+        m_pending.fetch_sub(seen - 1, std::memory_order_acq_rel);
+        m_exec.schedule(this);
+        return;
+    }
+    // under the lock so waitIdle() can't return (and the
+    // strand be destroyed) before we're done with it
+    std::lock_guard<std::mutex> lk(m_idleLock);
+    if (m_pending.fetch_sub(seen, std::memory_order_acq_rel) != seen) {
+        // notified while running, the body may have missed it
+        m_exec.schedule(this);
+        return;
+    }
+    m_idle.notify_all();
+}
+
+void Strand::waitIdle() {
+    std::unique_lock<std::mutex> lk(m_idleLock);
+    m_idle.wait(lk, [&] { return m_pending.load(std::memory_order_acquire) == 0; });
+}
+
+Executor::Executor(const ExecutorConfig& config) {
+    size_t n = config.threads;
+    if (n == 0) {
+        n = config.cpus.empty() ? std::max(1u, std::thread::hardware_concurrency())
+                                : config.cpus.size();
+    }
+    for (size_t i = 0; i < n; i++) {
+        auto pWorker = std::make_unique<Worker>();
+        for (auto& r : pWorker->ring) {
+            r.resize(kInitialRing);
+        }
+        if (!config.cpus.empty()) {
+            pWorker->cpu = config.cpus[i % config.cpus.size()];
+        }
+        m_workers.push_back(std::move(pWorker));
+    }
+    // all workers exist before any can steal from them
+    for (size_t i = 0; i < n; i++) {
+        m_workers[i]->thread = std::thread(&Executor::workerLoop, this, i);
+    }
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> lk(m_sleepLock);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    for (auto& w : m_workers) {
+        w->thread.join();
+    }
+}
+
+void Executor::schedule(Strand* s) {
+    size_t p = size_t(s->m_priority);
+    Worker& w = *m_workers[tExecutor == this ? tWorker : s->m_home];
+    {
+        std::lock_guard<std::mutex> lk(w.lock);
+        std::vector<Strand*>& ring = w.ring[p];
+        if (w.count[p] == ring.size()) {
+            // unroll to head 0, then double
+            std::rotate(ring.begin(), ring.begin() + w.head[p], ring.end());
+            w.head[p] = 0;
+            ring.resize(ring.size() * 2);
+        }
+        ring[(w.head[p] + w.count[p]) % ring.size()] = s;
+        w.count[p]++;
+        w.maxDepth = std::max(w.maxDepth, w.count[0] + w.count[1]);
+    }
+    m_queued.fetch_add(1);
+    if (m_sleepers.load() > 0) {
+        std::lock_guard<std::mutex> lk(m_sleepLock);
+        m_wake.notify_one();
+    }
+}
+
+Strand* Executor::take(size_t self, bool& stolen) {
+    size_t n = m_workers.size();
+    for (size_t p = 0; p < kTaskPriorities; p++) {
+        // own queue from the front (oldest first), then the
+        // others' from the back
+        for (size_t k = 0; k < n; k++) {
+            Worker& w = *m_workers[(self + k) % n];
+            std::lock_guard<std::mutex> lk(w.lock);
+            if (w.count[p] == 0) {
+                continue;
+            }
+            std::vector<Strand*>& ring = w.ring[p];
+            Strand* s;
+            if (k == 0) {
+                s = ring[w.head[p]];
+                w.head[p] = (w.head[p] + 1) % ring.size();
+            } else {
+                s = ring[(w.head[p] + w.count[p] - 1) % ring.size()];
+            }
+            w.count[p]--;
+            m_queued.fetch_sub(1);
+            stolen = k != 0;
+            return s;
+        }
+    }
+    return nullptr;
+}
+
+void Executor::workerLoop(size_t self) {
+    Worker& w = *m_workers[self];
+    tExecutor = this;
+    tWorker = self;
+    char name[16];
+    snprintf(name, sizeof(name), "sq-exec-%zu", self);
+    pthread_setname_np(pthread_self(), name);
+    trace::nameThread(name);
+    {
+        // stats() reads these
+        std::lock_guard<std::mutex> lk(w.lock);
+        if (w.cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(w.cpu, &set);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+                fprintf(stderr, "executor: can't pin worker %zu to cpu %d\n", self,
+                        w.cpu);
+                w.cpu = -1;
+            }
+        }
+        w.startUs = utils::nowUs();
+    }
+
+    while (true) {
+        bool stolen = false;
+        Strand* s = take(self, stolen);
+        if (!s) {
+            std::unique_lock<std::mutex> lk(m_sleepLock);
+            m_sleepers.fetch_add(1);
+            m_wake.wait(lk, [&] { return m_stopping || m_queued.load() > 0; });
+            m_sleepers.fetch_sub(1);
+            if (m_stopping) {
+                return;
+            }
+            continue;
+        }
+        uint64_t t0 = utils::nowUs();
+        s->run();  // may be gone once this returns
+        w.busyUs.fetch_add(utils::nowUs() - t0, std::memory_order_relaxed);
+        w.runs.fetch_add(1, std::memory_order_relaxed);
+        if (stolen) {
+            w.steals.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+std::vector<WorkerStats> Executor::stats() const {
+    std::vector<WorkerStats> out;
+    uint64_t now = utils::nowUs();
+    for (const auto& pWorker : m_workers) {
+        Worker& w = *pWorker;
+        WorkerStats s;
+        s.runs = w.runs.load(std::memory_order_relaxed);
+        s.steals = w.steals.load(std::memory_order_relaxed);
+        s.busyUs = w.busyUs.load(std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lk(w.lock);
+            s.cpu = w.cpu;
+            s.upUs = w.startUs ? now - w.startUs : 0;
+            for (size_t p = 0; p < kTaskPriorities; p++) {
+                s.depth[p] = w.count[p];
+            }
+            s.maxDepth = w.maxDepth;
+        }
+        out.push_back(s);
+    }
+    return out;
+}
+
+std::string Executor::summary() const {
+    std::ostringstream os;
+    std::vector<WorkerStats> all = stats();
+    for (size_t i = 0; i < all.size(); i++) {
+        const WorkerStats& s = all[i];
+        os << "worker " << i;
+        if (s.cpu >= 0) {
+            os << " (cpu " << s.cpu << ")";
+        }
+        os << ": " << (s.upUs ? 100 * s.busyUs / s.upUs : 0) << "% busy, "
+           << s.runs << " runs, " << s.steals << " stolen, depth " << s.depth[0]
+           << "+" << s.depth[1] << " (max " << s.maxDepth << ")\n";
+    }
+    return os.str();
+}
@@ -0,0 +1,87 @@
+#include "squig/flvreader.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+constexpr uint8_t kCodecAVC = 7;
+
+uint32_t be24(const uint8_t* p) {
+    return uint32_t(p[0]) << 16 | uint32_t(p[1]) << 8 | p[2];
+}
+
+// AMF0 number following the property name key, e.g. "width".
+bool amfNumber(const std::vector<uint8_t>& d, const char* key, double& out) {
+    // u16 name length, name, number marker (0x00), 8 byte double
+    size_t n = strlen(key);
+    for (size_t i = 0; i + 2 + n + 9 <= d.size(); i++) {
+        if (d[i] != 0 || d[i + 1] != n || memcmp(&d[i + 2], key, n) != 0 ||
+            d[i + 2 + n] != 0x00) {
+            continue;
+        }
+        uint64_t bits = 0;
+        for (size_t b = 0; b < 8; b++) {
+            bits = bits << 8 | d[i + 3 + n + b];
+        }
+        memcpy(&out, &bits, sizeof(out));
+        return true;
+    }
+    return false;
+}
+}  // namespace
+
+FlvReader::FlvReader(const std::string& path) : m_in(path, std::ios::binary) {
+    uint8_t hdr[9];
+    if (!m_in.read(reinterpret_cast<char*>(hdr), sizeof(hdr)) ||
+        memcmp(hdr, "FLV", 3) != 0) {
+        throw std::runtime_error(path + ": not an FLV file");
+    }
+    uint32_t dataOffset = uint32_t(hdr[5]) << 24 | be24(hdr + 6);
+    // skip any extra header bytes and PreviousTagSize0
+    m_in.seekg(dataOffset + 4);
+}
+
+bool FlvReader::next(FlvTag& tag) {
+    uint8_t hdr[11];
+    if (!m_in.read(reinterpret_cast<char*>(hdr), sizeof(hdr))) {
+        return false;
+    }
+    tag.type = hdr[0] & 0x1f;
+    uint32_t size = be24(hdr + 1);
+    // 24 bit timestamp plus an extension byte on top
+    tag.timestampMs = be24(hdr + 4) | uint32_t(hdr[7]) << 24;
+    tag.data.resize(size);
+    if (!m_in.read(reinterpret_cast<char*>(tag.data.data()), size)) {
+        return false;
+    }
+    // PreviousTagSize
+    m_in.ignore(4);
+    return true;
+}
+
+bool flvVideoToMessage(const FlvTag& tag, librtmp::RTMPMediaMessage& m) {
+    const auto& d = tag.data;
+    if (tag.type != FlvTag::kVideo || d.size() < 5 || (d[0] & 0x0f) != kCodecAVC) {
+        return false;
+    }
+    m.message_type = librtmp::RTMPMessageType::VIDEO;
+    m.timestamp = tag.timestampMs;
+    m.video.d.frame_type = d[0] >> 4;
+    m.video.d.avc_packet_type = d[1];
+    // signed 24 bit
+    int32_t cts = static_cast<int32_t>(be24(&d[2]) << 8) >> 8;
+    m.video.d.composition_time = cts;
+    m.video.video_data_send.assign(d.begin() + 5, d.end());
+    return true;
+}
+
+bool flvMetaDimensions(const FlvTag& tag, int& width, int& height) {
+    double w, h;
+    if (tag.type != FlvTag::kScript || !amfNumber(tag.data, "width", w) ||
+        !amfNumber(tag.data, "height", h)) {
+        return false;
+    }
+    width = static_cast<int>(w);
+    height = static_cast<int>(h);
+    return true;
+}
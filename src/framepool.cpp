@@ -0,0 +1,189 @@
+#include "squig/framepool.h"
+
+#include <vector>
+
+namespace {
+int alignUp(int v, int a) { return (v + a - 1) / a * a; }
+}  // namespace
+
+FramePool::~FramePool() {
+    // outstanding buffers keep the pool alive until they are unref'd
+    av_buffer_pool_uninit(&m_pPool);
+}
+
+void FramePool::reset(AVPixelFormat fmt, int width, int height) {
+    m_fmt = fmt;
+    m_width = width;
+    m_height = height;
+
+    // One buffer per frame holding all planes, every row
+    // starts kAlign aligned so SIMD kernels can use aligned
+    // loads and the decoder's edge emulation is happy.
+    int lines[4]{};
+    av_image_fill_linesizes(m_linesize, fmt, alignUp(width, kAlign));
+    for (int i = 0; i < 4; i++) {
+        m_linesize[i] = alignUp(m_linesize[i], kAlign);
+    }
+    // plane heights: chroma planes of 4:2:0 are half height
+    lines[0] = height;
+    lines[1] = lines[2] = (fmt == AV_PIX_FMT_YUV420P ||
+                           fmt == AV_PIX_FMT_YUVJ420P ||
+                           fmt == AV_PIX_FMT_NV12)
+                              ? (height + 1) / 2
+                              : height;
+    lines[3] = height;
+    size_t offset = 0;
+    for (int i = 0; i < 4; i++) {
+        m_planeOffset[i] = offset;
+        offset += static_cast<size_t>(m_linesize[i]) * lines[i];
+    }
+    size_t bufSize = offset + kAlign;  // overread slack for SIMD tails
+    if (m_pPool && bufSize <= m_bufSize) {
+        // A stream that switched to a smaller size (or back
+        // to one it had): the buffers are big enough, only
+        // the layout above changes. Frames already out keep
+        // their own data pointers.
+        m_reuses++;
+        return;
+    }
+    av_buffer_pool_uninit(&m_pPool);
+    m_bufSize = bufSize;
+
+    if (m_pExport && m_pExport->configure(m_bufSize)) {
+        m_pPool = av_buffer_pool_init2(m_bufSize, m_pExport,
+                                       &ShmFrameExport::allocBuffer, nullptr);
+    } else {
+        // not zeroed, whoever gets a buffer writes every
+        // byte of the picture
+        m_pPool = av_buffer_pool_init(m_bufSize, av_buffer_alloc);
+    }
+    m_reallocs++;
+
+    // warm the pool so the first frames don't hit malloc
+    std::vector<AVBufferRef*> warm;
+    for (size_t i = 0; i < m_prealloc; i++) {
+        warm.push_back(av_buffer_pool_get(m_pPool));
+    }
+    for (AVBufferRef* b : warm) {
+        av_buffer_unref(&b);
+    }
+}
+
+int FramePool::get(AVFrame* frame) {
+    AVPixelFormat fmt = static_cast<AVPixelFormat>(frame->format);
+    AVBufferRef* buf;
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (!m_pPool || fmt != m_fmt || frame->width != m_width ||
+            frame->height != m_height) {
+            reset(fmt, frame->width, frame->height);
+        }
+        buf = av_buffer_pool_get(m_pPool);
+        if (!buf) {
+            return AVERROR(ENOMEM);
+        }
+        if (m_pExport) {
+            m_pExport->onAcquire(buf);
+        }
+        for (int i = 0; i < 4; i++) {
+            frame->linesize[i] = m_linesize[i];
+            frame->data[i] = m_linesize[i] ? buf->data + m_planeOffset[i]
+                                           : nullptr;
+        }
+    }
+    frame->buf[0] = buf;
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+int FramePool::getBuffer2(AVCodecContext* ctx, AVFrame* frame, int flags) {
+    auto* pool = static_cast<FramePool*>(ctx->opaque);
+    if (!pool || (frame->format != AV_PIX_FMT_YUV420P &&
+                  frame->format != AV_PIX_FMT_YUVJ420P)) {
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+
+    // The decoder writes past the visible size (macroblock
+    // padding, edge emulation), allocate for the aligned size
+    // but hand back the frame with the real one.
+    int w = frame->width;
+    int h = frame->height;
+    int strideAlign[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(ctx, &w, &h, strideAlign);
+
+    int visibleW = frame->width;
+    int visibleH = frame->height;
+    frame->width = w;
+    frame->height = h;
+    int ret = pool->get(frame);
+    frame->width = visibleW;
+    frame->height = visibleH;
+    return ret;
+}
+
+FrameShells::FrameShells() {
+    // the idle lists never grow past this
+    m_frames.reserve(kMaxIdle);
+    m_blocks.reserve(kMaxIdle);
+}
+
+FrameShells::~FrameShells() {
+    for (AVFrame*& f : m_frames) {
+        av_frame_free(&f);
+    }
+    for (void* p : m_blocks) {
+        ::operator delete(p);
+    }
+}
+
+AVFrame* FrameShells::getFrame() {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (!m_frames.empty()) {
+            AVFrame* f = m_frames.back();
+            m_frames.pop_back();
+            return f;
+        }
+    }
+    return av_frame_alloc();
+}
+
+void FrameShells::putFrame(AVFrame* f) {
+    if (!f) {
+        return;
+    }
+    // back to defaults, as a new frame; drops the buffer
+    // references outside the lock
+    av_frame_unref(f);
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (m_frames.size() < kMaxIdle) {
+            m_frames.push_back(f);
+            return;
+        }
+    }
+    av_frame_free(&f);
+}
+
+void* FrameShells::getBlock() {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (!m_blocks.empty()) {
+            void* p = m_blocks.back();
+            m_blocks.pop_back();
+            return p;
+        }
+    }
+    return ::operator new(kBlockSize);
+}
+
+void FrameShells::putBlock(void* p) {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (m_blocks.size() < kMaxIdle) {
+            m_blocks.push_back(p);
+            return;
+        }
+    }
+    ::operator delete(p);
+}
@@ -0,0 +1,83 @@
+#include "squig/framering.h"
+
+#include <utility>
+
+namespace {
+bool moving(const FrameHandle& f, float minMotion) {
+    // < 0: not scored
+    return minMotion <= 0 || f->motion() < 0 || f->motion() >= minMotion;
+}
+}  // namespace
+
+void FrameRing::publish(FrameHandle f) {
+    uint64_t seq = f->seq();
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        // the overwritten handle is released outside the lock
+        // (its destructor may return a buffer to the pool)
+        std::swap(m_slots[seq % m_slots.size()], f);
+        m_latestSeq.store(seq, std::memory_order_release);
+    }
+    m_cv.notify_all();
+}
+
+void FrameRing::close() {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_closed = true;
+    }
+    m_cv.notify_all();
+}
+
+FrameHandle FrameRing::latest() const {
+    uint64_t seq = m_latestSeq.load(std::memory_order_acquire);
+    if (seq == 0) {
+        return nullptr;
+    }
+    return at(seq);
+}
+
+FrameHandle FrameRing::next(uint64_t& cursor, float minMotion) const {
+    // lock-free fast path for the common "nothing new" poll
+    if (m_latestSeq.load(std::memory_order_acquire) <= cursor) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lk(m_lock);
+    uint64_t seq = m_latestSeq.load(std::memory_order_relaxed);
+    cursor = seq;
+    const FrameHandle& f = m_slots[seq % m_slots.size()];
+    return moving(f, minMotion) ? f : nullptr;
+}
+
+FrameHandle FrameRing::waitNext(uint64_t& cursor,
+                                std::chrono::milliseconds timeout,
+                                float minMotion) const {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::unique_lock<std::mutex> lk(m_lock);
+    while (true) {
+        m_cv.wait_until(lk, deadline, [&] {
+            return m_closed ||
+                   m_latestSeq.load(std::memory_order_relaxed) > cursor;
+        });
+        uint64_t seq = m_latestSeq.load(std::memory_order_relaxed);
+        if (seq <= cursor) {
+            return nullptr;  // timed out, or closed
+        }
+        cursor = seq;
+        const FrameHandle& f = m_slots[seq % m_slots.size()];
+        if (moving(f, minMotion)) {
+            return f;
+        }
+        // static, wait for the next one (a closed ring
+        // has nothing newer, the wait returns at once)
+    }
+}
+
+FrameHandle FrameRing::at(uint64_t seq) const {
+    std::lock_guard<std::mutex> lk(m_lock);
+    const FrameHandle& f = m_slots[seq % m_slots.size()];
+    if (!f || f->seq() != seq) {
+        return nullptr;
+    }
+    return f;
+}
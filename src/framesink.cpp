@@ -0,0 +1,136 @@
+#include "squig/framesink.h"
+
+#include <iostream>
+
+#include <opencv2/core.hpp>
+#include <opencv2/highgui.hpp>
+
+#include "squig/mosaic.h"
+#include "squig/trace.h"
+
+DisplaySink::DisplaySink(int sessionId)
+    : m_windowName("Video Playback [" + std::to_string(sessionId) + "]") {}
+
+void DisplaySink::consume(const FrameHandle& f) {
+    // cached by the convert stage, no work here
+    cv::Mat img = f->bgr();
+    if (img.empty()) {
+        return;  // out of memory
+    }
+    {
+        trace::Scope span("imshow", f->pts());
+        cv::imshow(m_windowName, img);
+        m_windowShown = true;
+    }
+    // 1ms delay needed to allow OpenCV to draw.
+    {
+        trace::Scope span("waitKey", f->pts());
+        cv::waitKey(1);
+    }
+}
+
+void DisplaySink::finish() {
+    if (m_windowShown) {
+        cv::destroyWindow(m_windowName);
+        m_windowShown = false;
+    }
+}
+
+MosaicSink::MosaicSink(std::shared_ptr<Mosaic> pMosaic, int sessionId)
+    : m_pMosaic(std::move(pMosaic)), m_sessionId(sessionId) {
+    m_pMosaic->attach(m_sessionId);
+}
+
+void MosaicSink::consume(const FrameHandle& f) {
+    // just a handle swap, drawing is the render thread's
+    m_pMosaic->offer(m_sessionId, f);
+}
+
+void MosaicSink::finish() {
+    if (m_attached) {
+        m_pMosaic->detach(m_sessionId);
+        m_attached = false;
+    }
+}
+
+RawFileSink::RawFileSink(std::string dir, int sessionId, bool bgr)
+    : m_dir(std::move(dir)), m_sessionId(sessionId), m_bgr(bgr) {}
+
+void RawFileSink::open(int width, int height) {
+    close();
+    m_width = width;
+    m_height = height;
+    std::string path = m_dir + "/squig-s" + std::to_string(m_sessionId) + "-" +
+                       std::to_string(width) + "x" + std::to_string(height) +
+                       (m_bgr ? ".bgr" : ".yuv");
+    // append: a new decoder (new AVCC header) at the same
+    // resolution continues the same file.
+    m_pFile = fopen(path.c_str(), "ab");
+    if (!m_pFile) {
+        std::cerr << "[Session " << m_sessionId << "] can't open " << path
+                  << "\n";
+        return;
+    }
+    // a 1080p frame is 3-6MB, write it in few syscalls
+    setvbuf(m_pFile, nullptr, _IOFBF, 4 << 20);
+    std::cout << "[Session " << m_sessionId << "] dumping to " << path
+              << " (ffplay -f rawvideo -pixel_format "
+              << (m_bgr ? "bgr24" : "yuv420p") << " -video_size " << width
+              << "x" << height << ")" << std::endl;
+}
+
+void RawFileSink::close() {
+    if (m_pFile) {
+        fclose(m_pFile);
+        m_pFile = nullptr;
+        std::cout << "[Session " << m_sessionId << "] dumped " << m_frames
+                  << " frames\n";
+    }
+}
+
+void RawFileSink::consume(const FrameHandle& f) {
+    if (!m_pFile || f->width() != m_width || f->height() != m_height) {
+        open(f->width(), f->height());
+    }
+    if (!m_pFile) {
+        return;
+    }
+    trace::Scope span("raw_write", f->pts());
+    // row by row, the frames have padded strides
+    auto writePlane = [this](const cv::Mat& m, size_t rowBytes) {
+        for (int y = 0; y < m.rows; y++) {
+            fwrite(m.ptr(y), 1, rowBytes, m_pFile);
+        }
+    };
+    if (m_bgr) {
+        cv::Mat img = f->bgr();
+        if (img.empty()) {
+            return;  // out of memory
+        }
+        writePlane(img, img.cols * 3);
+    } else {
+        for (const cv::Mat& plane : {f->yPlane(), f->uPlane(), f->vPlane()}) {
+            writePlane(plane, plane.cols);
+        }
+    }
+    m_frames++;
+}
+
+std::unique_ptr<FrameSink> makeFrameSink(const StreamConfig& config, int sessionId) {
+    switch (config.sink) {
+        case SinkType::kNull:
+            return std::make_unique<NullSink>();
+        case SinkType::kRawYUV:
+            return std::make_unique<RawFileSink>(config.dumpDir, sessionId, false);
+        case SinkType::kRawBGR:
+            return std::make_unique<RawFileSink>(config.dumpDir, sessionId, true);
+        case SinkType::kMosaic:
+            if (config.mosaic) {
+                return std::make_unique<MosaicSink>(config.mosaic, sessionId);
+            }
+            return std::make_unique<DisplaySink>(sessionId);
+        case SinkType::kDisplay:
+        default:
+            return std::make_unique<DisplaySink>(sessionId);
+    }
+}
@@ -0,0 +1,155 @@
+#include "squig/gopcache.h"
+
+#include <cstring>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "squig/nalparser.h"
+
+void GopCache::append(const uint8_t* data,
+                      size_t size,
+                      int64_t dts,
+                      int32_t cts,
+                      bool idr,
+                      bool reference) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (idr) {
+        if (m_arena.capacity() == 0) {
+            // all of it up front, so a longer GOP later never
+            // reallocates on the ingest thread. Large enough to
+            // be mmap'ed, pages are only committed as written.
+            m_arena.reserve(m_maxBytes);
+            m_aus.reserve(kReservedAUs);
+        }
+        // new GOP, the old one is of no use to anyone now.
+        // clear() keeps the capacity.
+        m_arena.clear();
+        m_aus.clear();
+        m_valid = true;
+        m_gops.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (!m_valid) {
+        return;
+    }
+    if (m_arena.size() + size > m_maxBytes) {
+        // GOP too long for the budget, a late joiner
+        // waits for the next IDR after all.
+        m_arena.clear();
+        m_aus.clear();
+        m_valid = false;
+        m_overflows.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    m_aus.push_back({m_arena.size(), size, dts, cts, idr, reference});
+    m_arena.insert(m_arena.end(), data, data + size);
+}
+
+void GopCache::setHeader(const uint8_t* data, size_t size) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_avccHdr.size() == size && std::memcmp(m_avccHdr.data(), data, size) == 0) {
+        return;  // resent as is, the GOP is still good
+    }
+    m_avccHdr.assign(data, data + size);
+    m_arena.clear();
+    m_aus.clear();
+    m_valid = false;
+}
+
+bool GopCache::snapshot(GopSnapshot& out) const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_valid || m_aus.empty()) {
+        return false;
+    }
+    out.avccHdr = m_avccHdr;
+    out.aus = m_aus;
+    out.data = m_arena;
+    m_snapshots.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+size_t GopCache::bytes() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_arena.size();
+}
+
+size_t GopCache::auCount() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_aus.size();
+}
+
+FrameHandle decodeLatest(const GopSnapshot& gop) {
+    if (gop.aus.empty()) {
+        return nullptr;
+    }
+    const AVCodec* pDec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    AVCodecContext* pCtx = avcodec_alloc_context3(pDec);
+    AVPacket* pPkt = av_packet_alloc();
+    AVFrame* pFrame = av_frame_alloc();
+    AVFrame* pLatest = nullptr;
+
+    pCtx->extradata = (uint8_t*)av_mallocz(gop.avccHdr.size() +
+                                           AV_INPUT_BUFFER_PADDING_SIZE);
+    pCtx->extradata_size = gop.avccHdr.size();
+    memcpy(pCtx->extradata, gop.avccHdr.data(), gop.avccHdr.size());
+    // one picture per send, no frame threading delay
+    pCtx->thread_count = 1;
+
+    // keep the newest (highest pts) frame out of receive_frame
+    auto drain = [&]() {
+        while (avcodec_receive_frame(pCtx, pFrame) == 0) {
+            if (!pLatest || pFrame->pts > pLatest->pts) {
+                if (!pLatest) {
+                    pLatest = av_frame_alloc();
+                }
+                av_frame_unref(pLatest);
+                av_frame_move_ref(pLatest, pFrame);
+            } else {
+                av_frame_unref(pFrame);
+            }
+        }
+    };
+
+    if (avcodec_open2(pCtx, pDec, nullptr) == 0) {
+        size_t last = gop.aus.size() - 1;
+        for (size_t i = 0; i <= last; i++) {
+            const CachedAU& au = gop.aus[i];
+            // nothing later depends on a non-reference picture,
+            // only the newest one is worth decoding
+            if (!au.reference && i != last) {
+                continue;
+            }
+            if (av_new_packet(pPkt, au.size) < 0) {
+                break;
+            }
+            memcpy(pPkt->data, gop.auData(i), au.size);
+            h264::avccToAnnexB(pPkt->data, au.size);
+            pPkt->dts = au.dts;
+            pPkt->pts = au.dts + au.cts;
+            int ret = avcodec_send_packet(pCtx, pPkt);
+            if (ret == AVERROR(EAGAIN)) {
+                // output pending first, then it takes the packet
+                drain();
+                ret = avcodec_send_packet(pCtx, pPkt);
+            }
+            av_packet_unref(pPkt);
+            if (ret < 0) {
+                continue;  // a broken AU, the rest may still decode
+            }
+            drain();
+        }
+        // flush, frames held back for reordering
+        avcodec_send_packet(pCtx, nullptr);
+        drain();
+    }
+
+    av_frame_free(&pFrame);
+    av_packet_free(&pPkt);
+    avcodec_free_context(&pCtx);
+    if (!pLatest) {
+        return nullptr;
+    }
+    return std::make_shared<const DecodedFrame>(
+        pLatest, 0, 0, std::make_shared<ConversionPools>());
+}
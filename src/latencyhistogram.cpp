@@ -0,0 +1,114 @@
+#include "squig/latencyhistogram.h"
+
+#include <algorithm>
+#include <sstream>
+
+LatencyHistogram& LatencyHistogram::operator=(const LatencyHistogram& o) {
+    if (this != &o) {
+        reset();
+        merge(o);
+    }
+    return *this;
+}
+
+uint64_t LatencyHistogram::upperOf(size_t idx) {
+    if (idx < 2 * kSubBuckets) {
+        return idx;
+    }
+    // inverse of bucketOf(): idx = shift * 32 + (v >> shift)
+    size_t shift = idx / kSubBuckets - 1;
+    uint64_t sub = idx - shift * kSubBuckets;
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& o) {
+    for (size_t i = 0; i < kBuckets; i++) {
+        uint32_t c = o.m_counts[i].load(std::memory_order_relaxed);
+        if (c) {
+            m_counts[i].fetch_add(c, std::memory_order_relaxed);
+        }
+    }
+    m_count.fetch_add(o.count(), std::memory_order_relaxed);
+    m_sum.fetch_add(o.m_sum.load(std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+
+    uint64_t oMin = o.m_min.load(std::memory_order_relaxed);
+    uint64_t cur = m_min.load(std::memory_order_relaxed);
+    while (oMin < cur &&
+           !m_min.compare_exchange_weak(cur, oMin, std::memory_order_relaxed)) {
+    }
+    uint64_t oMax = o.max();
+    cur = m_max.load(std::memory_order_relaxed);
+    while (oMax > cur &&
+           !m_max.compare_exchange_weak(cur, oMax, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::reset() {
+    for (auto& c : m_counts) {
+        c.store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_min.store(UINT64_MAX, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::quantile(double q) const {
+    // sum the buckets instead of trusting m_count, a
+    // concurrent writer may have bumped one but not the other
+    uint64_t total = 0;
+    for (const auto& c : m_counts) {
+        total += c.load(std::memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    q = std::clamp(q, 0.0, 1.0);
+    // rank of the sample we want, 1-based (q=0 -> first)
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * total + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; i++) {
+        seen += m_counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(upperOf(i), max());
+        }
+    }
+    return max();
+}
+
+std::string LatencyHistogram::summary() const {
+    std::ostringstream out;
+    out << "p50 " << quantile(0.5) << "us, p90 " << quantile(0.9)
+        << "us, p99 " << quantile(0.99) << "us, p99.9 " << quantile(0.999)
+        << "us, max " << max() << "us (" << count() << ")";
+    return out.str();
+}
+
+void WindowedHistogram::record(uint64_t v, uint64_t nowUs) {
+    m_total.record(v);
+
+    uint64_t epoch = nowUs / kSliceUs;
+    Slice& s = m_slices[epoch % kSlices];
+    if (s.epoch.load(std::memory_order_relaxed) != epoch) {
+        // this slot last held kSlices slices ago, recycle it
+        s.hist.reset();
+        s.epoch.store(epoch, std::memory_order_release);
+    }
+    s.hist.record(v);
+}
+
+LatencyHistogram WindowedHistogram::window(uint64_t spanUs, uint64_t nowUs) const {
+    uint64_t nSlices = (spanUs + kSliceUs - 1) / kSliceUs;
+    nSlices = std::clamp<uint64_t>(nSlices, 1, kSlices);
+    uint64_t nowEpoch = nowUs / kSliceUs;
+
+    LatencyHistogram out;
+    for (const Slice& s : m_slices) {
+        uint64_t e = s.epoch.load(std::memory_order_acquire);
+        if (e <= nowEpoch && nowEpoch - e < nSlices) {
+            out.merge(s.hist);
+        }
+    }
+    return out;
+}
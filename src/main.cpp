@@ -1,127 +1,278 @@
 #include <algorithm>
-#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
 #include <cstdint>
+#include <cstdlib>
 #include <iostream>
-#include <limits>
 #include <memory>
-#include <numeric>
+#include <string>
+#include <thread>
 
-#include "squig/perfstatistics.hpp"
-#include "squig/streamdecoder.h"
+#include "squig/executor.h"
+#include "squig/metrics.h"
+#include "squig/mosaic.h"
+#include "squig/replay.h"
+#include "squig/sessionserver.h"
+#include "squig/tensorbatcher.h"
 #include "squig/utils.hpp"
 
 namespace {
-int fifoIdx{};
-std::unique_ptr<StreamDecoder> sd;
-}  // namespace
+const char* kUsage =
+    "usage: squig [port] [--sink display|null|yuv|bgr|mosaic] [--mosaic WxH[@FPS]]\n"
+    "             [--dump-dir DIR] [--latency-budget MS] [--decode all|keyframes|<N>fps]\n"
+    "             [--profile low-latency|balanced|throughput] [--gop-cache MB]\n"
+    "             [--record DIR [--record-format mp4|ts] [--segment-sec S] [--keep-segments N]]\n"
+    "             [--shm] [--motion T] [--pyramid bgr/2,gray/4,...]\n"
+    "             [--workers N [--pin 0-7|node0]] [--metrics PORT|/path.sock]\n"
+    "             [--batch WxH:N[@MS]]\n"
+    "             [--headless] [--replay <file.pcap|file.flv> [--fast]]\n";
+
+bool parseFloat(const char* s, float& out) {
+    char* end = nullptr;
+    errno = 0;
+    float v = std::strtof(s, &end);
+    if (end == s || *end != '\0' || errno == ERANGE || !std::isfinite(v)) {
+        return false;
+    }
+    out = v;
+    return true;
+}
+
+SessionServer* gServer = nullptr;
 
-PerfStatistics stats(utils::nowMs());
-
-void handleVideo(librtmp::RTMPMediaMessage m,
-                 librtmp::ClientParameters* sourceParams) {
-    // do the Decode -> Display
-    // The first rtmp message (header, avc_packet_type=0) initializes the client
-    // params i.e. video height frame rate etc. It is an AMF message. Confirmed
-    // from printf in easyrtmp handleAMF()
-
-    // From assts/extracting-NALU.png:
-    // NALUs of the same frame have the same timestamp
-    // ---
-    // https://rtmp.veriskope.com/pdf/video_file_format_spec_v10.pdf
-    // https://stackoverflow.com/questions/24884827/possible-locations-for-sequence-picture-parameter-sets-for-h-264-stream
-    // video_data_send: One or more NALUs, in a buffer, either VCL or non-VCL
-    // The bytes in the video_data_send are in AVCC format,
-    // they specify the length of NALU, and then contain the raw data.
-    // EasyRTMP populates m.d with supplementary RTMP info as in spec.
-    // EasyRTMP ensures each MediaMessage contains a single Access Unit (Frame)
-    // which is made up of several NALUs.
-    //
-    // VCL NALU: A slice of a video frame, contains pure image data.
-    // VCL type 5: NALU is a single encoded image (video frame).
-    // VCL type 1: Non-VCL NALU:
-    const char* fType = (m.video.d.frame_type == 1)
-                            ? "Keyframe"
-                            : "Interframe";  // 2 = interframe
-    const char* pType =
-        (m.video.d.avc_packet_type == 0) ? "AVCC-Hdr" : "AVCC-Access-Unit";  //
-
-    // Single line output with fixed spacing
-    // printf("[RTMP %-3d] TS:%-8ld SID:%-3d | %-5s | %-8s | Size:%4zu\n",
-    //        fifoIdx,
-    //        m.timestamp,
-    //        m.message_stream_id,
-    //        fType,
-    //        pType,
-    //        m.video.video_data_send.size());
-
-    // utils::printHexDump(m.video.video_data_send);
-
-    bool isAVCCHdr = (m.video.d.avc_packet_type == 0);
-    if (isAVCCHdr) {
-        sd = std::make_unique<StreamDecoder>(m, *sourceParams, stats);
-        return;
+void onSignal(int) {
+    if (gServer) {
+        gServer->stop();
     }
-    // RTMPMediaMessage -> AVPacket -> <avc_decode> -> AVFrame (uncompressed)
-    // AVFrame.data -> cv::Mat() -> DISPLAY on screen!:
-    // AVFrame: Uncompressed Video Frame
-    // This func should output an AVFrame
-    // for each RTMP Message.
-    // https://github.com/leandromoreira/ffmpeg-libav-tutorial/blob/master/0_hello_world.c
-    if (sd) {
-        sd->process(m);
+}
+
+void onTraceSignal(int) {
+    if (gServer) {
+        gServer->requestTraceDump();
+    }
+}
+
+// SIGUSR2 flips between the configured decode policy and
+// keyframes only, e.g. to thin out a wall of cameras.
+DecodePolicy gConfiguredPolicy;
+volatile sig_atomic_t gKeyframesOnly = 0;
+
+void onPolicySignal(int) {
+    if (gServer) {
+        gKeyframesOnly = !gKeyframesOnly;
+        gServer->requestDecodePolicy(gKeyframesOnly
+                                         ? DecodePolicy{DecodeMode::kKeyframes, 0}
+                                         : gConfiguredPolicy);
     }
 }
+}  // namespace
 
-int main() {
+int main(int argc, char** argv) {
     std::cout << "Sup bros" << std::endl;
 
-    // start server
-    TCPServer tcp_server(1935);
-    // client = accept socket
-    auto client = tcp_server.accept();
-    std::cout << "conn accepted" << std::endl;
-
-    librtmp::RTMPEndpoint rtmp_endpoint(client.get());
-    librtmp::RTMPServerSession server_session(&rtmp_endpoint);
-
-    try {
-        while (true) {
-            // is an std::vector<char>
-
-            // start timer
-            auto start = std::chrono::high_resolution_clock::now();
-            librtmp::RTMPMediaMessage message = server_session.GetRTMPMessage();
-
-            // get received media codec parameters and streaming key
-            auto params = server_session.GetClientParameters();
-            switch (message.message_type) {
-                case librtmp::RTMPMessageType::VIDEO: {
-                    handleVideo(message, params);
-
-                    // auto end = std::chrono::high_resolution_clock::now();
-                    // uint64_t durationUs =
-                    //     std::chrono::duration_cast<std::chrono::microseconds>(
-                    //         end - start)
-                    //         .count();
-                    // stats.update(durationUs);
-                    fifoIdx++;
-                    break;
-                }  // braces needed if declaring vars inside a case
-                case librtmp::RTMPMessageType::AUDIO:
-                    // std::cout << "[" << message.timestamp << "]" << "Audio
-                    // Message\n";
-                    break;
+    uint16_t port = 1935;
+    StreamConfig config;
+    std::string replayPath;
+    ReplayOptions replayOpts;
+    bool useExecutor = false;
+    ExecutorConfig execConfig;
+    std::string metricsListen;
+    MosaicConfig mosaicConfig;
+    TensorSpec batchSpec;
+    size_t batchSize = 0;
+    int batchDeadlineMs = 10;
+    unsigned long n;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        // a typo or a flag missing its value is an error,
+        // not a port number
+        auto bad = [&](const char* what) {
+            std::cerr << "bad " << what << " " << argv[i] << "\n" << kUsage;
+            return 1;
+        };
+        if (arg == "--headless") {
+            // decode only, no window and no BGR conversion
+            config.sink = SinkType::kNull;
+        } else if (arg == "--sink" && i + 1 < argc) {
+            if (!parseSinkType(argv[++i], config.sink)) {
+                std::cerr << "unknown sink " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--mosaic" && i + 1 < argc) {
+            // one window with a tile per stream, canvas size and refresh rate
+            if (!parseMosaicSpec(argv[++i], mosaicConfig)) {
+                std::cerr << "bad mosaic " << argv[i] << ", want e.g. 1920x1080@30\n";
+                return 1;
+            }
+            config.sink = SinkType::kMosaic;
+        } else if (arg == "--dump-dir" && i + 1 < argc) {
+            config.dumpDir = argv[++i];
+        } else if (arg == "--latency-budget" && i + 1 < argc) {
+            // drop frames once decode falls this far behind
+            if (!utils::parseUInt(argv[++i], UINT32_MAX, n)) {
+                return bad("latency budget");
+            }
+            config.latencyBudgetMs = static_cast<uint32_t>(n);
+        } else if (arg == "--decode" && i + 1 < argc) {
+            if (!parseDecodePolicy(argv[++i], config.decode)) {
+                std::cerr << "unknown decode policy " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--profile" && i + 1 < argc) {
+            // decoder threading, see DecodeProfile
+            if (!parseDecodeProfile(argv[++i], config.profile)) {
+                std::cerr << "unknown decode profile " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--gop-cache" && i + 1 < argc) {
+            // off by default, for in-process late joiners
+            if (!utils::parseUInt(argv[++i], 1u << 16, n)) {
+                return bad("GOP cache size");
+            }
+            config.gopCacheBytes = size_t(n) << 20;
+        } else if (arg == "--record" && i + 1 < argc) {
+            config.recordDir = argv[++i];
+        } else if (arg == "--record-format" && i + 1 < argc) {
+            if (!parseRecordFormat(argv[++i], config.recordFormat)) {
+                std::cerr << "unknown record format " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--segment-sec" && i + 1 < argc) {
+            if (!utils::parseUInt(argv[++i], 24 * 3600, n) || n == 0) {
+                return bad("segment length");
+            }
+            config.segmentSec = static_cast<uint32_t>(n);
+        } else if (arg == "--keep-segments" && i + 1 < argc) {
+            if (!utils::parseUInt(argv[++i], UINT32_MAX, n)) {
+                return bad("segment count");
+            }
+            config.keepSegments = static_cast<uint32_t>(n);
+        } else if (arg == "--shm") {
+            config.shmExport = true;
+        } else if (arg == "--motion" && i + 1 < argc) {
+            // e.g. 0.005: skip frames with < 0.5% of the picture changed
+            if (!parseFloat(argv[++i], config.motionThreshold) ||
+                config.motionThreshold < 0 || config.motionThreshold > 1) {
+                return bad("motion threshold (0 to 1)");
+            }
+        } else if (arg == "--pyramid" && i + 1 < argc) {
+            if (!parsePyramidLevels(argv[++i], config.pyramid)) {
+                std::cerr << "unknown pyramid levels " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--workers" && i + 1 < argc) {
+            // shared workers for every session's stages, 0: one per core
+            useExecutor = true;
+            if (!utils::parseUInt(argv[++i], 4096, n)) {
+                return bad("worker count");
+            }
+            execConfig.threads = n;
+        } else if (arg == "--pin" && i + 1 < argc) {
+            if (!parseCpuSpec(argv[++i], execConfig.cpus)) {
+                std::cerr << "bad cpu list " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--batch" && i + 1 < argc) {
+            // model input for an inference worker, e.g.
+            // 640x640:8@10 (8 streams per batch, 10ms deadline)
+            if (!parseBatchSpec(argv[++i], batchSpec, batchSize, batchDeadlineMs)) {
+                return bad("batch, want e.g. 640x640:8[@10]");
+            }
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            // Prometheus endpoint, a TCP port or a Unix socket path
+            metricsListen = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (arg == "--fast") {
+            replayOpts.pacing = ReplayPacing::kFast;
+        } else if (arg[0] != '-' && utils::parseUInt(argv[i], 65535, n) && n > 0) {
+            port = static_cast<uint16_t>(n);
+        } else {
+            return bad(arg[0] == '-' ? "option (or missing value)" : "port");
+        }
+    }
+
+    if (useExecutor) {
+        config.executor = std::make_shared<Executor>(execConfig);
+        std::cout << "Running sessions on " << config.executor->threads()
+                  << " workers" << std::endl;
+    }
+
+    if (config.sink == SinkType::kMosaic) {
+        config.mosaic = std::make_shared<Mosaic>(mosaicConfig);
+    }
+
+    // No engine is linked into squig: the worker takes the
+    // batches and drops them, so the summary at exit shows
+    // what filling them costs. An embedder runs its engine
+    // in this loop.
+    std::thread batchWorker;
+    if (batchSize > 0) {
+        config.batcher = std::make_shared<TensorBatcher>(
+            batchSpec, batchSize, std::chrono::milliseconds(batchDeadlineMs));
+        batchWorker = std::thread([b = config.batcher] {
+            TensorBatcher::Batch batch;
+            while (b->next(batch, std::chrono::milliseconds(100)) ||
+                   !b->closed()) {
             }
+        });
+    }
+    auto stopBatcher = [&] {
+        if (batchWorker.joinable()) {
+            config.batcher->close();
+            batchWorker.join();
+            std::cout << "Batches: " << config.batcher->summary() << "\n";
+        }
+    };
+
+    // outlives the server and its sessions
+    std::unique_ptr<MetricsServer> pMetrics;
+    if (!metricsListen.empty()) {
+        config.metrics = std::make_shared<MetricsRegistry>();
+        pMetrics = std::make_unique<MetricsServer>(config.metrics, metricsListen);
+        std::cout << "Metrics on " << pMetrics->where() << std::endl;
+    }
+
+    if (!replayPath.empty()) {
+        // a recorded session instead of live publishers
+        ReplayResult r = replayFile(replayPath, config, replayOpts);
+        std::cout << "Replayed " << r.frames << " frames in " << r.wallSec
+                  << "s\n";
+        stopBatcher();
+        if (config.executor) {
+            std::cout << config.executor->summary();
+        }
+        if (config.mosaic) {
+            std::cout << "Mosaic: " << config.mosaic->summary() << "\n";
         }
-    } catch (...) {
-        // connection terminated by peer or network conditions
-        // stats.writeToCSV("testing/squigV0_e2e_latencies.csv",
-        // kFfmpegLocalhost);
-
-        std::cout << "Connection Terminated\n";
-        std::cout << "Min Time: " << stats.min() << "\n";
-        std::cout << "Max Time: " << stats.max() << "\n";
-        // std::cout << "p99E2E Time: " << stats.p99E2E() << "\n";
-        std::cout << "p99Imshow Period: " << stats.p99Imshow() << "\n";
+        return 0;
+    }
+
+    // start server, publishers may connect
+    // and disconnect at any time.
+    SessionServer server(port, config);
+    gServer = &server;
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    // kill -USR1 <pid>: dump a Chrome trace of the last few seconds
+    std::signal(SIGUSR1, onTraceSignal);
+    // kill -USR2 <pid>: toggle keyframe-only decoding
+    gConfiguredPolicy = config.decode;
+    std::signal(SIGUSR2, onPolicySignal);
+    // a peer closing mid-write must not kill the process
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "Listening on :" << port << std::endl;
+    server.run();
+
+    gServer = nullptr;
+    std::cout << "Server stopped\n";
+    stopBatcher();
+    if (config.executor) {
+        std::cout << config.executor->summary();
+    }
+    if (config.mosaic) {
+        std::cout << "Mosaic: " << config.mosaic->summary() << "\n";
     }
 }
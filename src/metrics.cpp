@@ -0,0 +1,263 @@
+#include "squig/metrics.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "squig/trace.h"
+
+namespace {
+void throwErrno(const std::string& what) {
+    throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+bool writeAll(int fd, const char* p, size_t n) {
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return false;
+        }
+        p += w;
+        n -= size_t(w);
+    }
+    return true;
+}
+}  // namespace
+
+MetricsWriter::Family& MetricsWriter::family(const char* name,
+                                             const char* help,
+                                             const char* type) {
+    auto it = m_index.find(name);
+    if (it != m_index.end()) {
+        return m_families[it->second];
+    }
+    m_index.emplace(name, m_families.size());
+    m_families.push_back({name, help, type, {}});
+    return m_families.back();
+}
+
+void MetricsWriter::sample(std::string& out,
+                           const std::string& name,
+                           const std::string& labels,
+                           double v) {
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    char buf[32];
+    // integers (most counters) without an exponent
+    if (v == std::floor(v) && std::fabs(v) < 1e15) {
+        snprintf(buf, sizeof(buf), " %.0f\n", v);
+    } else {
+        snprintf(buf, sizeof(buf), " %g\n", v);
+    }
+    out += buf;
+}
+
+void MetricsWriter::counter(const char* name,
+                            const char* help,
+                            const std::string& labels,
+                            double v) {
+    Family& f = family(name, help, "counter");
+    sample(f.samples, f.name, labels, v);
+}
+
+void MetricsWriter::gauge(const char* name,
+                          const char* help,
+                          const std::string& labels,
+                          double v) {
+    Family& f = family(name, help, "gauge");
+    sample(f.samples, f.name, labels, v);
+}
+
+void MetricsWriter::summary(const char* name,
+                            const char* help,
+                            const std::string& labels,
+                            const LatencyHistogram& h) {
+    Family& f = family(name, help, "summary");
+    std::string sep = labels.empty() ? "" : ",";
+    for (const char* q : {"0.5", "0.9", "0.99", "0.999"}) {
+        sample(f.samples, f.name, labels + sep + "quantile=\"" + q + "\"",
+               double(h.quantile(std::atof(q))));
+    }
+    sample(f.samples, f.name + "_sum", labels, double(h.sum()));
+    sample(f.samples, f.name + "_count", labels, double(h.count()));
+}
+
+std::string MetricsWriter::text() const {
+    std::string out;
+    for (const Family& f : m_families) {
+        out += "# HELP " + f.name + " " + f.help + "\n";
+        out += "# TYPE " + f.name + " " + f.type + "\n";
+        out += f.samples;
+    }
+    return out;
+}
+
+MetricsRegistry::Registration& MetricsRegistry::Registration::operator=(
+    Registration&& o) noexcept {
+    if (this != &o) {
+        reset();
+        m_pRegistry = std::exchange(o.m_pRegistry, nullptr);
+        m_id = o.m_id;
+    }
+    return *this;
+}
+
+void MetricsRegistry::Registration::reset() {
+    if (m_pRegistry) {
+        std::lock_guard<std::mutex> lk(m_pRegistry->m_lock);
+        m_pRegistry->m_collectors.erase(m_id);
+        m_pRegistry = nullptr;
+    }
+}
+
+MetricsRegistry::Registration MetricsRegistry::add(Collector c) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    Registration r;
+    r.m_pRegistry = this;
+    r.m_id = m_nextId++;
+    m_collectors.emplace(r.m_id, std::move(c));
+    return r;
+}
+
+std::string MetricsRegistry::scrape() {
+    MetricsWriter w;
+    std::lock_guard<std::mutex> lk(m_lock);
+    for (auto& [id, collect] : m_collectors) {
+        collect(w);
+    }
+    return w.text();
+}
+
+MetricsServer::MetricsServer(std::shared_ptr<MetricsRegistry> pRegistry,
+                             const std::string& listen)
+    : m_pRegistry(std::move(pRegistry)),
+      m_unix(listen.find('/') != std::string::npos) {
+    if (m_unix) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (listen.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("metrics socket path too long: " + listen);
+        }
+        memcpy(addr.sun_path, listen.c_str(), listen.size());
+        m_listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(listen.c_str());
+        if (m_listenFd < 0 ||
+            bind(m_listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            throwErrno("metrics " + listen);
+        }
+        m_where = "unix:" + listen;
+    } else {
+        int port = std::atoi(listen.c_str());
+        if (port <= 0 || port > 65535) {
+            throw std::runtime_error("bad metrics port " + listen);
+        }
+        m_listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(uint16_t(port));
+        if (m_listenFd < 0 ||
+            bind(m_listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            throwErrno("metrics :" + listen);
+        }
+        m_where = "http://0.0.0.0:" + listen + "/metrics";
+    }
+    if (::listen(m_listenFd, 16) < 0) {
+        throwErrno("metrics listen");
+    }
+    m_stopFd = eventfd(0, EFD_CLOEXEC);
+    if (m_stopFd < 0) {
+        throwErrno("metrics eventfd");
+    }
+    m_thread = std::thread(&MetricsServer::serveLoop, this);
+}
+
+MetricsServer::~MetricsServer() {
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t r = write(m_stopFd, &one, sizeof(one));
+    m_thread.join();
+    close(m_listenFd);
+    close(m_stopFd);
+    if (m_unix) {
+        unlink(m_where.c_str() + strlen("unix:"));
+    }
+}
+
+void MetricsServer::serveLoop() {
+    trace::nameThread("sq-metrics");
+    pollfd fds[2] = {{m_listenFd, POLLIN, 0}, {m_stopFd, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (fds[1].revents) {
+            return;
+        }
+        int fd = accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        // a stuck client can't hold the endpoint for long
+        timeval tv{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serve(fd);
+        close(fd);
+    }
+}
+
+void MetricsServer::serve(int fd) {
+    // the request line is all that matters, read up to the
+    // end of the headers (or as much as fits)
+    char req[2048];
+    size_t n = 0;
+    while (n < sizeof(req) - 1) {
+        ssize_t r = recv(fd, req + n, sizeof(req) - 1 - n, 0);
+        if (r <= 0) {
+            break;
+        }
+        n += size_t(r);
+        req[n] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+            break;
+        }
+    }
+    req[n] = '\0';
+
+    std::string status = "200 OK";
+    std::string body;
+    if (strncmp(req, "GET /metrics", 12) == 0 || strncmp(req, "GET / ", 6) == 0) {
+        body = m_pRegistry->scrape();
+    } else {
+        status = "404 Not Found";
+        body = "try /metrics\n";
+    }
+    std::string head = "HTTP/1.0 " + status +
+                       "\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: " +
+                       std::to_string(body.size()) +
+                       "\r\nConnection: close\r\n\r\n";
+    writeAll(fd, head.data(), head.size()) && writeAll(fd, body.data(), body.size());
+}
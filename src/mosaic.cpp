@@ -0,0 +1,297 @@
+#include "squig/mosaic.h"
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <utility>
+
+#include <opencv2/highgui.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "squig/trace.h"
+#include "squig/utils.hpp"
+
+namespace {
+// gap between tiles, px
+constexpr int kGap = 2;
+
+// source position per output position, n outputs over src
+// inputs. box: the first of the 2x2 block to average.
+void sampleGrid(std::vector<int>& out, int n, int src, bool box) {
+    out.resize(n);
+    for (int i = 0; i < n; i++) {
+        out[i] = box ? std::min(int(int64_t(i) * src / n), src - 2)
+                     : int(int64_t(2 * i + 1) * src / (2 * n));
+    }
+}
+
+void gatherRow(const uint8_t* s0, ptrdiff_t stride, const std::vector<int>& cols,
+               bool box, uint8_t* dst) {
+    size_t n = cols.size();
+    if (box) {
+        const uint8_t* s1 = s0 + stride;
+        for (size_t x = 0; x < n; x++) {
+            int c = cols[x];
+            dst[x] = uint8_t((s0[c] + s0[c + 1] + s1[c] + s1[c + 1] + 2) >> 2);
+        }
+    } else {
+        for (size_t x = 0; x < n; x++) {
+            dst[x] = s0[cols[x]];
+        }
+    }
+}
+}  // namespace
+
+bool parseMosaicSpec(const std::string& spec, MosaicConfig& c) {
+    int w = 0, h = 0, fps = c.fps, end = 0;
+    int n = sscanf(spec.c_str(), "%dx%d%n@%d%n", &w, &h, &end, &fps, &end);
+    if (n < 2 || size_t(end) != spec.size() || w < 64 || h < 64 || fps <= 0) {
+        return false;
+    }
+    c.width = w;
+    c.height = h;
+    c.fps = fps;
+    return true;
+}
+
+Mosaic::Mosaic(const MosaicConfig& config)
+    : m_config(config), m_simd(yuv::detectSimd()) {
+    int w = std::max(2, config.width & ~1);
+    int h = std::max(2, config.height & ~1);
+    m_canvas = cv::Mat::zeros(h, w, CV_8UC3);
+    // a tile row pair is at most the canvas wide
+    m_rowY.resize(size_t(w) * 2);
+    m_rowU.resize(w / 2);
+    m_rowV.resize(w / 2);
+    if (config.fps > 0) {
+        m_thread = std::thread(&Mosaic::renderLoop, this);
+    }
+}
+
+Mosaic::~Mosaic() {
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            m_stopping = true;
+        }
+        m_wake.notify_all();
+        m_thread.join();
+    }
+}
+
+void Mosaic::attach(int streamId) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    for (const Stream& s : m_streams) {
+        if (s.id == streamId) {
+            return;
+        }
+    }
+    m_streams.push_back({streamId, nullptr, 0});
+    m_layoutChanged = true;
+}
+
+void Mosaic::offer(int streamId, const FrameHandle& f) {
+    FrameHandle old;  // released outside the lock
+    std::lock_guard<std::mutex> lk(m_lock);
+    for (Stream& s : m_streams) {
+        if (s.id == streamId) {
+            old = std::exchange(s.latest, f);
+            m_offered++;
+            return;
+        }
+    }
+}
+
+void Mosaic::detach(int streamId) {
+    FrameHandle old;
+    std::lock_guard<std::mutex> lk(m_lock);
+    auto it = std::find_if(m_streams.begin(), m_streams.end(),
+                           [&](const Stream& s) { return s.id == streamId; });
+    if (it != m_streams.end()) {
+        old = std::move(it->latest);
+        m_streams.erase(it);
+        m_layoutChanged = true;
+    }
+}
+
+void Mosaic::layout(size_t n) {
+    m_canvas.setTo(cv::Scalar::all(0));
+    m_maps.clear();
+    m_tiles.clear();
+    m_draws.reserve(n);
+    if (n == 0) {
+        return;
+    }
+    int cols = int(std::ceil(std::sqrt(double(n))));
+    int rows = int((n + cols - 1) / cols);
+    for (size_t i = 0; i < n; i++) {
+        int c = int(i) % cols, r = int(i) / cols;
+        // even edges, the 4:2:0 row pairs and chroma
+        // columns line up with the canvas
+        int x0 = (c * m_canvas.cols / cols) & ~1;
+        int x1 = ((c + 1) * m_canvas.cols / cols) & ~1;
+        int y0 = (r * m_canvas.rows / rows) & ~1;
+        int y1 = ((r + 1) * m_canvas.rows / rows) & ~1;
+        m_tiles.emplace_back(x0, y0, std::max(0, x1 - x0 - kGap),
+                             std::max(0, y1 - y0 - kGap));
+    }
+}
+
+const Mosaic::TileMap& Mosaic::tileMap(int id, const cv::Rect& tile, const AVFrame* f) {
+    TileMap& m = m_maps[id];
+    if (m.srcW == f->width && m.srcH == f->height && m.tile == tile) {
+        return m;
+    }
+    m.srcW = f->width;
+    m.srcH = f->height;
+    m.tile = tile;
+    // letterbox, keeping the aspect ratio
+    int dw = tile.width;
+    int dh = int(int64_t(dw) * f->height / std::max(1, f->width));
+    if (dh > tile.height) {
+        dh = tile.height;
+        dw = int(int64_t(dh) * f->width / std::max(1, f->height));
+    }
+    dw &= ~1;
+    dh &= ~1;
+    m.image = cv::Rect(tile.x + (((tile.width - dw) / 2) & ~1),
+                       tile.y + (((tile.height - dh) / 2) & ~1), dw, dh);
+    m.box = dw > 0 && dh > 0 && f->width >= 2 * dw && f->height >= 2 * dh;
+    sampleGrid(m.yCols, dw, f->width, m.box);
+    sampleGrid(m.yRows, dh, f->height, m.box);
+    sampleGrid(m.cCols, dw / 2, (f->width + 1) / 2, m.box);
+    sampleGrid(m.cRows, dh / 2, (f->height + 1) / 2, m.box);
+    return m;
+}
+
+void Mosaic::drawTile(const Draw& d) {
+    const AVFrame* f = d.frame->avFrame();
+    if (!yuv::isSupported(f->format)) {
+        return;
+    }
+    const TileMap& m = tileMap(d.id, d.tile, f);
+    if (m.image.width < 2 || m.image.height < 2) {
+        return;
+    }
+    trace::Scope span("mosaic_tile", d.frame->pts());
+    int dw = m.image.width;
+    yuv::Planes pair{{m_rowY.data(), m_rowU.data(), m_rowV.data()},
+                     {dw, dw / 2, dw / 2},
+                     dw,
+                     2};
+    yuv::ColorParams cp = yuv::colorParamsOf(f);
+    cv::Mat img = m_canvas(m.image);
+    // a row pair of the tile at a time: gather the sampled
+    // Y rows and their chroma row, convert into the canvas
+    for (int r = 0; r < m.image.height; r += 2) {
+        for (int k = 0; k < 2; k++) {
+            gatherRow(f->data[0] + ptrdiff_t(m.yRows[r + k]) * f->linesize[0],
+                      f->linesize[0], m.yCols, m.box, m_rowY.data() + k * dw);
+        }
+        int cy = m.cRows[r / 2];
+        gatherRow(f->data[1] + ptrdiff_t(cy) * f->linesize[1], f->linesize[1],
+                  m.cCols, m.box, m_rowU.data());
+        gatherRow(f->data[2] + ptrdiff_t(cy) * f->linesize[2], f->linesize[2],
+                  m.cCols, m.box, m_rowV.data());
+        yuv::convertRows(pair, 0, 2, img.ptr(r), int(img.step), cp, yuv::Order::kBGR,
+                         m_simd);
+    }
+    cv::putText(m_canvas, "S" + std::to_string(d.id),
+                cv::Point(d.tile.x + 6, d.tile.y + 20), cv::FONT_HERSHEY_SIMPLEX, 0.5,
+                cv::Scalar(0, 255, 255), 1);
+}
+
+void Mosaic::compose() {
+    trace::Scope span("mosaic_compose");
+    uint64_t t0 = utils::nowUs();
+    size_t skipped = 0;
+    m_draws.clear();
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (m_layoutChanged) {
+            // rare (a stream came or went), everything is
+            // redrawn in its new place
+            layout(m_streams.size());
+            for (Stream& s : m_streams) {
+                s.drawnSeq = 0;
+            }
+            m_layoutChanged = false;
+        }
+        for (size_t i = 0; i < m_streams.size(); i++) {
+            Stream& s = m_streams[i];
+            if (!s.latest || s.latest->seq() == s.drawnSeq) {
+                skipped++;
+                continue;
+            }
+            s.drawnSeq = s.latest->seq();
+            m_draws.push_back({s.id, s.latest, m_tiles[i]});
+        }
+    }
+    for (const Draw& d : m_draws) {
+        drawTile(d);
+    }
+    size_t drawn = m_draws.size();
+    // the frames go back to their decoders' pools
+    m_draws.clear();
+
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_tilesDrawn += drawn;
+    m_tilesSkipped += skipped;
+    m_composeUs.record(utils::nowUs() - t0);
+}
+
+void Mosaic::renderLoop() {
+    pthread_setname_np(pthread_self(), "sq-mosaic");
+    trace::nameThread("sq-mosaic");
+    using Clock = std::chrono::steady_clock;
+    const auto period = std::chrono::microseconds(1000000 / m_config.fps);
+    auto next = Clock::now();
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(m_lock);
+            if (m_wake.wait_until(lk, next, [&] { return m_stopping; })) {
+                break;
+            }
+        }
+        // behind by a period or more: skip ahead instead of
+        // refreshing back to back to catch up
+        auto now = Clock::now();
+        bool late = now - next >= period;
+        next = late ? now + period : next + period;
+
+        compose();
+        uint64_t t0 = utils::nowUs();
+        if (m_config.show) {
+            trace::Scope span("mosaic_show");
+            cv::imshow(m_config.title, m_canvas);
+            m_windowShown = true;
+            // the window's event loop, 1ms is the minimum
+            cv::waitKey(1);
+        }
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_refreshes++;
+        m_late += late;
+        if (m_config.show) {
+            m_presentUs.record(utils::nowUs() - t0);
+        }
+    }
+    if (m_windowShown) {
+        cv::destroyWindow(m_config.title);
+    }
+}
+
+std::string Mosaic::summary() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    std::ostringstream os;
+    os << m_refreshes << " refreshes (" << m_late << " late), " << m_tilesDrawn
+       << " tiles drawn, " << m_tilesSkipped << " skipped (no new frame), "
+       << m_offered << " frames offered\n  compose: " << m_composeUs.summary();
+    if (m_presentUs.count() > 0) {
+        os << "\n  show: " << m_presentUs.summary();
+    }
+    return os.str();
+}
@@ -0,0 +1,204 @@
+#include "squig/motion.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SQUIG_X86 1
+#include <immintrin.h>
+#endif
+
+namespace motion {
+namespace {
+
+// Means of blocks [bxBegin, bxEnd) of one block row.
+void blockRowScalar(const uint8_t* y, int stride, int bxBegin, int bxEnd,
+                    uint8_t* dst) {
+    for (int bx = bxBegin; bx < bxEnd; bx++) {
+        unsigned sum = 0;
+        for (int r = 0; r < kBlock; r++) {
+            const uint8_t* p = y + (size_t)r * stride + bx * kBlock;
+            for (int x = 0; x < kBlock; x++) {
+                sum += p[x];
+            }
+        }
+        dst[bx] = static_cast<uint8_t>((sum + 32) >> 6);
+    }
+}
+
+#ifdef SQUIG_X86
+// Two blocks per 16 bytes: psadbw against zero leaves the
+// sum of each 8 byte half in its 64 bit lane.
+__attribute__((target("sse4.1"))) void blockRowSSE41(const uint8_t* y,
+                                                     int stride,
+                                                     int blocks,
+                                                     uint8_t* dst) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi64x(32);
+    int bx = 0;
+    for (; bx + 2 <= blocks; bx += 2) {
+        __m128i acc = round;
+        for (int r = 0; r < kBlock; r++) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                y + (size_t)r * stride + bx * kBlock));
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+        }
+        acc = _mm_srli_epi64(acc, 6);
+        dst[bx] = static_cast<uint8_t>(_mm_cvtsi128_si32(acc));
+        dst[bx + 1] = static_cast<uint8_t>(_mm_extract_epi32(acc, 2));
+    }
+    blockRowScalar(y, stride, bx, blocks, dst);
+}
+
+// Four blocks per 32 bytes.
+__attribute__((target("avx2"))) void blockRowAVX2(const uint8_t* y,
+                                                  int stride,
+                                                  int blocks,
+                                                  uint8_t* dst) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi64x(32);
+    int bx = 0;
+    for (; bx + 4 <= blocks; bx += 4) {
+        __m256i acc = round;
+        for (int r = 0; r < kBlock; r++) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                y + (size_t)r * stride + bx * kBlock));
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+        }
+        acc = _mm256_srli_epi64(acc, 6);
+        // the means are in bytes 0, 8, 16, 24
+        dst[bx] = static_cast<uint8_t>(_mm256_extract_epi8(acc, 0));
+        dst[bx + 1] = static_cast<uint8_t>(_mm256_extract_epi8(acc, 8));
+        dst[bx + 2] = static_cast<uint8_t>(_mm256_extract_epi8(acc, 16));
+        dst[bx + 3] = static_cast<uint8_t>(_mm256_extract_epi8(acc, 24));
+    }
+    blockRowSSE41(y + bx * kBlock, stride, blocks - bx, dst + bx);
+}
+
+// |a - b| > noise, 16 at a time: the saturating
+// differences both ways OR'd give |a - b|, subtracting
+// noise (saturating) leaves non-zero exactly where it's
+// over.
+__attribute__((target("sse4.1"))) size_t countSSE41(const uint8_t* a,
+                                                   const uint8_t* b,
+                                                   size_t n,
+                                                   uint8_t noise) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vNoise = _mm_set1_epi8(static_cast<char>(noise));
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        __m128i still = _mm_cmpeq_epi8(_mm_subs_epu8(d, vNoise), zero);
+        count += 16 - __builtin_popcount(_mm_movemask_epi8(still));
+    }
+    for (; i < n; i++) {
+        count += std::abs(a[i] - b[i]) > noise;
+    }
+    return count;
+}
+
+__attribute__((target("avx2"))) size_t countAVX2(const uint8_t* a,
+                                                const uint8_t* b,
+                                                size_t n,
+                                                uint8_t noise) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i vNoise = _mm256_set1_epi8(static_cast<char>(noise));
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m256i d =
+            _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+        __m256i still = _mm256_cmpeq_epi8(_mm256_subs_epu8(d, vNoise), zero);
+        count += 32 - __builtin_popcount(
+                          static_cast<uint32_t>(_mm256_movemask_epi8(still)));
+    }
+    return count + countSSE41(a + i, b + i, n - i, noise);
+}
+#endif
+
+}  // namespace
+
+void downsample(const uint8_t* y,
+                int stride,
+                int width,
+                int height,
+                uint8_t* dst,
+                yuv::SimdLevel level) {
+    int blocks = width / kBlock;
+    for (int by = 0; by < height / kBlock; by++) {
+        const uint8_t* row = y + (size_t)by * kBlock * stride;
+        uint8_t* dRow = dst + (size_t)by * blocks;
+        switch (level) {
+#ifdef SQUIG_X86
+            case yuv::SimdLevel::kAVX2:
+                blockRowAVX2(row, stride, blocks, dRow);
+                break;
+            case yuv::SimdLevel::kSSE41:
+                blockRowSSE41(row, stride, blocks, dRow);
+                break;
+#endif
+            default:
+                blockRowScalar(row, stride, 0, blocks, dRow);
+                break;
+        }
+    }
+}
+
+size_t countChanged(const uint8_t* a,
+                    const uint8_t* b,
+                    size_t n,
+                    uint8_t noise,
+                    yuv::SimdLevel level) {
+    switch (level) {
+#ifdef SQUIG_X86
+        case yuv::SimdLevel::kAVX2:
+            return countAVX2(a, b, n, noise);
+        case yuv::SimdLevel::kSSE41:
+            return countSSE41(a, b, n, noise);
+#endif
+        default: {
+            size_t count = 0;
+            for (size_t i = 0; i < n; i++) {
+                count += std::abs(a[i] - b[i]) > noise;
+            }
+            return count;
+        }
+    }
+}
+
+float MotionDetector::score(const AVFrame* f, float threshold) {
+    if (f->width != m_width || f->height != m_height) {
+        m_width = f->width;
+        m_height = f->height;
+        size_t n = size_t(m_width / kBlock) * (m_height / kBlock);
+        m_ref.assign(n, 0);
+        m_cur.assign(n, 0);
+        m_hasRef = false;
+    }
+    if (m_cur.empty()) {
+        return 1.0f;  // smaller than a block
+    }
+    downsample(f->data[0], f->linesize[0], m_width, m_height, m_cur.data(),
+               m_level);
+    float s = 1.0f;
+    if (m_hasRef) {
+        s = float(countChanged(m_cur.data(), m_ref.data(), m_cur.size(), kNoise,
+                               m_level)) /
+            m_cur.size();
+    }
+    if (s >= threshold) {
+        // passed the gate, the next frames are compared
+        // with this one. Below it the reference stays, so
+        // small changes keep adding up against it.
+        std::swap(m_ref, m_cur);
+        m_hasRef = true;
+    }
+    return s;
+}
+
+}  // namespace motion
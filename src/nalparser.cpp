@@ -0,0 +1,425 @@
+#include "squig/nalparser.h"
+
+
+namespace {
+// Reads Exp-Golomb codes from the start of a NAL payload,
+// skipping emulation prevention bytes (00 00 03).
+class BitReader {
+   private:
+    const uint8_t* m_p;
+    const uint8_t* m_end;
+    int m_zeros{};  // consecutive zero bytes consumed
+    uint8_t m_byte{};
+    int m_bitsLeft{};
+
+    bool nextByte() {
+        if (m_p == m_end) {
+            return false;
+        }
+        if (m_zeros >= 2 && *m_p == 0x03) {
+            m_zeros = 0;
+            if (++m_p == m_end) {
+                return false;
+            }
+        }
+        m_byte = *m_p++;
+        m_zeros = m_byte == 0 ? m_zeros + 1 : 0;
+        m_bitsLeft = 8;
+        return true;
+    }
+
+   public:
+    BitReader(const uint8_t* p, const uint8_t* end) : m_p(p), m_end(end) {}
+
+    int bit() {
+        if (m_bitsLeft == 0 && !nextByte()) {
+            return -1;
+        }
+        return (m_byte >> --m_bitsLeft) & 1;
+    }
+
+    // ue(v); false on truncation or a code longer than 31 bits
+    bool ue(uint32_t& v) {
+        int zeros = 0;
+        int b;
+        while ((b = bit()) == 0) {
+            if (++zeros > 31) {
+                return false;
+            }
+        }
+        if (b < 0) {
+            return false;
+        }
+        uint32_t suffix = 0;
+        for (int i = 0; i < zeros; i++) {
+            int s = bit();
+            if (s < 0) {
+                return false;
+            }
+            suffix = suffix << 1 | s;
+        }
+        v = (1u << zeros) - 1 + suffix;
+        return true;
+    }
+
+    // se(v)
+    bool se(int32_t& v) {
+        uint32_t u;
+        if (!ue(u)) {
+            return false;
+        }
+        v = (u & 1) ? int32_t((u + 1) / 2) : -int32_t(u / 2);
+        return true;
+    }
+
+    bool flag(bool& v) {
+        int b = bit();
+        v = b == 1;
+        return b >= 0;
+    }
+
+    bool byte(uint8_t& v) {
+        v = 0;
+        for (int i = 0; i < 8; i++) {
+            int b = bit();
+            if (b < 0) {
+                return false;
+            }
+            v = uint8_t(v << 1 | b);
+        }
+        return true;
+    }
+};
+
+// scaling_list() of an SPS, only skipped
+bool skipScalingList(BitReader& br, int size) {
+    int32_t last = 8, next = 8;
+    for (int i = 0; i < size; i++) {
+        if (next != 0) {
+            int32_t delta;
+            if (!br.se(delta)) {
+                return false;
+            }
+            // mod 256 even for out of range deltas, % could
+            // go negative
+            next = (last + delta + 256) & 0xff;
+        }
+        last = next == 0 ? last : next;
+    }
+    return true;
+}
+
+// seq_parameter_set_data() up to the frame size (7.3.2.1.1),
+// payload after the NAL header.
+bool parseSPS(const uint8_t* p, const uint8_t* end, h264::AVCConfig& out) {
+    BitReader br(p, end);
+    uint8_t profile, constraints, level;
+    uint32_t id;
+    if (!br.byte(profile) || !br.byte(constraints) || !br.byte(level) ||
+        !br.ue(id)) {
+        return false;
+    }
+    out.profile = profile;
+    out.level = level;
+    uint32_t chroma = 1;  // 4:2:0 unless the high profiles say otherwise
+    bool separatePlanes = false;
+    bool flag;
+    switch (profile) {
+        case 100: case 110: case 122: case 244: case 44:
+        case 83: case 86: case 118: case 128: case 138:
+        case 139: case 134: case 135: {
+            uint32_t depthLuma, depthChroma;
+            if (!br.ue(chroma) || chroma > 3) {
+                return false;
+            }
+            if (chroma == 3 && !br.flag(separatePlanes)) {
+                return false;
+            }
+            bool scaling;
+            if (!br.ue(depthLuma) || !br.ue(depthChroma) ||
+                !br.flag(flag) ||  // qpprime_y_zero_transform_bypass
+                !br.flag(scaling)) {
+                return false;
+            }
+            for (int i = 0; scaling && i < (chroma == 3 ? 12 : 8); i++) {
+                bool present;
+                if (!br.flag(present) ||
+                    (present && !skipScalingList(br, i < 6 ? 16 : 64))) {
+                    return false;
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    uint32_t v, pocType;
+    if (!br.ue(v) || !br.ue(pocType)) {  // log2_max_frame_num_minus4
+        return false;
+    }
+    if (pocType == 0) {
+        if (!br.ue(v)) {  // log2_max_pic_order_cnt_lsb_minus4
+            return false;
+        }
+    } else if (pocType == 1) {
+        int32_t s;
+        uint32_t cycle;
+        if (!br.flag(flag) || !br.se(s) || !br.se(s) || !br.ue(cycle) ||
+            cycle > 255) {
+            return false;
+        }
+        for (uint32_t i = 0; i < cycle; i++) {
+            if (!br.se(s)) {
+                return false;
+            }
+        }
+    }
+    uint32_t widthMbs, heightMapUnits;
+    bool frameMbsOnly, cropping;
+    if (!br.ue(v) || !br.flag(flag) ||  // max_num_ref_frames, gaps_allowed
+        !br.ue(widthMbs) || !br.ue(heightMapUnits) || !br.flag(frameMbsOnly)) {
+        return false;
+    }
+    if (!frameMbsOnly && !br.flag(flag)) {  // mb_adaptive_frame_field
+        return false;
+    }
+    if (!br.flag(flag) || !br.flag(cropping)) {  // direct_8x8_inference
+        return false;
+    }
+    uint32_t crop[4]{};  // left, right, top, bottom
+    if (cropping) {
+        for (uint32_t& c : crop) {
+            if (!br.ue(c)) {
+                return false;
+            }
+        }
+    }
+    // crop units, 6.2 / 7.4.2.1.1: in luma samples for
+    // ChromaArrayType 0 (monochrome, or 4:4:4 coded as three
+    // separate planes), else in chroma samples
+    uint32_t chromaArrayType = separatePlanes ? 0 : chroma;
+    int unitX = chromaArrayType == 1 || chromaArrayType == 2 ? 2 : 1;
+    int unitY = (chromaArrayType == 1 ? 2 : 1) * (frameMbsOnly ? 1 : 2);
+    int w = int(widthMbs + 1) * 16 - unitX * int(crop[0] + crop[1]);
+    int h = int(heightMapUnits + 1) * 16 * (frameMbsOnly ? 1 : 2) -
+            unitY * int(crop[2] + crop[3]);
+    if (w <= 0 || h <= 0) {
+        return false;
+    }
+    out.width = w;
+    out.height = h;
+    return true;
+}
+
+// Walks the parameter set lists of an AVCDecoderConfiguration-
+// Record, calling onNal(nal, size, isSPS) for each.
+template <typename OnNal>
+bool forEachParamSet(const uint8_t* data, size_t size, OnNal onNal) {
+    // version, profile, compatibility, level, length size
+    if (size < 7 || data[0] != 1) {
+        return false;
+    }
+    size_t off = 5;
+    for (int list = 0; list < 2; list++) {
+        if (off >= size) {
+            return false;
+        }
+        // SPS count has 3 reserved bits on top
+        int count = list == 0 ? data[off] & 0x1f : data[off];
+        off++;
+        for (int i = 0; i < count; i++) {
+            if (off + 2 > size) {
+                return false;
+            }
+            size_t len = size_t(data[off]) << 8 | data[off + 1];
+            off += 2;
+            if (len == 0 || len > size - off) {
+                return false;
+            }
+            if (!onNal(data + off, len, list == 0)) {
+                return false;
+            }
+            off += len;
+        }
+    }
+    return true;
+}
+// sei_message() payload type/size: 0xff bytes add 255 each
+bool seiValue(BitReader& br, uint32_t& v) {
+    v = 0;
+    uint8_t b;
+    do {
+        if (!br.byte(b)) {
+            return false;
+        }
+        v += b;
+    } while (b == 0xff);
+    return true;
+}
+
+// Looks for the Squig stamp among the SEI messages of one
+// SEI NAL (payload after the NAL header), 0 if absent.
+uint64_t findStamp(const uint8_t* p, const uint8_t* end) {
+    BitReader br(p, end);
+    uint32_t type, size;
+    // a few messages at most, stop at the trailing bits or junk
+    for (int msg = 0; msg < 8; msg++) {
+        if (!seiValue(br, type) || !seiValue(br, size)) {
+            return 0;
+        }
+        uint8_t b;
+        if (type == 5 && size == sizeof(h264::kStampUUID) + 8) {
+            bool match = true;
+            for (uint8_t u : h264::kStampUUID) {
+                if (!br.byte(b)) {
+                    return 0;
+                }
+                match &= b == u;
+            }
+            uint64_t us = 0;
+            for (int i = 0; i < 8; i++) {
+                if (!br.byte(b)) {
+                    return 0;
+                }
+                us = us << 8 | b;
+            }
+            if (match) {
+                return us;
+            }
+            continue;
+        }
+        for (uint32_t i = 0; i < size; i++) {
+            if (!br.byte(b)) {
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+}  // namespace
+
+bool h264::parseAVCC(const uint8_t* data, size_t size, AUInfo& info) {
+    info = AUInfo{};
+    bool haveSlice = false;
+    size_t off = 0;
+    while (off + 4 < size) {
+        uint32_t len = uint32_t(data[off]) << 24 | uint32_t(data[off + 1]) << 16 |
+                       uint32_t(data[off + 2]) << 8 | data[off + 3];
+        off += 4;
+        if (len == 0 || len > size - off) {
+            return false;
+        }
+        const uint8_t* nal = data + off;
+        off += len;
+
+        uint8_t refIdc = (nal[0] >> 5) & 0x3;
+        uint8_t type = nal[0] & 0x1f;
+        switch (type) {
+            case kNalSPS:
+            case kNalPPS:
+                info.hasParamSets = true;
+                continue;
+            case kNalIDR:
+                info.idr = true;
+                break;
+            case kNalSEI:
+                if (!info.captureUs) {
+                    info.captureUs = findStamp(nal + 1, nal + len);
+                }
+                continue;
+            case kNalSlice:
+                break;
+            default:
+                // AUD, filler, data partitions (not used by any
+                // encoder we see) etc.
+                continue;
+        }
+
+        info.reference |= refIdc != 0;
+        if (!haveSlice) {
+            haveSlice = true;
+            // slice_header(): first_mb_in_slice, slice_type
+            BitReader br(nal + 1, nal + len);
+            uint32_t firstMb, sliceType;
+            if (br.ue(firstMb) && br.ue(sliceType) && sliceType <= 9) {
+                info.sliceType = static_cast<SliceType>(sliceType % 5);
+            }
+        }
+    }
+    return haveSlice;
+}
+
+size_t h264::writeStampSEI(uint64_t captureUs, uint8_t* dst) {
+    uint8_t payload[2 + sizeof(kStampUUID) + 8];
+    size_t n = 0;
+    payload[n++] = 5;  // user_data_unregistered
+    payload[n++] = sizeof(kStampUUID) + 8;
+    for (uint8_t u : kStampUUID) {
+        payload[n++] = u;
+    }
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        payload[n++] = uint8_t(captureUs >> shift);
+    }
+
+    const uint8_t header[] = {0x00, 0x00, 0x00, 0x01, kNalSEI};
+    size_t out = 0;
+    for (uint8_t b : header) {
+        dst[out++] = b;
+    }
+    // emulation prevention: no 00 00 0x (x <= 3) in the payload
+    int zeros = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (zeros >= 2 && payload[i] <= 3) {
+            dst[out++] = 0x03;
+            zeros = 0;
+        }
+        dst[out++] = payload[i];
+        zeros = payload[i] == 0 ? zeros + 1 : 0;
+    }
+    dst[out++] = 0x80;  // rbsp_trailing_bits
+    return out;
+}
+
+void h264::avccToAnnexB(uint8_t* data, size_t size) {
+    size_t offset = 0;
+    while (offset + 4 <= size) {
+        // Read length of nalu
+        uint32_t naluLen = uint32_t(data[offset]) << 24 |
+                           uint32_t(data[offset + 1]) << 16 |
+                           uint32_t(data[offset + 2]) << 8 | data[offset + 3];
+
+        // replace length bytes with nalu start code.
+        data[offset] = 0x00;
+        data[offset + 1] = 0x00;
+        data[offset + 2] = 0x00;
+        data[offset + 3] = 0x01;
+
+        // Jump to the next nalu length field
+        offset += 4 + size_t(naluLen);
+    }
+}
+
+bool h264::parseAVCConfig(const uint8_t* data, size_t size, AVCConfig& out) {
+    out = AVCConfig{};
+    bool ok = forEachParamSet(data, size, [&](const uint8_t* nal, size_t len, bool sps) {
+        if (!sps) {
+            out.ppsCount++;
+            return true;
+        }
+        // the first SPS sets the size
+        if (out.spsCount++ == 0) {
+            return (nal[0] & 0x1f) == kNalSPS && parseSPS(nal + 1, nal + len, out);
+        }
+        return true;
+    });
+    return ok && out.spsCount > 0;
+}
+
+bool h264::avcConfigToAnnexB(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+    return forEachParamSet(data, size, [&](const uint8_t* nal, size_t len, bool) {
+        const uint8_t startCode[] = {0x00, 0x00, 0x00, 0x01};
+        out.insert(out.end(), startCode, startCode + 4);
+        out.insert(out.end(), nal, nal + len);
+        return true;
+    });
+}
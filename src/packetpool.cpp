@@ -0,0 +1,55 @@
+#include "squig/packetpool.h"
+
+#include <cstring>
+
+PacketPool::~PacketPool() {
+    // references still held by libavcodec keep
+    // their buffer alive until released
+    for (auto& slot : m_slots) {
+        av_buffer_unref(&slot->pBuf);
+    }
+}
+
+PacketSlot* PacketPool::copyIn(const uint8_t* data, size_t size) {
+    size_t needed = size + AV_INPUT_BUFFER_PADDING_SIZE;
+    if (needed > m_bufSize) {
+        // grow geometrically, a stream settles after a few IDRs
+        size_t newSize = m_bufSize ? m_bufSize : kInitialSize;
+        while (newSize < needed) {
+            newSize *= 2;
+        }
+        m_bufSize = newSize;
+        m_grows++;
+    }
+
+    PacketSlot* pSlot = nullptr;
+    for (size_t i = 0; i < m_slots.size(); i++) {
+        PacketSlot* s = m_slots[(m_next + i) % m_slots.size()].get();
+        if (s->isFree()) {
+            pSlot = s;
+            m_next = (m_next + i + 1) % m_slots.size();
+            break;
+        }
+    }
+    if (!pSlot) {
+        if (m_slots.size() == m_maxSlots) {
+            return nullptr;
+        }
+        m_slots.push_back(std::make_unique<PacketSlot>());
+        pSlot = m_slots.back().get();
+    }
+
+    if (!pSlot->pBuf || static_cast<size_t>(pSlot->pBuf->size) < m_bufSize) {
+        // the old buffer stays valid for anyone still referencing it
+        av_buffer_unref(&pSlot->pBuf);
+        pSlot->pBuf = av_buffer_alloc(m_bufSize);
+        if (!pSlot->pBuf) {
+            return nullptr;
+        }
+    }
+
+    pSlot->claimed.store(true, std::memory_order_relaxed);
+    memcpy(pSlot->pBuf->data, data, size);
+    memset(pSlot->pBuf->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return pSlot;
+}
@@ -0,0 +1,112 @@
+#include "squig/parallelfor.h"
+
+#include "squig/trace.h"
+
+namespace {
+// This thread runs chunks of a job: a body that splits its
+// own work (a conversion inside a batch fill) runs that
+// serially. The caller holds m_runLock, locking it again
+// would be undefined.
+thread_local bool t_inJob = false;
+
+struct JobScope {
+    bool prev = t_inJob;
+    JobScope() { t_inJob = true; }
+    ~JobScope() { t_inJob = prev; }
+};
+}  // namespace
+
+ParallelFor::ParallelFor(size_t nThreads) {
+    for (size_t i = 0; i < nThreads; i++) {
+        m_workers.emplace_back(&ParallelFor::workerLoop, this);
+    }
+}
+
+ParallelFor::~ParallelFor() {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    for (auto& t : m_workers) {
+        t.join();
+    }
+}
+
+void ParallelFor::drainChunks() {
+    JobScope job;
+    while (true) {
+        size_t c = m_nextChunk.fetch_add(1, std::memory_order_relaxed);
+        if (c >= m_chunks) {
+            return;
+        }
+        size_t begin = c * m_grain;
+        size_t end = std::min(m_n, begin + m_grain);
+        trace::Scope span("chunk");
+        (*m_pBody)(begin, end);
+    }
+}
+
+void ParallelFor::workerLoop() {
+    trace::nameThread("sq-pool");
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(m_lock);
+            m_wake.wait(lk, [&] { return m_stopping || m_generation != seen; });
+            if (m_stopping) {
+                return;
+            }
+            seen = m_generation;
+            m_arrived++;
+            m_busyWorkers++;
+        }
+        drainChunks();
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            m_busyWorkers--;
+        }
+        m_done.notify_one();
+    }
+}
+
+void ParallelFor::run(size_t n, size_t grain, const Body& body) {
+    if (grain == 0) {
+        grain = 1;
+    }
+    if (t_inJob) {
+        body(0, n);
+        return;
+    }
+    std::unique_lock<std::mutex> runLk(m_runLock, std::try_to_lock);
+    if (!runLk.owns_lock() || m_workers.empty() || n <= grain) {
+        body(0, n);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_pBody = &body;
+        m_n = n;
+        m_grain = grain;
+        m_chunks = (n + grain - 1) / grain;
+        m_nextChunk.store(0, std::memory_order_relaxed);
+        m_arrived = 0;
+        m_generation++;
+    }
+    m_wake.notify_all();
+    drainChunks();
+
+    // all chunks are claimed, wait for the ones still running
+    std::unique_lock<std::mutex> lk(m_lock);
+    m_done.wait(lk, [&] {
+        return m_arrived == m_workers.size() && m_busyWorkers == 0;
+    });
+    m_pBody = nullptr;
+}
+
+ParallelFor& ParallelFor::shared() {
+    static ParallelFor pool(
+        std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return pool;
+}
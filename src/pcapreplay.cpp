@@ -0,0 +1,265 @@
+#include "squig/pcapreplay.h"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+
+namespace {
+// libpcap LINKTYPE_* values
+constexpr uint32_t kLinkNull = 0;
+constexpr uint32_t kLinkEthernet = 1;
+constexpr uint32_t kLinkRaw = 101;
+constexpr uint32_t kLinkSLL = 113;
+constexpr uint32_t kLinkSLL2 = 276;
+
+constexpr uint16_t kEtherIPv4 = 0x0800;
+constexpr uint16_t kEtherIPv6 = 0x86dd;
+constexpr uint16_t kEtherVLAN = 0x8100;
+
+constexpr uint8_t kProtoTCP = 6;
+constexpr uint8_t kTcpSyn = 0x02;
+
+uint16_t be16(const uint8_t* p) { return uint16_t(p[0] << 8 | p[1]); }
+uint32_t be32(const uint8_t* p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 |
+           p[3];
+}
+
+struct Segment {
+    uint64_t tUs;
+    std::vector<uint8_t> data;
+};
+
+// One client -> server TCP connection, as captured.
+struct Flow {
+    std::string client;
+    bool haveIsn = false;
+    uint32_t isn{};  // seq of the first payload byte
+    // keyed by offset from isn; first copy of a seq wins
+    std::map<uint32_t, Segment> segments;
+};
+
+// Offset of the IP header for the link type, and its
+// ethertype-ish protocol, or false if not IP.
+bool ipOffset(uint32_t link, const uint8_t* p, size_t len, size_t& off, uint16_t& proto) {
+    switch (link) {
+        case kLinkEthernet:
+            if (len < 14) {
+                return false;
+            }
+            off = 14;
+            proto = be16(p + 12);
+            if (proto == kEtherVLAN && len >= 18) {
+                off = 18;
+                proto = be16(p + 16);
+            }
+            return true;
+        case kLinkSLL:
+            if (len < 16) {
+                return false;
+            }
+            off = 16;
+            proto = be16(p + 14);
+            return true;
+        case kLinkSLL2:
+            if (len < 20) {
+                return false;
+            }
+            off = 20;
+            proto = be16(p);
+            return true;
+        case kLinkNull: {
+            if (len < 4) {
+                return false;
+            }
+            // address family in the capturing host's byte order
+            uint32_t af;
+            memcpy(&af, p, 4);
+            off = 4;
+            proto = (af == 2 || af == 0x02000000) ? kEtherIPv4 : kEtherIPv6;
+            return true;
+        }
+        case kLinkRaw:
+            if (len < 1) {
+                return false;
+            }
+            off = 0;
+            proto = (p[0] >> 4) == 4 ? kEtherIPv4 : kEtherIPv6;
+            return true;
+        default:
+            return false;
+    }
+}
+
+std::string ipString(int family, const uint8_t* addr) {
+    char buf[INET6_ADDRSTRLEN] = {};
+    inet_ntop(family, addr, buf, sizeof(buf));
+    return family == AF_INET6 ? std::string("[") + buf + "]" : buf;
+}
+}  // namespace
+
+std::vector<PcapStream> readPcapStreams(const std::string& path, uint16_t serverPort) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("can't open " + path);
+    }
+    std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)),
+                              std::istreambuf_iterator<char>());
+    if (file.size() < 24) {
+        throw std::runtime_error(path + ": not a pcap file");
+    }
+
+    uint32_t magic;
+    memcpy(&magic, file.data(), 4);
+    bool swapped, nanos;
+    switch (magic) {
+        case 0xa1b2c3d4: swapped = false; nanos = false; break;
+        case 0xd4c3b2a1: swapped = true; nanos = false; break;
+        case 0xa1b23c4d: swapped = false; nanos = true; break;
+        case 0x4d3cb2a1: swapped = true; nanos = true; break;
+        default:
+            throw std::runtime_error(path + ": not a pcap file (pcapng?)");
+    }
+    auto u32 = [swapped](const uint8_t* p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return swapped ? __builtin_bswap32(v) : v;
+    };
+    uint32_t link = u32(file.data() + 20);
+
+    // in order of the first packet seen, so stream order is stable
+    std::vector<std::string> order;
+    std::map<std::string, Flow> flows;
+
+    size_t pos = 24;
+    while (pos + 16 <= file.size()) {
+        const uint8_t* rec = file.data() + pos;
+        uint64_t tUs = uint64_t(u32(rec)) * 1000000 +
+                       (nanos ? u32(rec + 4) / 1000 : u32(rec + 4));
+        uint32_t capLen = u32(rec + 8);
+        pos += 16;
+        if (pos + capLen > file.size()) {
+            break;  // capture cut off mid packet
+        }
+        const uint8_t* p = file.data() + pos;
+        size_t len = capLen;
+        pos += capLen;
+
+        size_t off;
+        uint16_t proto;
+        if (!ipOffset(link, p, len, off, proto)) {
+            continue;
+        }
+        p += off;
+        len -= std::min(len, off);
+
+        // IP header -> TCP segment
+        std::string src;
+        size_t ipHdr, ipTotal;
+        if (proto == kEtherIPv4) {
+            if (len < 20 || (p[0] >> 4) != 4 || p[9] != kProtoTCP) {
+                continue;
+            }
+            ipHdr = (p[0] & 0x0f) * 4;
+            ipTotal = be16(p + 2);
+            src = ipString(AF_INET, p + 12);
+        } else if (proto == kEtherIPv6) {
+            // extension headers aren't followed, rare on a LAN
+            if (len < 40 || (p[0] >> 4) != 6 || p[6] != kProtoTCP) {
+                continue;
+            }
+            ipHdr = 40;
+            ipTotal = 40 + be16(p + 4);
+            src = ipString(AF_INET6, p + 8);
+        } else {
+            continue;
+        }
+        // snaplen or ethernet padding, trust the smaller
+        len = std::min(len, ipTotal);
+        if (len < ipHdr + 20) {
+            continue;
+        }
+        const uint8_t* tcp = p + ipHdr;
+        size_t tcpLen = len - ipHdr;
+        uint16_t srcPort = be16(tcp);
+        uint16_t dstPort = be16(tcp + 2);
+        if (dstPort != serverPort) {
+            continue;  // server -> client, or unrelated
+        }
+        uint32_t seq = be32(tcp + 4);
+        size_t tcpHdr = (tcp[12] >> 4) * 4;
+        bool syn = tcp[13] & kTcpSyn;
+        if (tcpLen < tcpHdr) {
+            continue;
+        }
+
+        std::string key = src + ":" + std::to_string(srcPort);
+        auto [it, inserted] = flows.try_emplace(key);
+        Flow& flow = it->second;
+        if (inserted) {
+            flow.client = key;
+            order.push_back(key);
+        }
+        if (syn) {
+            // a new connection from the same port starts over
+            flow.haveIsn = true;
+            flow.isn = seq + 1;
+            flow.segments.clear();
+            continue;
+        }
+        size_t payload = tcpLen - tcpHdr;
+        if (payload == 0) {
+            continue;
+        }
+        if (!flow.haveIsn) {
+            // capture started mid connection
+            flow.haveIsn = true;
+            flow.isn = seq;
+        }
+        uint32_t rel = seq - flow.isn;  // wraps like TCP does
+        if (rel >= 0x80000000u) {
+            continue;  // before the start, i.e. a stale retransmit
+        }
+        flow.segments.try_emplace(
+            rel, Segment{tUs, std::vector<uint8_t>(tcp + tcpHdr, tcp + tcpLen)});
+    }
+
+    std::vector<PcapStream> streams;
+    for (const std::string& key : order) {
+        Flow& flow = flows[key];
+        PcapStream s;
+        s.client = flow.client;
+        uint64_t expected = 0;
+        uint64_t t0 = 0, tPrev = 0;
+        for (auto& [rel, seg] : flow.segments) {
+            uint64_t end = rel + seg.data.size();
+            if (end <= expected) {
+                continue;  // retransmit of data we have
+            }
+            if (rel > expected) {
+                s.truncated = true;
+                break;
+            }
+            if (s.chunks.empty()) {
+                t0 = seg.tUs;
+            }
+            // seq order isn't always capture order (retransmits),
+            // keep the replay clock monotonic.
+            uint64_t t = std::max(tPrev, seg.tUs - std::min(seg.tUs, t0));
+            tPrev = t;
+            ReplayChunk c{t, {}};
+            c.data.assign(seg.data.begin() + (expected - rel), seg.data.end());
+            s.bytes += c.data.size();
+            s.chunks.push_back(std::move(c));
+            expected = end;
+        }
+        if (!s.chunks.empty()) {
+            streams.push_back(std::move(s));
+        }
+    }
+    return streams;
+}
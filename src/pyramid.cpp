@@ -0,0 +1,270 @@
+#include "squig/pyramid.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "squig/parallelfor.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SQUIG_X86 1
+#include <immintrin.h>
+#endif
+
+namespace pyramid {
+namespace {
+
+// 4 half-res and 2 quarter-res luma rows, i.e. whole
+// chroma rows at both levels
+constexpr int kStripRows = 8;
+// SIMD tails may read past a row
+constexpr int kSlack = 64;
+
+size_t idx(PyramidFormat f, int div) { return PyramidLevel{f, div}.index(); }
+
+// Outputs [xBegin, xEnd) of a 2x2 box of rows a and b.
+void boxScalar(const uint8_t* a, const uint8_t* b, int xBegin, int xEnd,
+               uint8_t* dst) {
+    for (int x = xBegin; x < xEnd; x++) {
+        dst[x] = uint8_t((a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] + 2) >> 2);
+    }
+}
+
+#ifdef SQUIG_X86
+// pmaddubsw against 1s sums horizontal byte pairs into
+// words, exact, then the two rows are added as words.
+__attribute__((target("sse4.1"))) int boxSSE41(const uint8_t* a,
+                                               const uint8_t* b,
+                                               int n,
+                                               uint8_t* dst) {
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi16(2);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i s[2];
+        for (int h = 0; h < 2; h++) {
+            auto pa = reinterpret_cast<const __m128i*>(a + 2 * x + 16 * h);
+            auto pb = reinterpret_cast<const __m128i*>(b + 2 * x + 16 * h);
+            __m128i sum = _mm_add_epi16(_mm_maddubs_epi16(_mm_loadu_si128(pa), ones),
+                                        _mm_maddubs_epi16(_mm_loadu_si128(pb), ones));
+            s[h] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x),
+                         _mm_packus_epi16(s[0], s[1]));
+    }
+    return x;
+}
+
+__attribute__((target("avx2"))) int boxAVX2(const uint8_t* a,
+                                            const uint8_t* b,
+                                            int n,
+                                            uint8_t* dst) {
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi16(2);
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i s[2];
+        for (int h = 0; h < 2; h++) {
+            auto pa = reinterpret_cast<const __m256i*>(a + 2 * x + 32 * h);
+            auto pb = reinterpret_cast<const __m256i*>(b + 2 * x + 32 * h);
+            __m256i sum =
+                _mm256_add_epi16(_mm256_maddubs_epi16(_mm256_loadu_si256(pa), ones),
+                                 _mm256_maddubs_epi16(_mm256_loadu_si256(pb), ones));
+            s[h] = _mm256_srli_epi16(_mm256_add_epi16(sum, two), 2);
+        }
+        // packus works per 128 bit lane, put the quarters back in order
+        __m256i packed = _mm256_packus_epi16(s[0], s[1]);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x),
+                            _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    return x;
+}
+#endif
+
+// 2x2 box of rows a and b (b == a on a bottom edge) into
+// outW samples. An odd source width has a last column of
+// its own, only averaged vertically.
+void boxRow(const uint8_t* a, const uint8_t* b, int srcW, int outW, uint8_t* dst,
+            yuv::SimdLevel level) {
+    int pairs = std::min(outW, srcW / 2);
+    int done = 0;
+    switch (level) {
+#ifdef SQUIG_X86
+        case yuv::SimdLevel::kAVX2:
+            done = boxAVX2(a, b, pairs, dst);
+            done += boxSSE41(a + 2 * done, b + 2 * done, pairs - done, dst + done);
+            break;
+        case yuv::SimdLevel::kSSE41:
+            done = boxSSE41(a, b, pairs, dst);
+            break;
+#endif
+        default:
+            break;
+    }
+    boxScalar(a, b, done, pairs, dst);
+    for (int x = pairs; x < outW; x++) {
+        dst[x] = uint8_t((a[2 * x] + b[2 * x] + 1) >> 1);
+    }
+}
+
+// A plane of one level, rows numbered as in the level
+// (data holds row first onwards).
+struct Plane {
+    uint8_t* data;
+    int stride;
+    int first = 0;
+    uint8_t* row(int r) const { return data + (ptrdiff_t)(r - first) * stride; }
+};
+
+// Per worker scratch for the reduced planes of one strip
+// (unless a gray target takes the Y rows directly).
+// Grows once, then reused.
+struct Scratch {
+    std::vector<uint8_t> y2, u2, v2, y4, u4, v4;
+};
+thread_local Scratch tScratch;
+
+// A strip-sized scratch plane, holding rows firstRow on.
+Plane scratchPlane(std::vector<uint8_t>& buf, int rows, int width, int firstRow) {
+    buf.resize((size_t)rows * width + kSlack);
+    return Plane{buf.data(), width, firstRow};
+}
+
+struct Job {
+    const AVFrame* src;
+    const Targets* t;
+    yuv::ColorParams cp;
+    yuv::SimdLevel level;
+    bool packed2, packed4;  // any BGR/RGB target at that level
+    bool any4;
+};
+
+void convertLevel(const Job& j, const Plane& y, const Plane& u, const Plane& v,
+                  int width, int rowBegin, int rowEnd, int div) {
+    // convertRows counts rows from the planes' start, and
+    // rowBegin is even, so chroma row rowBegin / 2 lines up
+    yuv::Planes p{{y.row(rowBegin), u.row(rowBegin / 2), v.row(rowBegin / 2)},
+                  {y.stride, u.stride, v.stride},
+                  width,
+                  rowEnd - rowBegin};
+    for (PyramidFormat f : {PyramidFormat::kBGR24, PyramidFormat::kRGB24}) {
+        size_t i = idx(f, div);
+        if (!j.t->data[i]) {
+            continue;
+        }
+        Plane dst{j.t->data[i], j.t->stride[i]};
+        yuv::convertRows(p, 0, rowEnd - rowBegin, dst.row(rowBegin), dst.stride,
+                         j.cp,
+                         f == PyramidFormat::kRGB24 ? yuv::Order::kRGB
+                                                    : yuv::Order::kBGR,
+                         j.level);
+    }
+}
+
+void runStrip(const Job& j, int r0) {
+    const Targets& t = *j.t;
+    const AVFrame* src = j.src;
+    int w = src->width, h = src->height;
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    // level sizes, luma and chroma
+    int w2 = w / 2, h2 = h / 2, cw2 = (w2 + 1) / 2, ch2 = (h2 + 1) / 2;
+    int w4 = w2 / 2, h4 = h2 / 2, cw4 = (w4 + 1) / 2, ch4 = (h4 + 1) / 2;
+    Scratch& s = tScratch;
+
+    if (t.bgr) {
+        yuv::Planes p{{src->data[0] + (size_t)r0 * src->linesize[0],
+                       src->data[1] + (size_t)(r0 / 2) * src->linesize[1],
+                       src->data[2] + (size_t)(r0 / 2) * src->linesize[2]},
+                      {src->linesize[0], src->linesize[1], src->linesize[2]},
+                      w,
+                      h};
+        yuv::convertRows(p, 0, std::min(kStripRows, h - r0),
+                         t.bgr + (size_t)r0 * t.bgrStride, t.bgrStride, j.cp,
+                         yuv::Order::kBGR, j.level);
+    }
+
+    Plane Y{src->data[0], src->linesize[0]};
+    Plane U{src->data[1], src->linesize[1]};
+    Plane V{src->data[2], src->linesize[2]};
+
+    // half: 4 luma rows, 2 chroma rows
+    int y2Begin = r0 / 2, y2End = std::min(y2Begin + kStripRows / 2, h2);
+    size_t g2 = idx(PyramidFormat::kGray, 2);
+    Plane Y2 = t.data[g2] ? Plane{t.data[g2], t.stride[g2]}
+                          : scratchPlane(s.y2, kStripRows / 2, w2, y2Begin);
+    for (int r = y2Begin; r < y2End; r++) {
+        boxRow(Y.row(2 * r), Y.row(2 * r + 1), w, w2, Y2.row(r), j.level);
+    }
+    int c2Begin = r0 / 4, c2End = std::min(c2Begin + kStripRows / 4, ch2);
+    Plane U2 = scratchPlane(s.u2, kStripRows / 4, cw2, c2Begin);
+    Plane V2 = scratchPlane(s.v2, kStripRows / 4, cw2, c2Begin);
+    if (j.packed2 || j.packed4) {
+        for (int r = c2Begin; r < c2End; r++) {
+            int below = std::min(2 * r + 1, ch - 1);
+            boxRow(U.row(2 * r), U.row(below), cw, cw2, U2.row(r), j.level);
+            boxRow(V.row(2 * r), V.row(below), cw, cw2, V2.row(r), j.level);
+        }
+    }
+    if (j.packed2 && y2Begin < y2End) {
+        convertLevel(j, Y2, U2, V2, w2, y2Begin, y2End, 2);
+    }
+    if (!j.any4) {
+        return;
+    }
+
+    // quarter, from the half strip: 2 luma rows, 1 chroma row
+    int y4Begin = r0 / 4, y4End = std::min(y4Begin + kStripRows / 4, h4);
+    size_t g4 = idx(PyramidFormat::kGray, 4);
+    Plane Y4 = t.data[g4] ? Plane{t.data[g4], t.stride[g4]}
+                          : scratchPlane(s.y4, kStripRows / 4, w4, y4Begin);
+    for (int r = y4Begin; r < y4End; r++) {
+        boxRow(Y2.row(2 * r), Y2.row(2 * r + 1), w2, w4, Y4.row(r), j.level);
+    }
+    if (!j.packed4 || y4Begin >= y4End) {
+        return;
+    }
+    int c4 = r0 / 8;
+    Plane U4 = scratchPlane(s.u4, 1, cw4, c4);
+    Plane V4 = scratchPlane(s.v4, 1, cw4, c4);
+    if (c4 < ch4) {
+        int below = std::min(2 * c4 + 1, ch2 - 1);
+        boxRow(U2.row(2 * c4), U2.row(below), cw2, cw4, U4.row(c4), j.level);
+        boxRow(V2.row(2 * c4), V2.row(below), cw2, cw4, V4.row(c4), j.level);
+    }
+    convertLevel(j, Y4, U4, V4, w4, y4Begin, y4End, 4);
+}
+
+}  // namespace
+
+void build(const AVFrame* src,
+           const Targets& t,
+           ParallelFor* pWorkers,
+           yuv::SimdLevel level) {
+    auto has = [&](PyramidFormat f, int div) { return t.data[idx(f, div)] != nullptr; };
+    Job j{src,
+          &t,
+          yuv::colorParamsOf(src),
+          level,
+          has(PyramidFormat::kBGR24, 2) || has(PyramidFormat::kRGB24, 2),
+          has(PyramidFormat::kBGR24, 4) || has(PyramidFormat::kRGB24, 4),
+          false};
+    j.any4 = j.packed4 || has(PyramidFormat::kGray, 4);
+    bool any2 = j.packed2 || has(PyramidFormat::kGray, 2);
+    if (!t.bgr && !any2 && !j.any4) {
+        return;
+    }
+    // 8 strips = 64 rows per chunk, as yuv::convertFrame
+    constexpr size_t kStripGrain = 8;
+    size_t strips = (src->height + kStripRows - 1) / kStripRows;
+    auto body = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            runStrip(j, int(i) * kStripRows);
+        }
+    };
+    if (!pWorkers) {
+        body(0, strips);
+        return;
+    }
+    pWorkers->run(strips, kStripGrain, body);
+}
+
+}  // namespace pyramid
@@ -0,0 +1,447 @@
+#include "squig/recorder.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+}
+
+#include "squig/utils.hpp"
+
+namespace {
+// RTMP/FLV SoundFormat
+constexpr int kSoundFormatAAC = 10;
+
+uint64_t wallMs() {
+    using clock = std::chrono::system_clock;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               clock::now().time_since_epoch())
+        .count();
+}
+
+// sample rate and channel count from an AudioSpecificConfig
+// (ISO 14496-3 1.6.2.1), the mp4 muxer wants both.
+bool parseAAC(const std::vector<uint8_t>& asc, int& sampleRate, int& channels) {
+    static constexpr int kRates[] = {96000, 88200, 64000, 48000, 44100,
+                                     32000, 24000, 22050, 16000, 12000,
+                                     11025, 8000,  7350};
+    if (asc.size() < 2) {
+        return false;
+    }
+    int freqIdx = (asc[0] & 0x07) << 1 | asc[1] >> 7;
+    if (freqIdx == 0x0f) {
+        // explicit 24 bit rate follows
+        if (asc.size() < 5) {
+            return false;
+        }
+        sampleRate = (asc[1] & 0x7f) << 17 | asc[2] << 9 | asc[3] << 1 | asc[4] >> 7;
+        channels = (asc[4] >> 3) & 0x0f;
+    } else if (freqIdx < 13) {
+        sampleRate = kRates[freqIdx];
+        channels = (asc[1] >> 3) & 0x0f;
+    } else {
+        return false;
+    }
+    // 0 means "defined elsewhere (PCE)", stereo is the safe guess
+    if (channels == 0) {
+        channels = 2;
+    }
+    return true;
+}
+
+void setExtradata(AVCodecParameters* par, const std::vector<uint8_t>& data) {
+    par->extradata =
+        (uint8_t*)av_mallocz(data.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+    par->extradata_size = data.size();
+    memcpy(par->extradata, data.data(), data.size());
+}
+}  // namespace
+
+Recorder::Recorder(int sessionId, const StreamConfig& config)
+    : m_sessionId(sessionId),
+      m_dir(config.recordDir),
+      m_format(config.recordFormat),
+      m_segmentMs(int64_t(config.segmentSec) * 1000),
+      m_keepSegments(config.keepSegments) {
+    m_pPkt = av_packet_alloc();
+    m_thread = std::thread(&Recorder::writeLoop, this);
+}
+
+Recorder::~Recorder() {
+    stop();
+    av_packet_free(&m_pPkt);
+}
+
+void Recorder::enqueue(ItemKind kind,
+                       const std::vector<char>& payload,
+                       const librtmp::RTMPMediaMessage& m,
+                       bool keyframe) {
+    bool isVideo = kind == ItemKind::kVideo;
+    if (isVideo && m_waitForKeyframe && !keyframe) {
+        m_dropped++;
+        return;
+    }
+    Item item;
+    item.kind = kind;
+    item.au.pSlot = m_pool.copyIn(
+        reinterpret_cast<const uint8_t*>(payload.data()), payload.size());
+    if (!item.au.pSlot) {
+        // every slot still queued, i.e. the disk is behind
+        m_waitForKeyframe |= isVideo;
+        m_dropped++;
+        return;
+    }
+    item.au.size = payload.size();
+    item.au.dts = m.timestamp;
+    item.au.cts = isVideo ? m.video.d.composition_time : 0;
+    item.au.keyframe = keyframe;
+    item.wallMs = wallMs();
+    if (!m_queue.tryPush(std::move(item))) {
+        m_waitForKeyframe |= isVideo;
+        m_dropped++;
+        return;
+    }
+    if (isVideo) {
+        m_waitForKeyframe = false;
+    }
+}
+
+void Recorder::videoHeader(const librtmp::RTMPMediaMessage& m,
+                           int width,
+                           int height) {
+    Item item;
+    item.kind = ItemKind::kVideoHdr;
+    auto& payload = m.video.video_data_send;
+    item.au.pSlot = m_pool.copyIn(
+        reinterpret_cast<const uint8_t*>(payload.data()), payload.size());
+    item.au.size = payload.size();
+    item.width = width;
+    item.height = height;
+    // losing a header would lose every segment after it,
+    // the rare case of a full queue gets no special care
+    // beyond resyncing video on the next keyframe.
+    if (!item.au.pSlot || !m_queue.tryPush(std::move(item))) {
+        m_waitForKeyframe = true;
+        m_dropped++;
+    }
+}
+
+void Recorder::video(const librtmp::RTMPMediaMessage& m) {
+    enqueue(ItemKind::kVideo, m.video.video_data_send, m,
+            m.video.d.frame_type == 1);
+}
+
+void Recorder::audio(const librtmp::RTMPMediaMessage& m) {
+    if (m.audio.d.sound_format != kSoundFormatAAC) {
+        return;
+    }
+    bool isHdr = m.audio.d.aac_packet_type == 0;
+    enqueue(isHdr ? ItemKind::kAudioHdr : ItemKind::kAudio,
+            m.audio.audio_data_send, m, false);
+}
+
+void Recorder::writeLoop() {
+    char name[16];
+    snprintf(name, sizeof(name), "sq-rec-%d", m_sessionId);
+    pthread_setname_np(pthread_self(), name);
+
+    Item item;
+    while (m_queue.waitPop(item)) {
+        if (m_abandon.load(std::memory_order_relaxed)) {
+            item.au.reset();
+            m_abandoned++;
+            continue;
+        }
+        m_maxDepth = std::max(m_maxDepth, m_queue.size() + 1);
+        handle(item);
+        // slot back to the pool (unless the muxer still
+        // holds a reference for interleaving)
+        item.au.reset();
+    }
+    closeSegment();
+    {
+        std::lock_guard<std::mutex> lock(m_doneLock);
+        m_done = true;
+    }
+    m_doneWake.notify_all();
+}
+
+void Recorder::handle(Item& item) {
+    const uint8_t* pData = item.au.data();
+    switch (item.kind) {
+        case ItemKind::kVideoHdr: {
+            std::vector<uint8_t> hdr(pData, pData + item.au.size);
+            if (hdr == m_avccHdr) {
+                return;  // repeated, e.g. on every keyframe
+            }
+            // new SPS/PPS, possibly a new resolution,
+            // the next keyframe starts a new segment.
+            closeSegment();
+            m_avccHdr = std::move(hdr);
+            m_width = item.width;
+            m_height = item.height;
+            return;
+        }
+        case ItemKind::kAudioHdr:
+            // only read when a segment opens, audio joins the
+            // recording at the next segment if it starts late.
+            m_aacHdr.assign(pData, pData + item.au.size);
+            return;
+        case ItemKind::kVideo:
+            if (m_pFmt && item.au.keyframe &&
+                item.au.dts - m_baseDts >= m_segmentMs) {
+                closeSegment();
+            }
+            if (!m_pFmt && !(item.au.keyframe && openSegment(item))) {
+                return;  // segments start at a keyframe
+            }
+            writePacket(m_videoIdx, item.au);
+            m_lastDts = item.au.dts;
+            return;
+        case ItemKind::kAudio:
+            if (m_pFmt && m_audioIdx >= 0 && item.au.dts >= m_baseDts) {
+                writePacket(m_audioIdx, item.au);
+            }
+            return;
+    }
+}
+
+bool Recorder::openSegment(const Item& first) {
+    if (m_avccHdr.empty()) {
+        return false;
+    }
+    const char* ext = recordFormatName(m_format);
+    m_current = {};
+    m_current.startMs = first.wallMs;
+    m_current.path = m_dir + "/squig-s" + std::to_string(m_sessionId) + "-" +
+                     std::to_string(first.wallMs) + "." + ext;
+
+    m_fd = open(m_current.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+    if (m_fd < 0) {
+        std::cerr << "[Session " << m_sessionId << "] record: can't open "
+                  << m_current.path << ": " << strerror(errno) << "\n";
+        m_errors++;
+        return false;
+    }
+
+    avformat_alloc_output_context2(&m_pFmt, nullptr,
+                                   m_format == RecordFormat::kTS ? "mpegts" : "mp4",
+                                   m_current.path.c_str());
+    if (!m_pFmt) {
+        close(m_fd);
+        m_fd = -1;
+        m_errors++;
+        return false;
+    }
+
+    // streams as received, time base is RTMP's ms
+    AVStream* pVideo = avformat_new_stream(m_pFmt, nullptr);
+    pVideo->time_base = {1, 1000};
+    pVideo->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    pVideo->codecpar->codec_id = AV_CODEC_ID_H264;
+    pVideo->codecpar->width = m_width;
+    pVideo->codecpar->height = m_height;
+    // avcC as is: mp4 stores it, mpegts inserts
+    // h264_mp4toannexb on its own.
+    setExtradata(pVideo->codecpar, m_avccHdr);
+    m_videoIdx = pVideo->index;
+
+    int sampleRate, channels;
+    m_audioIdx = -1;
+    if (parseAAC(m_aacHdr, sampleRate, channels)) {
+        AVStream* pAudio = avformat_new_stream(m_pFmt, nullptr);
+        pAudio->time_base = {1, 1000};
+        pAudio->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+        pAudio->codecpar->codec_id = AV_CODEC_ID_AAC;
+        pAudio->codecpar->sample_rate = sampleRate;
+        pAudio->codecpar->frame_size = 1024;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 24, 100)
+        av_channel_layout_default(&pAudio->codecpar->ch_layout, channels);
+#else
+        // before FFmpeg 5.1's AVChannelLayout
+        pAudio->codecpar->channel_layout = av_get_default_channel_layout(channels);
+        pAudio->codecpar->channels = channels;
+#endif
+        setExtradata(pAudio->codecpar, m_aacHdr);
+        m_audioIdx = pAudio->index;
+    }
+
+    // our own AVIO on top of the fd: a big buffer, so the
+    // muxer's many small writes reach the disk batched.
+    auto* pBuf = static_cast<unsigned char*>(av_malloc(kIOBufSize));
+    m_pFmt->pb = avio_alloc_context(pBuf, kIOBufSize, 1, this, nullptr,
+                                    &Recorder::writeCallback, nullptr);
+    m_pFmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+    // non-seekable output would otherwise flush every packet
+    m_pFmt->flush_packets = 0;
+
+    AVDictionary* pOpts = nullptr;
+    if (m_format == RecordFormat::kMP4) {
+        // fragmented: no seeking back for the moov, and a
+        // segment cut short (crash, power) stays playable.
+        av_dict_set(&pOpts, "movflags", "frag_keyframe+empty_moov+default_base_moof",
+                    0);
+    }
+    int ret = avformat_write_header(m_pFmt, &pOpts);
+    av_dict_free(&pOpts);
+    if (ret < 0) {
+        std::cerr << "[Session " << m_sessionId
+                  << "] record: can't write header for " << m_current.path
+                  << "\n";
+        m_errors++;
+        closeSegment();
+        unlink(m_current.path.c_str());
+        return false;
+    }
+    m_headerWritten = true;
+    m_baseDts = first.au.dts;
+    m_lastDts = first.au.dts;
+    return true;
+}
+
+void Recorder::writePacket(int streamIdx, const EncodedAU& au) {
+    AVPacket* pkt = m_pPkt;
+    // the muxer takes the packet's reference (it may hold on
+    // to it for interleaving), hand it one of its own.
+    pkt->buf = av_buffer_ref(au.buffer());
+    if (!pkt->buf) {
+        m_errors++;
+        return;
+    }
+    pkt->data = pkt->buf->data;
+    pkt->size = au.size;
+    pkt->stream_index = streamIdx;
+    pkt->dts = au.dts - m_baseDts;
+    pkt->pts = pkt->dts + au.cts;
+    // every AAC frame decodes on its own
+    pkt->flags = au.keyframe || streamIdx == m_audioIdx ? AV_PKT_FLAG_KEY : 0;
+    // write_header may have changed the stream's time base
+    AVRational ms{1, 1000};
+    AVRational tb = m_pFmt->streams[streamIdx]->time_base;
+    pkt->dts = av_rescale_q(pkt->dts, ms, tb);
+    pkt->pts = av_rescale_q(pkt->pts, ms, tb);
+    if (av_interleaved_write_frame(m_pFmt, pkt) < 0) {
+        m_errors++;
+    }
+    // unref'd by the muxer either way
+}
+
+void Recorder::closeSegment() {
+    if (!m_pFmt) {
+        return;
+    }
+    bool wroteHeader = std::exchange(m_headerWritten, false);
+    if (wroteHeader) {
+        av_write_trailer(m_pFmt);
+    }
+    if (m_pFmt->pb) {
+        avio_flush(m_pFmt->pb);
+        av_freep(&m_pFmt->pb->buffer);
+        avio_context_free(&m_pFmt->pb);
+    }
+    avformat_free_context(m_pFmt);
+    m_pFmt = nullptr;
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+    if (!wroteHeader) {
+        return;
+    }
+
+    m_current.durationMs = m_lastDts - m_baseDts;
+    m_index.push_back(m_current);
+    m_segments++;
+    // rolling: the oldest segments go, file and index entry
+    while (m_keepSegments && m_index.size() > m_keepSegments) {
+        unlink(m_index.front().path.c_str());
+        m_index.pop_front();
+    }
+    writeIndex();
+}
+
+void Recorder::writeIndex() {
+    std::string path = m_dir + "/squig-s" + std::to_string(m_sessionId) + ".index";
+    std::string tmp = path + ".tmp";
+    FILE* pFile = fopen(tmp.c_str(), "w");
+    if (!pFile) {
+        m_errors++;
+        return;
+    }
+    fprintf(pFile, "# path\tstart_unix_ms\tduration_ms\tbytes\n");
+    for (const SegmentInfo& s : m_index) {
+        fprintf(pFile, "%s\t%llu\t%llu\t%llu\n", s.path.c_str(),
+                (unsigned long long)s.startMs, (unsigned long long)s.durationMs,
+                (unsigned long long)s.bytes);
+    }
+    fclose(pFile);
+    // readers never see a half written index
+    if (rename(tmp.c_str(), path.c_str()) < 0) {
+        m_errors++;
+    }
+}
+
+int Recorder::writeCallback(void* opaque, WriteBuf buf, int size) {
+    auto* self = static_cast<Recorder*>(opaque);
+    uint64_t t0 = utils::nowUs();
+    int left = size;
+    while (left > 0) {
+        ssize_t n = write(self->m_fd, buf, left);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            self->m_errors++;
+            return AVERROR(errno);
+        }
+        buf += n;
+        left -= n;
+    }
+    self->m_writeTime.record(utils::nowUs() - t0);
+    self->m_current.bytes += size;
+    self->m_bytes += size;
+    return size;
+}
+
+void Recorder::stop() {
+    m_queue.close();
+    if (!m_thread.joinable()) {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_doneLock);
+        if (!m_doneWake.wait_for(lock, std::chrono::milliseconds(kFlushMs),
+                                 [this] { return m_done; })) {
+            // the disk is that far behind: the rest of the queue
+            // goes, the open segment still gets its trailer
+            m_abandon.store(true, std::memory_order_relaxed);
+        }
+    }
+    m_thread.join();
+}
+
+void Recorder::printStats() {
+    std::cout << "[Session " << m_sessionId << "] record: " << m_segments
+              << " segments, " << m_bytes / (1024 * 1024) << "MB, dropped "
+              << m_dropped << ", errors " << m_errors << ", max depth "
+              << m_maxDepth << "/" << kQueueLen << "\n";
+    if (m_abandoned > 0) {
+        std::cout << "[Session " << m_sessionId << "] record: " << m_abandoned
+                  << " AUs still queued after " << kFlushMs
+                  << "ms at stop, not written\n";
+    }
+    if (m_writeTime.count() > 0) {
+        std::cout << "[Session " << m_sessionId << "] record write(): "
+                  << m_writeTime.summary() << "\n";
+    }
+}
@@ -0,0 +1,214 @@
+#include "squig/replay.h"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "squig/flvreader.h"
+#include "squig/pcapreplay.h"
+#include "squig/perfstatistics.hpp"
+#include "squig/sessionserver.h"
+#include "squig/streamdecoder.h"
+#include "squig/trace.h"
+#include "squig/utils.hpp"
+
+namespace {
+double cpuSeconds() {
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    auto sec = [](const timeval& tv) { return tv.tv_sec + tv.tv_usec / 1e6; };
+    return sec(ru.ru_utime) + sec(ru.ru_stime);
+}
+
+void sleepUntilUs(uint64_t t) {
+    uint64_t now = utils::nowUs();
+    if (t > now) {
+        std::this_thread::sleep_for(std::chrono::microseconds(t - now));
+    }
+}
+
+bool endsWith(const std::string& s, const char* suffix) {
+    std::string x(suffix);
+    return s.size() >= x.size() && s.compare(s.size() - x.size(), x.size(), x) == 0;
+}
+
+// The publisher side of a socketpair: writes the captured
+// bytes, throws away whatever the server answers.
+void feedSocket(int fd, const PcapStream& s, ReplayPacing pacing) {
+    trace::nameThread("sq-replay");
+    char sink[4096];
+    uint64_t start = utils::nowUs();
+    for (const ReplayChunk& c : s.chunks) {
+        if (pacing == ReplayPacing::kWire) {
+            sleepUntilUs(start + c.tUs);
+        }
+        size_t sent = 0;
+        while (sent < c.data.size()) {
+            ssize_t n = send(fd, c.data.data() + sent, c.data.size() - sent,
+                             MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // session closed on its side, nothing left to do
+                close(fd);
+                return;
+            }
+            sent += n;
+        }
+        while (recv(fd, sink, sizeof(sink), MSG_DONTWAIT) > 0) {
+        }
+    }
+    // EOF ends the session; wait for it to close its end
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, sink, sizeof(sink), 0) > 0) {
+    }
+    close(fd);
+}
+
+ReplayResult replayPcap(const std::string& path,
+                        const StreamConfig& config,
+                        const ReplayOptions& opts) {
+    std::vector<PcapStream> streams = readPcapStreams(path, opts.capturePort);
+    if (streams.empty()) {
+        throw std::runtime_error(path + ": no connection to port " +
+                                 std::to_string(opts.capturePort));
+    }
+    for (const PcapStream& s : streams) {
+        std::cout << "replay: " << s.client << ", " << s.bytes << " bytes in "
+                  << s.chunks.size() << " chunks"
+                  << (s.truncated ? " (capture has a hole, truncated)" : "")
+                  << "\n";
+    }
+
+    // port 0: the listener is unused, don't clash with a live server
+    SessionServer server(0, config);
+    server.setExitWhenIdle(true);
+    std::vector<std::thread> writers;
+    for (const PcapStream& s : streams) {
+        for (int c = 0; c < opts.copies; c++) {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+                throw std::runtime_error("socketpair failed");
+            }
+            server.adopt(sv[0]);
+            writers.emplace_back(feedSocket, sv[1], std::cref(s), opts.pacing);
+        }
+    }
+
+    ReplayResult r;
+    r.streams = writers.size();
+    server.run();
+    for (auto& t : writers) {
+        t.join();
+    }
+    r.frames = server.allSessionsFrames();
+    r.aus = server.allSessionsAUs();
+    r.e2e.merge(server.allSessionsE2E());
+    return r;
+}
+
+// One FLV playback straight into a StreamDecoder, the way
+// RTMPSession::handleVideo() drives it.
+void feedDecoder(const std::string& path,
+                 const StreamConfig& config,
+                 ReplayPacing pacing,
+                 int id,
+                 ReplayResult& r,
+                 std::mutex& lock) {
+    trace::nameThread("sq-replay");
+    FlvReader reader(path);
+    PerfStatistics stats(utils::nowUs());
+    librtmp::ClientParameters params{};
+    std::unique_ptr<StreamDecoder> pDecoder;
+    uint64_t frames = 0, aus = 0;
+
+    FlvTag tag;
+    librtmp::RTMPMediaMessage m{};
+    uint64_t start = utils::nowUs();
+    int64_t ts0 = -1;
+    while (reader.next(tag)) {
+        flvMetaDimensions(tag, params.width, params.height);
+        if (!flvVideoToMessage(tag, m)) {
+            continue;
+        }
+        if (pacing == ReplayPacing::kWire) {
+            if (ts0 < 0) {
+                ts0 = tag.timestampMs;
+            }
+            sleepUntilUs(start + (tag.timestampMs - ts0) * 1000);
+        }
+        if (m.video.d.avc_packet_type == 0) {
+            // as a live session does, see RTMPSession::handleVideo()
+            if (pDecoder) {
+                pDecoder->reconfigure(m);
+            } else {
+                pDecoder = std::make_unique<StreamDecoder>(m, params, stats, id, config);
+            }
+            continue;
+        }
+        if (pDecoder) {
+            pDecoder->process(m);
+        }
+    }
+    if (pDecoder) {
+        pDecoder->stop();
+        pDecoder->printStageStats(id);
+        frames += pDecoder->framesDecoded();
+        aus += pDecoder->ausIn();
+    }
+
+    std::lock_guard<std::mutex> g(lock);
+    r.frames += frames;
+    r.aus += aus;
+    r.e2e.merge(stats.e2e().total());
+}
+
+ReplayResult replayFlv(const std::string& path,
+                       const StreamConfig& config,
+                       const ReplayOptions& opts) {
+    // fail early on a bad file, not in a thread
+    FlvReader probe(path);
+
+    ReplayResult r;
+    std::mutex lock;
+    std::vector<std::thread> feeders;
+    for (int c = 0; c < opts.copies; c++) {
+        feeders.emplace_back(feedDecoder, std::cref(path), std::cref(config),
+                             opts.pacing, c, std::ref(r), std::ref(lock));
+    }
+    for (auto& t : feeders) {
+        t.join();
+    }
+    r.streams = feeders.size();
+    return r;
+}
+}  // namespace
+
+ReplayResult replayFile(const std::string& path,
+                        const StreamConfig& config,
+                        const ReplayOptions& opts) {
+    uint64_t t0 = utils::nowUs();
+    double cpu0 = cpuSeconds();
+
+    StreamConfig replayConfig = config;
+    replayConfig.blockingIngest = opts.pacing == ReplayPacing::kFast;
+    ReplayResult r;
+    if (endsWith(path, ".flv")) {
+        r = replayFlv(path, replayConfig, opts);
+    } else {
+        r = replayPcap(path, replayConfig, opts);
+    }
+
+    r.wallSec = (utils::nowUs() - t0) / 1e6;
+    r.cpuSec = cpuSeconds() - cpu0;
+    return r;
+}
@@ -0,0 +1,199 @@
+#include "squig/rtmpframer.h"
+
+#include <algorithm>
+
+namespace {
+enum MessageType : uint8_t {
+    kSetChunkSize = 1,
+    kAbort = 2,
+    kAudio = 8,
+    kVideo = 9,
+};
+
+uint32_t be24(const uint8_t* p) { return (p[0] << 16) | (p[1] << 8) | p[2]; }
+
+uint32_t be32(const uint8_t* p) {
+    return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// 1 to 3 bytes, ids 0 and 1 flag the longer forms
+size_t basicHeaderLen(uint8_t b0) {
+    switch (b0 & 0x3f) {
+        case 0:
+            return 2;
+        case 1:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+uint32_t chunkStreamId(const uint8_t* h) {
+    switch (h[0] & 0x3f) {
+        case 0:
+            return 64 + h[1];
+        case 1:
+            return 64 + h[1] + (uint32_t(h[2]) << 8);
+        default:
+            return h[0] & 0x3f;
+    }
+}
+}  // namespace
+
+// Header bytes the next chunk needs, as far as the bytes
+// in so far tell: the basic header gives the format, the
+// timestamp (or, fmt 3, the stream's last header) whether
+// an extended timestamp follows.
+size_t RTMPFramer::headerLen() const {
+    static constexpr size_t kMessageHeader[4] = {11, 7, 3, 0};
+    if (m_hdr.empty()) {
+        return 1;
+    }
+    size_t basic = basicHeaderLen(m_hdr[0]);
+    int fmt = m_hdr[0] >> 6;
+    size_t len = basic + kMessageHeader[fmt];
+    if (fmt < 3) {
+        if (m_hdr.size() < basic + 3) {
+            return len;
+        }
+        if (be24(&m_hdr[basic]) == 0xffffff) {
+            len += 4;
+        }
+    } else {
+        if (m_hdr.size() < basic) {
+            return len;
+        }
+        auto it = m_streams.find(chunkStreamId(m_hdr.data()));
+        if (it != m_streams.end() && it->second.extTs) {
+            len += 4;
+        }
+    }
+    return len;
+}
+
+bool RTMPFramer::parseHeader() {
+    const uint8_t* h = m_hdr.data();
+    int fmt = h[0] >> 6;
+    ChunkStream& cs = m_streams[chunkStreamId(h)];
+    const uint8_t* mh = h + basicHeaderLen(h[0]);
+    if (fmt < 3) {
+        cs.extTs = be24(mh) == 0xffffff;
+    }
+    bool fresh = cs.remaining == 0;
+    if (fmt <= 1) {
+        // a new length and type; mid-message that means the
+        // publisher gave up on the old one
+        cs.length = be24(mh + 3);
+        cs.type = mh[6];
+        fresh = true;
+    }
+    if (fresh) {
+        cs.remaining = cs.length;
+        m_ctrlLen = 0;
+    }
+    m_hdr.clear();
+    m_skip = std::min(cs.remaining, m_chunkSize);
+    if (m_skip == 0) {
+        return messageDone(cs);  // empty message
+    }
+    m_pCur = &cs;
+    return true;
+}
+
+bool RTMPFramer::messageDone(const ChunkStream& cs) {
+    switch (cs.type) {
+        case kSetChunkSize:
+            if (m_ctrlLen < 4) {
+                return false;
+            }
+            m_chunkSize = be32(m_ctrl) & 0x7fffffff;
+            return m_chunkSize > 0;
+        case kAbort:
+            if (m_ctrlLen == 4) {
+                auto it = m_streams.find(be32(m_ctrl));
+                if (it != m_streams.end()) {
+                    it->second.remaining = 0;
+                }
+            }
+            return true;
+        case kAudio:
+        case kVideo:
+            m_mediaEnds.push_back(m_offset);
+            return true;
+        default:
+            return true;
+    }
+}
+
+bool RTMPFramer::feed(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        if (m_handshakeLeft > 0) {
+            size_t n = std::min(size, m_handshakeLeft);
+            m_handshakeLeft -= n;
+            data += n;
+            size -= n;
+            m_offset += n;
+            continue;
+        }
+        if (m_pCur) {
+            // payload, skipped except for the few bytes of
+            // the control messages that change the framing
+            size_t n = std::min<size_t>(size, m_skip);
+            if (m_pCur->type == kSetChunkSize || m_pCur->type == kAbort) {
+                size_t c = std::min<size_t>(n, sizeof(m_ctrl) - m_ctrlLen);
+                std::copy(data, data + c, m_ctrl + m_ctrlLen);
+                m_ctrlLen += c;
+            }
+            m_skip -= n;
+            m_pCur->remaining -= n;
+            data += n;
+            size -= n;
+            m_offset += n;
+            if (m_skip == 0) {
+                ChunkStream& cs = *m_pCur;
+                m_pCur = nullptr;
+                if (cs.remaining == 0 && !messageDone(cs)) {
+                    return false;
+                }
+            }
+            continue;
+        }
+        size_t need = headerLen();
+        while (m_hdr.size() < need && size > 0) {
+            size_t n = std::min(size, need - m_hdr.size());
+            m_hdr.insert(m_hdr.end(), data, data + n);
+            data += n;
+            size -= n;
+            m_offset += n;
+            need = headerLen();
+        }
+        if (m_hdr.size() < need) {
+            break;  // the rest of the header is still on its way
+        }
+        if (!parseHeader()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t RTMPFramer::takeMedia(uint64_t end) {
+    size_t n = 0;
+    while (!m_mediaEnds.empty() && m_mediaEnds.front() <= end) {
+        m_mediaEnds.pop_front();
+        n++;
+    }
+    return n;
+}
+
+bool RTMPFramer::midMessage() const {
+    if (!m_hdr.empty() || m_pCur) {
+        return true;
+    }
+    for (const auto& [id, cs] : m_streams) {
+        if (cs.remaining > 0) {
+            return true;
+        }
+    }
+    return false;
+}
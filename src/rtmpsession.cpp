@@ -0,0 +1,532 @@
+#include "squig/rtmpsession.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "squig/trace.h"
+#include "squig/utils.hpp"
+
+namespace {
+void throwErrno(const char* what) {
+    throw std::runtime_error(std::string(what) + ": " + std::strerror(errno));
+}
+
+void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+void setBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+void setReadTimeout(int fd, int ms) {
+    timeval tv{};
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// ours, easyRTMP's
+std::array<int, 2> relayPair() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        throwErrno("socketpair");
+    }
+    // the limit is the writer's send buffer, the read side
+    // for good measure
+    int size = RTMPSession::kRelayBuffer;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setNonBlocking(sv[0]);
+    return {sv[0], sv[1]};
+}
+}  // namespace
+
+RTMPSession::RTMPSession(int id,
+                         int fd,
+                         int epollFd,
+                         int wakeFd,
+                         const StreamConfig& config)
+    : RTMPSession(id, fd, epollFd, wakeFd, config, relayPair()) {}
+
+RTMPSession::RTMPSession(int id,
+                         int fd,
+                         int epollFd,
+                         int wakeFd,
+                         const StreamConfig& config,
+                         std::array<int, 2> relay)
+    : m_id(id),
+      m_fd(fd),
+      m_relayFd(relay[0]),
+      m_libFd(relay[1]),
+      m_epollFd(epollFd),
+      m_wakeFd(wakeFd),
+      m_config(config),
+      m_lastReadUs(utils::nowUs()),
+      m_pClient(std::make_unique<TCPNetwork>(relay[1])),
+      m_endpoint(m_pClient.get()),
+      m_session(&m_endpoint),
+      m_stats(utils::nowUs()) {
+    setNonBlocking(m_fd);
+    setReadTimeout(m_libFd, kReaderTimeoutMs);
+
+    epoll_event ev{};
+    ev.events = m_peerEvents = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = m_fd;
+    bool ok = epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_fd, &ev) == 0;
+    ev.events = m_relayEvents = EPOLLIN;
+    ev.data.fd = m_relayFd;
+    if (!ok || epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_relayFd, &ev) < 0) {
+        int err = errno;
+        epoll_ctl(m_epollFd, EPOLL_CTL_DEL, m_fd, nullptr);
+        close(m_relayFd);  // m_pClient closes the other end
+        errno = err;
+        throwErrno("epoll_ctl");
+    }
+
+    if (!m_config.recordDir.empty()) {
+        m_pRecorder = std::make_unique<Recorder>(m_id, m_config);
+    }
+    if (m_config.metrics) {
+        m_metrics = m_config.metrics->add(
+            [this](MetricsWriter& w) { collectMetrics(w); });
+    }
+    m_readerThread = std::thread(&RTMPSession::readerLoop, this);
+}
+
+RTMPSession::~RTMPSession() {
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, m_fd, nullptr);
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, m_relayFd, nullptr);
+    {
+        std::lock_guard<std::mutex> lock(m_readerLock);
+        m_quit = true;
+    }
+    m_readerWake.notify_one();
+    // a reader thread still waiting on the publisher reads EOF
+    shutdown(m_relayFd, SHUT_RDWR);
+    m_readerThread.join();
+    close(m_relayFd);
+    close(m_fd);
+}
+
+void RTMPSession::readerLoop() {
+    char name[16];
+    snprintf(name, sizeof(name), "sq-reader-%d", m_id);
+    pthread_setname_np(pthread_self(), name);
+    trace::nameThread(name);
+    std::unique_lock<std::mutex> lock(m_readerLock);
+    while (!m_quit) {
+        lock.unlock();
+        // The first time round the handshake and
+        // connect/publish exchange inside easyRTMP, up to the
+        // first media message. Then whenever handOff() asks.
+        Reader result = Reader::kDone;
+        try {
+            m_handoff = m_session.GetRTMPMessage();
+        } catch (...) {
+            result = Reader::kFailed;
+        }
+        m_reader.store(result, std::memory_order_release);
+        uint64_t one = 1;
+        [[maybe_unused]] ssize_t r = write(m_wakeFd, &one, sizeof(one));
+        lock.lock();
+        if (result == Reader::kFailed) {
+            return;
+        }
+        m_readerWake.wait(lock, [this] {
+            return m_quit ||
+                   m_reader.load(std::memory_order_relaxed) == Reader::kThread;
+        });
+    }
+}
+
+void RTMPSession::pollReader() {
+    Reader reader = m_reader.load(std::memory_order_acquire);
+    if (reader == Reader::kThread || reader == Reader::kLoop) {
+        return;
+    }
+    if (reader == Reader::kFailed) {
+        throw std::runtime_error("RTMP read failed");
+    }
+    // From here on easyRTMP only reads what the framer has
+    // seen whole: a framing mismatch fails the read (EAGAIN)
+    // and closes the session instead of waiting.
+    setNonBlocking(m_libFd);
+    m_reader.store(Reader::kLoop, std::memory_order_relaxed);
+
+    // the reader thread read the next media message
+    m_ready += m_framer.takeMedia(m_relayed);
+    if (m_ready > 0) {
+        m_ready--;
+    }
+    handleMessage(m_handoff);
+    m_handoff = {};
+    dispatch();
+    if (m_peerClosed && m_reader.load(std::memory_order_relaxed) == Reader::kLoop) {
+        throw std::runtime_error("peer closed");
+    }
+    watch();
+}
+
+void RTMPSession::onReadable() {
+    // A few reads per event, so one busy publisher can't
+    // starve the others; level-triggered epoll comes back
+    // for the rest.
+    uint8_t buf[64 * 1024];
+    for (int reads = 0; reads < 4 && m_toLib.size() < kMaxBuffered; reads++) {
+        ssize_t n = recv(m_fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            throwErrno("recv");
+        }
+        if (n == 0) {
+            m_peerClosed = true;
+            break;
+        }
+        if (!m_framer.feed(buf, n)) {
+            throw std::runtime_error("not an RTMP stream");
+        }
+        m_toLib.insert(m_toLib.end(), buf, buf + n);
+        m_lastReadUs = utils::nowUs();
+        if (size_t(n) < sizeof(buf)) {
+            break;  // drained
+        }
+    }
+    relayToLib();
+    dispatch();
+    if (m_peerClosed && m_reader.load(std::memory_order_relaxed) == Reader::kLoop) {
+        // after everything it sent that was whole, e.g. a
+        // replay's last frames. The reader thread still busy:
+        // once it's done, see pollReader().
+        throw std::runtime_error("peer closed");
+    }
+    watch();
+}
+
+void RTMPSession::onWritable() {
+    flushPeer();
+    watch();
+}
+
+void RTMPSession::onRelayEvent(uint32_t events) {
+    if (events & EPOLLIN) {
+        uint8_t buf[16 * 1024];
+        while (true) {
+            ssize_t n = recv(m_relayFd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                m_toPeer.insert(m_toPeer.end(), buf, buf + n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            throw std::runtime_error("easyRTMP side closed");
+        }
+        flushPeer();
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        throw std::runtime_error("easyRTMP side closed");
+    }
+    if (events & EPOLLOUT) {
+        // easyRTMP made room
+        relayToLib();
+        dispatch();
+    }
+    watch();
+}
+
+bool RTMPSession::stalled(uint64_t nowUs, uint64_t timeoutUs) const {
+    // while the reader thread has it, its read timeout applies
+    return m_reader.load(std::memory_order_relaxed) == Reader::kLoop &&
+           m_framer.midMessage() && nowUs - m_lastReadUs > timeoutUs;
+}
+
+void RTMPSession::relayToLib() {
+    size_t sent = 0;
+    while (sent < m_toLib.size()) {
+        ssize_t n = send(m_relayFd, m_toLib.data() + sent, m_toLib.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            throwErrno("relay");
+        }
+        sent += n;
+    }
+    m_toLib.erase(m_toLib.begin(), m_toLib.begin() + sent);
+    m_relayed += sent;
+}
+
+void RTMPSession::dispatch() {
+    if (m_reader.load(std::memory_order_relaxed) != Reader::kLoop) {
+        return;
+    }
+    while (true) {
+        relayToLib();
+        m_ready += m_framer.takeMedia(m_relayed);
+        if (m_ready == 0) {
+            if (m_framer.hasMedia()) {
+                // whole here, but the socketpair is full of it
+                handOff();
+            }
+            return;
+        }
+        // control messages in between are read along with
+        // the media message after them
+        for (; m_ready > 0; m_ready--) {
+            librtmp::RTMPMediaMessage message = m_session.GetRTMPMessage();
+            handleMessage(message);
+        }
+    }
+}
+
+// The reader thread waits for the rest of the message,
+// the loop relays it as the socketpair makes room. All of
+// it is here already, that takes as long as copying it.
+void RTMPSession::handOff() {
+    setBlocking(m_libFd);
+    {
+        std::lock_guard<std::mutex> lock(m_readerLock);
+        m_reader.store(Reader::kThread, std::memory_order_relaxed);
+    }
+    m_readerWake.notify_one();
+}
+
+void RTMPSession::flushPeer() {
+    size_t sent = 0;
+    while (sent < m_toPeer.size()) {
+        ssize_t n = send(m_fd, m_toPeer.data() + sent, m_toPeer.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            throwErrno("send");
+        }
+        sent += n;
+    }
+    m_toPeer.erase(m_toPeer.begin(), m_toPeer.begin() + sent);
+}
+
+void RTMPSession::watch() {
+    // Level-triggered, so only what can make progress: no
+    // reading while the buffer before easyRTMP is full or
+    // the publisher is gone, room only while there's
+    // something to write.
+    uint32_t peer = 0;
+    if (!m_peerClosed && m_toLib.size() < kMaxBuffered) {
+        peer |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (!m_toPeer.empty()) {
+        peer |= EPOLLOUT;
+    }
+    uint32_t relay = EPOLLIN | (m_toLib.empty() ? 0 : EPOLLOUT);
+    auto update = [this](int fd, uint32_t& registered, uint32_t events) {
+        if (events == registered) {
+            return;
+        }
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(m_epollFd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+            throwErrno("epoll_ctl");
+        }
+        registered = events;
+    };
+    update(m_fd, m_peerEvents, peer);
+    update(m_relayFd, m_relayEvents, relay);
+}
+
+void RTMPSession::handleVideo(librtmp::RTMPMediaMessage& m,
+                              librtmp::ClientParameters* sourceParams) {
+    // do the Decode -> Display
+    // The first rtmp message (header, avc_packet_type=0) initializes the client
+    // params i.e. video height frame rate etc. It is an AMF message. Confirmed
+    // from printf in easyrtmp handleAMF()
+
+    // From assts/extracting-NALU.png:
+    // NALUs of the same frame have the same timestamp
+    // ---
+    // https://rtmp.veriskope.com/pdf/video_file_format_spec_v10.pdf
+    // https://stackoverflow.com/questions/24884827/possible-locations-for-sequence-picture-parameter-sets-for-h-264-stream
+    // video_data_send: One or more NALUs, in a buffer, either VCL or non-VCL
+    // The bytes in the video_data_send are in AVCC format,
+    // they specify the length of NALU, and then contain the raw data.
+    // EasyRTMP populates m.d with supplementary RTMP info as in spec.
+    // EasyRTMP ensures each MediaMessage contains a single Access Unit (Frame)
+    // which is made up of several NALUs.
+    //
+    // VCL NALU: A slice of a video frame, contains pure image data.
+    // VCL type 5: NALU is a single encoded image (video frame).
+    // VCL type 1: Non-VCL NALU:
+    bool isAVCCHdr = (m.video.d.avc_packet_type == 0);
+    if (m_pRecorder) {
+        // queued for the recorder thread before decoding,
+        // same payload, untouched.
+        if (isAVCCHdr) {
+            m_pRecorder->videoHeader(m, sourceParams->width, sourceParams->height);
+        } else {
+            m_pRecorder->video(m);
+        }
+    }
+    if (isAVCCHdr) {
+        if (m_pDecoder) {
+            // a new one mid-stream (bitrate/resolution
+            // adaptation): same pipeline, reconfigured in
+            // stream order, no frame or IDR lost.
+            m_pDecoder->reconfigure(m);
+            return;
+        }
+        auto pDecoder =
+            std::make_unique<StreamDecoder>(m, *sourceParams, m_stats, m_id, m_config);
+        std::lock_guard<std::mutex> lock(m_decoderLock);
+        m_pDecoder = std::move(pDecoder);
+        return;
+    }
+    // RTMPMediaMessage -> AVPacket -> <avc_decode> -> AVFrame (uncompressed)
+    // AVFrame.data -> cv::Mat() -> DISPLAY on screen!:
+    // https://github.com/leandromoreira/ffmpeg-libav-tutorial/blob/master/0_hello_world.c
+    if (m_pDecoder) {
+        m_pDecoder->process(m);
+    }
+}
+
+void RTMPSession::handleMessage(librtmp::RTMPMediaMessage& message) {
+    // the hand-off shows up nested as "ingest"
+    trace::Scope span("rtmp_message");
+    if (message.message_type == librtmp::RTMPMessageType::VIDEO) {
+        // the frame id every later stage uses, i.e. the pts
+        span.setFrame(message.timestamp + message.video.d.composition_time);
+    }
+
+    // get received media codec parameters and streaming key
+    auto params = m_session.GetClientParameters();
+    switch (message.message_type) {
+        case librtmp::RTMPMessageType::VIDEO: {
+            // single writer, no RMW needed
+            m_videoMessages.store(m_videoMessages.load(std::memory_order_relaxed) + 1,
+                                  std::memory_order_relaxed);
+            m_videoBytes.store(m_videoBytes.load(std::memory_order_relaxed) +
+                                   message.video.video_data_send.size(),
+                               std::memory_order_relaxed);
+            handleVideo(message, params);
+            m_fifoIdx++;
+            break;
+        }
+        case librtmp::RTMPMessageType::AUDIO:
+            m_audioMessages.store(m_audioMessages.load(std::memory_order_relaxed) + 1,
+                                  std::memory_order_relaxed);
+            m_audioBytes.store(m_audioBytes.load(std::memory_order_relaxed) +
+                                   message.audio.audio_data_send.size(),
+                               std::memory_order_relaxed);
+            // not decoded, only recorded
+            if (m_pRecorder) {
+                m_pRecorder->audio(message);
+            }
+            break;
+    }
+}
+
+void RTMPSession::setDecodePolicy(const DecodePolicy& policy) {
+    m_config.decode = policy;
+    if (m_pDecoder) {
+        m_pDecoder->setDecodePolicy(policy);
+    }
+}
+
+uint64_t RTMPSession::framesDecoded() const {
+    return m_pDecoder ? m_pDecoder->framesDecoded() : 0;
+}
+
+void RTMPSession::collectMetrics(MetricsWriter& w) const {
+    // per second rates are the scraper's job (rate()), only
+    // totals here. Decoder and stage stats come from the
+    // decoder's own collector.
+    const std::string session = "session=\"" + std::to_string(m_id) + "\"";
+    const std::string video = session + ",type=\"video\"";
+    const std::string audio = session + ",type=\"audio\"";
+    w.counter("squig_rtmp_messages_total", "RTMP media messages read", video,
+              double(m_videoMessages.load(std::memory_order_relaxed)));
+    w.counter("squig_rtmp_messages_total", "RTMP media messages read", audio,
+              double(m_audioMessages.load(std::memory_order_relaxed)));
+    w.counter("squig_rtmp_bytes_total", "RTMP media payload bytes read", video,
+              double(m_videoBytes.load(std::memory_order_relaxed)));
+    w.counter("squig_rtmp_bytes_total", "RTMP media payload bytes read", audio,
+              double(m_audioBytes.load(std::memory_order_relaxed)));
+    for (size_t r = 0; r < size_t(DropReason::kCount); r++) {
+        auto reason = static_cast<DropReason>(r);
+        w.counter("squig_dropped_aus_total", "AUs dropped before decoding",
+                  session + ",reason=\"" + dropReasonName(reason) + "\"",
+                  double(m_stats.dropped(reason)));
+    }
+    uint64_t now = utils::nowUs();
+    w.summary("squig_e2e_latency_us",
+              "Socket read -> sink latency over the last 60s, us", session,
+              m_stats.e2e().window(60'000'000, now));
+    for (size_t s = 0; s < size_t(GlassStage::kCount); s++) {
+        auto stage = static_cast<GlassStage>(s);
+        const LatencyHistogram& h = m_stats.glass(stage);
+        if (h.count() > 0) {
+            // stamped streams only, all time
+            w.summary("squig_glass_latency_us",
+                      "Capture -> stage latency of stamped streams, us",
+                      session + ",stage=\"" + glassStageName(stage) + "\"", h);
+        }
+    }
+}
+
+void RTMPSession::printStats() {
+    std::cout << "[Session " << m_id << "] Terminated after " << m_fifoIdx
+              << " video messages\n";
+    if (m_pDecoder) {
+        // join the pipeline before reading stats it writes to
+        m_pDecoder->stop();
+        m_pDecoder->printStageStats(m_id);
+    }
+    if (m_pRecorder) {
+        // closes the last segment
+        m_pRecorder->stop();
+        m_pRecorder->printStats();
+    }
+    if (m_stats.count() > 0) {
+        uint64_t now = utils::nowUs();
+        const auto& e2e = m_stats.e2e();
+        std::cout << "[Session " << m_id << "] E2E (read -> "
+                  << sinkName(m_config.sink) << "): "
+                  << e2e.total().summary() << "\n"
+                  << "[Session " << m_id << "]   last 10s: "
+                  << e2e.window(10'000'000, now).summary() << "\n"
+                  << "[Session " << m_id << "]   last 60s: "
+                  << e2e.window(60'000'000, now).summary() << "\n";
+    }
+    if (m_stats.imshowCount() < 2) {
+        return;
+    }
+    std::cout << "[Session " << m_id << "] " << sinkName(m_config.sink)
+              << " period: "
+              << m_stats.imshow().total().summary() << "\n";
+}
@@ -0,0 +1,369 @@
+#include "squig/sessionserver.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "squig/trace.h"
+#include "squig/utils.hpp"
+
+namespace {
+void throwErrno(const char* what) {
+    throw std::runtime_error(std::string(what) + ": " + std::strerror(errno));
+}
+}  // namespace
+
+SessionServer::SessionServer(uint16_t port, const StreamConfig& config)
+    : m_config(config) {
+    m_listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listenFd < 0) {
+        throwErrno("socket");
+    }
+    int one = 1;
+    setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(m_listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) <
+        0) {
+        throwErrno("bind");
+    }
+    if (listen(m_listenFd, SOMAXCONN) < 0) {
+        throwErrno("listen");
+    }
+
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_traceFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_policyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_readerFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epollFd < 0 || m_stopFd < 0 || m_traceFd < 0 || m_policyFd < 0 ||
+        m_readerFd < 0) {
+        throwErrno("epoll/eventfd");
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = m_listenFd;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_listenFd, &ev);
+    ev.data.fd = m_stopFd;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_stopFd, &ev);
+    ev.data.fd = m_traceFd;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_traceFd, &ev);
+    ev.data.fd = m_policyFd;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_policyFd, &ev);
+    ev.data.fd = m_readerFd;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_readerFd, &ev);
+
+    if (m_config.metrics) {
+        m_metrics = m_config.metrics->add([this](MetricsWriter& w) {
+            w.gauge("squig_sessions", "Publishers connected now", "",
+                    double(m_activeSessions.load(std::memory_order_relaxed)));
+            w.counter("squig_sessions_accepted_total", "Publishers accepted", "",
+                      double(m_acceptedSessions.load(std::memory_order_relaxed)));
+        });
+    }
+    m_reaper = std::thread(&SessionServer::reapLoop, this);
+}
+
+SessionServer::~SessionServer() {
+    m_metrics.reset();
+    // sessions close their own sockets, and join their
+    // reader threads (which write m_readerFd)
+    m_sessions.clear();
+    stopReaper();
+    if (m_stopFd >= 0) close(m_stopFd);
+    if (m_readerFd >= 0) close(m_readerFd);
+    if (m_traceFd >= 0) close(m_traceFd);
+    if (m_policyFd >= 0) close(m_policyFd);
+    if (m_epollFd >= 0) close(m_epollFd);
+    if (m_listenFd >= 0) close(m_listenFd);
+}
+
+void SessionServer::acceptAll() {
+    // drain the backlog, the listen socket is non-blocking
+    while (true) {
+        int fd = accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN: backlog empty. Anything else (EMFILE etc.)
+            // is reported and retried on the next event.
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "accept: " << std::strerror(errno) << "\n";
+            }
+            return;
+        }
+
+        // Small frequent writes (acks) from the server side,
+        // don't let Nagle delay them.
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        adopt(fd);
+    }
+}
+
+void SessionServer::adopt(int fd) {
+    std::unique_ptr<RTMPSession> pSession;
+    int id = m_nextSessionId;
+    try {
+        // registers fd with the loop, non-blocking
+        pSession = std::make_unique<RTMPSession>(id, fd, m_epollFd, m_readerFd,
+                                                 m_config);
+    } catch (const std::exception& e) {
+        std::cerr << "session: " << e.what() << "\n";
+        close(fd);
+        return;
+    }
+    m_nextSessionId++;
+    m_relays.emplace(pSession->relayFd(), fd);
+    m_sessions.emplace(fd, std::move(pSession));
+    m_activeSessions.store(m_sessions.size(), std::memory_order_relaxed);
+    m_acceptedSessions.fetch_add(1, std::memory_order_relaxed);
+    std::cout << "[Session " << id << "] conn accepted ("
+              << m_sessions.size() << " active)" << std::endl;
+}
+
+void SessionServer::closeSession(int fd) {
+    auto it = m_sessions.find(fd);
+    if (it == m_sessions.end()) {
+        return;
+    }
+    // No more events for it. The fds stay open until the
+    // reaper destroys it, their numbers aren't reused before.
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, it->second->relayFd(), nullptr);
+    m_relays.erase(it->second->relayFd());
+    {
+        std::lock_guard<std::mutex> lock(m_reapLock);
+        m_toReap.push_back(std::move(it->second));
+    }
+    m_reapWake.notify_one();
+    m_sessions.erase(it);
+    m_activeSessions.store(m_sessions.size(), std::memory_order_relaxed);
+}
+
+// Stopping a session joins its decoder pipeline and
+// recorder (trailer writes, a slow disk), none of which
+// may hold up the loop.
+void SessionServer::reapLoop() {
+    pthread_setname_np(pthread_self(), "sq-reaper");
+    trace::nameThread("sq-reaper");
+    std::unique_lock<std::mutex> lock(m_reapLock);
+    while (true) {
+        m_reapWake.wait(lock, [this] { return m_reapStop || !m_toReap.empty(); });
+        if (m_toReap.empty()) {
+            return;  // stopping, and all reaped
+        }
+        std::vector<std::unique_ptr<RTMPSession>> batch;
+        batch.swap(m_toReap);
+        lock.unlock();
+        for (auto& pSession : batch) {
+            pSession->printStats();
+            m_allE2E.merge(pSession->stats().e2e().total());
+            m_allGlass.merge(pSession->stats().glass(GlassStage::kSink));
+            m_allFrames += pSession->framesDecoded();
+            m_allAUs += pSession->ausIn();
+            pSession.reset();
+        }
+        lock.lock();
+    }
+}
+
+void SessionServer::stopReaper() {
+    if (!m_reaper.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_reapLock);
+        m_reapStop = true;
+    }
+    m_reapWake.notify_one();
+    m_reaper.join();
+}
+
+void SessionServer::closeAll() {
+    while (!m_sessions.empty()) {
+        closeSession(m_sessions.begin()->first);
+    }
+    stopReaper();
+    if (m_allE2E.count() > 0) {
+        std::cout << "[All sessions] E2E (read -> "
+                  << sinkName(m_config.sink) << "): "
+                  << m_allE2E.summary() << "\n";
+    }
+    if (m_allGlass.count() > 0) {
+        // the number to track, publisher capture to sink
+        std::cout << "[All sessions] glass-to-glass (capture -> "
+                  << sinkName(m_config.sink) << "): " << m_allGlass.summary()
+                  << "\n";
+    }
+}
+
+void SessionServer::dumpTrace() {
+    uint64_t n;
+    [[maybe_unused]] ssize_t r = read(m_traceFd, &n, sizeof(n));
+    if (!trace::enabled()) {
+        std::cerr << "trace: built without SQUIG_ENABLE_TRACING\n";
+        return;
+    }
+    std::string path =
+        "squig-trace-" + std::to_string(utils::nowUs()) + ".json";
+    if (trace::dumpChrome(path.c_str())) {
+        std::cout << "trace: wrote " << path << std::endl;
+    } else {
+        std::cerr << "trace: can't write " << path << "\n";
+    }
+}
+
+void SessionServer::applyDecodePolicy() {
+    uint64_t n;
+    [[maybe_unused]] ssize_t r = read(m_policyFd, &n, sizeof(n));
+    DecodePolicy policy{m_reqMode.load(), m_reqFps.load()};
+    std::cerr << "Decode policy " << decodePolicyName(policy)
+              << " from the next IDR\n";
+    m_config.decode = policy;
+    for (auto& [fd, pSession] : m_sessions) {
+        pSession->setDecodePolicy(policy);
+    }
+}
+
+// Sessions whose reader thread finished get the message it
+// read dispatched, or go away if the read failed.
+void SessionServer::pollReaders() {
+    uint64_t n;
+    [[maybe_unused]] ssize_t r = read(m_readerFd, &n, sizeof(n));
+    std::vector<int> failed;
+    for (auto& [fd, pSession] : m_sessions) {
+        try {
+            pSession->pollReader();
+        } catch (...) {
+            failed.push_back(fd);
+        }
+    }
+    for (int fd : failed) {
+        closeSession(fd);
+    }
+}
+
+// The per-session deadline for a half-sent message.
+void SessionServer::closeStalled() {
+    uint64_t now = utils::nowUs();
+    if (now - m_lastSweepUs < uint64_t(kSweepMs) * 1000) {
+        return;
+    }
+    m_lastSweepUs = now;
+    std::vector<int> stalled;
+    for (auto& [fd, pSession] : m_sessions) {
+        if (pSession->stalled(now, uint64_t(kRecvTimeoutMs) * 1000)) {
+            stalled.push_back(fd);
+        }
+    }
+    for (int fd : stalled) {
+        std::cerr << "[Session " << m_sessions[fd]->id()
+                  << "] no progress on a message for " << kRecvTimeoutMs
+                  << "ms, closing\n";
+        closeSession(fd);
+    }
+}
+
+void SessionServer::run() {
+    trace::nameThread("sq-server");
+    epoll_event events[kMaxEvents];
+    while (true) {
+        int n = epoll_wait(m_epollFd, events, kMaxEvents, kSweepMs);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throwErrno("epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == m_stopFd) {
+                closeAll();
+                return;
+            }
+            if (fd == m_listenFd) {
+                acceptAll();
+                continue;
+            }
+            if (fd == m_traceFd) {
+                dumpTrace();
+                continue;
+            }
+            if (fd == m_policyFd) {
+                applyDecodePolicy();
+                continue;
+            }
+            if (fd == m_readerFd) {
+                pollReaders();
+                continue;
+            }
+            uint32_t ev = events[i].events;
+            auto relay = m_relays.find(fd);
+            int sessionFd = relay != m_relays.end() ? relay->second : fd;
+            auto it = m_sessions.find(sessionFd);
+            if (it == m_sessions.end()) {
+                continue;  // closed earlier in this batch
+            }
+            try {
+                if (relay != m_relays.end()) {
+                    it->second->onRelayEvent(ev);
+                    continue;
+                }
+                if (ev & EPOLLOUT) {
+                    it->second->onWritable();
+                }
+                if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    it->second->onReadable();
+                }
+            } catch (...) {
+                // connection terminated by peer or network conditions,
+                // only this session goes away.
+                closeSession(sessionFd);
+            }
+        }
+        closeStalled();
+        if (m_exitWhenIdle && m_sessions.empty()) {
+            closeAll();
+            return;
+        }
+    }
+}
+
+void SessionServer::stop() {
+    uint64_t one = 1;
+    // write() is async-signal-safe
+    [[maybe_unused]] ssize_t r = write(m_stopFd, &one, sizeof(one));
+}
+
+void SessionServer::requestTraceDump() {
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t r = write(m_traceFd, &one, sizeof(one));
+}
+
+void SessionServer::requestDecodePolicy(const DecodePolicy& policy) {
+    // fps first, a loop woken by an earlier request must not
+    // pair the new mode with the old rate.
+    m_reqFps.store(policy.fps);
+    m_reqMode.store(policy.mode);
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t r = write(m_policyFd, &one, sizeof(one));
+}
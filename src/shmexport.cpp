@@ -0,0 +1,223 @@
+#include "squig/shmexport.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+#include "squig/utils.hpp"
+
+namespace {
+size_t pageAlign(size_t v) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (v + page - 1) / page * page;
+}
+
+void wakeReaders(shm::Header* pHdr) {
+    // seq_cst, see ShmFrameReader::next()
+    pHdr->futex.fetch_add(1);
+    if (pHdr->waiters.load() != 0) {
+        // shared futex, readers are other processes
+        syscall(SYS_futex, &pHdr->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
+}  // namespace
+
+void ShmFrameExport::Region::release() {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        munmap(pBase, mapSize);
+        close(fd);
+        delete this;
+    }
+}
+
+ShmFrameExport::ShmFrameExport(std::string name, size_t slots)
+    : m_name(std::move(name)), m_slots(slots) {}
+
+ShmFrameExport::~ShmFrameExport() { retire(); }
+
+void ShmFrameExport::retire() {
+    if (!m_pRegion) {
+        return;
+    }
+    m_pRegion->pHdr->stale.store(1, std::memory_order_release);
+    wakeReaders(m_pRegion->pHdr);
+    // readers that have it mapped keep it, new ones
+    // find the replacement (or nothing)
+    shm_unlink(m_name.c_str());
+    m_pRegion->release();
+    m_pRegion = nullptr;
+}
+
+bool ShmFrameExport::configure(size_t bufSize) {
+    retire();
+    m_bufSize = bufSize;
+
+    size_t slotSize = pageAlign(bufSize);
+    size_t hdrSize = sizeof(shm::Header) + m_slots * sizeof(uint32_t);
+    size_t dataOffset = pageAlign(hdrSize);
+    size_t mapSize = dataOffset + m_slots * slotSize;
+
+    // a crashed run may have left one behind
+    shm_unlink(m_name.c_str());
+    int fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0660);
+    if (fd < 0 || ftruncate(fd, mapSize) < 0) {
+        std::cerr << "shm: can't create " << m_name << ": " << strerror(errno)
+                  << "\n";
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(m_name.c_str());
+        }
+        return false;
+    }
+    // tmpfs pages are only committed once the decoder
+    // writes to a slot.
+    void* p = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        shm_unlink(m_name.c_str());
+        return false;
+    }
+
+    auto* pRegion = new Region;
+    pRegion->fd = fd;
+    pRegion->pBase = static_cast<uint8_t*>(p);
+    pRegion->mapSize = mapSize;
+    pRegion->pHdr = reinterpret_cast<shm::Header*>(p);
+    pRegion->freeSlots.reserve(m_slots);
+    for (size_t i = m_slots; i-- > 0;) {
+        pRegion->freeSlots.push_back(static_cast<uint32_t>(i));
+    }
+
+    // ftruncate zeroed it, only the constants to fill in
+    shm::Header* pHdr = pRegion->pHdr;
+    pHdr->version = shm::kVersion;
+    pHdr->slotCount = static_cast<uint32_t>(m_slots);
+    pHdr->slotSize = slotSize;
+    pHdr->dataOffset = dataOffset;
+    // magic last, a reader that sees it sees the rest
+    std::atomic_thread_fence(std::memory_order_release);
+    reinterpret_cast<std::atomic<uint32_t>*>(&pHdr->magic)
+        ->store(shm::kMagic, std::memory_order_release);
+
+    m_pRegion = pRegion;
+    return true;
+}
+
+int ShmFrameExport::slotOf(const uint8_t* data) const {
+    if (!m_pRegion) {
+        return -1;
+    }
+    const shm::Header* pHdr = m_pRegion->pHdr;
+    const uint8_t* pData = m_pRegion->pBase + pHdr->dataOffset;
+    if (data < pData || data >= m_pRegion->pBase + m_pRegion->mapSize) {
+        return -1;  // heap fallback, or an older region
+    }
+    return static_cast<int>((data - pData) / pHdr->slotSize);
+}
+
+AVBufferRef* ShmFrameExport::allocBuffer(void* opaque, BufSize size) {
+    auto* self = static_cast<ShmFrameExport*>(opaque);
+    Region* pRegion = self->m_pRegion;
+    if (!pRegion || size_t(size) > pRegion->pHdr->slotSize) {
+        return av_buffer_allocz(size);
+    }
+    uint32_t slot;
+    {
+        std::lock_guard<std::mutex> lk(pRegion->lock);
+        if (pRegion->freeSlots.empty()) {
+            // more frames alive than slots, not exported
+            return av_buffer_allocz(size);
+        }
+        slot = pRegion->freeSlots.back();
+        pRegion->freeSlots.pop_back();
+    }
+    uint8_t* pData = pRegion->pBase + pRegion->pHdr->dataOffset +
+                     slot * pRegion->pHdr->slotSize;
+    pRegion->refs.fetch_add(1, std::memory_order_relaxed);
+    AVBufferRef* pBuf = av_buffer_create(pData, size, &ShmFrameExport::freeSlot,
+                                         pRegion, 0);
+    if (!pBuf) {
+        freeSlot(pRegion, pData);
+    }
+    return pBuf;
+}
+
+void ShmFrameExport::freeSlot(void* opaque, uint8_t* data) {
+    auto* pRegion = static_cast<Region*>(opaque);
+    const uint8_t* pData = pRegion->pBase + pRegion->pHdr->dataOffset;
+    auto slot = static_cast<uint32_t>((data - pData) / pRegion->pHdr->slotSize);
+    {
+        std::lock_guard<std::mutex> lk(pRegion->lock);
+        pRegion->freeSlots.push_back(slot);
+    }
+    pRegion->release();
+}
+
+void ShmFrameExport::onAcquire(const AVBufferRef* pBuf) {
+    int slot = slotOf(pBuf->data);
+    if (slot < 0) {
+        return;
+    }
+    auto& gen = shm::slotGens(m_pRegion->pHdr)[slot];
+    uint32_t g = gen.load(std::memory_order_relaxed);
+    if ((g & 1) == 0) {
+        // a reader still using the last frame in this slot
+        // sees the change, before the decoder's first write
+        gen.store(g + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+}
+
+bool ShmFrameExport::publish(const AVFrame* pFrame, uint64_t seq) {
+    int slot = pFrame->buf[0] ? slotOf(pFrame->buf[0]->data) : -1;
+    if (slot < 0) {
+        m_notExported++;
+        return false;
+    }
+    shm::Header* pHdr = m_pRegion->pHdr;
+    const uint8_t* pSlot =
+        m_pRegion->pBase + pHdr->dataOffset + slot * pHdr->slotSize;
+
+    // decoding is done, the content is stable from here on
+    auto& gen = shm::slotGens(pHdr)[slot];
+    uint32_t g = gen.load(std::memory_order_relaxed);
+    if (g & 1) {
+        g++;
+        gen.store(g, std::memory_order_release);
+    }
+
+    shm::FrameDesc& d = pHdr->desc[seq % shm::kDescs];
+    uint32_t lock = d.lock.load(std::memory_order_relaxed);
+    d.lock.store(lock + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    constexpr auto kRelaxed = std::memory_order_relaxed;
+    d.slot.store(slot, kRelaxed);
+    d.slotGen.store(g, kRelaxed);
+    d.fourcc.store(shm::kFourccI420, kRelaxed);
+    d.width.store(pFrame->width, kRelaxed);
+    d.height.store(pFrame->height, kRelaxed);
+    d.fullRange.store(pFrame->format == AV_PIX_FMT_YUVJ420P ||
+                          pFrame->color_range == AVCOL_RANGE_JPEG,
+                      kRelaxed);
+    for (int i = 0; i < 4; i++) {
+        bool plane = i < 3 && pFrame->data[i];
+        d.linesize[i].store(plane ? pFrame->linesize[i] : 0, kRelaxed);
+        d.planeOffset[i].store(plane ? pFrame->data[i] - pSlot : 0, kRelaxed);
+    }
+    d.seq.store(seq, kRelaxed);
+    d.pts.store(pFrame->pts, kRelaxed);
+    d.publishUs.store(utils::nowUs(), kRelaxed);
+    d.lock.store(lock + 2, std::memory_order_release);
+
+    pHdr->latestSeq.store(seq, std::memory_order_release);
+    wakeReaders(pHdr);
+    m_exported++;
+    return true;
+}
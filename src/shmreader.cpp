@@ -0,0 +1,173 @@
+#include "squig/shmreader.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+namespace {
+uint64_t monoUs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+}  // namespace
+
+bool ShmFrameReader::open(const std::string& name) {
+    close();
+    m_name = name;
+    return map();
+}
+
+bool ShmFrameReader::map() {
+    m_fd = shm_open(m_name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (m_fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(m_fd, &st) < 0 || size_t(st.st_size) < sizeof(shm::Header)) {
+        // just created, not sized yet
+        unmap();
+        return false;
+    }
+    // The pixels are mapped read-only, a reader can't corrupt
+    // Squig's frames; only the header is writable (waiters).
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (p == MAP_FAILED) {
+        unmap();
+        return false;
+    }
+    m_pBase = static_cast<uint8_t*>(p);
+    m_mapSize = st.st_size;
+    m_pHdr = reinterpret_cast<shm::Header*>(p);
+    auto* pMagic = reinterpret_cast<const std::atomic<uint32_t>*>(&m_pHdr->magic);
+    if (pMagic->load(std::memory_order_acquire) != shm::kMagic ||
+        m_pHdr->version != shm::kVersion ||
+        m_pHdr->dataOffset + uint64_t(m_pHdr->slotCount) * m_pHdr->slotSize >
+            m_mapSize) {
+        unmap();
+        return false;
+    }
+    if (mprotect(m_pBase, m_pHdr->dataOffset, PROT_READ | PROT_WRITE) < 0) {
+        unmap();
+        return false;
+    }
+    return true;
+}
+
+void ShmFrameReader::unmap() {
+    if (m_pBase) {
+        munmap(m_pBase, m_mapSize);
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+    m_fd = -1;
+    m_pBase = nullptr;
+    m_mapSize = 0;
+    m_pHdr = nullptr;
+}
+
+void ShmFrameReader::close() {
+    unmap();
+    m_cursor = 0;
+}
+
+bool ShmFrameReader::readDesc(uint64_t seq, ShmFrameView& v) const {
+    const shm::FrameDesc& d = m_pHdr->desc[seq % shm::kDescs];
+    constexpr auto kRelaxed = std::memory_order_relaxed;
+    for (int attempt = 0; attempt < 16; attempt++) {
+        uint32_t lock = d.lock.load(std::memory_order_acquire);
+        if (lock & 1) {
+            continue;  // being written, a few hundred ns
+        }
+        v.seq = d.seq.load(kRelaxed);
+        v.slot = d.slot.load(kRelaxed);
+        v.slotGen = d.slotGen.load(kRelaxed);
+        v.fourcc = d.fourcc.load(kRelaxed);
+        v.width = d.width.load(kRelaxed);
+        v.height = d.height.load(kRelaxed);
+        v.fullRange = d.fullRange.load(kRelaxed) != 0;
+        uint64_t offsets[4];
+        for (int i = 0; i < 4; i++) {
+            v.linesize[i] = d.linesize[i].load(kRelaxed);
+            offsets[i] = d.planeOffset[i].load(kRelaxed);
+        }
+        v.pts = d.pts.load(kRelaxed);
+        v.publishUs = d.publishUs.load(kRelaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (d.lock.load(kRelaxed) != lock) {
+            continue;
+        }
+        if (v.seq != seq || v.slot >= m_pHdr->slotCount) {
+            return false;  // lapped, the caller retries with a newer seq
+        }
+        const uint8_t* pSlot =
+            m_pBase + m_pHdr->dataOffset + uint64_t(v.slot) * m_pHdr->slotSize;
+        for (int i = 0; i < 4; i++) {
+            v.planes[i] = v.linesize[i] ? pSlot + offsets[i] : nullptr;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool ShmFrameReader::next(ShmFrameView& v, int timeoutMs) {
+    uint64_t deadline = monoUs() + uint64_t(timeoutMs) * 1000;
+    while (true) {
+        if (!m_pHdr && !map()) {
+            // not (yet) exported, e.g. between a resolution
+            // change's retire and recreate
+            if (monoUs() >= deadline) {
+                return false;
+            }
+            usleep(1000);
+            continue;
+        }
+        // read before latestSeq, so a publish in between
+        // changes it and the wait below returns at once
+        uint32_t futexVal = m_pHdr->futex.load(std::memory_order_acquire);
+        uint64_t latest = m_pHdr->latestSeq.load(std::memory_order_acquire);
+        if (latest > m_cursor && readDesc(latest, v) && valid(v)) {
+            m_cursor = latest;
+            return true;
+        }
+        if (m_pHdr->stale.load(std::memory_order_acquire)) {
+            // session over, or a new object for a new
+            // resolution under the same name
+            unmap();
+            continue;
+        }
+        uint64_t now = monoUs();
+        if (now >= deadline) {
+            return false;
+        }
+        if (latest > m_cursor) {
+            continue;  // raced with the writer, retry
+        }
+        uint64_t waitUs = deadline - now;
+        timespec ts{time_t(waitUs / 1000000), long(waitUs % 1000000) * 1000};
+        // announce the wait before the kernel compares the
+        // futex word, pairs with the writer's bump then load
+        // of waiters (both seq_cst): either it sees us, or
+        // FUTEX_WAIT sees its bump and returns at once.
+        m_pHdr->waiters.fetch_add(1);
+        syscall(SYS_futex, &m_pHdr->futex, FUTEX_WAIT, futexVal, &ts, nullptr, 0);
+        m_pHdr->waiters.fetch_sub(1);
+    }
+}
+
+bool ShmFrameReader::valid(const ShmFrameView& v) const {
+    if (!m_pHdr || v.slot >= m_pHdr->slotCount) {
+        return false;
+    }
+    // after the caller's reads of the pixels
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return shm::slotGens(m_pHdr)[v.slot].load(std::memory_order_relaxed) ==
+           v.slotGen;
+}
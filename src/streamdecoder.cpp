@@ -1,29 +1,179 @@
 #include "squig/streamdecoder.h"
 
-#include <opencv2/core.hpp>
-#include <opencv2/highgui.hpp>
+#include <pthread.h>
+#include <time.h>
 
+#include "squig/tensorbatcher.h"
+#include "squig/trace.h"
 #include "squig/utils.hpp"
 
-// 1. Is m_avccHdr doing a const to non-const conversion?
-StreamDecoder::StreamDecoder(const librtmp::RTMPMediaMessage& m,
+namespace {
+// shows up in top -H / perf, 15 chars max
+void nameThread(const char* stage, int sessionId) {
+    char name[16];
+    snprintf(name, sizeof(name), "sq-%s-%d", stage, sessionId);
+    pthread_setname_np(pthread_self(), name);
+    trace::nameThread(name);
+}
+
+uint64_t threadCpuUs() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Items a stage strand handles per run before it yields,
+// so a stream with a backlog can't hold a worker while
+// other streams' frames wait.
+constexpr size_t kStrandBatch = 4;
+
+// Executor mode stage body: pops up to kStrandBatch items
+// of in into onItem. Once in is closed and drained, finish
+// runs, once. Returns true if items may be left.
+template <typename Queue, typename Item, typename OnItem, typename OnFinish>
+bool drainSome(Queue& in, Item& item, StageStats& stage, OnItem onItem,
+               OnFinish onFinish) {
+    uint64_t c0 = threadCpuUs();
+    bool more = true;
+    for (size_t i = 0; i < kStrandBatch; i++) {
+        if (!in.tryPop(item)) {
+            // closed() first, an item pushed just before
+            // close() is still popped
+            bool closed = in.closed();
+            if (!closed || !in.tryPop(item)) {
+                if (closed && !stage.finished) {
+                    stage.finished = true;
+                    onFinish();
+                }
+                more = false;
+                break;
+            }
+        }
+        onItem(item);
+    }
+    stage.cpuUs += threadCpuUs() - c0;
+    return more;
+}
+
+void notifyStage(const std::unique_ptr<Strand>& pStrand) {
+    if (pStrand) {
+        pStrand->notify();
+    }
+}
+
+// profile_idc 66, no B slices: nothing to reorder
+constexpr uint8_t kBaselineProfile = 66;
+}  // namespace
+
+void applyDecodeProfile(AVCodecContext* pCtx,
+                        DecodeProfile profile,
+                        const h264::AVCConfig* pAvc) {
+    switch (profile) {
+        case DecodeProfile::kLowLatency:
+            // libavcodec's default, no pool: a pool per
+            // session would multiply threads by sessions, and
+            // camera streams are single slice, slice threads
+            // would have nothing to split anyway
+            pCtx->thread_count = 1;
+            // libavcodec's "non spec compliant speedup
+            // tricks", fine on what encoders send
+            pCtx->flags2 |= AV_CODEC_FLAG2_FAST;
+            if (pAvc && pAvc->profile == kBaselineProfile) {
+                pCtx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+            }
+            break;
+        case DecodeProfile::kBalanced:
+            pCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+            pCtx->thread_count = 2;
+            break;
+        case DecodeProfile::kThroughput:
+            pCtx->thread_type = FF_THREAD_FRAME;
+            pCtx->thread_count = 0;
+            pCtx->flags2 |= AV_CODEC_FLAG2_FAST;
+            break;
+    }
+}
+
+StreamDecoder::StreamDecoder(const librtmp::RTMPMediaMessage& avccHdr,
                              librtmp::ClientParameters& sourceParams,
-                             PerfStatistics& stats)
-    : m_avccHdr(m), m_sourceParams(sourceParams), m_stats(stats) {
+                             PerfStatistics& stats,
+                             int sessionId,
+                             const StreamConfig& config)
+    : m_sessionId(sessionId),
+      // only the record bytes, not the whole message
+      m_avccHdr(avccHdr.video.video_data_send.begin(),
+                avccHdr.video.video_data_send.end()),
+      m_config(config),
+      m_sourceParams(sourceParams),
+      m_stats(stats),
+      m_pSink(makeFrameSink(config, sessionId)),
+      m_convertAhead(m_pSink->wantsBGR() || !config.pyramid.empty()),
+      m_policy(config.decode),
+      m_budgetUs(uint64_t(config.latencyBudgetMs) * 1000) {
     //  get AV_CODEC ID from params->video_codec
     // codec_id.h
     AVCodecID cID = AV_CODEC_ID_H264;
     m_dec = avcodec_find_decoder(cID);
 
     m_pDecCtx = avcodec_alloc_context3(m_dec);
+    m_pPkt = av_packet_alloc();
+    if (config.shmExport) {
+        m_pShmExport = std::make_unique<ShmFrameExport>(
+            "/squig-s" + std::to_string(sessionId), kShmSlots);
+        m_yuvPool.setExport(m_pShmExport.get());
+    }
+    for (const PyramidLevel& l : config.pyramid) {
+        m_pConvPools->subscribe(l);
+    }
+    if (config.gopCacheBytes) {
+        m_pGopCache = std::make_unique<GopCache>(m_avccHdr, config.gopCacheBytes);
+    }
+    // the SPS knows better than the connect metadata
+    h264::AVCConfig avc;
+    bool parsed = h264::parseAVCConfig(m_avccHdr.data(), m_avccHdr.size(), avc);
+    m_width = parsed ? avc.width : int(sourceParams.width);
+    m_height = parsed ? avc.height : int(sourceParams.height);
 
     initDecoder();
+
+    if (config.metrics) {
+        m_metrics = config.metrics->add(
+            [this](MetricsWriter& w) { collectMetrics(w); });
+    }
+
+    // contexts are fully set up, from here on each
+    // is only touched by its own stage thread (or strand).
+    if (config.executor) {
+        Executor& exec = *config.executor;
+        bool shown =
+            config.sink == SinkType::kDisplay || config.sink == SinkType::kMosaic;
+        TaskPriority prio = shown ? TaskPriority::kLatency : TaskPriority::kBackground;
+        m_pDecodeStrand =
+            std::make_unique<Strand>(exec, prio, [this] { return decodeSome(); });
+        if (m_convertAhead) {
+            m_pConvertStrand = std::make_unique<Strand>(
+                exec, prio, [this] { return convertSome(); });
+        }
+        if (m_pSink->wantsOwnThread()) {
+            // imshow/waitKey hopping from worker to worker
+            // is worse than the thread the executor replaces
+            m_sinkThread = std::thread(&StreamDecoder::sinkLoop, this);
+        } else {
+            m_pSinkStrand =
+                std::make_unique<Strand>(exec, prio, [this] { return sinkSome(); });
+        }
+        return;
+    }
+    m_decodeThread = std::thread(&StreamDecoder::decodeLoop, this);
+    if (m_convertAhead) {
+        m_convertThread = std::thread(&StreamDecoder::convertLoop, this);
+    }
+    m_sinkThread = std::thread(&StreamDecoder::sinkLoop, this);
 }
 
 void StreamDecoder::initDecoder() {
     registerAVCCExtraData();
     registerDecoderCtx();
-    registerPixelFmtConversionCtx();
 }
 
 void StreamDecoder::registerDecoderCtx() {
@@ -32,12 +182,22 @@ void StreamDecoder::registerDecoderCtx() {
     m_pDecCtx->height = m_sourceParams.height;
     m_pDecCtx->pix_fmt = AV_PIX_FMT_YUV420P;
 
+    // decode straight into pooled, refcounted buffers
+    // so frames can be shared instead of overwritten.
+    // FramePool is locked, frame threads may call it.
+    m_pDecCtx->opaque = &m_yuvPool;
+    m_pDecCtx->get_buffer2 = FramePool::getBuffer2;
+
+    h264::AVCConfig avc;
+    bool parsed = h264::parseAVCConfig(m_avccHdr.data(), m_avccHdr.size(), avc);
+    applyDecodeProfile(m_pDecCtx, m_config.profile, parsed ? &avc : nullptr);
+
     // http://ffmpeg.org/doxygen/trunk/structAVFormatContext.html
     avcodec_open2(m_pDecCtx, m_dec, NULL);
 }
 
 void StreamDecoder::registerAVCCExtraData() {
-    auto& eData = m_avccHdr.video.video_data_send;
+    auto& eData = m_avccHdr;
     m_pDecCtx->extradata =
         (uint8_t*)av_mallocz(eData.size() + AV_INPUT_BUFFER_PADDING_SIZE);
     m_pDecCtx->extradata_size = eData.size();
@@ -46,195 +206,895 @@ void StreamDecoder::registerAVCCExtraData() {
     memcpy(m_pDecCtx->extradata, eData.data(), eData.size());
 }
 
-void StreamDecoder::registerPixelFmtConversionCtx() {
-    // Allocate frame once and keep
-    // overwiting framedata. Saves
-    // alloc on each RTMP message.
-    // May change with buffering scheme.
-    m_pFrameYUV = av_frame_alloc();
-    m_pFrameBGR = av_frame_alloc();
-
-    // get_buffer() needs frame->pixfmt, height, width to be set.
-    // allocates heap memory for the decoded data
-    // that (will eventually) be filled into
-    // this AVFRame by sws_scale
-    m_pFrameBGR->format = AV_PIX_FMT_BGR24;
-    m_pFrameBGR->width = m_pDecCtx->width;
-    m_pFrameBGR->height = m_pDecCtx->height;
-
-    // allocate a buffer only once,
-    // reuse for subsequent scaled frames
-    int ret;
-    ret = av_frame_get_buffer(m_pFrameBGR, 0);
-
-    // input and output frame resolutions must be the same.
-    m_pSwsCtx = sws_getContext(m_pDecCtx->width,
-                               m_pDecCtx->height,
-                               m_pDecCtx->pix_fmt,
-                               m_pDecCtx->width,
-                               m_pDecCtx->height,
-                               AV_PIX_FMT_BGR24,  // OpenCV uses BGR
-                               SWS_BICUBIC,
-                               NULL,
-                               NULL,
-                               NULL);
-}
-
 // Convert the AVCC buffer to standard nalu bytestream format (needed by libav)
 // send_packet requires start codes but
 // rtmp uses AVCC which is 4 byte length + raw data
 //  replace the length with a start code.
 void StreamDecoder::naluAVCCToAnnexB(uint8_t* pNaluData, size_t payloadSize) {
-    size_t offset = 0;
-    while (offset + 4 <= payloadSize) {
-        // Read length of nalu
-        uint32_t naluLen = (uint32_t)pNaluData[offset] << 24 |
-                           (uint32_t)pNaluData[offset + 1] << 16 |
-                           (uint32_t)pNaluData[offset + 2] << 8 |
-                           (uint32_t)pNaluData[offset + 3];
-
-        // replace length bytes with nalu start code.
-        pNaluData[offset] = 0x00;
-        pNaluData[offset + 1] = 0x00;
-        pNaluData[offset + 2] = 0x00;
-        pNaluData[offset + 3] = 0x01;
+    h264::avccToAnnexB(pNaluData, payloadSize);
+}
 
-        // Jump to the next nalu length field
-        offset += (4 + naluLen);
+const StreamDecoder::PtsArrival* StreamDecoder::arrivalOf(int64_t pts) const {
+    if (pts == AV_NOPTS_VALUE) {
+        return nullptr;
     }
+    for (const auto& a : m_arrivals) {
+        if (a.pts == pts) {
+            return &a;
+        }
+    }
+    return nullptr;
 }
 
-void StreamDecoder::h264AUDecode(uint8_t* pAUData,
-                                 size_t payloadSize,
-                                 uint64_t dTime,
-                                 uint32_t cTime) {
+void StreamDecoder::h264AUDecode(EncodedAU& au) {
     // packet->data and packet->size need to be populated.
-    // One AVPacket per RTMP Access Unit (i.e. Video Frame)
-    AVPacket* pkt = av_packet_alloc();
-    if (!pkt) {
-        fprintf(stderr, "Could not allocate packet\n");
+    // One reused AVPacket, borrowing the AU's pooled buffer:
+    // being refcounted, send_packet refs it instead of
+    // copying the payload.
+    AVPacket* pkt = m_pPkt;
+    pkt->buf = au.buffer();
+    pkt->data = pkt->buf->data;
+    pkt->size = au.size;
+    pkt->dts = au.dts;
+    pkt->pts = pkt->dts + au.cts;
+    m_arrivals[m_arrivalIdx++ % kArrivalSlots] = {pkt->pts, au.arrivalUs,
+                                                  au.captureUs, au.forward};
+
+    int ret;
+    {
+        trace::Scope span("send_packet", pkt->pts);
+        ret = avcodec_send_packet(m_pDecCtx, pkt);  // Decode NAL
+    }
+
+    // the buffer was only borrowed, the decoder holds its own
+    // reference if it needs it. Unref just resets the fields.
+    pkt->buf = nullptr;
+    av_packet_unref(pkt);
+    au.reset();
+
+    if (ret < 0) {
+        m_decodeErrors.fetch_add(1, std::memory_order_relaxed);
+        fprintf(stderr, "[Session %d] error sending a packet for decoding: %d\n",
+                m_sessionId, ret);
         return;
     }
+    receiveFrames();
+}
 
-    pkt->size = payloadSize;
-    pkt->dts = dTime;
-    pkt->pts = pkt->dts + cTime;
-    pkt->data = pAUData;
+void StreamDecoder::receiveFrames() {
+    // One packet can release zero or more frames
+    // (B-frame reordering), hand each one downstream.
+    while (true) {
+        // receive_frame points a recycled shell at a buffer
+        // from m_yuvPool (get_buffer2)
+        AVFrame* pFrameYUV = m_pConvPools->shells.getFrame();
+        if (!pFrameYUV) {
+            return;
+        }
+        trace::Scope span("receive_frame");
+        int ret = avcodec_receive_frame(m_pDecCtx, pFrameYUV);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            m_pConvPools->shells.putFrame(pFrameYUV);
+            return;
+        } else if (ret < 0) {
+            // corrupt input, this AU is lost; the stream (and
+            // every other session) goes on
+            m_decodeErrors.fetch_add(1, std::memory_order_relaxed);
+            fprintf(stderr, "[Session %d] error during decoding: %d\n",
+                    m_sessionId, ret);
+            m_pConvPools->shells.putFrame(pFrameYUV);
+            return;
+        }
 
-    int ret;
-    ret = avcodec_send_packet(m_pDecCtx, pkt);  // Decode NAL
+        if (m_reconfigArrivalUs) {
+            // first frame since a new sequence header
+            m_reconfigFirstFrameUs.record(utils::nowUs() - m_reconfigArrivalUs);
+            m_reconfigArrivalUs = 0;
+        }
 
-    // Packet is sent, we can free the wrapper now
-    // (The data pointer refers to 'm', which is still valid)
-    av_packet_free(&pkt);
+        // frames come out in pts order, not in the order fed
+        span.setFrame(pFrameYUV->pts);
+        const PtsArrival* pArrival = arrivalOf(pFrameYUV->pts);
+        if (pArrival && !pArrival->forward) {
+            // only decoded as a reference, the policy's
+            // target fps doesn't want it.
+            m_pConvPools->shells.putFrame(pFrameYUV);
+            continue;
+        }
 
-    if (ret < 0) {
-        printf("error: %d\n", ret);
-        fprintf(stderr, "Error sending a packet for decoding\n");
+        // Scored before anyone sees the frame, so a frame
+        // with motion starting in it goes through at once.
+        float motionScore = -1;
+        if (m_config.motionThreshold >= 0) {
+            trace::Scope motionSpan("motion", pFrameYUV->pts);
+            uint64_t t0 = utils::nowUs();
+            motionScore = m_motion.score(pFrameYUV, m_config.motionThreshold);
+            m_motionUs += utils::nowUs() - t0;
+        }
+
+        // No copy, the handle refs the decoder's pooled buffer.
+        FrameHandle f =
+            DecodedFrame::create(pFrameYUV,
+                                 ++m_frameSeq,
+                                 pArrival ? pArrival->arrivalUs : 0,
+                                 m_pConvPools,
+                                 motionScore,
+                                 pArrival ? pArrival->captureUs : 0);
+        m_stats.recordGlass(GlassStage::kDecoded, f->captureUs(), utils::nowUs());
+        if (m_pShmExport) {
+            // just the descriptor, the pixels already are
+            // in shared memory
+            m_pShmExport->publish(f->avFrame(), f->seq());
+        }
+        m_ring.publish(f);
+        if (motionScore >= 0 && motionScore < m_config.motionThreshold) {
+            // static scene, nothing new to convert or analyze
+            m_motionGated++;
+            continue;
+        }
+        auto& next = m_convertAhead ? m_yuvQueue : m_sinkQueue;
+        if (!next.tryPush(std::move(f))) {
+            // next stage is behind, skip this one for it,
+            // it's still available in the ring.
+            m_decodeStage.dropped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        notifyStage(m_convertAhead ? m_pConvertStrand : m_pSinkStrand);
+    }
+}
+
+// The record is copied into a packet slot like any AU and
+// queued in stream order: AUs already queued still decode
+// with the old parameter sets, the ones after it with the
+// new. Nothing is torn down, see applyConfig().
+void StreamDecoder::reconfigure(const librtmp::RTMPMediaMessage& avccHdr) {
+    auto& payload = avccHdr.video.video_data_send;
+    const uint8_t* pData = reinterpret_cast<const uint8_t*>(payload.data());
+    if (m_pGopCache) {
+        m_pGopCache->setHeader(pData, payload.size());
+    }
+    uint64_t now = utils::nowUs();
+    if (pushConfig(pData, payload.size(), now)) {
+        m_configPending = false;  // a newer one replaces it
+        return;
+    }
+    // decode is behind; AUs are dropped until a keyframe
+    // anyway, the header goes right before it.
+    m_pendingConfig.assign(pData, pData + payload.size());
+    m_pendingConfigUs = now;
+    m_configPending = true;
+    m_waitForKeyframe = true;
+}
+
+bool StreamDecoder::pushConfig(const uint8_t* data, size_t size, uint64_t arrivalUs) {
+    EncodedAU au;
+    au.pSlot = copyIn(data, size);
+    if (!au.pSlot) {
+        return false;
+    }
+    au.size = size;
+    au.config = true;
+    au.arrivalUs = arrivalUs;
+    bool pushed = m_config.blockingIngest ? m_auQueue.waitPush(std::move(au))
+                                          : m_auQueue.tryPush(std::move(au));
+    if (!pushed) {
+        return false;
+    }
+    notifyStage(m_pDecodeStrand);
+    return true;
+}
+
+// Sleeps like copyIn() does, only for the AU that follows a
+// new header: the loop stalls for at most timeoutUs, once
+// per configuration change.
+bool StreamDecoder::waitForRoom(size_t n, uint64_t timeoutUs) {
+    uint64_t deadline = utils::nowUs() + timeoutUs;
+    while (m_auQueue.capacity() - m_auQueue.size() < n) {
+        if (m_auQueue.closed() || utils::nowUs() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    return true;
+}
+
+// False if the frame couldn't get a buffer (out of memory).
+bool StreamDecoder::pixFmtYUVToBGR(const FrameHandle& f) {
+    // The conversion itself (SIMD kernel, BT.601/709 and range
+    // from the frame tags) runs once per frame and is cached
+    // on it, whichever consumer asks first pays for it.
+    if (m_config.pyramid.empty()) {
+        return !f->bgr().empty();
+    }
+    // one pass for BGR and the reduced levels
+    return f->buildPyramid(m_pSink->wantsBGR());
+}
+
+// Runs on the RTMP read thread. Must never block, a full
+// decode queue drops AUs and resyncs on the next keyframe
+// (P-frames without their references would only decode
+// to garbage).
+PacketSlot* StreamDecoder::copyIn(const uint8_t* data, size_t size) {
+    PacketSlot* pSlot = m_packetPool.copyIn(data, size);
+    // replay: every slot is queued or in the decoder, one
+    // comes back as soon as the decoder moves on
+    while (!pSlot && m_config.blockingIngest && !m_auQueue.closed()) {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        pSlot = m_packetPool.copyIn(data, size);
+    }
+    return pSlot;
+}
+
+void StreamDecoder::process(const librtmp::RTMPMediaMessage& m) {
+    m_ausIn++;
+    auto& payload = m.video.video_data_send;
+    const uint8_t* pData = reinterpret_cast<const uint8_t*>(payload.data());
+    bool isKeyframe = (m.video.d.frame_type == 1);
+
+    EncodedAU au;
+    au.dts = m.timestamp;
+    au.cts = m.video.d.composition_time;
+    au.keyframe = isKeyframe;
+    // NAL headers only, for the policy and drop decisions.
+    // If it doesn't parse, keep the AU and let the decoder judge.
+    if (h264::parseAVCC(pData, payload.size(), m_auInfo)) {
+        au.idr = m_auInfo.idr;
+        au.reference = m_auInfo.reference;
+        au.resync = m_auInfo.idr || (m_auInfo.sliceType == h264::kSliceI &&
+                                     m_auInfo.hasParamSets);
+        au.bidir = m_auInfo.sliceType == h264::kSliceB;
+    } else {
+        au.idr = isKeyframe;
+        au.reference = true;
+        au.resync = isKeyframe;
+    }
+    // every AU, whatever this decoder drops or skips, a late
+    // joiner needs the whole GOP.
+    if (m_pGopCache) {
+        m_pGopCache->append(pData, payload.size(), au.dts, au.cts, au.idr,
+                            au.reference);
+    }
+    if (!admitByPolicy(au)) {
+        m_policySkipped++;
+        return;
+    }
+
+    if (m_waitForKeyframe && !isKeyframe) {
+        m_stats.addDropped(DropReason::kQueueFull);
+        return;
+    }
+    if (m_configPending && !m_config.blockingIngest) {
+        // header and keyframe, or the new stream starts
+        // a GOP late. If they still don't fit, the header
+        // stays pending for the next keyframe.
+        waitForRoom(2, kConfigWaitUs);
+    }
+    if (m_auQueue.size() == m_auQueue.capacity() && !m_config.blockingIngest) {
+        // don't bother copying, it would be dropped anyway
+        m_waitForKeyframe = true;
+        m_stats.addDropped(DropReason::kQueueFull);
+        return;
+    }
+    if (m_configPending) {
+        // the keyframe can't go without its header
+        if (!pushConfig(m_pendingConfig.data(), m_pendingConfig.size(),
+                        m_pendingConfigUs)) {
+            m_stats.addDropped(DropReason::kQueueFull);
+            return;
+        }
+        m_configPending = false;
+    }
+
+    // the only payload copy on the way to the decoder
+    trace::Scope span("ingest", m.timestamp + m.video.d.composition_time);
+    au.pSlot = copyIn(pData, payload.size());
+    if (!au.pSlot) {
+        m_stats.addDropped(DropReason::kQueueFull);
+        return;
+    }
+    au.size = payload.size();
+    au.arrivalUs = utils::nowUs();
+    au.captureUs = m_auInfo.captureUs;
+    m_stats.recordGlass(GlassStage::kIngest, au.captureUs, au.arrivalUs);
+
+    bool pushed = m_config.blockingIngest ? m_auQueue.waitPush(std::move(au))
+                                          : m_auQueue.tryPush(std::move(au));
+    if (!pushed) {
+        m_waitForKeyframe = true;
+        m_stats.addDropped(DropReason::kQueueFull);
+        return;
+    }
+    notifyStage(m_pDecodeStrand);
+    m_waitForKeyframe = false;
+}
+
+void StreamDecoder::setDecodePolicy(const DecodePolicy& policy) {
+    m_pendingPolicy = policy;
+    m_policyPending = !(policy == m_policy);
+}
+
+// Skipping an AU here is free, it is never copied, queued
+// or parsed by libavcodec. Only whole GOPs can go (or
+// non-reference pictures), anything else would leave the
+// decoder with missing references, so:
+//   - kKeyframes: IDRs only, skip_frame = AVDISCARD_NONKEY
+//     for good measure.
+//   - kTargetFps: if IDRs alone come often enough, IDRs only,
+//     at the target rate. Otherwise every reference picture
+//     is still decoded but only frames that are due are
+//     forwarded, and non-reference pictures that aren't due
+//     are skipped.
+// A new policy takes over at an IDR, where the decoder has
+// no references to lose.
+bool StreamDecoder::admitByPolicy(EncodedAU& au) {
+    int64_t pts = au.dts + au.cts;
+    if (au.idr) {
+        if (m_policyPending) {
+            m_policy = m_pendingPolicy;
+            m_policyPending = false;
+            m_nextDueMs = 0;
+            m_policySwitches++;
+        }
+        if (m_lastIdrPts >= 0 && pts > m_lastIdrPts) {
+            m_gopMs = pts - m_lastIdrPts;
+        }
+        m_lastIdrPts = pts;
+    }
+
+    switch (m_policy.mode) {
+        case DecodeMode::kAll:
+            return true;
+        case DecodeMode::kKeyframes:
+            au.discard = AVDISCARD_NONKEY;
+            return au.idr;
+        case DecodeMode::kTargetFps:
+            break;
+    }
+
+    double periodMs = 1000.0 / m_policy.fps;
+    if (au.idr) {
+        // decided per GOP, the interval can change
+        m_fpsIdrOnly = m_gopMs > 0 && m_gopMs <= periodMs;
+    }
+    bool due = pts >= m_nextDueMs;
+    bool admit = m_fpsIdrOnly ? au.idr && due : au.reference || due;
+    if (!admit) {
+        return false;
+    }
+    au.forward = due;
+    au.discard = m_fpsIdrOnly ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+    if (due) {
+        // keep the cadence, unless it fell behind (pause,
+        // long GOP), then restart it from this frame
+        m_nextDueMs += periodMs;
+        if (m_nextDueMs <= pts) {
+            m_nextDueMs = pts + periodMs;
+        }
+    }
+    return true;
+}
+
+// How far behind live the decode stage is: the age of the
+// AU it is about to decode, i.e. the time it sat in the
+// queue. Drops in two steps, cheapest loss first:
+//   - over budget: skip_frame = AVDISCARD_NONREF, nothing
+//     else depends on those pictures, the picture rate drops
+//     but the stream stays intact.
+//   - over twice the budget: drop everything up to the next
+//     IDR, then flush the decoder and start over from there.
+//     Streams with open GOPs (x264 --open-gop, few IDRs)
+//     restart at an I picture with in-band SPS/PPS instead,
+//     leaving out the B pictures right after it, which
+//     predict from the GOP that was skipped.
+bool StreamDecoder::keepWithinBudget(const EncodedAU& au, uint64_t now) {
+    if (m_budgetUs == 0) {
+        return true;
+    }
+    uint64_t lagUs = now - std::min(now, au.arrivalUs);
+
+    if (!m_skipToIDR && !au.resync && lagUs > 2 * m_budgetUs) {
+        m_skipToIDR = true;
+    }
+    if (m_skipToIDR) {
+        if (!au.resync) {
+            m_stats.addDropped(DropReason::kSkipToIDR);
+            return false;
+        }
+        // the references of whatever is still buffered in
+        // the decoder are gone, don't output concealed frames
+        avcodec_flush_buffers(m_pDecCtx);
+        m_skipToIDR = false;
+        m_skipLeading = !au.idr;
+    } else if (m_skipLeading) {
+        if (au.bidir) {
+            m_stats.addDropped(DropReason::kSkipToIDR);
+            return false;
+        }
+        m_skipLeading = false;  // the first P, all later B's are whole
+    }
+
+    if (!m_discardNonRef && lagUs > m_budgetUs) {
+        m_discardNonRef = true;
+    } else if (m_discardNonRef && lagUs < m_budgetUs / 2) {
+        m_discardNonRef = false;
+    }
+    if (m_discardNonRef && !au.reference) {
+        // still sent, the decoder parses and discards it
+        m_stats.addDropped(DropReason::kNonRef);
+    }
+    return true;
+}
+
+// The stricter of what the AU's decode policy and the
+// latency budget ask for.
+void StreamDecoder::applySkipFrame(const EncodedAU& au) {
+    AVDiscard skip = au.discard;
+    if (m_discardNonRef && skip < AVDISCARD_NONREF) {
+        skip = AVDISCARD_NONREF;
+    }
+    if (skip != m_skipFrame) {
+        m_skipFrame = skip;
+        m_pDecCtx->skip_frame = skip;
+    }
+}
+
+// A new sequence header, between the last AU of the old
+// configuration and the first of the new. Publishers send
+// one on a bitrate or resolution change (Larix, OBS with
+// adaptive bitrate), some resend the same one now and then.
+//   - same bytes: nothing to do.
+//   - new parameter sets, same size: sent in-band, like
+//     SPS/PPS NAL units inside the stream. libavcodec
+//     switches to them at the next slice that refers to them.
+//   - new size: the frames the decoder still holds back for
+//     reordering are drained out first (they are the last
+//     ones of the old stream, downstream gets them), then
+//     its state is reset, then the new parameter sets.
+//   - B-frames come or go under kLowLatency (LOW_DELAY
+//     has to change): drained, then a fresh codec context
+//     opened on the new header, the one case with a reopen.
+// Otherwise the codec context stays open, its buffer pool follows
+// the new size (see FramePool), and every frame carries its
+// own size, so conversions, the ring and the sinks follow
+// frame by frame.
+void StreamDecoder::applyConfig(EncodedAU& au) {
+    const uint8_t* pData = au.data();
+    size_t size = au.size;
+    uint64_t arrivalUs = au.arrivalUs;
+    if (size == m_avccHdr.size() && memcmp(pData, m_avccHdr.data(), size) == 0) {
+        m_reconfigsUnchanged.fetch_add(1, std::memory_order_relaxed);
+        au.reset();
+        return;
+    }
+    h264::AVCConfig avc;
+    bool parsed = h264::parseAVCConfig(pData, size, avc);
+    m_annexBConfig.clear();
+    if (!h264::avcConfigToAnnexB(pData, size, m_annexBConfig)) {
+        m_decodeErrors.fetch_add(1, std::memory_order_relaxed);
+        fprintf(stderr, "[Session %d] malformed sequence header, ignored\n",
+                m_sessionId);
+        au.reset();
         return;
     }
+    m_avccHdr.assign(pData, pData + size);
+    au.reset();
 
-    // receive_frame will allocate data buffer
-    // in frameYUV to store decoded NALUs.
-    ret = avcodec_receive_frame(m_pDecCtx, m_pFrameYUV);
-    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+    // LOW_DELAY (see applyDecodeProfile()) is only read when
+    // the codec opens, a stream that gains or loses B-frames
+    // needs a fresh context
+    bool lowDelay = (m_pDecCtx->flags & AV_CODEC_FLAG_LOW_DELAY) != 0;
+    bool reopen = lowDelay != (m_config.profile == DecodeProfile::kLowLatency &&
+                               parsed && avc.profile == kBaselineProfile);
+    // an SPS we can't read may well be a new size too
+    bool resized = !parsed || avc.width != m_width || avc.height != m_height;
+    if (resized || reopen) {
+        trace::Scope span("reconfig_drain");
+        avcodec_send_packet(m_pDecCtx, nullptr);
+        receiveFrames();
+    }
+    if (reopen) {
+        // the new header goes in as extradata, no need to
+        // send the parameter sets
+        avcodec_free_context(&m_pDecCtx);
+        m_pDecCtx = avcodec_alloc_context3(m_dec);
+        m_skipFrame = AVDISCARD_DEFAULT;  // the policy sets it again
+        initDecoder();
+    } else if (resized) {
+        // out of draining mode, no references left
+        avcodec_flush_buffers(m_pDecCtx);
+    }
+    if (resized) {
+        m_resizes.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        m_reconfigs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (!reopen) {
+        // Not refcounted (no buf), send_packet copies it; the
+        // input padding is zeroed.
+        size_t n = m_annexBConfig.size();
+        m_annexBConfig.resize(n + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+        AVPacket* pkt = m_pPkt;
+        pkt->data = m_annexBConfig.data();
+        pkt->size = int(n);
+        int ret = avcodec_send_packet(m_pDecCtx, pkt);
+        av_packet_unref(pkt);
+        if (ret < 0) {
+            m_decodeErrors.fetch_add(1, std::memory_order_relaxed);
+            fprintf(stderr, "[Session %d] error sending parameter sets: %d\n",
+                    m_sessionId, ret);
+        }
+    }
+
+    uint64_t now = utils::nowUs();
+    m_reconfigApplyUs.record(now - std::min(now, arrivalUs));
+    m_reconfigArrivalUs = std::max<uint64_t>(arrivalUs, 1);
+    std::cout << "[Session " << m_sessionId << "] new sequence header: "
+              << m_width << "x" << m_height << " -> ";
+    if (parsed) {
+        m_width = avc.width;
+        m_height = avc.height;
+        std::cout << avc.width << "x" << avc.height << ", profile "
+                  << int(avc.profile) << " level " << int(avc.level);
+    } else {
+        std::cout << "unknown size";
+    }
+    std::cout << (reopen    ? " (decoder reopened)\n"
+                  : resized ? " (decoder drained)\n"
+                            : "\n");
+}
+
+void StreamDecoder::decodeOne(EncodedAU& au) {
+    m_decodeStage.maxDepth =
+        std::max(m_decodeStage.maxDepth, m_auQueue.size() + 1);
+    if (au.config) {
+        // not subject to the budget, the AUs after it
+        // can't decode without it
+        applyConfig(au);
         return;
-    } else if (ret < 0) {
-        fprintf(stderr, "Error during decoding\n");
-        exit(1);
     }
+    uint64_t t0 = utils::nowUs();
+    if (!keepWithinBudget(au, t0)) {
+        au.reset();
+        return;
+    }
+    applySkipFrame(au);
+
+    // convert video payload to AnnexB format for ffmpeg,
+    // in place in the pooled buffer.
+    {
+        trace::Scope span("annexb", au.dts + au.cts);
+        naluAVCCToAnnexB(au.data(), au.size);
+    }
+    h264AUDecode(au);
+
+    m_decodeStage.time.update(utils::nowUs() - t0);
 }
 
-void StreamDecoder::pixFmtYUVToBGR() {
-    sws_scale(m_pSwsCtx,
-              (const uint8_t* const*)m_pFrameYUV->data,
-              m_pFrameYUV->linesize,
-              0,
-              m_pFrameYUV->height,
-              m_pFrameBGR->data,
-              m_pFrameBGR->linesize);
+void StreamDecoder::decodeFinish() {
+    // the frames the decoder still holds back for reordering
+    // are the last ones of the stream, not to be lost
+    avcodec_send_packet(m_pDecCtx, nullptr);
+    receiveFrames();
+    // no more frames will follow, let the next stage drain and exit
+    m_yuvQueue.close();
+    notifyStage(m_pConvertStrand);
+    if (!m_convertAhead) {
+        m_sinkQueue.close();
+        notifyStage(m_pSinkStrand);
+    }
+    m_ring.close();
 }
 
-// pass by non-const reference need to modify contents
-// of m... in nalutoAnnexB
-// ref is valid until lifetime of object
-void StreamDecoder::process(librtmp::RTMPMediaMessage& m) {
+void StreamDecoder::decodeLoop() {
     // RTMPMediaMessage -> AVPacket -> <avc_decode> -> AVFrame (uncompressed)
-    // AVFrame.data -> cv::Mat() -> DISPLAY on screen!:
-    // AVFrame: Uncompressed Video Frame
-    // This func should output an AVFrame
-    // for each RTMP Message.
     // https://github.com/leandromoreira/ffmpeg-libav-tutorial/blob/master/0_hello_world.c
+    nameThread("dec", m_sessionId);
+    EncodedAU au;
+    while (m_auQueue.waitPop(au)) {
+        decodeOne(au);
+    }
+    decodeFinish();
+    m_decodeStage.cpuUs = threadCpuUs();
+}
 
-    // convert video payload to AnnexB format for ffmpeg
-    // Casting ensure safety. std::vector<T>, .data() returns T*
-    // Here, we convert the returned char* to const char*, and then
-    // reinterpret.
-    uint8_t* pNaluData = reinterpret_cast<uint8_t*>(
-        const_cast<char*>(m.video.video_data_send.data()));
-    size_t payloadSize = m.video.video_data_send.size();
-    naluAVCCToAnnexB(pNaluData, payloadSize);
-
-    uint32_t cTime = m.video.d.composition_time;
-    uint64_t dTime = m.timestamp;
-    h264AUDecode(pNaluData, payloadSize, dTime, cTime);
-
-    // release any data previouslywritten to the
-    // undo any previous get_buffer().
-    // av_frame_unref(pFrameBGR);
-
-    // To avoid alloc/free buffer on each rtmp packet decode,
-    // reuse the original buffer, i.e. let
-    // sws_scale overwrite a previously filled buffer.
-    // Possible future issue: If resolution of
-    // incoming stream changes in a session,
-    // there could be trouble. (cv::mat reads part-old data)
-    // --
-    // In such a case, can add a check here to verify no change
-    // in codec context, but rn the main loop logic itself only
-    // allows a single resolution per session.
-    // (fifoIdx=0 is used to get the SPS, and initAvc()).
-
-    // write to pFrameBGR data buffer
-    // OpenCV methods only work with BGR frames,
-    // but video is transmitted as YUV.
-    pixFmtYUVToBGR();
-
-    // TODO Add YUV Frame to a shared AVFrame Buffer
-    // for playback/analysis.
-    //
-    // Current: Display frame immediately
-    cv::Mat img(m_pFrameBGR->height,
-                m_pFrameBGR->width,
-                CV_8UC3,
-                m_pFrameBGR->data[0],
-                m_pFrameBGR->linesize[0]);
+bool StreamDecoder::decodeSome() {
+    EncodedAU au;
+    return drainSome(m_auQueue, au, m_decodeStage,
+                     [this](EncodedAU& a) { decodeOne(a); },
+                     [this] { decodeFinish(); });
+}
+
+void StreamDecoder::convertOne(FrameHandle& in) {
+    m_convertStage.maxDepth =
+        std::max(m_convertStage.maxDepth, m_yuvQueue.size() + 1);
+    uint64_t t0 = utils::nowUs();
+
+    // The size may change mid-session (new sequence header),
+    // conversions are sized by each frame, not the session.
+
+    // OpenCV render methods only work with BGR frames,
+    // but video is transmitted as YUV. Convert ahead of
+    // the sink stage so the two overlap.
+    if (!pixFmtYUVToBGR(in)) {
+        // out of memory, the sink would only get an empty image
+        in.reset();
+        m_convertStage.dropped.fetch_add(1, std::memory_order_relaxed);
+        m_convertStage.time.update(utils::nowUs() - t0);
+        return;
+    }
+    m_stats.recordGlass(GlassStage::kConverted, in->captureUs(), utils::nowUs());
+
+    if (!m_sinkQueue.tryPush(std::move(in))) {
+        in.reset();
+        m_convertStage.dropped.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        notifyStage(m_pSinkStrand);
+    }
+    m_convertStage.time.update(utils::nowUs() - t0);
+}
+
+void StreamDecoder::convertFinish() {
+    m_sinkQueue.close();
+    notifyStage(m_pSinkStrand);
+}
+
+void StreamDecoder::convertLoop() {
+    nameThread("cvt", m_sessionId);
+    FrameHandle in;
+    while (m_yuvQueue.waitPop(in)) {
+        convertOne(in);
+    }
+    convertFinish();
+    m_convertStage.cpuUs = threadCpuUs();
+}
+
+bool StreamDecoder::convertSome() {
+    FrameHandle in;
+    return drainSome(m_yuvQueue, in, m_convertStage,
+                     [this](FrameHandle& f) { convertOne(f); },
+                     [this] { convertFinish(); });
+}
+
+void StreamDecoder::sinkOne(FrameHandle& in) {
+    m_sinkStage.maxDepth =
+        std::max(m_sinkStage.maxDepth, m_sinkQueue.size() + 1);
+    uint64_t t0 = utils::nowUs();
 
     // get curr time
     // update currtime
-    updateImshowTime(utils::nowMs());
+    updateImshowTime(t0);
+    if (in->arrivalUs()) {
+        m_stats.update(t0 - in->arrivalUs());
+    }
+
+    m_pSink->consume(in);
+    m_stats.recordGlass(GlassStage::kSink, in->captureUs(), utils::nowUs());
+    if (m_config.batcher) {
+        m_config.batcher->offer(m_sessionId, in);
+    }
 
-    cv::imshow("Video Playback", img);
-    // 1ms delay needed to allow OpenCV to draw.
-    // TODO move draw to an independent thread.
-    cv::waitKey(1);
+    in.reset();
+    m_sinkStage.time.update(utils::nowUs() - t0);
+}
+
+void StreamDecoder::sinkFinish() { m_pSink->finish(); }
+
+void StreamDecoder::sinkLoop() {
+    nameThread("sink", m_sessionId);
+    FrameHandle in;
+    while (m_sinkQueue.waitPop(in)) {
+        sinkOne(in);
+    }
+    sinkFinish();
+    m_sinkStage.cpuUs = threadCpuUs();
+}
+
+bool StreamDecoder::sinkSome() {
+    FrameHandle in;
+    return drainSome(m_sinkQueue, in, m_sinkStage,
+                     [this](FrameHandle& f) { sinkOne(f); },
+                     [this] { sinkFinish(); });
 }
 
 void StreamDecoder::updateImshowTime(uint64_t now) {
     m_stats.updateImshowTime(now);
 }
 
-StreamDecoder::~StreamDecoder() {
-    if (m_pDecCtx) {
-        avcodec_free_context(&m_pDecCtx);
+void StreamDecoder::stop() {
+    // closing the head of the pipeline cascades,
+    // each stage drains its input and closes the next.
+    m_auQueue.close();
+    if (m_pDecodeStrand) {
+        // each stage's finish closes the next one's queue
+        // and notifies it, so waiting for them in order
+        // sees the whole pipeline drained
+        m_pDecodeStrand->notify();
+        for (Strand* p :
+             {m_pDecodeStrand.get(), m_pConvertStrand.get(), m_pSinkStrand.get()}) {
+            if (p) {
+                p->waitIdle();
+            }
+        }
+    }
+    for (std::thread* t : {&m_decodeThread, &m_convertThread, &m_sinkThread}) {
+        if (t->joinable()) {
+            t->join();
+        }
+    }
+}
+
+void StreamDecoder::printStageStats(int sessionId) {
+    auto print = [sessionId](const char* name, StageStats& s, size_t cap) {
+        if (s.time.count() == 0) {
+            return;
+        }
+        std::cout << "[Session " << sessionId << "] " << name
+                  << ": p99 " << s.time.p99E2E() << "us, max "
+                  << s.time.max() << "us, max depth " << s.maxDepth << "/"
+                  << cap << ", dropped " << s.dropped.load() << ", cpu "
+                  << s.cpuUs / 1000 << "ms\n";
+    };
+    std::cout << "[Session " << sessionId << "] decoded " << framesDecoded()
+              << " frames, dropped " << m_stats.droppedTotal() << " AUs (";
+    for (size_t r = 0; r < size_t(DropReason::kCount); r++) {
+        auto reason = static_cast<DropReason>(r);
+        std::cout << (r ? ", " : "") << dropReasonName(reason) << " "
+                  << m_stats.dropped(reason);
+    }
+    std::cout << ")\n";
+    const int active = m_pDecCtx->active_thread_type;
+    std::cout << "[Session " << sessionId << "] decoder: profile "
+              << decodeProfileName(m_config.profile) << ", "
+              << m_pDecCtx->thread_count << " "
+              << (active == FF_THREAD_FRAME   ? "frame "
+                  : active == FF_THREAD_SLICE ? "slice "
+                                              : "")
+              << "thread(s)\n";
+    if (m_pGopCache) {
+        std::cout << "[Session " << sessionId << "] gop cache: "
+                  << m_pGopCache->auCount() << " AUs, "
+                  << m_pGopCache->bytes() / 1024 << "/"
+                  << m_pGopCache->capacityBytes() / 1024 << "KB, "
+                  << m_pGopCache->gops() << " GOPs, "
+                  << m_pGopCache->overflows() << " overflowed, "
+                  << m_pGopCache->snapshots() << " snapshots\n";
+    }
+    if (m_pShmExport) {
+        std::cout << "[Session " << sessionId << "] shm " << m_pShmExport->name()
+                  << ": exported " << m_pShmExport->exported()
+                  << " frames, not exported " << m_pShmExport->notExported()
+                  << "\n";
+    }
+    if (m_config.motionThreshold >= 0) {
+        std::cout << "[Session " << sessionId << "] motion gate "
+                  << m_config.motionThreshold << ": " << m_motionGated
+                  << " of " << framesDecoded() << " frames static, scoring "
+                  << (framesDecoded() ? m_motionUs / framesDecoded() : 0)
+                  << "us/frame\n";
+    }
+    if (m_policySkipped || m_policySwitches) {
+        std::cout << "[Session " << sessionId << "] decode policy "
+                  << decodePolicyName(m_policy) << " skipped "
+                  << m_policySkipped << " AUs";
+        if (m_policySwitches) {
+            std::cout << ", switched " << m_policySwitches << " times";
+        }
+        std::cout << "\n";
+    }
+    if (m_stats.glass(GlassStage::kIngest).count() > 0) {
+        // stamped stream, age of its frames along the pipeline
+        for (size_t s = 0; s < size_t(GlassStage::kCount); s++) {
+            auto stage = static_cast<GlassStage>(s);
+            if (m_stats.glass(stage).count() > 0) {
+                std::cout << "[Session " << sessionId << "] capture -> "
+                          << glassStageName(stage) << ": "
+                          << m_stats.glass(stage).summary() << "\n";
+            }
+        }
+    }
+    uint64_t resizes = m_resizes.load(), reconfigs = m_reconfigs.load();
+    if (resizes + reconfigs + m_reconfigsUnchanged.load() > 0) {
+        std::cout << "[Session " << sessionId << "] sequence headers: " << resizes
+                  << " resized, " << reconfigs << " new parameter sets, "
+                  << m_reconfigsUnchanged.load() << " unchanged, now " << m_width
+                  << "x" << m_height << ", pool reused " << m_yuvPool.reuses()
+                  << " / reallocated " << m_yuvPool.reallocs() << "\n";
+        if (m_reconfigApplyUs.count() > 0) {
+            std::cout << "[Session " << sessionId
+                      << "] reconfig, header -> applied: "
+                      << m_reconfigApplyUs.summary() << "\n";
+        }
+        if (m_reconfigFirstFrameUs.count() > 0) {
+            std::cout << "[Session " << sessionId
+                      << "] reconfig, header -> first frame: "
+                      << m_reconfigFirstFrameUs.summary() << "\n";
+        }
     }
-    if (m_pFrameYUV) {
-        av_frame_free(&m_pFrameYUV);
+    print("decode", m_decodeStage, kAUQueueLen);
+    print("convert", m_convertStage, kFrameQueueLen);
+    print("sink", m_sinkStage, kFrameQueueLen);
+}
+
+void StreamDecoder::collectMetrics(MetricsWriter& w) const {
+    // all atomics or histograms, written by the stages as
+    // they go. Latencies are the last 60s, a 24/7 stream's
+    // all-time quantiles barely move.
+    const std::string session = "session=\"" + std::to_string(m_sessionId) + "\"";
+    uint64_t now = utils::nowUs();
+    w.counter("squig_frames_decoded_total",
+              "Frames out of the decoder",
+              session, double(framesDecoded()));
+    w.counter("squig_decode_errors_total",
+              "AUs the decoder rejected or failed on", session,
+              double(m_decodeErrors.load(std::memory_order_relaxed)));
+
+    // the yuv queue and convert stage only exist with
+    // m_convertAhead
+    struct Queue {
+        const char* name;
+        size_t depth, capacity;
+        bool used;
+    };
+    for (const Queue& q :
+         {Queue{"au", m_auQueue.size(), m_auQueue.capacity(), true},
+          Queue{"yuv", m_yuvQueue.size(), m_yuvQueue.capacity(), m_convertAhead},
+          Queue{"sink", m_sinkQueue.size(), m_sinkQueue.capacity(), true}}) {
+        if (!q.used) {
+            continue;
+        }
+        std::string labels = session + ",queue=\"" + q.name + "\"";
+        w.gauge("squig_queue_depth", "Items waiting in a stage input queue", labels,
+                double(q.depth));
+        w.gauge("squig_queue_capacity", "Stage input queue size", labels,
+                double(q.capacity));
     }
-    if (m_pFrameBGR) {
-        av_frame_free(&m_pFrameBGR);
+
+    struct Stage {
+        const char* name;
+        const StageStats& stats;
+        bool used;
+    };
+    for (const Stage& s : {Stage{"decode", m_decodeStage, true},
+                           Stage{"convert", m_convertStage, m_convertAhead},
+                           Stage{"sink", m_sinkStage, true}}) {
+        if (!s.used) {
+            continue;
+        }
+        std::string labels = session + ",stage=\"" + s.name + "\"";
+        w.counter("squig_stage_dropped_total",
+                  "Items a stage dropped because the next queue was full "
+                  "or a frame buffer couldn't be allocated",
+                  labels,
+                  double(s.stats.dropped.load(std::memory_order_relaxed)));
+        w.summary("squig_stage_latency_us",
+                  "Time per item in a stage over the last 60s, us", labels,
+                  s.stats.time.e2e().window(60'000'000, now));
+    }
+
+    struct Reconfig {
+        const char* kind;
+        const std::atomic<uint64_t>& n;
+    };
+    for (const Reconfig& r : {Reconfig{"resized", m_resizes},
+                              Reconfig{"params", m_reconfigs},
+                              Reconfig{"unchanged", m_reconfigsUnchanged}}) {
+        w.counter("squig_reconfigs_total",
+                  "Sequence headers received mid-stream, by what they changed",
+                  session + ",kind=\"" + r.kind + "\"",
+                  double(r.n.load(std::memory_order_relaxed)));
     }
-    if (m_pSwsCtx) {
-        sws_freeContext(m_pSwsCtx);
+    w.summary("squig_reconfig_latency_us",
+              "Sequence header read -> first frame decoded with it, us", session,
+              m_reconfigFirstFrameUs);
+}
+
+StreamDecoder::~StreamDecoder() {
+    // no scrape may run the collector from here on
+    m_metrics.reset();
+    stop();
+    if (m_pDecCtx) {
+        avcodec_free_context(&m_pDecCtx);
     }
+    av_packet_free(&m_pPkt);
 }
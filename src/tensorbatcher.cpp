@@ -0,0 +1,290 @@
+#include "squig/tensorbatcher.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <type_traits>
+#include <utility>
+
+#include <opencv2/imgproc.hpp>
+
+#include "squig/parallelfor.h"
+#include "squig/trace.h"
+#include "squig/utils.hpp"
+
+namespace {
+// Rows of the resized image, in the buffer's element type
+// and layout. src is 8 bit, 3 channels, already in output
+// channel order.
+void writeNHWC32(const cv::Mat& src, float* dst, const float* mul, const float* add) {
+    for (int y = 0; y < src.rows; y++) {
+        const uint8_t* s = src.ptr<uint8_t>(y);
+        float* d = dst + (size_t)y * src.cols * 3;
+        for (int x = 0; x < src.cols * 3; x += 3) {
+            d[x] = s[x] * mul[0] + add[0];
+            d[x + 1] = s[x + 1] * mul[1] + add[1];
+            d[x + 2] = s[x + 2] * mul[2] + add[2];
+        }
+    }
+}
+
+template <typename T>
+void writeNCHW(const cv::Mat& src, T* dst, const float* mul, const float* add) {
+    size_t plane = (size_t)src.rows * src.cols;
+    for (int y = 0; y < src.rows; y++) {
+        const uint8_t* s = src.ptr<uint8_t>(y);
+        size_t row = (size_t)y * src.cols;
+        for (int c = 0; c < 3; c++) {
+            T* d = dst + c * plane + row;
+            for (int x = 0; x < src.cols; x++) {
+                if constexpr (std::is_same_v<T, float>) {
+                    d[x] = s[3 * x + c] * mul[c] + add[c];
+                } else {
+                    d[x] = s[3 * x + c];
+                }
+            }
+        }
+    }
+}
+
+void freeAligned(void* p) { std::free(p); }
+}  // namespace
+
+TensorBatcher::Batch& TensorBatcher::Batch::operator=(Batch&& o) noexcept {
+    if (this != &o) {
+        reset();
+        m_pOwner = std::exchange(o.m_pOwner, nullptr);
+        m_buf = o.m_buf;
+    }
+    return *this;
+}
+
+void TensorBatcher::Batch::reset() {
+    if (m_pOwner) {
+        std::exchange(m_pOwner, nullptr)->release(m_buf);
+    }
+}
+
+size_t TensorBatcher::Batch::size() const { return m_pOwner->m_buffers[m_buf].count; }
+
+const void* TensorBatcher::Batch::data() const {
+    return m_pOwner->m_buffers[m_buf].data.get();
+}
+
+size_t TensorBatcher::Batch::bytes() const {
+    return size() * m_pOwner->m_spec.bytesPerImage();
+}
+
+const BatchSlotInfo& TensorBatcher::Batch::slot(size_t i) const {
+    return m_pOwner->m_buffers[m_buf].slots[i];
+}
+
+bool parseBatchSpec(const std::string& spec,
+                    TensorSpec& tensor,
+                    size_t& maxBatch,
+                    int& deadlineMs) {
+    int w = 0, h = 0, n = 0, ms = deadlineMs, end = 0;
+    int got = sscanf(spec.c_str(), "%dx%d:%d%n@%d%n", &w, &h, &n, &end, &ms, &end);
+    if (got < 3 || size_t(end) != spec.size() || w < 8 || h < 8 || n < 1 ||
+        ms < 0) {
+        return false;
+    }
+    tensor.width = w;
+    tensor.height = h;
+    maxBatch = size_t(n);
+    deadlineMs = ms;
+    return true;
+}
+
+TensorBatcher::TensorBatcher(const TensorSpec& spec,
+                             size_t maxBatch,
+                             std::chrono::microseconds deadline,
+                             size_t buffers)
+    : m_spec(spec),
+      m_maxBatch(std::max<size_t>(1, maxBatch)),
+      m_deadlineUs(deadline.count()),
+      m_buffers(std::max<size_t>(1, buffers)) {
+    for (int c = 0; c < 3; c++) {
+        m_mul[c] = 1.0f / (255.0f * spec.std[c]);
+        m_add[c] = -spec.mean[c] / spec.std[c];
+    }
+    // 64 byte aligned, what engines' host buffers usually are
+    size_t bytes = (m_maxBatch * spec.bytesPerImage() + 63) / 64 * 64;
+    for (Buffer& b : m_buffers) {
+        b.data = {static_cast<uint8_t*>(std::aligned_alloc(64, bytes)), &freeAligned};
+        b.slots.resize(m_maxBatch);
+    }
+    m_pending.reserve(m_maxBatch * 4);
+    m_taking.reserve(m_maxBatch);
+}
+
+void TensorBatcher::offer(int streamId, const FrameHandle& f) {
+    uint64_t now = utils::nowUs();
+    bool wake;
+    FrameHandle old;  // released outside the lock
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_offered++;
+        auto it = std::find_if(m_pending.begin(), m_pending.end(),
+                               [&](const Pending& p) { return p.streamId == streamId; });
+        if (it != m_pending.end()) {
+            // keeps its place (and offer time) in the queue,
+            // a busy stream can't starve the others
+            old = std::exchange(it->frame, f);
+            m_replaced++;
+            return;
+        }
+        m_pending.push_back({streamId, f, now});
+        // first one starts the deadline, maxBatch-th fills it
+        wake = m_pending.size() == 1 || m_pending.size() == m_maxBatch;
+    }
+    if (wake) {
+        m_cv.notify_one();
+    }
+}
+
+void TensorBatcher::close() {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_closed = true;
+    }
+    m_cv.notify_all();
+}
+
+bool TensorBatcher::closed() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    return m_closed;
+}
+
+void TensorBatcher::release(size_t buf) {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_buffers[buf].leased = false;
+    }
+    m_cv.notify_all();
+}
+
+bool TensorBatcher::next(Batch& out, std::chrono::milliseconds timeout) {
+    out.reset();
+    uint64_t giveUp = utils::nowUs() + uint64_t(timeout.count()) * 1000;
+    std::unique_lock<std::mutex> lk(m_lock);
+    Buffer* pBuf = nullptr;
+    while (true) {
+        uint64_t now = utils::nowUs();
+        bool due = m_pending.size() >= m_maxBatch ||
+                   (!m_pending.empty() &&
+                    (m_closed || now >= m_pending.front().offeredUs + m_deadlineUs));
+        if (due) {
+            auto it = std::find_if(m_buffers.begin(), m_buffers.end(),
+                                   [](const Buffer& b) { return !b.leased; });
+            if (it != m_buffers.end()) {
+                pBuf = &*it;
+                break;
+            }
+        } else if (m_closed) {
+            return false;  // drained
+        }
+        if (now >= giveUp) {
+            return false;
+        }
+        uint64_t wakeAt = giveUp;
+        if (!due && !m_pending.empty()) {
+            wakeAt = std::min(wakeAt, m_pending.front().offeredUs + m_deadlineUs);
+        }
+        m_cv.wait_for(lk, std::chrono::microseconds(wakeAt - now));
+    }
+
+    size_t n = std::min(m_pending.size(), m_maxBatch);
+    uint64_t now = utils::nowUs();
+    m_taking.clear();
+    for (size_t i = 0; i < n; i++) {
+        m_waitUs.record(now - m_pending[i].offeredUs);
+        m_taking.push_back(std::move(m_pending[i]));
+    }
+    m_pending.erase(m_pending.begin(), m_pending.begin() + n);
+    pBuf->leased = true;
+    pBuf->count = n;
+    lk.unlock();
+
+    // one image per chunk, converting/resizing a frame is
+    // plenty of work for one core
+    uint64_t t0 = utils::nowUs();
+    {
+        trace::Scope span("batch_fill");
+        size_t stride = m_spec.bytesPerImage();
+        ParallelFor::shared().run(n, 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const Pending& p = m_taking[i];
+                fillSlot(p, pBuf->data.get() + i * stride);
+                pBuf->slots[i] = {p.streamId, p.frame->pts(), p.frame->seq(),
+                                  p.frame->arrivalUs()};
+            }
+        });
+    }
+    uint64_t fillUs = utils::nowUs() - t0;
+    // frames go back to their pools before the engine runs
+    m_taking.clear();
+
+    lk.lock();
+    m_fillUs.record(fillUs);
+    m_batches++;
+    m_images += n;
+    out.m_pOwner = this;
+    out.m_buf = size_t(pBuf - m_buffers.data());
+    return true;
+}
+
+void TensorBatcher::fillSlot(const Pending& p, uint8_t* dst) const {
+    const DecodedFrame& f = *p.frame;
+    int w = m_spec.width, h = m_spec.height;
+    PyramidFormat fmt = m_spec.rgb ? PyramidFormat::kRGB24 : PyramidFormat::kBGR24;
+
+    // smallest level that doesn't upscale
+    cv::Mat src;
+    for (int div : {4, 2}) {
+        if (f.width() / div >= w && f.height() / div >= h) {
+            src = f.scaled(fmt, div);
+            break;
+        }
+    }
+    if (src.empty()) {
+        src = m_spec.rgb ? f.rgb() : f.bgr();
+    }
+    if (src.empty()) {
+        // out of memory, a black image keeps the slot order
+        memset(dst, 0, m_spec.bytesPerImage());
+        return;
+    }
+
+    if (m_spec.layout == TensorLayout::kNHWC && m_spec.type == TensorType::kU8) {
+        // straight into the batch
+        cv::Mat out(h, w, CV_8UC3, dst);
+        cv::resize(src, out, out.size(), 0, 0, cv::INTER_LINEAR);
+        return;
+    }
+    thread_local cv::Mat resized;
+    resized.create(h, w, CV_8UC3);
+    cv::resize(src, resized, resized.size(), 0, 0, cv::INTER_LINEAR);
+    if (m_spec.layout == TensorLayout::kNHWC) {
+        writeNHWC32(resized, reinterpret_cast<float*>(dst), m_mul, m_add);
+    } else if (m_spec.type == TensorType::kF32) {
+        writeNCHW(resized, reinterpret_cast<float*>(dst), m_mul, m_add);
+    } else {
+        writeNCHW(resized, dst, m_mul, m_add);
+    }
+}
+
+std::string TensorBatcher::summary() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    std::ostringstream os;
+    os << m_images << " images in " << m_batches << " batches";
+    if (m_batches) {
+        os << " (" << double(m_images) / m_batches << "/batch)";
+    }
+    os << ", " << m_replaced << " of " << m_offered
+       << " offered frames superseded\n  fill: " << m_fillUs.summary()
+       << "\n  wait: " << m_waitUs.summary();
+    return os.str();
+}
@@ -0,0 +1,192 @@
+#include "squig/trace.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef SQUIG_TRACING
+namespace {
+// ~256KB per thread, a few seconds of a busy stage
+constexpr size_t kEventsPerThread = 1 << 13;
+// rings of threads that are gone are kept for the next
+// dump, but not forever (sessions come and go).
+constexpr size_t kMaxExitedThreads = 64;
+
+struct Event {
+    const char* name;
+    uint64_t beginUs;
+    uint64_t durUs;
+    int64_t frameId;
+};
+
+// A ring slot. The dump may read a slot while its thread
+// overwrites it (and then discards it), relaxed atomics
+// keep that well defined at the cost of plain stores.
+struct Slot {
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> beginUs;
+    std::atomic<uint64_t> durUs;
+    std::atomic<int64_t> frameId;
+};
+
+// Single writer (its thread), read by dumpChrome().
+struct ThreadBuffer {
+    std::array<Slot, kEventsPerThread> events;
+    std::atomic<uint64_t> written{0};
+    std::atomic<bool> exited{false};
+    uint32_t tid{};
+    char name[16]{};  // guarded by the registry lock
+};
+
+struct Registry {
+    std::mutex lock;
+    std::deque<std::shared_ptr<ThreadBuffer>> buffers;
+    uint32_t nextTid = 1;
+};
+
+Registry& registry() {
+    // never destroyed, threads may still record during exit
+    static Registry* r = new Registry;
+    return *r;
+}
+
+struct LocalBuffer {
+    std::shared_ptr<ThreadBuffer> p;
+    ~LocalBuffer() {
+        if (p) {
+            p->exited.store(true, std::memory_order_relaxed);
+        }
+    }
+};
+thread_local LocalBuffer tLocal;
+
+ThreadBuffer& local() {
+    if (!tLocal.p) {
+        auto b = std::make_shared<ThreadBuffer>();
+        Registry& r = registry();
+        std::lock_guard<std::mutex> g(r.lock);
+        b->tid = r.nextTid++;
+        size_t exited = 0;
+        for (const auto& x : r.buffers) {
+            exited += x->exited.load(std::memory_order_relaxed);
+        }
+        for (auto it = r.buffers.begin();
+             it != r.buffers.end() && exited >= kMaxExitedThreads;) {
+            if ((*it)->exited.load(std::memory_order_relaxed)) {
+                it = r.buffers.erase(it);
+                exited--;
+            } else {
+                ++it;
+            }
+        }
+        r.buffers.push_back(b);
+        tLocal.p = std::move(b);
+    }
+    return *tLocal.p;
+}
+}  // namespace
+
+namespace trace {
+void record(const char* name, uint64_t beginUs, uint64_t endUs, int64_t frameId) {
+    ThreadBuffer& b = local();
+    uint64_t n = b.written.load(std::memory_order_relaxed);
+    Slot& e = b.events[n % kEventsPerThread];
+    // pairs with the fence in dumpChrome(): a reader that sees
+    // any of the stores below also sees written >= n.
+    std::atomic_thread_fence(std::memory_order_release);
+    e.name.store(name, std::memory_order_relaxed);
+    e.beginUs.store(beginUs, std::memory_order_relaxed);
+    e.durUs.store(endUs - beginUs, std::memory_order_relaxed);
+    e.frameId.store(frameId, std::memory_order_relaxed);
+    b.written.store(n + 1, std::memory_order_release);
+}
+
+void nameThread(const char* name) {
+    ThreadBuffer& b = local();
+    std::lock_guard<std::mutex> g(registry().lock);
+    snprintf(b.name, sizeof(b.name), "%s", name);
+}
+}  // namespace trace
+#endif
+
+bool trace::dumpChrome(const char* path) {
+#ifndef SQUIG_TRACING
+    (void)path;
+    return false;
+#else
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    std::vector<std::array<char, 16>> names;
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> g(r.lock);
+        for (const auto& b : r.buffers) {
+            buffers.push_back(b);
+            std::array<char, 16> n;
+            memcpy(n.data(), b->name, n.size());
+            names.push_back(n);
+        }
+    }
+
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        return false;
+    }
+    int pid = getpid();
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    std::vector<Event> copy;
+    for (size_t i = 0; i < buffers.size(); i++) {
+        ThreadBuffer& b = *buffers[i];
+        const char* name = names[i][0] ? names[i].data() : "thread";
+        fprintf(f,
+                "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", pid, b.tid, name);
+        first = false;
+
+        // copy what the ring holds, then drop whatever the
+        // writer may have overwritten while we were copying,
+        // including the slot it may be writing right now.
+        uint64_t end = b.written.load(std::memory_order_acquire);
+        uint64_t begin = end > kEventsPerThread ? end - kEventsPerThread : 0;
+        copy.resize(kEventsPerThread);
+        for (uint64_t n = begin; n < end; n++) {
+            const Slot& e = b.events[n % kEventsPerThread];
+            copy[n % kEventsPerThread] = {
+                e.name.load(std::memory_order_relaxed),
+                e.beginUs.load(std::memory_order_relaxed),
+                e.durUs.load(std::memory_order_relaxed),
+                e.frameId.load(std::memory_order_relaxed)};
+        }
+        // (seqlock style: slot loads must not sink below this)
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t endAfter = b.written.load(std::memory_order_relaxed);
+        if (endAfter + 1 > kEventsPerThread) {
+            begin = std::max(begin, endAfter + 1 - kEventsPerThread);
+        }
+
+        for (uint64_t n = begin; n < end; n++) {
+            const Event& e = copy[n % kEventsPerThread];
+            fprintf(f,
+                    ",\n{\"name\":\"%s\",\"cat\":\"squig\",\"ph\":\"X\","
+                    "\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%u",
+                    e.name, (unsigned long long)e.beginUs,
+                    (unsigned long long)e.durUs, pid, b.tid);
+            if (e.frameId != kNoFrame) {
+                fprintf(f, ",\"args\":{\"frame\":%lld}", (long long)e.frameId);
+            }
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+#endif
+}
@@ -0,0 +1,376 @@
+#include "squig/yuvconvert.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "squig/parallelfor.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SQUIG_X86 1
+#include <immintrin.h>
+#endif
+
+namespace yuv {
+namespace {
+
+// All coefficients are Q13, inputs are pre-shifted by 6,
+// so mulhrs(x << 6, c) = x * c * 16 (i.e. 4 fractional bits).
+struct Coeffs {
+    int16_t yOff;  // 16 for limited range, 0 for full
+    int16_t yMul;
+    int16_t rv, gu, gv, bu;
+};
+
+constexpr int16_t q13(double c) {
+    return static_cast<int16_t>(c * 8192.0 + (c < 0 ? -0.5 : 0.5));
+}
+
+constexpr Coeffs makeCoeffs(double kr, double kb, bool fullRange) {
+    double kg = 1.0 - kr - kb;
+    double ys = fullRange ? 1.0 : 255.0 / 219.0;
+    double cs = fullRange ? 1.0 : 255.0 / 224.0;
+    return Coeffs{
+        static_cast<int16_t>(fullRange ? 0 : 16),
+        q13(ys),
+        q13(cs * 2.0 * (1.0 - kr)),
+        q13(cs * 2.0 * (1.0 - kb) * kb / kg),
+        q13(cs * 2.0 * (1.0 - kr) * kr / kg),
+        q13(cs * 2.0 * (1.0 - kb)),
+    };
+}
+
+// [matrix][fullRange]
+constexpr Coeffs kCoeffs[2][2] = {
+    {makeCoeffs(0.299, 0.114, false), makeCoeffs(0.299, 0.114, true)},
+    {makeCoeffs(0.2126, 0.0722, false), makeCoeffs(0.2126, 0.0722, true)},
+};
+
+const Coeffs& coeffsFor(const ColorParams& cp) {
+    return kCoeffs[cp.matrix == Matrix::kBT709][cp.fullRange];
+}
+
+// Scalar model of _mm_mulhrs_epi16.
+inline int mulhrs(int a, int b) { return (a * b + 0x4000) >> 15; }
+
+inline uint8_t toU8(int v4) {
+    return static_cast<uint8_t>(std::clamp((v4 + 8) >> 4, 0, 255));
+}
+
+void rowScalar(const uint8_t* yRow,
+               const uint8_t* uRow,
+               const uint8_t* vRow,
+               uint8_t* dst,
+               int xBegin,
+               int width,
+               const Coeffs& c,
+               int c0,  // byte offset of R within a pixel
+               int c2) {  // byte offset of B
+    for (int x = xBegin; x < width; x++) {
+        int u = (uRow[x >> 1] - 128) << 6;
+        int v = (vRow[x >> 1] - 128) << 6;
+        int y = mulhrs((yRow[x] - c.yOff) << 6, c.yMul);
+        uint8_t* px = dst + 3 * x;
+        px[c0] = toU8(y + mulhrs(v, c.rv));
+        px[1] = toU8(y - (mulhrs(u, c.gu) + mulhrs(v, c.gv)));
+        px[c2] = toU8(y + mulhrs(u, c.bu));
+    }
+}
+
+#ifdef SQUIG_X86
+// pshufb masks interleaving 16 bytes of each of three
+// channels into 48 packed bytes: [chunk][channel][byte].
+struct InterleaveMasks {
+    alignas(16) uint8_t m[3][3][16];
+};
+
+constexpr InterleaveMasks makeInterleaveMasks() {
+    InterleaveMasks im{};
+    for (int chunk = 0; chunk < 3; chunk++) {
+        for (int ch = 0; ch < 3; ch++) {
+            for (int k = 0; k < 16; k++) {
+                int n = 16 * chunk + k;
+                im.m[chunk][ch][k] =
+                    (n % 3 == ch) ? static_cast<uint8_t>(n / 3) : 0x80;
+            }
+        }
+    }
+    return im;
+}
+constexpr InterleaveMasks kInterleave = makeInterleaveMasks();
+
+__attribute__((target("sse4.1"))) inline void store48(uint8_t* dst,
+                                                      __m128i a,
+                                                      __m128i b,
+                                                      __m128i c) {
+    const __m128i* m = reinterpret_cast<const __m128i*>(kInterleave.m);
+    for (int chunk = 0; chunk < 3; chunk++) {
+        __m128i out = _mm_or_si128(
+            _mm_or_si128(_mm_shuffle_epi8(a, _mm_load_si128(m + 3 * chunk)),
+                         _mm_shuffle_epi8(b, _mm_load_si128(m + 3 * chunk + 1))),
+            _mm_shuffle_epi8(c, _mm_load_si128(m + 3 * chunk + 2)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16 * chunk), out);
+    }
+}
+
+// Adds (or subtracts) the per-2-pixel chroma term to 16 luma
+// values, rounds off the fractional bits and saturates to u8.
+__attribute__((target("sse4.1"))) inline __m128i channelSSE41(__m128i yLo,
+                                                              __m128i yHi,
+                                                              __m128i term,
+                                                              bool subtract) {
+    const __m128i round = _mm_set1_epi16(8);
+    __m128i lo = _mm_unpacklo_epi16(term, term);
+    __m128i hi = _mm_unpackhi_epi16(term, term);
+    lo = subtract ? _mm_sub_epi16(yLo, lo) : _mm_add_epi16(yLo, lo);
+    hi = subtract ? _mm_sub_epi16(yHi, hi) : _mm_add_epi16(yHi, hi);
+    lo = _mm_srai_epi16(_mm_add_epi16(lo, round), 4);
+    hi = _mm_srai_epi16(_mm_add_epi16(hi, round), 4);
+    return _mm_packus_epi16(lo, hi);
+}
+
+// 16 pixels per iteration.
+__attribute__((target("sse4.1"))) void rowSSE41(const uint8_t* yRow,
+                                                const uint8_t* uRow,
+                                                const uint8_t* vRow,
+                                                uint8_t* dst,
+                                                int width,
+                                                const Coeffs& c,
+                                                bool rgb) {
+    const __m128i yOff = _mm_set1_epi16(c.yOff);
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i yMul = _mm_set1_epi16(c.yMul);
+    const __m128i rv = _mm_set1_epi16(c.rv);
+    const __m128i gu = _mm_set1_epi16(c.gu);
+    const __m128i gv = _mm_set1_epi16(c.gv);
+    const __m128i bu = _mm_set1_epi16(c.bu);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(yRow + x));
+        __m128i u = _mm_cvtepu8_epi16(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(uRow + x / 2)));
+        __m128i v = _mm_cvtepu8_epi16(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(vRow + x / 2)));
+        u = _mm_slli_epi16(_mm_sub_epi16(u, c128), 6);
+        v = _mm_slli_epi16(_mm_sub_epi16(v, c128), 6);
+
+        // chroma terms once per 2 pixels, then duplicated
+        __m128i rV = _mm_mulhrs_epi16(v, rv);
+        __m128i gUV =
+            _mm_add_epi16(_mm_mulhrs_epi16(u, gu), _mm_mulhrs_epi16(v, gv));
+        __m128i bU = _mm_mulhrs_epi16(u, bu);
+
+        __m128i yLo = _mm_cvtepu8_epi16(y8);
+        __m128i yHi = _mm_cvtepu8_epi16(_mm_srli_si128(y8, 8));
+        yLo = _mm_mulhrs_epi16(_mm_slli_epi16(_mm_sub_epi16(yLo, yOff), 6),
+                               yMul);
+        yHi = _mm_mulhrs_epi16(_mm_slli_epi16(_mm_sub_epi16(yHi, yOff), 6),
+                               yMul);
+
+        __m128i r = channelSSE41(yLo, yHi, rV, false);
+        __m128i g = channelSSE41(yLo, yHi, gUV, true);
+        __m128i b = channelSSE41(yLo, yHi, bU, false);
+        if (rgb) {
+            store48(dst + 3 * x, r, g, b);
+        } else {
+            store48(dst + 3 * x, b, g, r);
+        }
+    }
+    rowScalar(yRow, uRow, vRow, dst, x, width, c, rgb ? 0 : 2, rgb ? 2 : 0);
+}
+
+__attribute__((target("avx2"))) inline __m256i channelAVX2(__m256i yLo,
+                                                           __m256i yHi,
+                                                           __m256i term,
+                                                           bool subtract) {
+    const __m256i round = _mm256_set1_epi16(8);
+    // unpack works per 128 bit lane, reorder quads first
+    // so lo/hi cover chroma for pixels 0-15 and 16-31.
+    __m256i t = _mm256_permute4x64_epi64(term, 0xD8);
+    __m256i lo = _mm256_unpacklo_epi16(t, t);
+    __m256i hi = _mm256_unpackhi_epi16(t, t);
+    lo = subtract ? _mm256_sub_epi16(yLo, lo) : _mm256_add_epi16(yLo, lo);
+    hi = subtract ? _mm256_sub_epi16(yHi, hi) : _mm256_add_epi16(yHi, hi);
+    lo = _mm256_srai_epi16(_mm256_add_epi16(lo, round), 4);
+    hi = _mm256_srai_epi16(_mm256_add_epi16(hi, round), 4);
+    // packus interleaves lanes, undo with the same permute
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+}
+
+// 32 pixels per iteration. The math runs on 256 bit
+// registers, the interleave reuses the 128 bit shuffles.
+__attribute__((target("avx2"))) void rowAVX2(const uint8_t* yRow,
+                                             const uint8_t* uRow,
+                                             const uint8_t* vRow,
+                                             uint8_t* dst,
+                                             int width,
+                                             const Coeffs& c,
+                                             bool rgb) {
+    const __m256i yOff = _mm256_set1_epi16(c.yOff);
+    const __m256i c128 = _mm256_set1_epi16(128);
+    const __m256i yMul = _mm256_set1_epi16(c.yMul);
+    const __m256i rv = _mm256_set1_epi16(c.rv);
+    const __m256i gu = _mm256_set1_epi16(c.gu);
+    const __m256i gv = _mm256_set1_epi16(c.gv);
+    const __m256i bu = _mm256_set1_epi16(c.bu);
+
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i u = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(uRow + x / 2)));
+        __m256i v = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(vRow + x / 2)));
+        u = _mm256_slli_epi16(_mm256_sub_epi16(u, c128), 6);
+        v = _mm256_slli_epi16(_mm256_sub_epi16(v, c128), 6);
+
+        __m256i rV = _mm256_mulhrs_epi16(v, rv);
+        __m256i gUV = _mm256_add_epi16(_mm256_mulhrs_epi16(u, gu),
+                                       _mm256_mulhrs_epi16(v, gv));
+        __m256i bU = _mm256_mulhrs_epi16(u, bu);
+
+        __m256i yLo = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(yRow + x)));
+        __m256i yHi = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(yRow + x + 16)));
+        yLo = _mm256_mulhrs_epi16(
+            _mm256_slli_epi16(_mm256_sub_epi16(yLo, yOff), 6), yMul);
+        yHi = _mm256_mulhrs_epi16(
+            _mm256_slli_epi16(_mm256_sub_epi16(yHi, yOff), 6), yMul);
+
+        __m256i r = channelAVX2(yLo, yHi, rV, false);
+        __m256i g = channelAVX2(yLo, yHi, gUV, true);
+        __m256i b = channelAVX2(yLo, yHi, bU, false);
+        __m256i first = rgb ? r : b;
+        __m256i last = rgb ? b : r;
+        store48(dst + 3 * x,
+                _mm256_castsi256_si128(first),
+                _mm256_castsi256_si128(g),
+                _mm256_castsi256_si128(last));
+        store48(dst + 3 * x + 48,
+                _mm256_extracti128_si256(first, 1),
+                _mm256_extracti128_si256(g, 1),
+                _mm256_extracti128_si256(last, 1));
+    }
+    rowSSE41(yRow + x, uRow + x / 2, vRow + x / 2, dst + 3 * x, width - x, c,
+             rgb);
+}
+#endif  // SQUIG_X86
+
+}  // namespace
+
+ColorParams colorParamsOf(const AVFrame* f) {
+    ColorParams cp;
+    cp.fullRange = f->color_range == AVCOL_RANGE_JPEG ||
+                   f->format == AV_PIX_FMT_YUVJ420P;
+    switch (f->colorspace) {
+        case AVCOL_SPC_BT709:
+            cp.matrix = Matrix::kBT709;
+            break;
+        case AVCOL_SPC_BT470BG:
+        case AVCOL_SPC_SMPTE170M:
+            cp.matrix = Matrix::kBT601;
+            break;
+        default:
+            cp.matrix = f->height >= 720 ? Matrix::kBT709 : Matrix::kBT601;
+            break;
+    }
+    return cp;
+}
+
+SimdLevel detectSimd() {
+#ifdef SQUIG_X86
+    static const SimdLevel level = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return SimdLevel::kAVX2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return SimdLevel::kSSE41;
+        }
+        return SimdLevel::kScalar;
+    }();
+    return level;
+#else
+    return SimdLevel::kScalar;
+#endif
+}
+
+const char* simdName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::kAVX2:
+            return "avx2";
+        case SimdLevel::kSSE41:
+            return "sse4.1";
+        default:
+            return "scalar";
+    }
+}
+
+bool isSupported(int avPixFmt) {
+    return avPixFmt == AV_PIX_FMT_YUV420P || avPixFmt == AV_PIX_FMT_YUVJ420P;
+}
+
+void convertRows(const Planes& src,
+                 int rowBegin,
+                 int rowEnd,
+                 uint8_t* dst,
+                 int dstStride,
+                 const ColorParams& cp,
+                 Order order,
+                 SimdLevel level) {
+    const Coeffs& c = coeffsFor(cp);
+    bool rgb = order == Order::kRGB;
+    for (int row = rowBegin; row < rowEnd; row++) {
+        const uint8_t* yRow = src.data[0] + (size_t)row * src.stride[0];
+        const uint8_t* uRow = src.data[1] + (size_t)(row >> 1) * src.stride[1];
+        const uint8_t* vRow = src.data[2] + (size_t)(row >> 1) * src.stride[2];
+        uint8_t* dRow = dst + (size_t)row * dstStride;
+        switch (level) {
+#ifdef SQUIG_X86
+            case SimdLevel::kAVX2:
+                rowAVX2(yRow, uRow, vRow, dRow, src.width, c, rgb);
+                break;
+            case SimdLevel::kSSE41:
+                rowSSE41(yRow, uRow, vRow, dRow, src.width, c, rgb);
+                break;
+#endif
+            default:
+                rowScalar(yRow,
+                          uRow,
+                          vRow,
+                          dRow,
+                          0,
+                          src.width,
+                          c,
+                          rgb ? 0 : 2,
+                          rgb ? 2 : 0);
+                break;
+        }
+    }
+}
+
+void convertFrame(const AVFrame* src,
+                  uint8_t* dst,
+                  int dstStride,
+                  ParallelFor* pWorkers,
+                  Order order,
+                  SimdLevel level) {
+    Planes p{{src->data[0], src->data[1], src->data[2]},
+             {src->linesize[0], src->linesize[1], src->linesize[2]},
+             src->width,
+             src->height};
+    ColorParams cp = colorParamsOf(src);
+
+    // ~64 rows per chunk keeps per-chunk overhead small
+    // while still spreading a 1080p frame over many cores.
+    constexpr size_t kRowGrain = 64;
+    if (!pWorkers) {
+        convertRows(p, 0, p.height, dst, dstStride, cp, order, level);
+        return;
+    }
+    pWorkers->run(p.height, kRowGrain, [&](size_t begin, size_t end) {
+        convertRows(p, begin, end, dst, dstStride, cp, order, level);
+    });
+}
+
+}  // namespace yuv